@@ -0,0 +1,9 @@
+include(common)
+
+find_lib(IoUring_LIBRARIES LIBS uring)
+find_include(IoUring_INCLUDE_DIR HEADERS liburing.h)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(IoUring DEFAULT_MSG IoUring_LIBRARIES IoUring_INCLUDE_DIR)
+
+mark_as_advanced(IoUring_LIBRARIES IoUring_INCLUDE_DIR)
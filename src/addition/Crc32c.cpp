@@ -0,0 +1,190 @@
+#include "Crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 反射表示，最高位是x^0的系数
+static constexpr uint32_t CRC32C_POLY = 0x82f63b78;
+
+// 三路并行时每一路的长度，长的用于大块数据，剩下的部分用短的
+static constexpr size_t CRC32C_LONG_BLOCK = 8192;
+static constexpr size_t CRC32C_SHORT_BLOCK = 256;
+
+static inline uint64_t load64(const unsigned char* p) {
+    uint64_t w;
+    std::memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+// slicing-by-8的表
+struct crc32c_table_t {
+    uint32_t t[8][256];
+
+    crc32c_table_t() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; ++k) {
+                crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+            t[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+static const crc32c_table_t& crc32c_table() {
+    static crc32c_table_t table;
+    return table;
+}
+
+// 以下的crc都是没有取反的寄存器值
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t n) {
+    auto& t = crc32c_table().t;
+    while (n >= 8) {
+        uint64_t w = load64(p) ^ crc;
+        crc = t[7][w & 0xff] ^ t[6][(w >> 8) & 0xff]
+              ^ t[5][(w >> 16) & 0xff] ^ t[4][(w >> 24) & 0xff]
+              ^ t[3][(w >> 32) & 0xff] ^ t[2][(w >> 40) & 0xff]
+              ^ t[1][(w >> 48) & 0xff] ^ t[0][w >> 56];
+        p += 8;
+        n -= 8;
+    }
+    while (n--) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// a * b mod P，a不能为0
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^n mod P
+static uint32_t xnmodp(uint64_t n) {
+    uint32_t p = 1u << 31;
+    uint32_t sq = 1u << 30;
+    while (n) {
+        if (n & 1) {
+            p = multmodp(sq, p);
+        }
+        sq = multmodp(sq, sq);
+        n >>= 1;
+    }
+    return p;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * crc乘以x^(8 * len)，即后面接len个0字节，k = x^(8 * len - 33) mod P
+ * 反射表示下clmul的积多乘了一个x，crc32指令再乘x^32并约化
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_shift(uint32_t crc, uint32_t k) {
+    __m128i prod = _mm_clmulepi64_si128(
+          _mm_cvtsi32_si128(int(crc)), _mm_cvtsi32_si128(int(k)), 0);
+    return uint32_t(_mm_crc32_u64(0, uint64_t(_mm_cvtsi128_si64(prod))));
+}
+
+/*
+ * 每轮三段各block字节，三条crc32指令互不依赖，隐藏指令的延迟，
+ * 前两段的结果用clmul移位后合并
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_3way(uint32_t crc, const unsigned char*& p, size_t& n,
+      size_t block, uint32_t k) {
+    while (n >= 3 * block) {
+        uint64_t c0 = crc;
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        const unsigned char* end = p + block;
+        for (; p < end; p += 8) {
+            c0 = _mm_crc32_u64(c0, load64(p));
+            c1 = _mm_crc32_u64(c1, load64(p + block));
+            c2 = _mm_crc32_u64(c2, load64(p + 2 * block));
+        }
+        crc = crc32c_shift(crc32c_shift(uint32_t(c0), k) ^ uint32_t(c1), k) ^ uint32_t(c2);
+        p += 2 * block;
+        n -= 3 * block;
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n) {
+    static const uint32_t long_k = xnmodp(8 * CRC32C_LONG_BLOCK - 33);
+    static const uint32_t short_k = xnmodp(8 * CRC32C_SHORT_BLOCK - 33);
+    while (n > 0 && (reinterpret_cast<uintptr_t>(p) & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        --n;
+    }
+    crc = crc32c_3way(crc, p, n, CRC32C_LONG_BLOCK, long_k);
+    crc = crc32c_3way(crc, p, n, CRC32C_SHORT_BLOCK, short_k);
+    uint64_t c = crc;
+    while (n >= 8) {
+        c = _mm_crc32_u64(c, load64(p));
+        p += 8;
+        n -= 8;
+    }
+    crc = uint32_t(c);
+    while (n--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+#endif
+
+bool crc32c_hardware() {
+#if defined(__x86_64__)
+    static const bool supported = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+uint32_t crc32c_software(uint32_t crc, const void* data, size_t n) {
+    return ~crc32c_sw(~crc, static_cast<const unsigned char*>(data), n);
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t n) {
+#if defined(__x86_64__)
+    if (crc32c_hardware()) {
+        return ~crc32c_hw(~crc, static_cast<const unsigned char*>(data), n);
+    }
+#endif
+    return crc32c_software(crc, data, n);
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
@@ -0,0 +1,28 @@
+#ifndef PARADIGM4_PICO_CORE_CRC32C_H
+#define PARADIGM4_PICO_CORE_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+/*
+ * CRC-32C (Castagnoli)，crc是之前部分的结果，可以分段计算：
+ * crc32c(crc32c(0, a, n), b, m)等于a和b连在一起的结果
+ * 支持SSE4.2和PCLMUL的x86_64上三路并行的crc32指令再用clmul合并，否则查表
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t n);
+
+// 查表实现，用于校验和没有硬件支持时
+uint32_t crc32c_software(uint32_t crc, const void* data, size_t n);
+
+// 是否使用硬件指令
+bool crc32c_hardware();
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_CRC32C_H
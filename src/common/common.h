@@ -257,6 +257,24 @@ std::string format_string(const std::string& fmt_str, ARGS&&... args) {
     return boost_fmt.str();
 }
 
+/*!
+ * \brief 配置结构体从任意类型转换时复制一个字段，from没有这个字段时保留默认值，
+ *  后加的字段不要求用户自己的配置类型跟着加；通过PICO_CONFIG_COPY_FIELD使用
+ */
+template<class V, class T, class GET>
+auto config_copy_field(V& to, const T& from, GET get, int) -> decltype(get(from), void()) {
+    to = get(from);
+}
+
+template<class V, class T, class GET>
+void config_copy_field(V&, const T&, GET, long) {}
+
+#ifndef PICO_CONFIG_COPY_FIELD
+#define PICO_CONFIG_COPY_FIELD(o, field) \
+    paradigm4::pico::core::config_copy_field(field, o, \
+          [](const auto& pico_c) -> decltype(pico_c.field) { return pico_c.field; }, 0)
+#endif // PICO_CONFIG_COPY_FIELD
+
 /*!
  * \brief try to run func(args) until it exec correctly
  * \param func  function to run, func must has return code to indicate the function
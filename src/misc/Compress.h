@@ -1,6 +1,8 @@
 #ifndef PARADIGM4_PICO_CORE_COMPRESS_H
 #define PARADIGM4_PICO_CORE_COMPRESS_H
 
+#include <algorithm>
+#include <limits>
 #include <type_traits>
 
 #include "common.h"
@@ -111,11 +113,27 @@ public:
 
     virtual void raw_uncompress(const char* in, size_t in_size, char** out, size_t* out_size) = 0;
 
+    /*
+     * 用于不可信的输入，如网络上收到的数据
+     * 数据损坏或者解压后超过max_size时返回false，不会越界读写，*out仍由调用者释放
+     */
+    virtual bool try_raw_uncompress(const char* in, size_t in_size, size_t max_size,
+          char** out, size_t* out_size) = 0;
+
     virtual void set_property(const std::string& key, const std::string&) {
         SLOG(FATAL) << "useless property : " << key;
     }
 
 protected:
+    // raw_compress在压缩数据后面追加了原长度，压缩过的数据不会为空
+    static bool read_raw_length(const char* in, size_t in_size, size_t max_size, size_t* len) {
+        if (in_size < sizeof(size_t)) {
+            return false;
+        }
+        memcpy(len, in + in_size - sizeof(size_t), sizeof(size_t));
+        return *len > 0 && *len <= max_size;
+    }
+
     BinaryArchive _in;
     BinaryArchive _out;
 };
@@ -147,6 +165,22 @@ public:
                     (zlib::Bytef*)in, (zlib::uLong)in_size));
     }
 
+    bool try_raw_uncompress(const char* in, size_t in_size, size_t max_size,
+          char** out, size_t* out_size) {
+        size_t len;
+        if (!read_raw_length(in, in_size, max_size, &len)) {
+            return false;
+        }
+        if (*out_size < len) {
+            *out = buf_realloc(*out, len);
+        }
+        *out_size = len;
+        zlib::uLong dst_len = len;
+        return Z_OK == zlib::uncompress((zlib::Bytef*)*out, &dst_len,
+                    (zlib::Bytef*)in, (zlib::uLong)(in_size - sizeof(len)))
+              && dst_len == len;
+    }
+
     void raw_compress(const char* in, size_t in_size, char** out, size_t* out_size) {
         size_t max_buffer_size = zlib::compressBound(in_size) + sizeof(in_size);
         if (*out_size < max_buffer_size) {
@@ -204,6 +238,19 @@ public:
         SCHECK(snappy::RawUncompress(in, in_size, *out)) 
             << "snappy uncompress failed"; 
     }
+
+    bool try_raw_uncompress(const char* in, size_t in_size, size_t max_size,
+          char** out, size_t* out_size) {
+        size_t len = 0;
+        if (!snappy::GetUncompressedLength(in, in_size, &len) || len == 0 || len > max_size) {
+            return false;
+        }
+        if (*out_size < len) {
+            *out = buf_realloc(*out, len);
+        }
+        *out_size = len;
+        return snappy::RawUncompress(in, in_size, *out);
+    }
 };
 
 class LZ4CompressEntity : public CompressEntity {
@@ -232,6 +279,23 @@ public:
         SCHECK(ret == static_cast<int>(compressed_size)) << "lz4 uncompress failed";
     }
 
+    // LZ4_decompress_fast只用于自己压缩的数据，这里用按输入长度检查的LZ4_decompress_safe
+    bool try_raw_uncompress(const char* in, size_t in_size, size_t max_size,
+          char** out, size_t* out_size) {
+        const size_t int_max = std::numeric_limits<int>::max();
+        size_t len;
+        if (!read_raw_length(in, in_size, std::min(max_size, int_max), &len)
+              || in_size - sizeof(len) > int_max) {
+            return false;
+        }
+        if (*out_size < len) {
+            *out = buf_realloc(*out, len);
+        }
+        *out_size = len;
+        int ret = LZ4::LZ4_decompress_safe(in, *out, int(in_size - sizeof(len)), int(len));
+        return ret == int(len);
+    }
+
     void raw_compress(const char* in, size_t in_size, char** out, size_t* out_size) {
         size_t max_buffer_size = LZ4::LZ4_compressBound(in_size) + sizeof(in_size);
         if (*out_size < max_buffer_size) {
@@ -311,6 +375,21 @@ public:
         SCHECK(ret == len) << "zstd uncompress failed";
     }
 
+    bool try_raw_uncompress(const char* in, size_t in_size, size_t max_size,
+          char** out, size_t* out_size) {
+        size_t len;
+        if (!read_raw_length(in, in_size, max_size, &len)) {
+            return false;
+        }
+        if (*out_size < len) {
+            *out = buf_realloc(*out, len);
+        }
+        *out_size = len;
+        size_t ret = ZSTD_decompressDCtx(thread_context().dctx,
+              *out, *out_size, in, in_size - sizeof(len));
+        return !ZSTD_isError(ret) && ret == len;
+    }
+
     void raw_compress(const char* in, size_t in_size, char** out, size_t* out_size) {
         size_t max_buffer_size = ZSTD_compressBound(in_size) + sizeof(in_size);
         if (*out_size < max_buffer_size) {
@@ -394,6 +473,11 @@ public:
         _c->raw_uncompress(in, in_size, out, out_size);
     }
 
+    bool try_raw_uncompress(const char* in, size_t in_size, size_t max_size,
+          char** out, size_t* out_size) {
+        return _c->try_raw_uncompress(in, in_size, max_size, out, out_size);
+    }
+
     void raw_compress(BinaryArchive& in, BinaryArchive& out) {
         _c->raw_compress(in, out);
     }
@@ -0,0 +1,128 @@
+#include "AsyncExecutor.h"
+
+#include "observability/metrics/Metrics.h"
+#include "pico_log.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+static const std::vector<double>& async_duration_bucket() {
+    static const std::vector<double> bucket = Metrics::create_general_duration_bucket();
+    return bucket;
+}
+
+void AsyncExecutor::initialize(size_t max_thread_num,
+      const std::map<std::string, std::string>& labels) {
+    SCHECK(max_thread_num > 0);
+    std::lock_guard<std::mutex> lk(_mu);
+    _max_thread_num = max_thread_num;
+    // 没有启用时metrics_*返回thread_local的对象，不能缓存
+    if (!Metrics::Singleton().enabled()) {
+        return;
+    }
+    _queue_depth = &metrics_gauge("pico_rpc_async_queue_depth",
+          "tasks waiting in rpc async executor", labels);
+    _thread_num = &metrics_gauge("pico_rpc_async_thread_num",
+          "threads in rpc async executor", labels);
+    _wait_ms = &metrics_histogram("pico_rpc_async_wait_ms",
+          "time from submit to start of rpc async tasks", labels, async_duration_bucket());
+    _run_ms = &metrics_histogram("pico_rpc_async_run_ms",
+          "running time of rpc async tasks", labels, async_duration_bucket());
+}
+
+// finalize开始后线程可能已经退出，join的线程也不能再变
+void AsyncExecutor::submit(std::function<void()> task) {
+    size_t depth, thread_num;
+    {
+        std::unique_lock<std::mutex> lk(_mu);
+        if (_stop) {
+            lk.unlock();
+            task();
+            return;
+        }
+        _tasks.push_back({std::move(task), std::chrono::steady_clock::now()});
+        depth = _tasks.size();
+        if (_idle_thread_num < depth && _threads.size() < _max_thread_num) {
+            _threads.emplace_back(&AsyncExecutor::run, this);
+        }
+        thread_num = _threads.size();
+    }
+    _task_cv.notify_one();
+    if (_queue_depth) {
+        _queue_depth->Set(depth);
+        _thread_num->Set(thread_num);
+    }
+}
+
+void AsyncExecutor::drain() {
+    std::unique_lock<std::mutex> lk(_mu);
+    _drain_cv.wait(lk, [this]() {
+        return _tasks.empty() && _running_task_num == 0;
+    });
+}
+
+void AsyncExecutor::finalize() {
+    {
+        std::lock_guard<std::mutex> lk(_mu);
+        if (_stop) {
+            return;
+        }
+        _stop = true;
+    }
+    _task_cv.notify_all();
+    for (auto& th : _threads) {
+        th.join();
+    }
+    // _stop之前提交的任务都有线程取走，之后的没有进队列
+    std::lock_guard<std::mutex> lk(_mu);
+    SCHECK(_tasks.empty()) << _tasks.size();
+}
+
+/*
+ * _stop之后仍然把队列中的任务执行完才退出，
+ * 这时任务中再submit的任务在当前线程中直接执行
+ */
+void AsyncExecutor::run() {
+    std::unique_lock<std::mutex> lk(_mu);
+    for (;;) {
+        ++_idle_thread_num;
+        _task_cv.wait(lk, [this]() {
+            return _stop || !_tasks.empty();
+        });
+        --_idle_thread_num;
+        if (_tasks.empty()) {
+            return;
+        }
+        task_t task = std::move(_tasks.front());
+        _tasks.pop_front();
+        ++_running_task_num;
+        size_t depth = _tasks.size();
+        lk.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::milli> wait = start - task.submit_time;
+        if (_queue_depth) {
+            _queue_depth->Set(depth);
+            _wait_ms->Observe(wait.count());
+        }
+
+        task.run();
+
+        std::chrono::duration<double, std::milli> dur
+              = std::chrono::steady_clock::now() - start;
+        if (_run_ms) {
+            _run_ms->Observe(dur.count());
+        }
+
+        lk.lock();
+        --_running_task_num;
+        if (_tasks.empty() && _running_task_num == 0) {
+            _drain_cv.notify_all();
+        }
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
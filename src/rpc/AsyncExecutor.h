@@ -0,0 +1,80 @@
+#ifndef PARADIGM4_PICO_CORE_ASYNC_EXECUTOR_H
+#define PARADIGM4_PICO_CORE_ASYNC_EXECUTOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "VirtualObject.h"
+
+namespace prometheus {
+class Gauge;
+class Histogram;
+}
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+/*
+ * RpcContext::async用的线程池
+ * 任务可能阻塞(keep_writing, connect重试)，所以没有空闲线程时按需创建，
+ * 最多max_thread_num个，之后的任务排队；线程创建后一直复用到finalize
+ */
+class AsyncExecutor : public NoncopyableObject {
+public:
+    AsyncExecutor() = default;
+
+    ~AsyncExecutor() {
+        finalize();
+    }
+
+    // labels附加在metrics上，用于区分同一进程中的多个RpcContext，Metrics需要在此之前initialize
+    void initialize(size_t max_thread_num,
+          const std::map<std::string, std::string>& labels);
+
+    // finalize开始后在调用者线程中直接执行
+    void submit(std::function<void()> task);
+
+    // 等待已提交的任务(包括执行中提交的)全部完成，线程保留
+    void drain();
+
+    // 执行完剩余任务后回收所有线程，之后submit的任务在调用者线程中直接执行
+    void finalize();
+
+private:
+    struct task_t {
+        std::function<void()> run;
+        std::chrono::steady_clock::time_point submit_time;
+    };
+
+    void run();
+
+    std::mutex _mu;
+    std::condition_variable _task_cv;
+    std::condition_variable _drain_cv;
+    std::deque<task_t> _tasks;
+    std::vector<std::thread> _threads;
+    size_t _max_thread_num = 1;
+    size_t _idle_thread_num = 0;
+    size_t _running_task_num = 0;
+    bool _stop = false;
+
+    // initialize时创建，Metrics没有启用时都为nullptr
+    prometheus::Gauge* _queue_depth = nullptr;
+    prometheus::Gauge* _thread_num = nullptr;
+    prometheus::Histogram* _wait_ms = nullptr;
+    prometheus::Histogram* _run_ms = nullptr;
+};
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_ASYNC_EXECUTOR_H
@@ -0,0 +1,95 @@
+#include "Collective.h"
+#include "RpcService.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+Collective::Collective(RpcService* service, const std::string& name, int rank, int size,
+      const CollectiveConfig& config)
+    : _service(service), _rpc_name("collective_" + name), _rank(rank), _size(size),
+      _config(config) {
+    SCHECK(rank >= 0 && rank < size) << rank << " " << size;
+    SCHECK(_config.chunk_bytes > 0 && _config.chunk_bytes <= UINT32_MAX) << _config.chunk_bytes;
+    if (_size == 1) {
+        return;
+    }
+    _server = _service->create_server(_rpc_name, _rank);
+    _server_dealer = _server->create_dealer();
+    // 等所有参与者的server都注册
+    _client = _service->create_client(_rpc_name, _size);
+    _client_dealer = _client->create_dealer();
+}
+
+Collective::~Collective() {
+    _client_dealer.reset();
+    _client.reset();
+    _server_dealer.reset();
+    _server.reset();
+}
+
+std::pair<size_t, size_t> Collective::segment(size_t n, int size, int i) {
+    size_t base = n / size;
+    size_t rem = n % size;
+    size_t idx = i;
+    size_t offset = base * idx + std::min(idx, rem);
+    return {offset, base + (idx < rem ? 1 : 0)};
+}
+
+bool Collective::use_recursive_doubling(size_t bytes) const {
+    bool pow2 = (_size & (_size - 1)) == 0;
+    if (_config.algorithm == "ring") {
+        return false;
+    }
+    if (_config.algorithm == "recursive_doubling") {
+        SCHECK(pow2) << "recursive doubling needs a power-of-two size, got " << _size;
+        return true;
+    }
+    SCHECK(_config.algorithm == "auto") << "unknown collective algorithm " << _config.algorithm;
+    return pow2 && bytes <= _config.recursive_doubling_bytes;
+}
+
+void Collective::barrier() {
+    int x = 0;
+    allreduce(&x, 1);
+}
+
+void Collective::send_block(int peer, uint32_t step, uint32_t chunk,
+      const char* data, size_t size) {
+    RpcRequest req;
+    req.set_sid(peer);
+    req << _rank << _seq << step << chunk;
+    // 发送是异步的，调用者之后会改写data，所以拷贝进自己的block
+    data_block_t block(static_cast<uint32_t>(size));
+    std::memcpy(block.data, data, size);
+    req.lazy() << std::move(block);
+    _client_dealer->send_request_one_way(std::move(req));
+}
+
+data_block_t Collective::recv_block(int peer, uint32_t step, uint32_t chunk) {
+    tag_t want(_seq, step, chunk, peer);
+    auto it = _stash.find(want);
+    if (it != _stash.end()) {
+        data_block_t block = std::move(it->second);
+        _stash.erase(it);
+        return block;
+    }
+    RpcRequest req;
+    for (;;) {
+        SCHECK(_server_dealer->recv_request(req)) << "collective " << _rpc_name << " terminated";
+        int src;
+        uint32_t seq, s, k;
+        req >> src >> seq >> s >> k;
+        data_block_t block;
+        req.lazy() >> block;
+        tag_t tag(seq, s, k, src);
+        if (tag == want) {
+            return block;
+        }
+        SCHECK(_stash.emplace(tag, std::move(block)).second) << "duplicated collective message";
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
@@ -0,0 +1,290 @@
+#ifndef PARADIGM4_PICO_CORE_COLLECTIVE_H
+#define PARADIGM4_PICO_CORE_COLLECTIVE_H
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "Dealer.h"
+#include "RpcClient.h"
+#include "RpcServer.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+class RpcService;
+
+struct CollectiveConfig {
+    CollectiveConfig() = default;
+
+    template<typename T>
+    CollectiveConfig(const T& o) {
+        PICO_CONFIG_COPY_FIELD(o, chunk_bytes);
+        PICO_CONFIG_COPY_FIELD(o, algorithm);
+        PICO_CONFIG_COPY_FIELD(o, recursive_doubling_bytes);
+    }
+
+    // 每个消息最多携带的字节数，大的数据切成多个chunk流水线发送
+    size_t chunk_bytes = 1 << 20;
+    // allreduce的算法: ring, recursive_doubling, auto
+    std::string algorithm = "auto";
+    // auto时不超过这个大小且参与者个数是2的幂时用recursive doubling，否则用ring
+    size_t recursive_doubling_bytes = 64 << 10;
+};
+
+enum class CollectiveOp {
+    SUM,
+    MAX,
+    MIN,
+};
+
+/*
+ * 基于RpcService的集合通信，参与者各自构造一个同name的Collective，
+ * rank是0到size-1的编号；所有参与者必须以相同的顺序调用相同的操作
+ * 每个参与者创建一个server_id为rank的server，点对点消息都是one way request，
+ * 数据拷贝进自己的block后作为lazy block发送，不经过BinaryArchive序列化，
+ * 接收方直接在收到的block上reduce
+ * 不是线程安全的
+ */
+class Collective {
+public:
+    Collective(RpcService* service, const std::string& name, int rank, int size,
+          const CollectiveConfig& config = CollectiveConfig());
+
+    ~Collective();
+
+    int rank() const {
+        return _rank;
+    }
+
+    int size() const {
+        return _size;
+    }
+
+    // n个元素平均分成size段时第i段的[offset, offset + count)
+    static std::pair<size_t, size_t> segment(size_t n, int size, int i);
+
+    template <class T>
+    void allreduce(T* data, size_t n, CollectiveOp op = CollectiveOp::SUM) {
+        check_type<T>();
+        if (_size == 1 || n == 0) {
+            return;
+        }
+        ++_seq;
+        if (use_recursive_doubling(n * sizeof(T))) {
+            recursive_doubling_allreduce(data, n, op);
+        } else {
+            ring_reduce_scatter(data, n, op);
+            ring_allgather(data, n, _size - 1);
+        }
+    }
+
+    // 结束后data中第rank段是所有参与者的规约结果，其他段的内容不确定
+    template <class T>
+    void reduce_scatter(T* data, size_t n, CollectiveOp op = CollectiveOp::SUM) {
+        check_type<T>();
+        if (_size == 1 || n == 0) {
+            return;
+        }
+        ++_seq;
+        ring_reduce_scatter(data, n, op);
+    }
+
+    // data中有n个元素，调用前每个参与者填好自己的第rank段，结束后所有段都已填好
+    template <class T>
+    void allgather(T* data, size_t n) {
+        check_type<T>();
+        if (_size == 1 || n == 0) {
+            return;
+        }
+        ++_seq;
+        ring_allgather(data, n, 0);
+    }
+
+    // root的data发给所有参与者，沿着ring接力，按chunk流水线
+    template <class T>
+    void broadcast(T* data, size_t n, int root) {
+        check_type<T>();
+        if (_size == 1 || n == 0) {
+            return;
+        }
+        ++_seq;
+        int pos = (_rank - root + _size) % _size;
+        size_t chunk = chunk_count<T>();
+        for (size_t off = 0, k = 0; off < n; off += chunk, ++k) {
+            size_t cnt = std::min(chunk, n - off);
+            if (pos != 0) {
+                recv_copy(left(), 0, k, data + off, cnt);
+            }
+            if (pos != _size - 1) {
+                send(right(), 0, k, data + off, cnt);
+            }
+        }
+    }
+
+    void barrier();
+
+private:
+    typedef std::tuple<uint32_t, uint32_t, uint32_t, int> tag_t;
+
+    template <class T>
+    static void check_type() {
+        static_assert(std::is_arithmetic<T>::value, "collective only supports arithmetic types");
+    }
+
+    template <class T>
+    size_t chunk_count() {
+        return std::max<size_t>(_config.chunk_bytes / sizeof(T), 1);
+    }
+
+    int left() const {
+        return (_rank - 1 + _size) % _size;
+    }
+
+    int right() const {
+        return (_rank + 1) % _size;
+    }
+
+    int seg_index(int i) const {
+        return ((i % _size) + _size) % _size;
+    }
+
+    bool use_recursive_doubling(size_t bytes) const;
+
+    template <class T>
+    static void reduce(T* out, const T* in, size_t n, CollectiveOp op) {
+        switch (op) {
+        case CollectiveOp::SUM:
+            for (size_t i = 0; i < n; ++i) {
+                out[i] += in[i];
+            }
+            break;
+        case CollectiveOp::MAX:
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = std::max(out[i], in[i]);
+            }
+            break;
+        case CollectiveOp::MIN:
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = std::min(out[i], in[i]);
+            }
+            break;
+        }
+    }
+
+    template <class T>
+    void send(int peer, uint32_t step, uint32_t chunk, const T* data, size_t n) {
+        send_block(peer, step, chunk, reinterpret_cast<const char*>(data), n * sizeof(T));
+    }
+
+    template <class T>
+    void recv_copy(int peer, uint32_t step, uint32_t chunk, T* data, size_t n) {
+        data_block_t block = recv_block(peer, step, chunk);
+        SCHECK(block.length == n * sizeof(T)) << block.length << " " << n;
+        std::memcpy(data, block.data, block.length);
+    }
+
+    template <class T>
+    void recv_reduce(int peer, uint32_t step, uint32_t chunk, T* data, size_t n,
+          CollectiveOp op) {
+        data_block_t block = recv_block(peer, step, chunk);
+        SCHECK(block.length == n * sizeof(T)) << block.length << " " << n;
+        reduce(data, reinterpret_cast<const T*>(block.data), n, op);
+    }
+
+    /*
+     * step s发送第rank - s - 1段，接收第rank - s - 2段并规约，
+     * 收到一个chunk就转发给下一步，size - 1步后第rank段规约完成
+     */
+    template <class T>
+    void ring_reduce_scatter(T* data, size_t n, CollectiveOp op) {
+        size_t chunk = chunk_count<T>();
+        auto first = segment(n, _size, seg_index(_rank - 1));
+        for (size_t off = 0, k = 0; off < first.second; off += chunk, ++k) {
+            send(right(), 0, k, data + first.first + off,
+                  std::min(chunk, first.second - off));
+        }
+        for (int s = 0; s < _size - 1; ++s) {
+            auto seg = segment(n, _size, seg_index(_rank - s - 2));
+            for (size_t off = 0, k = 0; off < seg.second; off += chunk, ++k) {
+                size_t cnt = std::min(chunk, seg.second - off);
+                T* p = data + seg.first + off;
+                recv_reduce(left(), s, k, p, cnt, op);
+                if (s < _size - 2) {
+                    send(right(), s + 1, k, p, cnt);
+                }
+            }
+        }
+    }
+
+    /*
+     * step s发送第rank - s段，接收第rank - s - 1段，收到一个chunk就转发给下一步
+     * step从step_base开始编号，接在reduce scatter之后时不会和它的消息混淆
+     */
+    template <class T>
+    void ring_allgather(T* data, size_t n, int step_base) {
+        size_t chunk = chunk_count<T>();
+        auto own = segment(n, _size, _rank);
+        for (size_t off = 0, k = 0; off < own.second; off += chunk, ++k) {
+            send(right(), step_base, k, data + own.first + off,
+                  std::min(chunk, own.second - off));
+        }
+        for (int s = 0; s < _size - 1; ++s) {
+            auto seg = segment(n, _size, seg_index(_rank - s - 1));
+            for (size_t off = 0, k = 0; off < seg.second; off += chunk, ++k) {
+                size_t cnt = std::min(chunk, seg.second - off);
+                T* p = data + seg.first + off;
+                recv_copy(left(), step_base + s, k, p, cnt);
+                if (s < _size - 2) {
+                    send(right(), step_base + s + 1, k, p, cnt);
+                }
+            }
+        }
+    }
+
+    // size是2的幂，第s步和rank ^ (1 << s)交换全部数据，log(size)步
+    template <class T>
+    void recursive_doubling_allreduce(T* data, size_t n, CollectiveOp op) {
+        size_t chunk = chunk_count<T>();
+        uint32_t step = 0;
+        for (int mask = 1; mask < _size; mask <<= 1, ++step) {
+            int peer = _rank ^ mask;
+            for (size_t off = 0, k = 0; off < n; off += chunk, ++k) {
+                send(peer, step, k, data + off, std::min(chunk, n - off));
+            }
+            for (size_t off = 0, k = 0; off < n; off += chunk, ++k) {
+                recv_reduce(peer, step, k, data + off, std::min(chunk, n - off), op);
+            }
+        }
+    }
+
+    void send_block(int peer, uint32_t step, uint32_t chunk, const char* data, size_t size);
+
+    // 等待peer发来的(当前操作, step, chunk)，先到的其他消息暂存
+    data_block_t recv_block(int peer, uint32_t step, uint32_t chunk);
+
+    RpcService* _service;
+    std::string _rpc_name;
+    int _rank;
+    int _size;
+    CollectiveConfig _config;
+    uint32_t _seq = 0;
+
+    std::unique_ptr<RpcServer> _server;
+    std::unique_ptr<RpcClient> _client;
+    std::shared_ptr<Dealer> _server_dealer;
+    std::shared_ptr<Dealer> _client_dealer;
+    std::map<tag_t, data_block_t> _stash;
+};
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_COLLECTIVE_H
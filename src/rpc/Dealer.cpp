@@ -1,4 +1,10 @@
 #include "Dealer.h"
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <random>
+
 #include "RpcService.h"
 #include "RpcServer.h"
 #include "RpcClient.h"
@@ -70,6 +76,15 @@ void Dealer::finalize() {
         } else {
             _ctx->remove_server_dealer(_rpc_id, -1, this);
         }
+        // 已经不会再收到request，没有取走的回复ENOSUCHSERVER，否则client的credit不会归还
+        std::vector<RpcRequest> reqs;
+        while (_server_req_ch->recv_batch(reqs, 64, 0, 0) > 0) {
+            shared_lock_guard<RWSpinLock> l(_ctx->_spin_lock);
+            for (auto& req : reqs) {
+                reply_terminated(req);
+            }
+            reqs.clear();
+        }
         _server_req_ch.reset();
         _initialized_server = false;
     }
@@ -82,6 +97,7 @@ void Dealer::finalize() {
         }
         _client_resp_ch.reset();
         _initialized_client = false;
+        fail_async();
     }
 }
 
@@ -102,12 +118,28 @@ void Dealer::reset() {
 // 尽可能访问local server
 void Dealer::_send_request(RpcRequest&& req) {
     SCHECK(_initialized_client);
+    // 没有dealer的request不会有response，不追踪
+    if (req.head().src_dealer != -1 && _ctx->tracer().sample()) {
+        req.enable_trace();
+    }
+    if (rpc_trace_t* trace = req.trace()) {
+        trace->stamp(RPC_TRACE_SEND_REQUEST);
+        trace->client_rank = _g_rank;
+    }
+    if (_request_timeout >= 0 && req.head().deadline_us == 0) {
+        req.set_timeout(_request_timeout);
+    }
     req.head().src_rank = _g_rank;
     req.head().rpc_id = _rpc_id;
+    // 多个线程可能同时发送，_servers由_servers_lock保护，_available_rank是原子的
     if (req.head().sid != -1) {
         int sid = req.head().sid;
-        auto it = _servers.find(sid);
-        if (it != _servers.end()) {
+        bool local;
+        {
+            lock_guard<SpinLock> _(_servers_lock);
+            local = _servers.count(sid) != 0;
+        }
+        if (local) {
             _ctx->_spin_lock.lock_shared();
             _ctx->push_request(std::move(req));
             _ctx->_spin_lock.unlock_shared();
@@ -115,8 +147,9 @@ void Dealer::_send_request(RpcRequest&& req) {
             // SLOG(INFO) << req.head();
             comm_rank_t rank = _ctx->send_request(std::move(req));
             if (rank == _g_rank) {
+                lock_guard<SpinLock> _(_servers_lock);
                 _servers.insert(sid);
-                _available_rank = _g_rank;
+                _available_rank.store(_g_rank, std::memory_order_relaxed);
             }
         }
     } else if (req.head().dest_rank != -1) {
@@ -126,22 +159,432 @@ void Dealer::_send_request(RpcRequest&& req) {
             _ctx->_spin_lock.unlock_shared();
         } else {
             comm_rank_t rank = _ctx->send_request(std::move(req));
-            if (_available_rank != _g_rank) {
-                _available_rank = rank;
+            comm_rank_t available = _available_rank.load(std::memory_order_relaxed);
+            if (available != _g_rank) {
+                _available_rank.compare_exchange_strong(available, rank,
+                      std::memory_order_relaxed);
             }
         }
     } else {
-        if (_available_rank == _g_rank) {
+        if (_available_rank.load(std::memory_order_relaxed) == _g_rank) {
             _ctx->_spin_lock.lock_shared();
             _ctx->push_request(std::move(req));
             _ctx->_spin_lock.unlock_shared();
         } else {
             comm_rank_t rank = _ctx->send_request(std::move(req));
-            _available_rank = rank;
+            _available_rank.store(rank, std::memory_order_relaxed);
+        }
+    }
+}
+
+uint32_t Dealer::register_async(callback_t done, bool run_in_io_thread) {
+    uint32_t id = 0;
+    while (id == 0) {
+        id = _async->next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+    auto& bucket = _async->bucket(id);
+    std::lock_guard<std::mutex> _(bucket.mu);
+    bucket.calls[id] = {std::move(done), run_in_io_thread};
+    return id;
+}
+
+void Dealer::async_request(RpcRequest&& req, callback_t done, bool run_in_io_thread) {
+    SCHECK(_initialized_client);
+    // 登记之后再发送，response可能在send_request返回前就到了
+    req.head().async_id = register_async(std::move(done), run_in_io_thread);
+    send_request(std::move(req));
+}
+
+int64_t Dealer::hedge_delay_us(const HedgeOption& opt) {
+    if (opt.delay_us >= 0) {
+        return opt.delay_us;
+    }
+    std::vector<double> samples;
+    {
+        std::lock_guard<std::mutex> _(_hedge->mu);
+        samples = _hedge->latency_us;
+    }
+    if (samples.size() < hedge_stat_t::WINDOW / 4) {
+        return opt.default_delay_us;
+    }
+    size_t k = std::min(size_t(opt.percentile * samples.size()), samples.size() - 1);
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return int64_t(samples[k]);
+}
+
+/*
+ * 两份request共用序列化好的payload，各自带async_id，回调在io线程中执行
+ * 迟到的response由async_id对应到已经完成的调用后丢弃
+ * 延迟样本从先返回的那一份发出时算起
+ */
+std::vector<RpcResponse> Dealer::hedged_rpc_calls(std::vector<RpcRequest>&& reqs,
+      const HedgeOption& opt) {
+    SCHECK(_initialized_client);
+    struct state_t {
+        std::mutex mu;
+        std::condition_variable cv;
+        std::vector<RpcResponse> resps;
+        // 每个调用还没有返回的份数，0表示已经完成
+        std::vector<int> inflight;
+        size_t remaining = 0;
+    };
+    auto st = std::make_shared<state_t>();
+    size_t n = reqs.size();
+    st->resps.resize(n);
+    st->inflight.assign(n, 1);
+    st->remaining = n;
+
+    std::vector<int> servers;
+    if (_rpc_client) {
+        _rpc_client->get_available_servers(servers);
+    }
+    thread_local std::mt19937 rng(std::random_device{}());
+    std::vector<int> primary(n, -1);
+    // 每个调用的两份request的async_id，第二份没有发出时为0
+    std::vector<std::array<uint32_t, 2>> async_ids(n, {0, 0});
+    std::vector<rpc_head_t> heads(n);
+    std::vector<std::shared_ptr<RpcMessage::shared_payload_t>> payloads(n);
+    auto start = std::chrono::steady_clock::now();
+    hedge_stat_t* stat = _hedge.get();
+    RpcMetrics* metrics = &_ctx->metrics();
+
+    auto make_callback = [st, stat, metrics](size_t i, bool hedge) {
+        auto sent_at = std::chrono::steady_clock::now();
+        return [st, stat, sent_at, metrics, i, hedge](RpcResponse&& resp) {
+            std::lock_guard<std::mutex> _(st->mu);
+            if (st->inflight[i] == 0) {
+                return;
+            }
+            // 还有另一份在路上时，失败的response不算数
+            if (resp.error_code() != RpcErrorCodeType::SUCC && st->inflight[i] > 1) {
+                --st->inflight[i];
+                return;
+            }
+            st->inflight[i] = 0;
+            st->resps[i] = std::move(resp);
+            if (hedge) {
+                stat->won.fetch_add(1, std::memory_order_relaxed);
+                metrics->hedge_win();
+            }
+            std::chrono::duration<double, std::micro> dur
+                  = std::chrono::steady_clock::now() - sent_at;
+            {
+                std::lock_guard<std::mutex> lk(stat->mu);
+                if (stat->latency_us.size() < hedge_stat_t::WINDOW) {
+                    stat->latency_us.push_back(dur.count());
+                } else {
+                    stat->latency_us[stat->next] = dur.count();
+                }
+                stat->next = (stat->next + 1) % hedge_stat_t::WINDOW;
+            }
+            if (--st->remaining == 0) {
+                st->cv.notify_all();
+            }
+        };
+    };
+
+    for (size_t i = 0; i < n; ++i) {
+        auto& req = reqs[i];
+        SCHECK(req.head().sid == -1 && req.head().dest_rank == -1) << req.head();
+        if (_request_timeout >= 0 && req.head().deadline_us == 0) {
+            req.set_timeout(_request_timeout);
+        }
+        req.head().src_rank = _g_rank;
+        req.head().src_dealer = _id;
+        req.head().rpc_id = _rpc_id;
+        if (!servers.empty()) {
+            primary[i] = servers[rng() % servers.size()];
+        }
+        req.head().sid = primary[i];
+        async_ids[i][0] = register_async(make_callback(i, false), true);
+        req.head().async_id = async_ids[i][0];
+        heads[i] = req.head();
+        payloads[i] = RpcMessage::share_payload(RpcMessage(std::move(req)));
+        _ctx->send_request(RpcMessage(heads[i], payloads[i]));
+    }
+
+    // 最多等到timeout_ms或最晚的deadline
+    auto give_up = std::chrono::steady_clock::time_point::max();
+    int64_t last_deadline_us = 0;
+    for (size_t i = 0; i < n && last_deadline_us >= 0; ++i) {
+        last_deadline_us = heads[i].deadline_us == 0
+              ? -1 : std::max(last_deadline_us, heads[i].deadline_us);
+    }
+    if (last_deadline_us > 0) {
+        give_up = std::chrono::steady_clock::now()
+              + std::chrono::microseconds(last_deadline_us - rpc_wall_clock_us());
+    }
+    if (opt.timeout_ms >= 0) {
+        give_up = std::min(give_up, start + std::chrono::milliseconds(opt.timeout_ms));
+    }
+
+    std::unique_lock<std::mutex> lock(st->mu);
+    auto deadline = std::min(give_up, start + std::chrono::microseconds(hedge_delay_us(opt)));
+    st->cv.wait_until(lock, deadline, [&st]() { return st->remaining == 0; });
+    if (st->remaining > 0 && servers.size() > 1) {
+        size_t sent = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (st->inflight[i] == 0) {
+                continue;
+            }
+            ++st->inflight[i];
+            int sid = servers[rng() % (servers.size() - 1)];
+            if (sid == primary[i]) {
+                sid = servers.back();
+            }
+            heads[i].sid = sid;
+            async_ids[i][1] = register_async(make_callback(i, true), true);
+            heads[i].async_id = async_ids[i][1];
+            lock.unlock();
+            _ctx->send_request(RpcMessage(heads[i], payloads[i]));
+            lock.lock();
+            ++sent;
+        }
+        _hedge->sent.fetch_add(sent, std::memory_order_relaxed);
+        _ctx->metrics().hedged_requests(sent);
+    }
+    auto done = [&st]() { return st->remaining == 0; };
+    if (give_up == std::chrono::steady_clock::time_point::max()) {
+        st->cv.wait(lock, done);
+        return std::move(st->resps);
+    }
+    size_t expired = 0;
+    if (!st->cv.wait_until(lock, give_up, done)) {
+        for (size_t i = 0; i < n; ++i) {
+            if (st->inflight[i] == 0) {
+                continue;
+            }
+            st->inflight[i] = 0;
+            heads[i].async_id = 0;
+            st->resps[i] = RpcResponse(heads[i]);
+            st->resps[i].set_error_code(RpcErrorCodeType::ETIMEOUT);
+            for (uint32_t id : async_ids[i]) {
+                if (id) {
+                    unregister_async(id);
+                }
+            }
+            ++expired;
+        }
+        st->remaining = 0;
+    }
+    lock.unlock();
+    // io线程持有读锁时会等st->mu，放开st->mu之后再拿读锁
+    if (expired) {
+        _ctx->_spin_lock.lock_shared();
+        if (RpcNameMetrics* name_metrics = _ctx->metrics().rpc(_rpc_id)) {
+            for (size_t i = 0; i < expired; ++i) {
+                name_metrics->client_error(RpcErrorCodeType::ETIMEOUT);
+            }
+        }
+        _ctx->_spin_lock.unlock_shared();
+    }
+    return std::move(st->resps);
+}
+
+RpcResponse Dealer::hedged_rpc_call(RpcRequest&& req, const HedgeOption& opt) {
+    std::vector<RpcRequest> reqs;
+    reqs.push_back(std::move(req));
+    return std::move(hedged_rpc_calls(std::move(reqs), opt)[0]);
+}
+
+std::future<RpcResponse> Dealer::async_request(RpcRequest&& req) {
+    auto promise = std::make_shared<std::promise<RpcResponse>>();
+    auto future = promise->get_future();
+    async_request(std::move(req), [promise](RpcResponse&& resp) {
+        promise->set_value(std::move(resp));
+    }, true);
+    return future;
+}
+
+size_t Dealer::pending_async_num() {
+    size_t ret = 0;
+    for (auto& bucket : _async->buckets) {
+        std::lock_guard<std::mutex> _(bucket.mu);
+        ret += bucket.calls.size();
+    }
+    return ret;
+}
+
+void Dealer::complete_async(RpcResponse&& resp) {
+    uint32_t id = resp.head().async_id;
+    async_call_t call;
+    {
+        auto& bucket = _async->bucket(id);
+        std::lock_guard<std::mutex> _(bucket.mu);
+        auto it = bucket.calls.find(id);
+        if (it == bucket.calls.end()) {
+            SLOG(WARNING) << "recv async resp, but the call has finished. Drop it. "
+                  << resp.head();
+            return;
+        }
+        call = std::move(it->second);
+        bucket.calls.erase(it);
+    }
+    if (call.run_in_io_thread) {
+        // 调用者持有读锁，done中的发送不能等待credit
+        bool& in_io_handler = RpcContext::in_io_handler();
+        bool saved = in_io_handler;
+        in_io_handler = true;
+        call.done(std::move(resp));
+        in_io_handler = saved;
+    } else {
+        // std::function要求可拷贝，response放在shared_ptr中
+        auto holder = std::make_shared<RpcResponse>(std::move(resp));
+        auto done = std::move(call.done);
+        _ctx->async([holder, done]() {
+            done(std::move(*holder));
+        });
+    }
+}
+
+void Dealer::unregister_async(uint32_t id) {
+    auto& bucket = _async->bucket(id);
+    std::lock_guard<std::mutex> _(bucket.mu);
+    bucket.calls.erase(id);
+}
+
+void Dealer::fail_async() {
+    if (!_async) {
+        return;
+    }
+    for (auto& bucket : _async->buckets) {
+        std::unordered_map<uint32_t, async_call_t> calls;
+        {
+            std::lock_guard<std::mutex> _(bucket.mu);
+            calls.swap(bucket.calls);
+        }
+        for (auto& it : calls) {
+            rpc_head_t req_head;
+            req_head.src_rank = _g_rank;
+            req_head.src_dealer = _id;
+            req_head.rpc_id = _rpc_id;
+            req_head.async_id = it.first;
+            RpcResponse resp(req_head);
+            resp.set_error_code(RpcErrorCodeType::ECONNECTION);
+            // dealer正在析构，直接在当前线程调用
+            it.second.done(std::move(resp));
+        }
+    }
+}
+
+void Dealer::offload_inline(const std::shared_ptr<inline_state_t>& st, RpcRequest&& req) {
+    auto holder = std::make_shared<RpcRequest>(std::move(req));
+    st->ctx->async([st, holder]() {
+        int64_t us = run_handler(*st, *holder, true);
+        if (!st->offloaded.load(std::memory_order_relaxed)) {
+            return;
+        }
+        // 转出后每次快的调用抵消一次慢的，抵消完回到io线程
+        if (us >= st->opt.slow_us) {
+            st->slow_calls.store(st->opt.max_slow_calls, std::memory_order_relaxed);
+        } else if (st->slow_calls.fetch_sub(1, std::memory_order_relaxed) <= 1
+              && st->offloaded.exchange(false)) {
+            st->slow_calls.store(0, std::memory_order_relaxed);
+            SLOG(INFO) << "inline rpc handler of rpc_id " << holder->head().rpc_id
+                       << " is fast again, run it in the io thread";
+        }
+    });
+}
+
+void Dealer::multicast_request(RpcRequest&& req, const std::vector<comm_rank_t>& dest_ranks,
+      bool one_way) {
+    SCHECK(_initialized_client);
+    if (_request_timeout >= 0 && req.head().deadline_us == 0) {
+        req.set_timeout(_request_timeout);
+    }
+    req.head().src_rank = _g_rank;
+    req.head().src_dealer = one_way ? -1 : _id;
+    req.head().rpc_id = _rpc_id;
+    req.head().sid = -1;
+    if (!one_way && _ctx->tracer().sample()) {
+        req.enable_trace();
+    }
+    if (rpc_trace_t* trace = req.trace()) {
+        trace->stamp(RPC_TRACE_SEND_REQUEST);
+        trace->client_rank = _g_rank;
+    }
+    rpc_head_t head = req.head();
+    RpcMessage msg(std::move(req));
+    // 只发给本rank时不压缩；有其他rank时只压缩一次，本rank收到时解压
+    bool remote = false;
+    for (comm_rank_t rank : dest_ranks) {
+        remote = remote || rank != _g_rank;
+    }
+    if (remote) {
+        _ctx->compress_request(msg);
+    }
+    auto payload = RpcMessage::share_payload(std::move(msg));
+    for (comm_rank_t rank : dest_ranks) {
+        head.dest_rank = rank;
+        // 本rank时send_request直接push_request
+        _ctx->send_request(RpcMessage(head, payload));
+    }
+}
+
+bool Dealer::recv_request(RpcRequest& req, int timeout) {
+    SCHECK(_initialized_server);
+    auto start = std::chrono::steady_clock::now();
+    int left = timeout;
+    while (_server_req_ch->recv(req, left, 64)) {
+        if (!req.head().expired(rpc_wall_clock_us())) {
+            req.stamp_trace(RPC_TRACE_RECV_REQUEST);
+            return true;
+        }
+        reply_expired(req);
+        if (timeout > 0) {
+            std::chrono::duration<double, std::milli> dur
+                  = std::chrono::steady_clock::now() - start;
+            left = std::max(timeout - int(dur.count()), 0);
+        }
+    }
+    return false;
+}
+
+bool Dealer::recv_requests(std::vector<RpcRequest>& reqs, size_t max_n, int timeout) {
+    SCHECK(_initialized_server);
+    auto start = std::chrono::steady_clock::now();
+    int left = timeout;
+    reqs.clear();
+    while (_server_req_ch->recv_batch(reqs, max_n, left, 64) > 0) {
+        int64_t now = rpc_wall_clock_us();
+        size_t n = 0;
+        for (size_t i = 0; i < reqs.size(); ++i) {
+            if (reqs[i].head().expired(now)) {
+                reply_expired(reqs[i]);
+            } else {
+                reqs[i].stamp_trace(RPC_TRACE_RECV_REQUEST);
+                if (n != i) {
+                    reqs[n] = std::move(reqs[i]);
+                }
+                ++n;
+            }
         }
+        reqs.resize(n);
+        if (n > 0) {
+            return true;
+        }
+        if (timeout > 0) {
+            std::chrono::duration<double, std::milli> dur
+                  = std::chrono::steady_clock::now() - start;
+            left = std::max(timeout - int(dur.count()), 0);
+        }
+    }
+    return false;
+}
+
+void Dealer::reply_expired(RpcRequest& req) {
+    _ctx->count_expired_request(RPC_EXPIRED_DEQUEUE);
+    if (req.head().src_dealer != -1) {
+        RpcResponse resp(req);
+        resp.set_error_code(RpcErrorCodeType::ETIMEOUT);
+        send_response(std::move(resp));
     }
 }
 
+void Dealer::reply_terminated(RpcRequest& req) {
+    _ctx->reply_error(req, RpcErrorCodeType::ENOSUCHSERVER);
+}
+
 /*
  * server method
  * 返回response不会做重连
@@ -149,15 +592,76 @@ void Dealer::_send_request(RpcRequest&& req) {
  * 等client超时重发
  */
 void Dealer::send_response(RpcResponse&& resp) {
+    send_response(_ctx, _g_rank, std::move(resp), true);
+}
+
+void Dealer::send_response(RpcContext* ctx, comm_rank_t g_rank,
+      RpcResponse&& resp, bool flow_control) {
     if (resp.head().dest_dealer == -1) {
         return;
     }
-    shared_lock_guard<RWSpinLock> lock(_ctx->_spin_lock);
+    resp.stamp_trace(RPC_TRACE_SEND_RESPONSE);
     comm_rank_t dest_g_rank = resp.head().dest_rank;
-    if (dest_g_rank == _g_rank) {
-        _ctx->push_response(std::move(resp));
+    if (dest_g_rank == g_rank) {
+        shared_lock_guard<RWSpinLock> lock(ctx->_spin_lock);
+        ctx->push_response(std::move(resp));
     } else {
-        _ctx->send_response(std::move(resp), true);
+        // credit不足时会等待，不能持有读锁
+        ctx->send_response(std::move(resp), true, flow_control);
+    }
+}
+
+void Dealer::set_inline_handler(handler_t handler, const InlineHandlerOption& opt) {
+    SCHECK(_initialized_server);
+    auto st = std::make_shared<inline_state_t>();
+    st->handler = std::move(handler);
+    st->opt = opt;
+    st->ctx = _ctx;
+    st->g_rank = _g_rank;
+    _inline = st;
+}
+
+bool Dealer::inline_offloaded() {
+    return _inline && _inline->offloaded.load(std::memory_order_relaxed);
+}
+
+int64_t Dealer::run_handler(inline_state_t& st, RpcRequest& req, bool flow_control) {
+    auto start = std::chrono::steady_clock::now();
+    req.stamp_trace(RPC_TRACE_RECV_REQUEST);
+    RpcResponse resp(req);
+    // io线程中handler发送的request和response都不等待credit
+    bool& in_io_handler = RpcContext::in_io_handler();
+    bool saved = in_io_handler;
+    in_io_handler = saved || !flow_control;
+    st.handler(req, resp);
+    in_io_handler = saved;
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start).count();
+    send_response(st.ctx, st.g_rank, std::move(resp), flow_control);
+    return us;
+}
+
+/*
+ * 调用者是io线程并持有_spin_lock读锁，handler中可以发送request和response，
+ * 但不能等待credit(等待时不释放读锁)，所以这期间的发送都不做流控，超过credit也直接发出
+ */
+void Dealer::handle_inline(const std::shared_ptr<inline_state_t>& st, RpcRequest&& req) {
+    if (st->offloaded.load(std::memory_order_relaxed)) {
+        return offload_inline(st, std::move(req));
+    }
+    int64_t us = run_handler(*st, req, false);
+    if (us < st->opt.slow_us) {
+        st->slow_calls.store(0, std::memory_order_relaxed);
+        return;
+    }
+    st->ctx->metrics().slow_inline_handler();
+    if (st->slow_calls.fetch_add(1, std::memory_order_relaxed) + 1 >= st->opt.max_slow_calls
+          && !st->offloaded.exchange(true)) {
+        st->slow_calls.store(st->opt.max_slow_calls, std::memory_order_relaxed);
+        SLOG(WARNING) << "inline rpc handler of rpc_id " << req.head().rpc_id << " took "
+                      << us << "us, exceeding " << st->opt.slow_us << "us "
+                      << st->opt.max_slow_calls
+                      << " times in a row, run it on the async executor until it is fast again";
     }
 }
 
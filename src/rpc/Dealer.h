@@ -1,7 +1,12 @@
 #ifndef PARADIGM4_PICO_CORE_DEALER_H
 #define PARADIGM4_PICO_CORE_DEALER_H
 
+#include <atomic>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include "MasterClient.h"
 #include "RpcChannel.h"
@@ -17,10 +22,26 @@ class RpcService;
 class RpcServer;
 class RpcClient;
 
+/*
+ * hedged_rpc_calls的选项
+ * 等待delay_us后还没有response的request再发一份给另一个server，先到的response有效
+ * delay_us小于0时等待最近延迟的percentile分位数，样本不足时等待default_delay_us
+ * 最多等到timeout_ms或所有request中最晚的deadline，没有返回的调用得到ETIMEOUT；
+ * timeout_ms小于0并且有request没有deadline时一直等待
+ */
+struct HedgeOption {
+    int delay_us = -1;
+    double percentile = 0.95;
+    int default_delay_us = 1000;
+    int timeout_ms = -1;
+};
+
 class Dealer {
 public:
     typedef RpcChannel<RpcRequest> req_ch_t;
     typedef RpcChannel<RpcResponse> resp_ch_t;
+    typedef std::function<void(RpcResponse&&)> callback_t;
+    typedef rpc_handler_t handler_t;
 
     Dealer() = default;
 
@@ -40,6 +61,10 @@ public:
         _client_resp_ch = std::move(rhs._client_resp_ch);
         _initialized_server = rhs._initialized_server;
         _initialized_client = rhs._initialized_client;
+        _request_timeout = rhs._request_timeout;
+        _async = std::move(rhs._async);
+        _hedge = std::move(rhs._hedge);
+        _inline = std::move(rhs._inline);
         rhs._initialized_server = false;
         rhs._initialized_client = false;
         return *this;
@@ -79,6 +104,14 @@ public:
         _send_request(std::move(req));
     }
 
+    /*
+     * 同一个request发给dest_ranks中的每个rank，body和lazy block只序列化和压缩一次，
+     * 每个目标只分配自己的head和trace；one_way为false时每个目标回复一个response
+     * 不能设置sid，response按rank区分
+     */
+    void multicast_request(RpcRequest&& req, const std::vector<comm_rank_t>& dest_ranks,
+          bool one_way = false);
+
     RpcResponse sync_rpc_call(RpcRequest&& req) {
         RpcResponse resp;
         send_request(std::move(req));
@@ -86,19 +119,78 @@ public:
         return resp;
     }
 
+    /*
+     * 之后发出的没有设置deadline的request都带上timeout_ms的deadline，-1表示不设置
+     * server在request过期后不再处理，回复ETIMEOUT
+     */
+    void set_request_timeout(int timeout_ms) {
+        _request_timeout = timeout_ms;
+    }
+
+    /*
+     * 异步调用，不经过recv_response，多个线程可以在同一个dealer上同时发出任意多个
+     * (send_request等其他发送方法同样可以并发调用)
+     * 收到response后调用done，run_in_io_thread为true时直接在io线程中调用，
+     * 这时done不能阻塞，其中的发送不做流控；否则交给RpcContext::async
+     * server一直不回复时done不会被调用，需要配合set_request_timeout使用；
+     * dealer finalize时还没有完成的调用收到ECONNECTION
+     */
+    void async_request(RpcRequest&& req, callback_t done, bool run_in_io_thread = false);
+
+    // response在io线程中交给future
+    std::future<RpcResponse> async_request(RpcRequest&& req);
+
+    // 还没有完成的异步调用数
+    size_t pending_async_num();
+
+    /*
+     * 只读的request可以发给任意一个server时使用，request不能指定sid和dest_rank
+     * 每个request先发给随机的一个server，超过等待时间的再发一份给另一个server，
+     * 每个request取先到的成功response，迟到的丢弃；返回的response与reqs一一对应
+     */
+    std::vector<RpcResponse> hedged_rpc_calls(std::vector<RpcRequest>&& reqs,
+          const HedgeOption& opt = HedgeOption());
+
+    RpcResponse hedged_rpc_call(RpcRequest&& req, const HedgeOption& opt = HedgeOption());
+
+    // 发出的第二份request数
+    size_t hedge_sent_num() {
+        return _hedge->sent.load(std::memory_order_relaxed);
+    }
+
+    // 第二份先返回的次数
+    size_t hedge_won_num() {
+        return _hedge->won.load(std::memory_order_relaxed);
+    }
+
     // retry现在是摆设
     void _send_request(RpcRequest&& req);
 
     void push_response(RpcResponse&& resp) {
         SCHECK(_initialized_client);
+        if (resp.head().async_id != 0) {
+            return complete_async(std::move(resp));
+        }
         return _client_resp_ch->send(std::move(resp));
     }
 
+    // 还没有取走的response个数，用于监控
+    int64_t pending_responses() const {
+        return _client_resp_ch->size();
+    }
+
     bool recv_response(RpcResponse& resp, int timeout = -1) {
         SCHECK(_initialized_client);
         return _client_resp_ch->recv(resp, timeout, 1);
     }
 
+    // 清空resps后最多取max_n个，等待方式与recv_response相同，没有取到时返回false
+    bool recv_responses(std::vector<RpcResponse>& resps, size_t max_n, int timeout = -1) {
+        SCHECK(_initialized_client);
+        resps.clear();
+        return _client_resp_ch->recv_batch(resps, max_n, timeout, 1) > 0;
+    }
+
     /*
      * server method
      * 返回response不会做重连
@@ -107,16 +199,48 @@ public:
      */
     void send_response(RpcResponse&& resp);
 
+    // 假设外部已经抢到读锁；terminate之后不再有人取，直接回复ENOSUCHSERVER归还credit
     void push_request(RpcRequest&& req) {
         SCHECK(_initialized_server);
+        if (_inline) {
+            return handle_inline(_inline, std::move(req));
+        }
+        if (_terminated.load(std::memory_order_relaxed)) {
+            return reply_terminated(req);
+        }
         return _server_req_ch->send(std::move(req));
     }
 
-    bool recv_request(RpcRequest& req, int timeout = -1) {
+    // 还没有取走的request个数，用于监控，inline handler时总是0
+    int64_t pending_requests() const {
+        return _server_req_ch->size();
+    }
+
+    /*
+     * 在收到request的线程(通常是io线程)中直接调用handler，不经过recv_request
+     * handler可能被多个线程同时调用；只适合很快的handler，慢了会自动转到RpcContext::async
+     */
+    void set_inline_handler(handler_t handler,
+          const InlineHandlerOption& opt = InlineHandlerOption());
+
+    // handler太慢，已经不在io线程中调用
+    bool inline_offloaded();
+
+    // 持有_spin_lock写锁时使用，inline handler交给RpcContext::async调用
+    void push_request_locked(RpcRequest&& req) {
         SCHECK(_initialized_server);
-        return _server_req_ch->recv(req, timeout, 64);
+        if (_inline) {
+            return offload_inline(_inline, std::move(req));
+        }
+        return _server_req_ch->send(std::move(req));
     }
 
+    // 在队列中过期的request直接回复ETIMEOUT，不返回给调用者
+    bool recv_request(RpcRequest& req, int timeout = -1);
+
+    // 清空reqs后最多取max_n个，用于server批量处理，过期的request同recv_request
+    bool recv_requests(std::vector<RpcRequest>& reqs, size_t max_n, int timeout = -1);
+
     int32_t id() {
         return _id;
     }
@@ -125,6 +249,73 @@ private:
 
     static int gen_id();
 
+    // 登记回调，返回async_id
+    uint32_t register_async(callback_t done, bool run_in_io_thread);
+
+    void complete_async(RpcResponse&& resp);
+
+    // 放弃还没有完成的异步调用，之后到达的response丢弃
+    void unregister_async(uint32_t id);
+
+    // 按opt和最近的延迟计算等待时间
+    int64_t hedge_delay_us(const HedgeOption& opt);
+
+    struct hedge_stat_t {
+        static constexpr size_t WINDOW = 256;
+        std::mutex mu;
+        // 最近WINDOW个调用的延迟，循环写入
+        std::vector<double> latency_us;
+        size_t next = 0;
+        std::atomic<size_t> sent = {0};
+        std::atomic<size_t> won = {0};
+    };
+
+    struct inline_state_t {
+        handler_t handler;
+        InlineHandlerOption opt;
+        RpcContext* ctx;
+        comm_rank_t g_rank;
+        std::atomic<int> slow_calls = {0};
+        std::atomic<bool> offloaded = {false};
+    };
+
+    static void handle_inline(const std::shared_ptr<inline_state_t>& st, RpcRequest&& req);
+
+    static void offload_inline(const std::shared_ptr<inline_state_t>& st, RpcRequest&& req);
+
+    // 返回handler用时
+    static int64_t run_handler(inline_state_t& st, RpcRequest& req, bool flow_control);
+
+    // 回复ETIMEOUT
+    void reply_expired(RpcRequest& req);
+
+    void reply_terminated(RpcRequest& req);
+
+    static void send_response(RpcContext* ctx, comm_rank_t g_rank,
+          RpcResponse&& resp, bool flow_control);
+
+    // 结束所有没有完成的异步调用
+    void fail_async();
+
+    struct async_call_t {
+        callback_t done;
+        bool run_in_io_thread;
+    };
+
+    // 按async_id分桶加锁，减少多个发送线程和io线程之间的竞争
+    struct async_table_t {
+        static constexpr size_t BUCKET_NUM = 16;
+        struct bucket_t {
+            std::mutex mu;
+            std::unordered_map<uint32_t, async_call_t> calls;
+        };
+        std::atomic<uint32_t> next_id = {1};
+        bucket_t buckets[BUCKET_NUM];
+
+        bucket_t& bucket(uint32_t id) {
+            return buckets[id % BUCKET_NUM];
+        }
+    };
 
     int _rpc_id;
     comm_rank_t _g_rank;
@@ -139,9 +330,16 @@ private:
 
     bool _initialized_server = false;
     bool _initialized_client = false;
-    bool _terminated = false;
+    std::atomic<bool> _terminated = {false};
+
+    int _request_timeout = -1;
+
+    std::unique_ptr<async_table_t> _async = std::make_unique<async_table_t>();
+    std::unique_ptr<hedge_stat_t> _hedge = std::make_unique<hedge_stat_t>();
+    std::shared_ptr<inline_state_t> _inline;
 
-    comm_rank_t _available_rank = -1;
+    std::atomic<comm_rank_t> _available_rank = {-1};
+    SpinLock _servers_lock;
     std::unordered_set<int> _servers; // local servers
 };
 
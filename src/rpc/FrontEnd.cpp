@@ -6,33 +6,38 @@ namespace paradigm4 {
 namespace pico {
 namespace core {
 
+// 写入socket后继续占用credit，等response带回
+static bool credit_wait_response(RpcMessage& msg) {
+    return msg.head()->dest_dealer == -1 && msg.head()->credit != 0;
+}
+
+// 发送时计入了LoadStat，等待response的request
+static bool load_wait_response(RpcMessage& msg) {
+    return msg.head()->dest_dealer == -1 && msg.head()->src_dealer != -1;
+}
+
 /*
  * 内部函数，外部保证只有一个线程调用
  */
 bool FrontEnd::connect() {
     if (state() & FRONTEND_DISCONNECT) {
-        std::unique_ptr<RpcSocket> socket;
-        if (_is_use_rdma) {
-#ifdef USE_RDMA
-            socket = std::make_unique<RdmaSocket>();
-#else
-            SLOG(FATAL) << "rdma not supported.";
-#endif
-        } else {
-            socket = std::make_unique<TcpSocket>();
-        }
+        std::unique_ptr<RpcSocket> socket = _ctx->create_socket();
         BinaryArchive ar;
         ar << uint16_t(0);
         ar << _ctx->self();
         std::string info;
         info.resize(ar.readable_length());
         memcpy(&info[0], ar.buffer(), info.size());
-        if (!socket->connect(_info.endpoint, info, 0)) {
+        if (!socket->connect(_info.endpoint, info, RPC_WIRE_VERSION)) {
             return false;
         }
         lock_guard<RWSpinLock> l(_ctx->_spin_lock);
         _socket = std::move(socket);
         _ctx->add_frontend_event(this);
+        // 断开前的request收不到response了
+        _load.on_disconnect();
+        _credit_used.fetch_sub(_credit_inflight.exchange(0));
+        notify_credit();
         set_state(FRONTEND_CONNECT);
     }
     return true;
@@ -40,55 +45,32 @@ bool FrontEnd::connect() {
 
 void FrontEnd::send_msg_nonblock(RpcMessage&& msg, std::shared_ptr<FrontEnd>& this_holder) {
     int sz = _sending_queue_size.fetch_add(1, std::memory_order_acq_rel);
+    if (_metrics) {
+        _metrics->send_queue_depth(sz + 1);
+    }
     if (sz == 0) {
         // 只有一个线程能到这里
         _msg = std::move(msg);
         _more = true;
-        int cnt = 0;
         _it1.reset();
         _it2.reset();
         if (state() & FRONTEND_DISCONNECT) {
-            _ctx->async([this, cnt, this_holder](){
-                keep_writing(cnt);
+            _ctx->async([this, this_holder](){
+                keep_writing(0);
             });
             return;
         }
-        for (;;) {
-            while (_more) {
-                _sending_msg = std::move(_msg);
-                _more = _sending_queue.pop(_msg);
-                ++cnt;
-                _it1.cursor(_sending_msg);
-                _it2.zero_copy_cursor(_sending_msg);
-                if (!_socket->send_msg(_sending_msg, true, _more, _it1, _it2)) {
-                    epipe(cnt);
-                    return;
-                }
-                if (_it1.has_next() || _it2.has_next()) {
-                    // 对于RDMA的情况，一定走不到这里
-                    SCHECK(!_is_use_rdma);
-                    _ctx->async([this, cnt, this_holder](){
-                        keep_writing(cnt);
-                    });
-                    return;
-                }
-            }
-            sz = _sending_queue_size.fetch_sub(cnt, std::memory_order_acq_rel);
-            if (sz == cnt) {
-                return;
-            } else {
-                while (!_sending_queue.pop(_msg));
-                _more = true;
-                cnt = 0;
-            }
-        }
+        continue_writing(0);
     } else {
-        _sending_queue.push(std::move(msg));
+        push_msg(std::move(msg));
     }
 }
 
 void FrontEnd::send_msg(RpcMessage&& msg) {
     int sz = _sending_queue_size.fetch_add(1, std::memory_order_acq_rel);
+    if (_metrics) {
+        _metrics->send_queue_depth(sz + 1);
+    }
     if (sz == 0) {
         // 只有一个线程能到这里
         _msg = std::move(msg);
@@ -97,8 +79,52 @@ void FrontEnd::send_msg(RpcMessage&& msg) {
         _it2.reset();
         keep_writing(0);
     } else {
-        _sending_queue.push(std::move(msg));
+        push_msg(std::move(msg));
+    }
+}
+
+void FrontEnd::push_msg(RpcMessage&& msg) {
+    int lane = std::min<int>(msg.head()->priority, RPC_PRIORITY_NUM - 1);
+    // 带大block的消息不能插在分段之间，和普通优先级的消息一起排队
+    if (lane == RPC_PRIORITY_HIGH && msg.has_zero_copy_block()) {
+        lane = RPC_PRIORITY_NORMAL;
+    }
+    _sending_queues[lane].push(std::move(msg));
+}
+
+/*
+ * 内部函数，外部保证只有一个线程调用
+ */
+bool FrontEnd::pop_msg(RpcMessage& msg) {
+    if (!_weighted) {
+        for (auto& q : _sending_queues) {
+            if (q.pop(msg)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    // 当前队列用完配额或者为空时换下一条，每条队列都试一次
+    for (int i = 0; i <= RPC_PRIORITY_NUM; ++i) {
+        if (_lane_left > 0 && _sending_queues[_lane].pop(msg)) {
+            --_lane_left;
+            return true;
+        }
+        _lane = (_lane + 1) % RPC_PRIORITY_NUM;
+        _lane_left = _queue_config.weights[_lane];
     }
+    return false;
+}
+
+void FrontEnd::set_queue_config(const SendQueueConfig& config) {
+    SCHECK(config.policy == "strict" || config.policy == "weighted")
+          << "unknown send queue policy " << config.policy;
+    SCHECK(config.weights.size() == RPC_PRIORITY_NUM) << config.weights.size();
+    for (int w : config.weights) {
+        SCHECK(w > 0) << w;
+    }
+    _queue_config = config;
+    _weighted = config.policy == "weighted";
 }
 
 /*
@@ -112,66 +138,389 @@ void FrontEnd::epipe(int cnt) {
         return;
     }
     _epipe_time = std::chrono::system_clock::now();
+    // 这一批中已经完整发出的消息不再重发
+    size_t finished = std::min(_it1.finished(), _it2.finished());
     _it1.reset();
     _it2.reset();
 
-    _ctx->send_request(std::move(_sending_msg));
+    // 重发的消息在新的FrontEnd上重新占用credit，不等待，负载也只计在新的FrontEnd上
+    auto resend = [this](RpcMessage&& msg) {
+        if (load_wait_response(msg)) {
+            _load.on_drop(1);
+        }
+        _credit_used.fetch_sub(msg._credit);
+        msg._credit = 0;
+        msg.head()->credit = 0;
+        _ctx->send_request(std::move(msg), false);
+    };
+    for (size_t i = finished; i < _sending_msgs.size(); ++i) {
+        if (load_wait_response(_sending_msgs[i])) {
+            --_batch_requests;
+        }
+        _batch_credit -= _sending_msgs[i]._credit;
+        if (credit_wait_response(_sending_msgs[i])) {
+            _batch_inflight -= _sending_msgs[i]._credit;
+        }
+        resend(std::move(_sending_msgs[i]));
+    }
+    finish_batch_credit();
+    _sending_msgs.clear();
+    size_t urgent_finished = _urgent_it.finished();
+    finish_urgent_credit(urgent_finished);
+    for (size_t i = urgent_finished; i < _urgent_msgs.size(); ++i) {
+        resend(std::move(_urgent_msgs[i]));
+    }
+    _urgent_msgs.clear();
+    _urgent_it.reset();
     if (_more) {
-        _ctx->send_request(std::move(_msg));
+        resend(std::move(_msg));
         ++cnt;
     }
+    RpcMessage msg;
     while (_sending_queue_size.fetch_sub(cnt) != cnt) {
-        while (!_sending_queue.pop(_sending_msg));
-        _ctx->send_request(std::move(_sending_msg));
+        while (!pop_msg(msg));
+        resend(std::move(msg));
         cnt = 1;
     }
     set_state(FRONTEND_DISCONNECT | FRONTEND_EPIPE);
 }
 
+/*
+ * trace的时间和checksum都要在编码head之前写好
+ */
+void FrontEnd::prepare_send(RpcMessage& msg) {
+    if (msg.head()->dest_dealer == -1) {
+        if (rpc_trace_t* trace = msg.trace()) {
+            trace->stamp(RPC_TRACE_SOCKET_SEND);
+        }
+    }
+    if (_checksum) {
+        msg.fill_checksum();
+    }
+    if (_metrics) {
+        _metrics->sent(msg.wire_size());
+    }
+    if (_compact_head) {
+        msg.encode_compact_head();
+    }
+}
+
+/*
+ * 内部函数，外部保证只有一个线程调用
+ */
+void FrontEnd::next_batch(int& cnt) {
+    _sending_msgs.clear();
+    _it1.reset();
+    _it2.reset();
+    size_t max_batch = _socket->max_send_batch();
+    // 紧凑的head在消息对象内，_sending_msgs不能扩容
+    _sending_msgs.reserve(max_batch);
+    while (_more && _sending_msgs.size() < max_batch) {
+        _sending_msgs.push_back(std::move(_msg));
+        _more = pop_msg(_msg);
+        ++cnt;
+        add_batch_credit(_sending_msgs.back());
+        prepare_send(_sending_msgs.back());
+        _it1.append(&_sending_msgs.back(), false);
+        _it2.append(&_sending_msgs.back(), true);
+        if (_it2.has_next()) {
+            break;
+        }
+    }
+    _urgent_left = urgent_quota();
+}
+
+size_t FrontEnd::urgent_quota() {
+    if (_weighted) {
+        return _queue_config.weights[RPC_PRIORITY_HIGH];
+    }
+    return _socket->max_send_batch();
+}
+
 void FrontEnd::keep_writing(int cnt) {
     if (state() & FRONTEND_DISCONNECT) {
         if (!connect()) {
-            _sending_msg = std::move(_msg);
-            _more = _sending_queue.pop(_msg);
+            _it1.reset();
+            _it2.reset();
+            _sending_msgs.clear();
+            _sending_msgs.push_back(std::move(_msg));
+            add_batch_credit(_sending_msgs.back());
+            _more = pop_msg(_msg);
             ++cnt;
             epipe(cnt);
             return;
         }
     }
-    if (_it1.has_next() || _it2.has_next()) {
-        if (!_socket->send_msg(_sending_msg, false, _more, _it1, _it2)) {
-            epipe(cnt);
-            return;
-        }
-    }
+    continue_writing(cnt);
+}
+
+/*
+ * 内部函数，外部保证只有一个线程调用
+ * 发不完时挂起，由io线程在socket可写时继续，发送线程从不阻塞
+ */
+void FrontEnd::continue_writing(int cnt) {
     for (;;) {
-        while (_more) {
-            _sending_msg = std::move(_msg);
-            _more = _sending_queue.pop(_msg);
-            ++cnt;
-            _it1.cursor(_sending_msg);
-            _it2.zero_copy_cursor(_sending_msg);
-            if (!_socket->send_msg(_sending_msg, false, _more, _it1, _it2)) {
+        if (_urgent_it.has_next() || (_it2.has_next() && _queue_config.chunk_bytes > 0
+              && _socket->interleave_blocks())) {
+            bool blocked = false;
+            if (!send_interleaved(cnt, blocked) || blocked) {
+                return;
+            }
+            continue;
+        }
+        if (_it1.has_next() || _it2.has_next()) {
+            if (!_socket->send_msgs(_sending_msgs, true, _more, _it1, _it2)) {
                 epipe(cnt);
                 return;
             }
             if (_it1.has_next() || _it2.has_next()) {
-                SLOG(FATAL) << "FATAL!!!!!";
+                // 对于RDMA的情况，一定走不到这里
+                SCHECK(!_is_use_rdma);
+                park(cnt);
                 return;
             }
+            finish_batch_credit();
+            continue;
+        }
+        if (_more) {
+            next_batch(cnt);
+            continue;
         }
         int sz = _sending_queue_size.fetch_sub(cnt, std::memory_order_acq_rel);
+        if (_metrics) {
+            _metrics->send_queue_depth(sz - cnt);
+        }
         // 此时已有其他线程可能会进来，所以cnt必须是局部变量
         if (sz == cnt) {
             return;
         } else {
-            while (!_sending_queue.pop(_msg));
+            while (!pop_msg(_msg));
             _more = true;
             cnt = 0;
         }
     }
 }
 
+/*
+ * 内部函数，外部保证只有一个线程调用
+ * 插入的消息在主连接上，大block在另一个连接上，两者互不影响；
+ * 只有当前这一批的主连接部分写完后才能插入
+ */
+bool FrontEnd::next_urgent(int& cnt) {
+    auto urgent = [](RpcMessage& msg) {
+        return msg.head()->priority == RPC_PRIORITY_HIGH && !msg.has_zero_copy_block();
+    };
+    _urgent_msgs.clear();
+    _urgent_it.reset();
+    // 这一段的配额用完后等下一段写完
+    size_t max_batch = std::min(_socket->max_send_batch(), _urgent_left);
+    if (max_batch == 0) {
+        return false;
+    }
+    _urgent_msgs.reserve(max_batch);
+    if (_more && urgent(_msg)) {
+        _urgent_msgs.push_back(std::move(_msg));
+        _more = pop_msg(_msg);
+        ++cnt;
+    }
+    RpcMessage msg;
+    while (_urgent_msgs.size() < max_batch && _sending_queues[RPC_PRIORITY_HIGH].pop(msg)) {
+        _urgent_msgs.push_back(std::move(msg));
+        ++cnt;
+    }
+    for (auto& m : _urgent_msgs) {
+        prepare_send(m);
+        _urgent_it.append(&m, false);
+    }
+    _urgent_left -= _urgent_msgs.size();
+    return !_urgent_msgs.empty();
+}
+
+/*
+ * 内部函数，外部保证只有一个线程调用
+ */
+bool FrontEnd::send_interleaved(int& cnt, bool& blocked) {
+    RpcMessage::byte_cursor empty;
+    if (_urgent_it.has_next()) {
+        if (!_socket->send_msgs(_urgent_msgs, true, false, _urgent_it, empty)) {
+            epipe(cnt);
+            return false;
+        }
+        if (_urgent_it.has_next()) {
+            park(cnt);
+            blocked = true;
+            return true;
+        }
+        finish_urgent_credit(_urgent_msgs.size());
+        _urgent_msgs.clear();
+        _urgent_it.reset();
+        return true;
+    }
+    if (!_it1.has_next() && next_urgent(cnt)) {
+        return true;
+    }
+    RpcMessage::byte_cursor chunk;
+    size_t n = _it2.prefix(chunk, _queue_config.chunk_bytes);
+    if (!_socket->send_msgs(_sending_msgs, true, _more, _it1, chunk)) {
+        epipe(cnt);
+        return false;
+    }
+    _it2.consume(n - chunk.bytes());
+    if (_it1.has_next() || chunk.has_next()) {
+        park(cnt);
+        blocked = true;
+        return true;
+    }
+    _urgent_left = urgent_quota();
+    if (!_it2.has_next()) {
+        finish_batch_credit();
+    }
+    return true;
+}
+
+/*
+ * 先注册EPOLLOUT再置_parked，
+ * 之后发送状态归unpark成功的一方所有
+ */
+void FrontEnd::park(int cnt) {
+    _cnt = cnt;
+    if (!_ctx->set_writable_event(this, true)) {
+        // fd已经被移出epoll，连接已断开
+        epipe(cnt);
+        return;
+    }
+    _parked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // io线程可能已经判定连接断开，与abort_writing竞争
+    if ((state() & FRONTEND_EPIPE) && unpark()) {
+        epipe(_cnt);
+    }
+}
+
+std::vector<int> FrontEnd::blocked_fds() {
+    if (_urgent_it.has_next()) {
+        RpcMessage::byte_cursor empty;
+        return _socket->blocked_fds(_urgent_it, empty);
+    }
+    return _socket->blocked_fds(_it1, _it2);
+}
+
+bool FrontEnd::unpark() {
+    if (!_parked.exchange(false)) {
+        return false;
+    }
+    _ctx->set_writable_event(this, false);
+    return true;
+}
+
+void FrontEnd::resume_writing() {
+    // 同一轮epoll_wait中_fd和_fd2可能都报可写，只有一个能拿到发送状态
+    if (unpark()) {
+        continue_writing(_cnt);
+    }
+}
+
+bool FrontEnd::abort_writing() {
+    if (unpark()) {
+        epipe(_cnt);
+        return true;
+    }
+    return false;
+}
+
+bool FrontEnd::acquire_credit(RpcMessage& msg, bool force) {
+    if (_max_credit == 0) {
+        return true;
+    }
+    size_t bytes = std::min<size_t>(msg.wire_size(), UINT32_MAX);
+    size_t used = _credit_used.load(std::memory_order_relaxed);
+    if (!force && used != 0 && used + bytes > _max_credit) {
+        return false;
+    }
+    _credit_used.fetch_add(bytes);
+    msg._credit = bytes;
+    return true;
+}
+
+void FrontEnd::wait_credit(size_t bytes) {
+    std::unique_lock<std::mutex> lk(_credit_mu);
+    _credit_waiters.fetch_add(1);
+    // 超时后由调用者重新选择FrontEnd，也防止漏掉唤醒
+    _credit_cv.wait_for(lk, std::chrono::milliseconds(100), [this, bytes]() {
+        size_t used = used_credit();
+        return used == 0 || used + bytes <= _max_credit || (state() & FRONTEND_EPIPE);
+    });
+    _credit_waiters.fetch_sub(1);
+}
+
+void FrontEnd::release_credit(size_t bytes) {
+    _credit_inflight.fetch_sub(bytes);
+    _credit_used.fetch_sub(bytes);
+    notify_credit();
+}
+
+/*
+ * 内部函数，外部保证只有一个线程调用
+ */
+void FrontEnd::add_batch_credit(RpcMessage& msg) {
+    if (load_wait_response(msg)) {
+        ++_batch_requests;
+    }
+    _batch_credit += msg._credit;
+    if (credit_wait_response(msg)) {
+        _batch_inflight += msg._credit;
+    }
+}
+
+/*
+ * 内部函数，外部保证只有一个线程调用
+ */
+void FrontEnd::finish_batch_credit() {
+    _load.on_sent(_batch_requests);
+    _batch_requests = 0;
+    if (_batch_credit == 0) {
+        return;
+    }
+    // 先转入inflight再归还，_credit_used不会短暂偏小
+    _credit_inflight.fetch_add(_batch_inflight);
+    _credit_used.fetch_sub(_batch_credit - _batch_inflight);
+    _batch_credit = 0;
+    _batch_inflight = 0;
+    notify_credit();
+}
+
+/*
+ * 内部函数，外部保证只有一个线程调用
+ */
+void FrontEnd::finish_urgent_credit(size_t n) {
+    size_t credit = 0;
+    size_t inflight = 0;
+    int requests = 0;
+    for (size_t i = 0; i < n; ++i) {
+        credit += _urgent_msgs[i]._credit;
+        if (credit_wait_response(_urgent_msgs[i])) {
+            inflight += _urgent_msgs[i]._credit;
+        }
+        if (load_wait_response(_urgent_msgs[i])) {
+            ++requests;
+        }
+    }
+    _load.on_sent(requests);
+    if (credit == 0) {
+        return;
+    }
+    _credit_inflight.fetch_add(inflight);
+    _credit_used.fetch_sub(credit - inflight);
+    notify_credit();
+}
+
+void FrontEnd::notify_credit() {
+    if (_credit_waiters.load() > 0) {
+        std::lock_guard<std::mutex> lk(_credit_mu);
+        _credit_cv.notify_all();
+    }
+}
+
 
 } // namespace core
 } // namespace pico
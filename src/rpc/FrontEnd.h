@@ -1,9 +1,13 @@
 #ifndef PARADIGM4_PICO_FRONTEND_H
 #define PARADIGM4_PICO_FRONTEND_H
 
+#include <condition_variable>
 #include <mutex>
 #include <memory>
 #include <atomic>
+#include <string>
+#include <vector>
+#include "LoadBalancer.h"
 #include "Master.h"
 #include "MpscQueue.h"
 
@@ -13,6 +17,55 @@ namespace core {
 
 
 class RpcContext;
+class RpcPeerMetrics;
+
+/*
+ * 每个连接上的credit，单位字节
+ * 消息进入发送队列时占用，写入socket后归还；
+ * 需要response的request写入后继续占用，对端在response中带回后才归还，
+ * 所以对端处理慢时发送方也会停下来，双方为这个连接缓存的数据都有上限
+ * 对端不处理的request(没有service/server，过期，dealer已经terminate)回复错误码带回credit；
+ * handler必须回复每个有src_dealer的request，否则它的credit直到连接重建才归还
+ */
+struct FlowControlConfig {
+    FlowControlConfig() = default;
+
+    template<typename T>
+    FlowControlConfig(const T& o) {
+        PICO_CONFIG_COPY_FIELD(o, max_credit_bytes);
+        PICO_CONFIG_COPY_FIELD(o, block);
+    }
+
+    // 0表示不限制；超过上限的单个消息在连接空闲时仍然可以发送
+    size_t max_credit_bytes = 0;
+    // credit不足时request阻塞等待，false时立即返回EOVERLOAD；response总是等待
+    bool block = true;
+};
+
+/*
+ * 每个连接的发送队列按RpcPriority分成几条
+ * strict总是先发优先级高的消息，weighted按weights轮流取，低优先级不会饿死
+ * 大block走单独的tcp连接时按chunk_bytes分段写入，段之间可以插入
+ * 不带大block的RPC_PRIORITY_HIGH消息，控制消息不必等大消息发完；
+ * 两段之间最多插入一批(strict)或者weights[RPC_PRIORITY_HIGH]个(weighted)，大消息也不会饿死
+ */
+struct SendQueueConfig {
+    SendQueueConfig() = default;
+
+    template<typename T>
+    SendQueueConfig(const T& o) {
+        PICO_CONFIG_COPY_FIELD(o, policy);
+        PICO_CONFIG_COPY_FIELD(o, weights);
+        PICO_CONFIG_COPY_FIELD(o, chunk_bytes);
+    }
+
+    // strict, weighted
+    std::string policy = "strict";
+    // weighted时每一轮各优先级最多连续取的消息数，下标是RpcPriority
+    std::vector<int> weights = {8, 4, 1};
+    // 0表示不分段
+    size_t chunk_bytes = 1 << 20;
+};
 
 constexpr int FRONTEND_DISCONNECT = 1;
 constexpr int FRONTEND_CONNECT = 2;
@@ -42,14 +95,38 @@ public:
     /*
      * 多线程会调用，确保只有一个线程
      * keep_writing 其他线程直接退出
+     * 未连接时先connect，之后与continue_writing相同
      */
     void keep_writing(int cnt);
 
+    void continue_writing(int cnt);
+
+    // io线程在EPOLLOUT时调用，继续发送挂起的消息
+    void resume_writing();
+
+    // 连接已断开，挂起的消息交给epipe重发，返回是否有挂起的消息
+    bool abort_writing();
+
     // thread safe, may call ctx->send_msg when flush pending
     void send_msg(RpcMessage&& msg);
 
     void epipe(int cnt);
 
+    /*
+     * 从_msg开始取出一批消息拼到_it1/_it2上，一次send_msgs发出
+     * 带zero copy block的消息结束这一批，保证单连接时block紧跟在所属消息之后
+     */
+    void next_batch(int& cnt);
+
+    // 发送阻塞时挂起，注册EPOLLOUT
+    void park(int cnt);
+
+    // 挂起时需要等待可写的fd
+    std::vector<int> blocked_fds();
+
+    // 取回挂起的发送状态，取消EPOLLOUT
+    bool unpark();
+
     bool available() const {
         if (state() & FRONTEND_EPIPE) {
             if (state() & FRONTEND_DISCONNECT) {
@@ -64,6 +141,11 @@ public:
         }
     }
 
+    // 作为client时发往该server的request的负载统计
+    LoadStat& load() {
+        return _load;
+    }
+
     bool& is_client_socket() {
         return _is_client_socket;
     }
@@ -72,6 +154,22 @@ public:
         return _socket->handle_event(fd, func);
     }
 
+    /*
+     * 为msg占用credit，不足时返回false；force时总是成功
+     * 多个线程同时检查时可能略微超过上限
+     */
+    bool acquire_credit(RpcMessage& msg, bool force);
+
+    // 不持有RpcContext读锁时调用，等待credit可能足够或者超时
+    void wait_credit(size_t bytes);
+
+    // 收到带credit的response时调用
+    void release_credit(size_t bytes);
+
+    size_t used_credit() const {
+        return _credit_used.load(std::memory_order_relaxed);
+    }
+
 private:
     std::mutex _mu; // for connect
     std::unique_ptr<RpcSocket> _socket;
@@ -80,21 +178,89 @@ private:
     bool _is_use_rdma;
     int _epfd = -1;
     RpcContext* _ctx;
+    // Metrics没有启用时为nullptr，见RpcMetrics
+    RpcPeerMetrics* _metrics = nullptr;
     std::chrono::time_point<std::chrono::system_clock> _epipe_time;
 
     char __pad__1[64];
     std::atomic<int> _state = {FRONTEND_DISCONNECT};
     char __pad__2[64];
+    LoadStat _load;
+    char __pad__4[64];
 
 // 发送线程的状态
+    // 挂起时已经从队列取出的消息个数
     int _cnt = 0;
+    std::atomic<bool> _parked = {false};
+    // 挂起时注册了EPOLLOUT的fd
+    std::vector<int> _writable_fds;
     bool _more = false;
-    RpcMessage _sending_msg, _msg;
+    RpcMessage _msg;
+    pico::core::vector<RpcMessage> _sending_msgs;
     RpcMessage::byte_cursor _it1, _it2;
 
     char __pad__3[64];
     std::atomic<int> _sending_queue_size;
-    MpscQueue<RpcMessage> _sending_queue;
+    MpscQueue<RpcMessage> _sending_queues[RPC_PRIORITY_NUM];
+
+    void push_msg(RpcMessage&& msg);
+
+    // 按SendQueueConfig选一条队列取出一个消息，只有发送线程调用
+    bool pop_msg(RpcMessage& msg);
+
+    // 当前这一批只剩大block时，取出可以插在分段之间的消息，返回是否取到
+    bool next_urgent(int& cnt);
+
+    // 加入发送批次之前调用：request的trace记录SOCKET_SEND，计算checksum，统计发出的字节，编码紧凑的head
+    void prepare_send(RpcMessage& msg);
+
+    // 发送分段的大block或者插入的消息，返回false时已经epipe，blocked表示已经挂起
+    bool send_interleaved(int& cnt, bool& blocked);
+
+    void set_queue_config(const SendQueueConfig& config);
+
+    SendQueueConfig _queue_config;
+    bool _weighted = false;
+    // 用紧凑的head发送，见RpcConfig
+    bool _compact_head = false;
+    // 发送前计算消息的CRC32C，见RpcConfig
+    bool _checksum = false;
+    // weighted时正在取的队列和剩余个数
+    int _lane = 0;
+    int _lane_left = 0;
+    // 插在大block分段之间的消息
+    pico::core::vector<RpcMessage> _urgent_msgs;
+    RpcMessage::byte_cursor _urgent_it;
+    // 下一段写完之前还可以插入的消息数
+    size_t _urgent_left = 0;
+
+    // 每写完一段重新给插入的配额
+    size_t urgent_quota();
+
+    void add_batch_credit(RpcMessage& msg);
+
+    // 这一批写完后，归还credit或者转为等待response
+    void finish_batch_credit();
+
+    // 插入的消息写完后，归还credit或者转为等待response
+    void finish_urgent_credit(size_t n);
+
+    void notify_credit();
+
+    char __pad__5[64];
+    size_t _max_credit = 0;
+    // 包括_credit_inflight
+    std::atomic<size_t> _credit_used = {0};
+    // 已经发出，等待response带回的部分，重连时清零
+    std::atomic<size_t> _credit_inflight = {0};
+    std::atomic<int> _credit_waiters = {0};
+    // 发送线程的状态，当前这一批占用的credit，其中需要等待response的部分
+    size_t _batch_credit = 0;
+    size_t _batch_inflight = 0;
+    // 当前这一批中计入_load的request数，写完后转为等待response
+    int _batch_requests = 0;
+    std::mutex _credit_mu;
+    std::condition_variable _credit_cv;
 };
 
 } // namespace core
@@ -0,0 +1,296 @@
+#ifdef USE_IO_URING
+#include "IoUringSocket.h"
+#include <limits.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+IoUringConfig IoUringSocket::_io_uring_config;
+
+// user_data，用来区分cqe属于哪个请求
+static constexpr uint64_t IO_URING_RECV = 0;
+static constexpr uint64_t IO_URING_SEND_FD = 1;
+static constexpr uint64_t IO_URING_SEND_FD2 = 2;
+
+IoUringSocket::IoUringSocket() : TcpSocket() {
+    // 握手完成前fds()就可能被调用
+    _recv_ring.ring_fd = -1;
+}
+
+IoUringSocket::IoUringSocket(int fd) : TcpSocket(fd) {
+    _recv_ring.ring_fd = -1;
+}
+
+IoUringSocket::~IoUringSocket() {
+    if (_recv_armed) {
+        // recv还挂在_buffer上，必须等它结束才能释放_buffer
+        ::shutdown(_fd, SHUT_RDWR);
+        io_uring_cqe* cqe;
+        if (io_uring_wait_cqe(&_recv_ring, &cqe) == 0) {
+            io_uring_cqe_seen(&_recv_ring, cqe);
+        }
+    }
+    if (_rings_initialized) {
+        io_uring_queue_exit(&_send_ring);
+        io_uring_queue_exit(&_recv_ring);
+    }
+}
+
+bool IoUringSocket::connect(const std::string& endpoint,
+      const std::string& info,
+      int64_t magic) {
+    if (!TcpSocket::connect(endpoint, info, magic)) {
+        return false;
+    }
+    init_rings();
+    reserve_recv_buffer();
+    arm_recv(_buffer.cursor, _buffer.avaliable_size());
+    return submit_recv();
+}
+
+bool IoUringSocket::accept(std::string& info) {
+    if (!TcpSocket::accept(info)) {
+        return false;
+    }
+    init_rings();
+    reserve_recv_buffer();
+    arm_recv(_buffer.cursor, _buffer.avaliable_size());
+    return submit_recv();
+}
+
+void IoUringSocket::init_rings() {
+    SCHECK(!_rings_initialized);
+    // sendmsg在ring上完成，不走MSG_ZEROCOPY
+    _zero_copy = false;
+    unsigned depth = _io_uring_config.queue_depth;
+    int ret = io_uring_queue_init(depth, &_send_ring, 0);
+    SCHECK(ret == 0) << "io_uring_queue_init failed: " << strerror(-ret);
+    ret = io_uring_queue_init(depth, &_recv_ring, 0);
+    SCHECK(ret == 0) << "io_uring_queue_init failed: " << strerror(-ret);
+    _rings_initialized = true;
+
+    // 单连接时index 1也指向_fd，发送时不会用到
+    int files[2] = {_fd, _single_connection ? _fd : _fd2};
+    ret = io_uring_register_files(&_send_ring, files, 2);
+    SCHECK(ret == 0) << "io_uring_register_files failed: " << strerror(-ret);
+    ret = io_uring_register_files(&_recv_ring, files, 1);
+    SCHECK(ret == 0) << "io_uring_register_files failed: " << strerror(-ret);
+}
+
+/*
+ * 只有io线程调用
+ * 完成前ptr所在的_buffer或pending block不能被替换
+ */
+void IoUringSocket::arm_recv(char* ptr, size_t size) {
+    io_uring_sqe* sqe = io_uring_get_sqe(&_recv_ring);
+    SCHECK(sqe) << "recv ring full";
+    // registered file index 0 is _fd
+    io_uring_prep_recv(sqe, 0, ptr, size, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    io_uring_sqe_set_data64(sqe, IO_URING_RECV);
+    _recv_ptr = ptr;
+    _recv_armed = true;
+}
+
+bool IoUringSocket::submit_recv() {
+    int ret = io_uring_submit(&_recv_ring);
+    if (ret < 0) {
+        errno = -ret;
+        PSLOG(WARNING) << "io_uring submit recv failed, fd is " << _fd;
+        return false;
+    }
+    return true;
+}
+
+std::pair<char*, size_t> IoUringSocket::recv_progress(
+      std::function<void(RpcMessage&&)>& func,
+      std::function<void(RpcMessage&&)>& tcp_func) {
+    if (_single_connection) {
+        return single_recv_progress(func, tcp_func);
+    }
+    dispatch_recv_buffer(tcp_func);
+    reserve_recv_buffer();
+    return {_buffer.cursor, _buffer.avaliable_size()};
+}
+
+/*
+ * 收割所有已完成的recv，处理后重新挂上并提交；socket中还有数据时新的recv在提交时
+ * 就地完成，继续在这一轮收割，直到没有新的完成
+ */
+bool IoUringSocket::reap_recv(std::function<void(RpcMessage&&)>& func) {
+    auto tcp_func = stash_pending(func);
+    io_uring_cqe* cqe;
+    while (io_uring_peek_cqe(&_recv_ring, &cqe) == 0) {
+        int res = cqe->res;
+        io_uring_cqe_seen(&_recv_ring, cqe);
+        _recv_armed = false;
+        if (res == -EINTR || res == -EAGAIN) {
+            arm_recv(_recv_ptr, _recv_ptr == _buffer.cursor
+                  ? _buffer.avaliable_size()
+                  : next_pending_block(func).second);
+            if (!submit_recv()) {
+                return false;
+            }
+            continue;
+        }
+        if (res <= 0) {
+            if (res == 0) {
+                SLOG(INFO) << "peer close.";
+            } else {
+                errno = -res;
+                PSLOG(ERROR) << "recv error." << _fd;
+            }
+            return false;
+        }
+        if (_recv_ptr == _buffer.cursor) {
+            _buffer.cursor += res;
+        } else {
+            pending_received(res);
+        }
+        char* ptr;
+        size_t size;
+        std::tie(ptr, size) = recv_progress(func, tcp_func);
+        if (_recv_corrupted) {
+            return false;
+        }
+        arm_recv(ptr, size);
+        if (!submit_recv()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IoUringSocket::handle_event(int fd, std::function<void(RpcMessage&&)> func) {
+    if (fd == _fd2) {
+        return try_recv_pending(func);
+    }
+    if (fd == _fd) {
+        // _fd只在发送阻塞时注册EPOLLOUT，这里是EPOLLERR/EPOLLHUP
+        return false;
+    }
+    SCHECK(fd == _recv_ring.ring_fd) << fd << " " << _recv_ring.ring_fd << " " << _fd2;
+    // cq中有完成时ring fd可读，收割完就不再可读
+    if (!reap_recv(func)) {
+        return false;
+    }
+    if (_single_connection) {
+        return true;
+    }
+    return try_recv_pending(func);
+}
+
+/*
+ * 与TcpSocket相同，nonblock时发不完的部分留在it1/it2中，由调用者继续
+ * 每一轮最多两个sendmsg，一次io_uring_enter提交，不等待；
+ * 带MSG_DONTWAIT的sendmsg在提交时就地完成或者返回EAGAIN，cqe直接收割，
+ * 只有阻塞发送才会等待完成
+ */
+bool IoUringSocket::send_cursors(bool nonblock,
+      bool more,
+      RpcMessage::byte_cursor& it1,
+      RpcMessage::byte_cursor& it2) {
+    int flag = MSG_NOSIGNAL;
+    if (nonblock) {
+        flag |= MSG_DONTWAIT;
+    }
+    _iov1.resize(IOV_MAX);
+    _iov2.resize(IOV_MAX);
+    while (it1.has_next() || it2.has_next()) {
+        msghdr hdr1 = {}, hdr2 = {};
+        unsigned n = 0;
+        size_t it1_bytes = 0;
+        if (_single_connection) {
+            // 大block紧跟在消息之后，拼进同一个sendmsg
+            size_t n1 = it1.fill_iovec(_iov1.data(), _iov1.size());
+            size_t n2 = it2.fill_iovec(_iov1.data() + n1, _iov1.size() - n1);
+            for (size_t k = 0; k < n1; ++k) {
+                it1_bytes += _iov1[k].iov_len;
+            }
+            hdr1.msg_iov = _iov1.data();
+            hdr1.msg_iovlen = n1 + n2;
+            int f = more || it1.size() + it2.size() > n1 + n2 ? flag | MSG_MORE : flag;
+            io_uring_sqe* sqe = io_uring_get_sqe(&_send_ring);
+            io_uring_prep_sendmsg(sqe, 0, &hdr1, f);
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+            io_uring_sqe_set_data64(sqe, IO_URING_SEND_FD);
+            ++n;
+        } else {
+            if (it1.has_next()) {
+                hdr1.msg_iov = _iov1.data();
+                hdr1.msg_iovlen = it1.fill_iovec(_iov1.data(), _iov1.size());
+                // Should NOT use MSG_MORE for both _fd and _fd2
+                int f = (more && !it2.has_next()) || it1.size() > hdr1.msg_iovlen
+                      ? flag | MSG_MORE : flag;
+                io_uring_sqe* sqe = io_uring_get_sqe(&_send_ring);
+                io_uring_prep_sendmsg(sqe, 0, &hdr1, f);
+                io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+                io_uring_sqe_set_data64(sqe, IO_URING_SEND_FD);
+                ++n;
+            }
+            if (it2.has_next()) {
+                hdr2.msg_iov = _iov2.data();
+                hdr2.msg_iovlen = it2.fill_iovec(_iov2.data(), _iov2.size());
+                io_uring_sqe* sqe = io_uring_get_sqe(&_send_ring);
+                io_uring_prep_sendmsg(sqe, 1, &hdr2, flag);
+                io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+                io_uring_sqe_set_data64(sqe, IO_URING_SEND_FD2);
+                ++n;
+            }
+        }
+        int ret = io_uring_submit(&_send_ring);
+        if (ret < 0) {
+            errno = -ret;
+            PSLOG(WARNING) << "io_uring submit send failed, fd is " << _fd;
+            return false;
+        }
+        bool blocked = false;
+        bool failed = false;
+        for (unsigned i = 0; i < n; ++i) {
+            io_uring_cqe* cqe;
+            ret = io_uring_peek_cqe(&_send_ring, &cqe);
+            if (ret == -EAGAIN) {
+                // 阻塞发送还没有完成
+                ret = io_uring_wait_cqe(&_send_ring, &cqe);
+            }
+            if (ret == -EINTR) {
+                --i;
+                continue;
+            }
+            SCHECK(ret == 0) << "io_uring_wait_cqe failed: " << strerror(-ret);
+            int res = cqe->res;
+            auto& it = io_uring_cqe_get_data64(cqe) == IO_URING_SEND_FD ? it1 : it2;
+            io_uring_cqe_seen(&_send_ring, cqe);
+            if (res > 0 && _single_connection) {
+                size_t n1 = std::min<size_t>(res, it1_bytes);
+                it1.consume(n1);
+                it2.consume(res - n1);
+            } else if (res > 0) {
+                it.consume(res);
+            } else if (res == -EAGAIN || res == -EWOULDBLOCK) {
+                blocked = true;
+            } else if (res != -EINTR) {
+                // 先把这一轮的cqe都收掉再返回
+                errno = -res;
+                failed = true;
+            }
+        }
+        if (failed) {
+            PSLOG(WARNING) << "tcp send error fd is " << _fd;
+            return false;
+        }
+        if (blocked) {
+            return true;
+        }
+    }
+    return true;
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef PARADIGM4_PICO_CORE_IO_URING_SOCKET_H
+#define PARADIGM4_PICO_CORE_IO_URING_SOCKET_H
+#ifdef USE_IO_URING
+
+#include <liburing.h>
+
+#include "RpcSocket.h"
+#include "TcpSocket.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+struct IoUringConfig {
+    IoUringConfig() = default;
+
+    template<typename T>
+    IoUringConfig(const T& o) {
+        PICO_CONFIG_COPY_FIELD(o, queue_depth);
+    }
+
+    unsigned queue_depth = 64;
+};
+
+/*
+ * 握手以及_fd2上的zero copy block沿用TcpSocket，_fd的收发走io_uring
+ * send: 一个消息在_fd和_fd2上的所有段各拼成一个sendmsg，单连接时拼成一个，
+ *       一次io_uring_enter提交，不等待；非阻塞发送带MSG_DONTWAIT，在提交时就地完成
+ * recv: 常驻一个recv请求，直接写进_buffer，单连接时也可能直接写进pending block，
+ *       recv ring的fd直接注册在io线程的epoll中，有cqe时可读，
+ *       一次唤醒收割所有完成，重新挂上的recv在有数据时就地完成，同一轮继续收割
+ * 发送线程和io线程各用一个ring，互不加锁
+ */
+class IoUringSocket : public TcpSocket {
+public:
+    IoUringSocket();
+
+    IoUringSocket(int fd);
+
+    ~IoUringSocket();
+
+    static void set_io_uring_config(const IoUringConfig& config) {
+        _io_uring_config = config;
+    }
+
+    bool connect(const std::string& endpoint, const std::string& info, int64_t magic) override;
+
+    bool accept(std::string& info) override;
+
+    std::vector<int> fds() override {
+        if (_single_connection) {
+            return {_recv_ring.ring_fd};
+        }
+        return {_recv_ring.ring_fd, _fd2};
+    }
+
+    bool handle_event(int fd, std::function<void(RpcMessage&&)> func) override;
+
+protected:
+    bool send_cursors(bool nonblock,
+          bool more,
+          RpcMessage::byte_cursor& it1,
+          RpcMessage::byte_cursor& it2) override;
+
+private:
+    // 握手完成后调用，注册fd并挂上第一个recv
+    void init_rings();
+
+    // 只准备sqe，由调用者提交
+    void arm_recv(char* ptr, size_t size);
+
+    bool submit_recv();
+
+    // 处理已收到的字节，返回下一次recv的位置
+    std::pair<char*, size_t> recv_progress(std::function<void(RpcMessage&&)>& func,
+          std::function<void(RpcMessage&&)>& tcp_func);
+
+    bool reap_recv(std::function<void(RpcMessage&&)>& func);
+
+    struct io_uring _send_ring;
+    struct io_uring _recv_ring;
+    bool _rings_initialized = false;
+    bool _recv_armed = false;
+    char* _recv_ptr = nullptr;
+
+    pico::core::vector<iovec> _iov1, _iov2;
+
+    static IoUringConfig _io_uring_config;
+};
+
+class IoUringAcceptor : public TcpAcceptor {
+public:
+    std::unique_ptr<RpcSocket> accept() override {
+        return std::make_unique<IoUringSocket>(accept_fd());
+    }
+};
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // USE_IO_URING
+#endif // PARADIGM4_PICO_CORE_IO_URING_SOCKET_H
@@ -12,20 +12,30 @@ namespace paradigm4 {
 namespace pico {
 namespace core {
 
+// 释放ShmSocket收到的共享内存block，见ShmSocket.cpp
+void shm_block_unmap(char* data);
+
 struct data_block_t {
     typedef RpcAllocator<char> allocator_type;
     struct delete_t {
-        int owner = 0;
+        // 0: 没有所有权 1: allocator_type分配 2: 映射的共享内存 3: pico_malloc分配
+        uint16_t owner = 0;
         void operator()(void* p)const {
-            SCHECK(owner <= 1);
+            SCHECK(owner <= 3);
             if (owner == 1) {
                 allocator_type().deallocate((char*)p, 1);
+            } else if (owner == 2) {
+                shm_block_unmap((char*)p);
+            } else if (owner == 3) {
+                pico_free(p);
             }
         }
     };
     char* data;
     uint32_t length;
     delete_t deleter;
+    // 线上的压缩方式，见RpcCompress.h，与deleter一起占用原来int owner的位置
+    uint16_t codec = 0;
 #ifdef USE_RDMA
     uint32_t lkey = 0;
 #endif
@@ -40,6 +50,7 @@ struct data_block_t {
     data_block_t& operator=(data_block_t&& o) {
         length = o.length;
         deleter.owner = o.deleter.owner;
+        codec = o.codec;
 #ifdef USE_RDMA
         lkey = o.lkey;
         o.lkey = 0;
@@ -48,6 +59,7 @@ struct data_block_t {
         o.data = nullptr;
         o.length = 0;
         o.deleter.owner = 0;
+        o.codec = 0;
         return *this;
     }
 
@@ -0,0 +1,190 @@
+#include "LoadBalancer.h"
+
+#include <random>
+
+#include "pico_log.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+constexpr double LoadStat::EWMA_ALPHA;
+
+// 只有所属frontend的io线程更新
+void LoadStat::on_response(double latency_us) {
+    _inflight.fetch_sub(1, std::memory_order_relaxed);
+    on_drop(1);
+    if (latency_us < 0) {
+        return;
+    }
+    double old = _latency_us.load(std::memory_order_relaxed);
+    double val = old == 0 ? latency_us : old + EWMA_ALPHA * (latency_us - old);
+    _latency_us.store(val, std::memory_order_relaxed);
+}
+
+// 不减到0以下，on_disconnect按_inflight扣除时可能与on_response重复
+void LoadStat::on_drop(int n) {
+    if (n <= 0) {
+        return;
+    }
+    int cur = _outstanding.load(std::memory_order_relaxed);
+    while (cur > 0 && !_outstanding.compare_exchange_weak(cur, std::max(cur - n, 0),
+                std::memory_order_relaxed)) {
+    }
+}
+
+static size_t lb_rand() {
+    static thread_local std::minstd_rand gen(std::random_device{}());
+    return gen();
+}
+
+// 从随机位置开始找第一个available的候选
+static int first_available(const std::vector<LoadInfo>& c) {
+    size_t n = c.size();
+    size_t start = n ? lb_rand() % n : 0;
+    for (size_t k = 0; k < n; ++k) {
+        size_t i = (start + k) % n;
+        if (c[i].available) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+class RandomBalancer : public LoadBalancer {
+public:
+    int select(const std::vector<LoadInfo>& c) override {
+        if (c.empty()) {
+            return -1;
+        }
+        size_t i = lb_rand() % c.size();
+        return c[i].available ? i : first_available(c);
+    }
+};
+
+class RoundRobinBalancer : public LoadBalancer {
+public:
+    int select(const std::vector<LoadInfo>& c) override {
+        size_t n = c.size();
+        size_t start = _index.fetch_add(1, std::memory_order_relaxed);
+        for (size_t k = 0; k < n; ++k) {
+            size_t i = (start + k) % n;
+            if (c[i].available) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+private:
+    std::atomic<size_t> _index = {0};
+};
+
+/*
+ * power of two choices
+ * 随机选两个，取outstanding较小的，相同时取延迟较小的
+ */
+class P2cBalancer : public LoadBalancer {
+public:
+    int select(const std::vector<LoadInfo>& c) override {
+        size_t n = c.size();
+        if (n < 2) {
+            return first_available(c);
+        }
+        size_t i = lb_rand() % n;
+        size_t j = lb_rand() % (n - 1);
+        if (j >= i) {
+            ++j;
+        }
+        if (!c[i].available || !c[j].available) {
+            if (c[i].available) {
+                return i;
+            }
+            return c[j].available ? j : first_available(c);
+        }
+        if (c[i].outstanding != c[j].outstanding) {
+            return c[i].outstanding < c[j].outstanding ? i : j;
+        }
+        return c[i].latency_us <= c[j].latency_us ? i : j;
+    }
+};
+
+class LeastOutstandingBalancer : public LoadBalancer {
+public:
+    int select(const std::vector<LoadInfo>& c) override {
+        size_t n = c.size();
+        size_t start = n ? lb_rand() % n : 0;
+        int ret = -1;
+        for (size_t k = 0; k < n; ++k) {
+            size_t i = (start + k) % n;
+            if (c[i].available && (ret == -1 || c[i].outstanding < c[ret].outstanding)) {
+                ret = i;
+            }
+        }
+        return ret;
+    }
+};
+
+/*
+ * 按 1 / (latency * (outstanding + 1)) 加权随机
+ * 还没有延迟样本的候选用已知延迟的平均值，避免新server饿死或被打爆
+ */
+class LatencyWeightedBalancer : public LoadBalancer {
+public:
+    int select(const std::vector<LoadInfo>& c) override {
+        double sum = 0;
+        int known = 0;
+        for (auto& info : c) {
+            if (info.available && info.latency_us > 0) {
+                sum += info.latency_us;
+                ++known;
+            }
+        }
+        double mean = known ? sum / known : 1.0;
+        static thread_local std::vector<double> weights;
+        weights.resize(c.size());
+        double total = 0;
+        for (size_t i = 0; i < c.size(); ++i) {
+            if (!c[i].available) {
+                weights[i] = 0;
+                continue;
+            }
+            double latency = c[i].latency_us > 0 ? c[i].latency_us : mean;
+            weights[i] = 1.0 / (latency * (c[i].outstanding + 1));
+            total += weights[i];
+        }
+        if (total <= 0) {
+            return -1;
+        }
+        double r = std::uniform_real_distribution<double>(0, total)(_gen());
+        for (size_t i = 0; i < c.size(); ++i) {
+            r -= weights[i];
+            if (weights[i] > 0 && r <= 0) {
+                return i;
+            }
+        }
+        return first_available(c);
+    }
+
+private:
+    static std::minstd_rand& _gen() {
+        static thread_local std::minstd_rand gen(std::random_device{}());
+        return gen;
+    }
+};
+
+PICO_FACTORY_REGISTER(load_balancer, RandomBalancer, random);
+PICO_FACTORY_REGISTER(load_balancer, RoundRobinBalancer, round_robin);
+PICO_FACTORY_REGISTER(load_balancer, P2cBalancer, p2c);
+PICO_FACTORY_REGISTER(load_balancer, LeastOutstandingBalancer, least_outstanding);
+PICO_FACTORY_REGISTER(load_balancer, LatencyWeightedBalancer, latency_weighted);
+
+std::shared_ptr<LoadBalancer> LoadBalancer::create(const std::string& policy) {
+    auto ret = pico_load_balancer_make_shared<LoadBalancer>(policy);
+    SCHECK(ret) << "unknown load balance policy: " << policy;
+    return ret;
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
@@ -0,0 +1,92 @@
+#ifndef PARADIGM4_PICO_CORE_LOAD_BALANCER_H
+#define PARADIGM4_PICO_CORE_LOAD_BALANCER_H
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Factory.h"
+#include "VirtualObject.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+/*
+ * 一个frontend的负载统计
+ * request进入发送队列时+1；收到response、没有发出就转到别处重发、
+ * 或者发出后连接断开时-1，每个request只计一次；收到response时更新延迟的EWMA
+ */
+class LoadStat {
+public:
+    void on_send() {
+        _outstanding.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // n个request已经完整写进socket，等待response
+    void on_sent(int n) {
+        if (n != 0) {
+            _inflight.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    // request没有带时间戳时latency_us为负，只更新计数
+    void on_response(double latency_us);
+
+    // n个request没有发出就离开了这个frontend
+    void on_drop(int n);
+
+    // 连接断开，已经发出的request收不到response了
+    void on_disconnect() {
+        on_drop(_inflight.exchange(0, std::memory_order_relaxed));
+        _latency_us.store(0, std::memory_order_relaxed);
+    }
+
+    int outstanding() const {
+        return std::max(_outstanding.load(std::memory_order_relaxed), 0);
+    }
+
+    // 没有样本时为0
+    double latency_us() const {
+        return _latency_us.load(std::memory_order_relaxed);
+    }
+
+    static constexpr double EWMA_ALPHA = 0.2;
+
+private:
+    std::atomic<int> _outstanding = {0};
+    // 已经发出还没有response的request数，response可能先于on_sent到达，短暂为负
+    std::atomic<int> _inflight = {0};
+    std::atomic<double> _latency_us = {0};
+};
+
+// 选择时的负载快照
+struct LoadInfo {
+    bool available = false;
+    int outstanding = 0;
+    double latency_us = 0;
+};
+
+/*
+ * 在一组候选中选择一个，按rpc name配置，多线程同时调用
+ * 内置random, round_robin, p2c, least_outstanding, latency_weighted，
+ * 也可以用PICO_FACTORY_REGISTER(load_balancer, ...)注册新的策略
+ */
+class LoadBalancer : public VirtualObject {
+public:
+    // 返回选中的下标，没有available的候选时返回-1
+    virtual int select(const std::vector<LoadInfo>& candidates) = 0;
+
+    static std::shared_ptr<LoadBalancer> create(const std::string& policy);
+};
+
+PICO_DEFINE_FACTORY(load_balancer);
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_LOAD_BALANCER_H
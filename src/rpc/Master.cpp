@@ -130,7 +130,7 @@ void Master::finalize() {
 
 void Master::exit() {
     TcpSocket temp_tcp_socket;
-    temp_tcp_socket.connect(_ep, _ep, 0);
+    temp_tcp_socket.connect(_ep, _ep, RPC_WIRE_VERSION);
     RpcRequest req(-1);
     req << PicoMasterReqType::MASTER_EXIT;
     temp_tcp_socket.send_rpc_message(std::move(req), false);
@@ -146,7 +146,10 @@ void Master::serving() {
                 std::unique_ptr<TcpSocket> tcp_socket = static_unique_pointer_cast<TcpSocket>(
                         std::move(rpc_socket));
                 std::string info;
-                tcp_socket->accept(info);
+                // 版本不同或者握手失败的连接直接关闭
+                if (!tcp_socket->accept(info)) {
+                    continue;
+                }
                 int socket_fd = tcp_socket->in_fd();
                 RpcRequest fake(-1);
                 fake.head().rpc_id = WATCHER_NOTIFY_RPC_ID;
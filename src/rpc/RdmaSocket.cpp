@@ -24,8 +24,9 @@ bool RdmaSocket::accept(std::string& info) {
     }
     int64_t magic = meta[0];
     int64_t len = meta[1];
-    if (magic != 0) {
-        SLOG(INFO) << "magic not correct. " << magic;
+    if (magic != RPC_WIRE_VERSION) {
+        SLOG(WARNING) << "rpc wire version mismatch, peer:" << magic
+                      << " local:" << RPC_WIRE_VERSION;
         PSCHECK(::close(_fd) == 0);
         return false;
     }
@@ -187,6 +188,9 @@ bool RdmaSocket::handle_in_event(std::function<void(RpcMessage&&)> pass) {
         }
     }
     ibv_ack_cq_events(_recv_cq, 1);
+    if (_recv_corrupted) {
+        return false;
+    }
     post_read();
     send_ack();
     return true;
@@ -27,6 +27,13 @@ bool RpcClient::get_available_servers(std::vector<int>& servers) {
     return _service->ctx()->get_avaliable_servers(_info.rpc_service_name, servers);
 }
 
+void RpcClient::set_load_balance(const std::string& policy) {
+    _service->ctx()->set_load_balance(_info.rpc_id, policy);
+}
+
+void RpcClient::set_compress(const RpcCompressOption& opt) {
+    _service->ctx()->set_compress(_info.rpc_id, opt);
+}
 
 RpcClient::~RpcClient() {
     int n_dealers = _n_dealers->load(std::memory_order_acquire);
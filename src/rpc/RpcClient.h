@@ -27,6 +27,19 @@ public:
 
     bool get_available_servers(std::vector<int>& servers);
 
+    /*
+     * 不指定server的request选择server的策略，对这个rpc name的所有client生效
+     * random(默认), round_robin, p2c, least_outstanding, latency_weighted
+     * 在server一方设置时，同一个rank上的多个server之间也按积压的request数选择
+     */
+    void set_load_balance(const std::string& policy);
+
+    /*
+     * 这个rpc name发往其他rank的request和response的压缩选项，对这个进程生效
+     * 对端不需要设置，按rpc_head_t中的codec解压
+     */
+    void set_compress(const RpcCompressOption& opt);
+
     ~RpcClient();
 
     RpcService* rpc_service() {
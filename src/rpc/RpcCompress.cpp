@@ -0,0 +1,146 @@
+#include "RpcCompress.h"
+
+#include <chrono>
+
+#include "Compress.h"
+#include "observability/metrics/Metrics.h"
+#include "pico_log.h"
+#include "pico_memory.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+RpcCompressOption::RpcCompressOption(const std::string& codec,
+      uint32_t min_body_size,
+      uint32_t min_block_size)
+    : codec(RpcCompressor::codec(codec)),
+      min_body_size(min_body_size),
+      min_block_size(min_block_size) {}
+
+static const char* RPC_CODEC_NAMES[RPC_CODEC_NUM] = {"none", "zlib", "snappy", "lz4", "zstd"};
+
+uint8_t RpcCompressor::codec(const std::string& name) {
+    for (uint8_t i = 0; i < RPC_CODEC_NUM; ++i) {
+        if (name == RPC_CODEC_NAMES[i]) {
+            return i;
+        }
+    }
+    SLOG(FATAL) << "unknown rpc codec " << name;
+    return RPC_CODEC_NONE;
+}
+
+const char* RpcCompressor::codec_name(uint8_t codec) {
+    SCHECK(codec < RPC_CODEC_NUM) << (int)codec;
+    return RPC_CODEC_NAMES[codec];
+}
+
+// raw_compress/raw_uncompress不使用CompressEntity的成员，可以多线程共用
+static Compress& rpc_codec_entity(uint8_t codec) {
+    static Compress entities[RPC_CODEC_NUM] = {Compress(),
+          Compress("zlib"),
+          Compress("snappy"),
+          Compress("lz4"),
+          Compress("zstd")};
+    SCHECK(codec != RPC_CODEC_NONE && codec < RPC_CODEC_NUM) << (int)codec;
+    return entities[codec];
+}
+
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start).count();
+}
+
+struct rpc_codec_metrics_t {
+    prometheus::Counter* raw_bytes = nullptr;
+    prometheus::Counter* wire_bytes = nullptr;
+    prometheus::Counter* compress_us = nullptr;
+    prometheus::Counter* uncompress_us = nullptr;
+};
+
+/*
+ * 第一次压缩时创建并缓存，Metrics需要在此之前initialize(见RpcMetrics)
+ * 没有启用时metrics_counter返回thread_local的对象，不能缓存，指针都为nullptr
+ */
+static const rpc_codec_metrics_t& rpc_codec_metrics(uint8_t codec) {
+    static const std::vector<rpc_codec_metrics_t> metrics = []() {
+        std::vector<rpc_codec_metrics_t> ret(RPC_CODEC_NUM);
+        if (!Metrics::Singleton().enabled()) {
+            return ret;
+        }
+        for (uint8_t i = 0; i < RPC_CODEC_NUM; ++i) {
+            std::map<std::string, std::string> labels = {{"codec", RPC_CODEC_NAMES[i]}};
+            ret[i].raw_bytes = &metrics_counter("pico_rpc_compress_raw_bytes",
+                  "bytes before rpc compression", labels);
+            ret[i].wire_bytes = &metrics_counter("pico_rpc_compress_wire_bytes",
+                  "bytes sent after rpc compression", labels);
+            ret[i].compress_us = &metrics_counter("pico_rpc_compress_us",
+                  "cpu time spent in rpc compression", labels);
+            ret[i].uncompress_us = &metrics_counter("pico_rpc_uncompress_us",
+                  "cpu time spent in rpc uncompression", labels);
+        }
+        return ret;
+    }();
+    return metrics[codec];
+}
+
+bool RpcCompressor::compress(uint8_t codec, const char* in, size_t in_size,
+      char** out, size_t* out_size) {
+    auto start = std::chrono::steady_clock::now();
+    *out = nullptr;
+    *out_size = 0;
+    rpc_codec_entity(codec).raw_compress(const_cast<char*>(in), in_size, out, out_size);
+    bool smaller = *out_size < in_size;
+    if (!smaller) {
+        pico_free(*out);
+        *out = nullptr;
+    }
+    uint64_t us = elapsed_us(start);
+    size_t wire_size = smaller ? *out_size : in_size;
+
+    auto& st = stat(codec);
+    st.raw_bytes.fetch_add(in_size, std::memory_order_relaxed);
+    st.wire_bytes.fetch_add(wire_size, std::memory_order_relaxed);
+    st.compress_us.fetch_add(us, std::memory_order_relaxed);
+    const auto& metrics = rpc_codec_metrics(codec);
+    if (metrics.raw_bytes) {
+        metrics.raw_bytes->Increment(in_size);
+        metrics.wire_bytes->Increment(wire_size);
+        metrics.compress_us->Increment(us);
+    }
+    return smaller;
+}
+
+bool RpcCompressor::uncompress(uint8_t codec, const char* in, size_t in_size, size_t max_size,
+      char** out, size_t* out_size) {
+    *out = nullptr;
+    *out_size = 0;
+    if (codec == RPC_CODEC_NONE || codec >= RPC_CODEC_NUM) {
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool ok = rpc_codec_entity(codec).try_raw_uncompress(in, in_size, max_size, out, out_size);
+    if (!ok) {
+        pico_free(*out);
+        *out = nullptr;
+        *out_size = 0;
+    }
+    uint64_t us = elapsed_us(start);
+
+    stat(codec).uncompress_us.fetch_add(us, std::memory_order_relaxed);
+    const auto& metrics = rpc_codec_metrics(codec);
+    if (metrics.uncompress_us) {
+        metrics.uncompress_us->Increment(us);
+    }
+    return ok;
+}
+
+RpcCompressStat& RpcCompressor::stat(uint8_t codec) {
+    static RpcCompressStat stats[RPC_CODEC_NUM];
+    SCHECK(codec < RPC_CODEC_NUM) << (int)codec;
+    return stats[codec];
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
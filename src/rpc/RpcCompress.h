@@ -0,0 +1,77 @@
+#ifndef PARADIGM4_PICO_CORE_RPC_COMPRESS_H
+#define PARADIGM4_PICO_CORE_RPC_COMPRESS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 记录在rpc_head_t::codec和data_block_t::codec中，数值不能改
+enum RpcCodecType : uint8_t {
+    RPC_CODEC_NONE = 0,
+    RPC_CODEC_ZLIB = 1,
+    RPC_CODEC_SNAPPY = 2,
+    RPC_CODEC_LZ4 = 3,
+    RPC_CODEC_ZSTD = 4,
+    RPC_CODEC_NUM
+};
+
+/*
+ * 发送到其他rank时的压缩选项，可以按rpc name设置，也可以对单个RpcRequest/RpcResponse设置
+ * 本进程内的消息不压缩；压缩后没有变小的部分按原样发送
+ */
+struct RpcCompressOption {
+    RpcCompressOption() = default;
+
+    // codec: none, zlib, snappy, lz4, zstd
+    RpcCompressOption(const std::string& codec,
+          uint32_t min_body_size = 1024,
+          uint32_t min_block_size = UINT32_MAX);
+
+    uint8_t codec = RPC_CODEC_NONE;
+    // body不小于这个大小时压缩
+    uint32_t min_body_size = 1024;
+    // 不小于这个大小的lazy block也压缩，默认只压缩body
+    uint32_t min_block_size = UINT32_MAX;
+};
+
+// 每个codec的累计统计，raw_bytes - wire_bytes就是省下的字节数
+struct RpcCompressStat {
+    std::atomic<uint64_t> raw_bytes = {0};
+    std::atomic<uint64_t> wire_bytes = {0};
+    std::atomic<uint64_t> compress_us = {0};
+    std::atomic<uint64_t> uncompress_us = {0};
+};
+
+class RpcCompressor {
+public:
+    static uint8_t codec(const std::string& name);
+
+    static const char* codec_name(uint8_t codec);
+
+    /*
+     * 线程安全
+     * 结果没有比输入小时返回false，不需要释放out；否则out由pico_free释放
+     */
+    static bool compress(uint8_t codec, const char* in, size_t in_size,
+          char** out, size_t* out_size);
+
+    /*
+     * 线程安全，输入来自网络，不可信
+     * codec不认识、数据损坏或者解压后超过max_size时返回false，不需要释放out；
+     * 否则out由pico_free释放
+     */
+    static bool uncompress(uint8_t codec, const char* in, size_t in_size, size_t max_size,
+          char** out, size_t* out_size);
+
+    static RpcCompressStat& stat(uint8_t codec);
+};
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_RPC_COMPRESS_H
@@ -13,6 +13,13 @@ static inline uint64_t rpc_sid_pack(int rpc_id, int sid) {
     return rpc_id * 1000000007LL + sid;
 }
 
+// 截断到32位，相减时按无符号回绕，只用于统计小于一小时的延迟
+static inline uint32_t rpc_timestamp_us() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    uint32_t ret = std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+    return ret == 0 ? 1 : ret;
+}
+
 void FairQueue::add_server(int sid) {
     //std::vector<RpcRequest> vec;
     //SCHECK(_sid2cache.emplace(sid, std::move(vec)).second);
@@ -20,15 +27,18 @@ void FairQueue::add_server(int sid) {
     SCHECK(_sid2cache.emplace(sid, std::move(cache_que)).second);
 }
 
-void FairQueue::remove_server(int sid) {
+void FairQueue::remove_server(int sid, std::vector<RpcRequest>& dropped) {
     auto cit = _sid2cache.find(sid);
     SCHECK(cit != _sid2cache.end());
     RpcRequest req;
-    if (cit->second->pop(req)) {
+    while (cit->second->pop(req)) {
+        dropped.push_back(std::move(req));
+    }
+    if (!dropped.empty()) {
         SLOG(WARNING)
-            << "remove server. Drop cached requests. "
-            << " rpc_id is " << req.head().rpc_id
-            << " sid is " << req.head().sid;
+            << "remove server. Drop " << dropped.size() << " cached requests. "
+            << " rpc_id is " << dropped[0].head().rpc_id
+            << " sid is " << sid;
     }
     _sid2cache.erase(cit);
 }
@@ -47,7 +57,7 @@ void FairQueue::add_server_dealer(int sid,
         RpcRequest req;
         //add server dealer之前会加写锁，所以应该不会少pop
         while (cit->second->pop(req)) {
-            dealer->push_request(std::move(req));
+            dealer->push_request_locked(std::move(req));
         }
     }
 }
@@ -95,6 +105,9 @@ Dealer* FairQueue::next(int sid) {
         if (_sids.empty()) {
             return nullptr;
         }
+        if (_balancer) {
+            return balanced_next();
+        }
         sid = _sids[_sids_rr_index.fetch_add(1, std::memory_order_relaxed)
                     % _sids.size()];
     }
@@ -113,6 +126,24 @@ Dealer* FairQueue::next(int sid) {
     return d[index];
 }
 
+// 候选是本进程中这个rpc的所有server dealer，没有延迟信息
+Dealer* FairQueue::balanced_next() {
+    static thread_local std::vector<Dealer*> dealers;
+    static thread_local std::vector<LoadInfo> infos;
+    dealers.clear();
+    infos.clear();
+    for (auto& it : _sid2dealers) {
+        for (Dealer* dealer : it.second) {
+            dealers.push_back(dealer);
+            infos.emplace_back();
+            infos.back().available = true;
+            infos.back().outstanding = dealer->pending_requests();
+        }
+    }
+    int k = _balancer->select(infos);
+    return k == -1 ? nullptr : dealers[k];
+}
+
 bool FairQueue::push_request(int sid, RpcRequest&& req) {
     if (sid == -1) {
         if (_sid2cache.empty()) {
@@ -139,13 +170,16 @@ bool FairQueue::push_request(int sid, RpcRequest&& req) {
     return false;
 }
 
-void RpcContext::initialize(bool is_use_rdma,
-      comm_rank_t rank,
-      int io_thread_num) {
+void RpcContext::initialize(const RpcConfig& config, comm_rank_t rank) {
+    _config = config;
     _self.global_rank = rank;
-    _is_use_rdma = is_use_rdma;
-    _io_thread_num = io_thread_num;
-    for (int i = 0; i < io_thread_num; ++i) {
+    _tracer.set_config(config.trace);
+    _metrics.initialize(rank);
+    _is_use_rdma = config.protocol == "rdma";
+    _io_thread_num = config.io_thread_num;
+    _executor.initialize(config.async_thread_num,
+          {{"rank", std::to_string(rank)}});
+    for (int i = 0; i < _io_thread_num; ++i) {
         _epfds.push_back(epoll_create1(EPOLL_CLOEXEC));
     }
     if (_is_use_rdma) {
@@ -154,26 +188,46 @@ void RpcContext::initialize(bool is_use_rdma,
 #else
         SLOG(FATAL) << "rdma not supported.";
 #endif
+    } else if (config.protocol == "io_uring") {
+#ifdef USE_IO_URING
+        _acceptor = std::make_unique<IoUringAcceptor>();
+#else
+        SLOG(FATAL) << "io_uring not supported.";
+#endif
+    } else if (config.protocol == "shm") {
+        _acceptor = std::make_unique<ShmAcceptor>();
     } else {
         _acceptor = std::make_unique<TcpAcceptor>();
     }
 }
 
-void RpcContext::finalize() {
-    SLOG(INFO) << "join rpc async threads";
-    while (_async_thread_num.load() > 0) {
-        std::this_thread::yield();
+std::unique_ptr<RpcSocket> RpcContext::create_socket() {
+    if (_is_use_rdma) {
+#ifdef USE_RDMA
+        return std::make_unique<RdmaSocket>();
+#else
+        SLOG(FATAL) << "rdma not supported.";
+#endif
+    } else if (_config.protocol == "io_uring") {
+#ifdef USE_IO_URING
+        return std::make_unique<IoUringSocket>();
+#else
+        SLOG(FATAL) << "io_uring not supported.";
+#endif
+    } else if (_config.protocol == "shm") {
+        return std::make_unique<ShmSocket>();
     }
-    SLOG(INFO) << "rpc async threads joined";
+    return std::make_unique<TcpSocket>();
+}
+
+void RpcContext::finalize() {
+    SLOG(INFO) << "drain rpc async tasks";
+    _executor.drain();
+    SLOG(INFO) << "rpc async tasks drained";
 }
 
 void RpcContext::async(std::function<void()> run) {
-    _async_thread_num.fetch_add(1);
-    std::thread th([this, run](){
-        run();
-        _async_thread_num.fetch_sub(1);
-    });
-    th.detach();
+    _executor.submit(std::move(run));
 }
  
 void RpcContext::bind(const std::string& ip, int backlog) {
@@ -189,24 +243,37 @@ void RpcContext::begin_add_server() {
     _spin_lock.lock();
 }
 
-void RpcContext::end_add_server(int rpc_id, int sid) {
+void RpcContext::end_add_server(int rpc_id, int sid, const std::string& rpc_name) {
     auto it = _server_backend.find(rpc_id);
     if (it == _server_backend.end()) {
         std::tie(it, std::ignore)
               = _server_backend.emplace(rpc_id, std::make_shared<FairQueue>());
+        auto bit = _rpc_balancer.find(rpc_id);
+        if (bit != _rpc_balancer.end()) {
+            it->second->set_balancer(bit->second);
+        }
     }
     it->second->add_server(sid);
+    _metrics.add_rpc(rpc_id, rpc_name);
     _spin_lock.unlock();
 }
 
 void RpcContext::remove_server(int rpc_id, int sid) {
-    lock_guard<RWSpinLock> l(_spin_lock);
-    auto it = _server_backend.find(rpc_id);
-    SCHECK(it != _server_backend.end()) << _server_backend.size();
-    auto fq = it->second;
-    fq->remove_server(sid);
-    if (fq->empty()) {
-        _server_backend.erase(it);
+    std::vector<RpcRequest> dropped;
+    {
+        lock_guard<RWSpinLock> l(_spin_lock);
+        auto it = _server_backend.find(rpc_id);
+        SCHECK(it != _server_backend.end()) << _server_backend.size();
+        auto fq = it->second;
+        fq->remove_server(sid, dropped);
+        if (fq->empty()) {
+            _server_backend.erase(it);
+        }
+    }
+    // 回复时要拿读锁，不能在写锁中
+    shared_lock_guard<RWSpinLock> l(_spin_lock);
+    for (auto& req : dropped) {
+        reply_error(req, RpcErrorCodeType::ENOSUCHSERVER);
     }
 }
 
@@ -218,6 +285,10 @@ void RpcContext::add_server_dealer(int rpc_id,
     if (it == _server_backend.end()) {
         std::tie(it, std::ignore)
               = _server_backend.emplace(rpc_id, std::make_shared<FairQueue>());
+        auto bit = _rpc_balancer.find(rpc_id);
+        if (bit != _rpc_balancer.end()) {
+            it->second->set_balancer(bit->second);
+        }
     }
     it->second->add_server_dealer(sid, dealer);
 }
@@ -252,14 +323,17 @@ void RpcContext::remove_client_dealer(Dealer* dealer) {
     _client_backend.erase(dealer->id());
 }
 
-void RpcContext::poll_wait(std::vector<epoll_event>& events,
+int RpcContext::poll_wait(std::vector<epoll_event>& events,
       int tid,
       int timeout) {
-    events.resize(_n_events.load(std::memory_order_acquire));
+    size_t n_events = _n_events.load(std::memory_order_acquire);
+    if (events.size() < n_events) {
+        events.resize(n_events);
+    }
     int n = retry_eintr_call(
           ::epoll_wait, _epfds[tid], events.data(), events.size(), timeout);
     PSCHECK(n >= 0);
-    events.resize(n);
+    return n;
 }
 
 std::shared_ptr<FrontEnd>* RpcContext::get_client_frontend_by_rank(
@@ -280,53 +354,126 @@ std::shared_ptr<FrontEnd>* RpcContext::get_client_frontend_by_rank(
 /*
  * 这个msg只能是request
  */
-comm_rank_t RpcContext::send_request(RpcMessage&& msg) {
-    shared_lock_guard<RWSpinLock> l(_spin_lock);
-    std::shared_ptr<FrontEnd>* f = nullptr;
-    auto sid = msg.head()->sid;
-    auto dest_rank = msg.head()->dest_rank;
-    auto rpc_id = msg.head()->rpc_id;
-    if (sid != -1) {
-        f = get_client_frontend_by_sid(rpc_id, sid);
-    } else if (dest_rank != -1) {
-        f = get_client_frontend_by_rank(dest_rank);
-    } else {
-        f = get_client_frontend_by_rpc_id(rpc_id);
-    }
-    if (!f) {
-        RpcResponse resp(*msg.head());
-        resp.set_error_code(RpcErrorCodeType::ENOSUCHSERVER);
-        push_response(std::move(resp));
-        return -1;
-    }
-    comm_rank_t ret = (*f)->info().global_rank;
-    
-    if ((*f)->info() == _self) {
-        push_request(std::move(msg));
-        return ret;
+comm_rank_t RpcContext::send_request(RpcMessage&& msg, bool flow_control) {
+    flow_control = flow_control && !in_io_handler();
+    bool counted = false;
+    RpcCompressOption compress_opt;
+    for (;;) {
+        std::shared_ptr<FrontEnd> blocked;
+        size_t bytes = 0;
+        bool compress = false;
+        {
+            shared_lock_guard<RWSpinLock> l(_spin_lock);
+            RpcNameMetrics* metrics = _metrics.rpc(msg.head()->rpc_id);
+            if (metrics && !counted) {
+                metrics->client_request();
+                counted = true;
+            }
+            std::shared_ptr<FrontEnd>* f = nullptr;
+            auto sid = msg.head()->sid;
+            auto dest_rank = msg.head()->dest_rank;
+            auto rpc_id = msg.head()->rpc_id;
+            if (sid != -1) {
+                f = get_client_frontend_by_sid(rpc_id, sid);
+            } else if (dest_rank != -1) {
+                f = get_client_frontend_by_rank(dest_rank);
+            } else {
+                f = get_client_frontend_by_rpc_id(rpc_id);
+            }
+            if (!f) {
+                RpcResponse resp(*msg.head());
+                resp.set_error_code(RpcErrorCodeType::ENOSUCHSERVER);
+                push_response(std::move(resp));
+                return -1;
+            }
+            comm_rank_t ret = (*f)->info().global_rank;
+
+            if ((*f)->info() == _self) {
+                push_request(std::move(msg));
+                return ret;
+            }
+            if (compress_option(msg, compress_opt)) {
+                // 压缩可能很慢，释放读锁后再压缩，然后重新选择frontend
+                compress = true;
+            } else if ((*f)->acquire_credit(msg, !flow_control)) {
+                // 没有dealer的request不会有response
+                if (msg.head()->src_dealer != -1) {
+                    // 只有需要延迟的统计或者负载均衡时才带时间戳，否则紧凑的head中不占字节
+                    if (metrics || (*f)->_metrics || _rpc_balancer.count(rpc_id)) {
+                        msg.head()->timestamp_us = rpc_timestamp_us();
+                    }
+                    msg.head()->credit = msg._credit;
+                    (*f)->load().on_send();
+                }
+                if (metrics) {
+                    metrics->client_request_bytes(msg.wire_size());
+                }
+                (*f)->send_msg_nonblock(std::move(msg), *f);
+                return ret;
+            } else if (!_config.flow_control.block) {
+                if (msg.head()->src_dealer != -1) {
+                    RpcResponse resp(*msg.head());
+                    resp.set_error_code(RpcErrorCodeType::EOVERLOAD);
+                    push_response(std::move(resp));
+                }
+                return -1;
+            } else {
+                // 等待时不能持有读锁，否则connect拿不到写锁
+                blocked = *f;
+                bytes = msg.wire_size();
+            }
+        }
+        if (compress) {
+            msg.compress(compress_opt);
+        } else {
+            blocked->wait_credit(bytes);
+        }
     }
-    (*f)->send_msg_nonblock(std::move(msg), *f);
-    return ret;
 }
 
-void RpcContext::send_response(RpcMessage&& resp, bool nonblcok) {
-    shared_lock_guard<RWSpinLock> l(_spin_lock);
-    std::shared_ptr<FrontEnd>* f = nullptr;
-    auto dest_rank = resp.head()->dest_rank;
-    f = get_server_frontend_by_rank(dest_rank);
-    if (!f) {
-        SLOG(WARNING) << "no server frontend";
-        return;
-    }
-    if ((*f)->state() & FRONTEND_DISCONNECT) {
-        SLOG(WARNING) << "no server frontend";
-        return;
-    }
+void RpcContext::send_response(RpcMessage&& resp, bool nonblcok, bool flow_control) {
+    flow_control = flow_control && !in_io_handler();
+    RpcCompressOption compress_opt;
+    for (;;) {
+        std::shared_ptr<FrontEnd> blocked;
+        size_t bytes = 0;
+        bool compress = false;
+        {
+            shared_lock_guard<RWSpinLock> l(_spin_lock);
+            std::shared_ptr<FrontEnd>* f = nullptr;
+            auto dest_rank = resp.head()->dest_rank;
+            f = get_server_frontend_by_rank(dest_rank);
+            if (!f) {
+                SLOG(WARNING) << "no server frontend";
+                return;
+            }
+            if ((*f)->state() & FRONTEND_DISCONNECT) {
+                SLOG(WARNING) << "no server frontend";
+                return;
+            }
 
-    if (nonblcok) {
-        (*f)->send_msg_nonblock(std::move(resp), *f);
-    } else {
-        (*f)->send_msg(std::move(resp));
+            if (compress_option(resp, compress_opt)) {
+                compress = true;
+            } else if ((*f)->acquire_credit(resp, !flow_control)) {
+                if (RpcNameMetrics* metrics = _metrics.rpc(resp.head()->rpc_id)) {
+                    metrics->server_response_bytes(resp.wire_size());
+                }
+                if (nonblcok) {
+                    (*f)->send_msg_nonblock(std::move(resp), *f);
+                } else {
+                    (*f)->send_msg(std::move(resp));
+                }
+                return;
+            } else {
+                blocked = *f;
+                bytes = resp.wire_size();
+            }
+        }
+        if (compress) {
+            resp.compress(compress_opt);
+        } else {
+            blocked->wait_credit(bytes);
+        }
     }
 }
 
@@ -338,6 +485,18 @@ std::shared_ptr<FrontEnd>* RpcContext::get_client_frontend_by_rpc_id(
         return nullptr;
     }
     auto& v = it1->second;
+    auto bit = _rpc_balancer.find(rpc_id);
+    if (bit != _rpc_balancer.end()) {
+        static thread_local std::vector<LoadInfo> infos;
+        infos.resize(v.size());
+        for (size_t i = 0; i < v.size(); ++i) {
+            infos[i].available = v[i]->available();
+            infos[i].outstanding = v[i]->load().outstanding();
+            infos[i].latency_us = v[i]->load().latency_us();
+        }
+        int k = bit->second->select(infos);
+        return k == -1 ? nullptr : &v[k];
+    }
     auto& ret = v[rand() % v.size()];
     if (ret->available()) {
         return &ret;
@@ -350,6 +509,51 @@ std::shared_ptr<FrontEnd>* RpcContext::get_client_frontend_by_rpc_id(
     return nullptr;
 }
 
+void RpcContext::set_load_balance(int rpc_id, const std::string& policy) {
+    auto balancer = LoadBalancer::create(policy);
+    lock_guard<RWSpinLock> l(_spin_lock);
+    auto it = _server_backend.find(rpc_id);
+    if (it != _server_backend.end()) {
+        it->second->set_balancer(balancer);
+    }
+    _rpc_balancer[rpc_id] = std::move(balancer);
+}
+
+void RpcContext::set_compress(int rpc_id, const RpcCompressOption& opt) {
+    lock_guard<RWSpinLock> l(_spin_lock);
+    _rpc_compress[rpc_id] = opt;
+}
+
+void RpcContext::compress_request(RpcMessage& msg) {
+    RpcCompressOption opt;
+    bool compress;
+    {
+        shared_lock_guard<RWSpinLock> l(_spin_lock);
+        compress = compress_option(msg, opt);
+    }
+    if (compress) {
+        msg.compress(opt);
+    }
+}
+
+bool RpcContext::compress_option(RpcMessage& msg, RpcCompressOption& opt) {
+    if (msg._compressed) {
+        return false;
+    }
+    if (msg.has_compress_option()) {
+        opt = msg._compress;
+        return true;
+    }
+    auto it = _rpc_compress.find(msg.head()->rpc_id);
+    if (it == _rpc_compress.end() || it->second.codec == RPC_CODEC_NONE) {
+        // 不压缩，重发时也不再查
+        msg._compressed = true;
+        return false;
+    }
+    opt = it->second;
+    return true;
+}
+
 std::shared_ptr<FrontEnd>* RpcContext::get_client_frontend_by_sid(int rpc_id,
       int server_id) {
     auto it = _rpc_server_id_frontend.find(rpc_sid_pack(rpc_id, server_id));
@@ -385,14 +589,18 @@ std::shared_ptr<FrontEnd>* RpcContext::get_server_frontend_by_rank(
     }
 }
 
-void RpcContext::handle_message_event(int fd) {
-    auto func = [this](RpcMessage&& msg) {
-        if (msg.head()->dest_dealer == -1) {
-            push_request(RpcRequest(std::move(msg)));
-        } else {
-            push_response(RpcResponse(std::move(msg)));
-        }
-    };
+// 解压失败的消息只保留路由用的字段，不带body和block
+static rpc_head_t illegal_msg_head(RpcMessage& msg) {
+    rpc_head_t head = *msg.head();
+    head.codec = RPC_CODEC_NONE;
+    head.body_size = 0;
+    head.extra_block_count = 0;
+    head.extra_block_length = 0;
+    head.checksum = 0;
+    return head;
+}
+
+void RpcContext::handle_message_event(int fd, uint32_t events) {
     shared_lock_guard<RWSpinLock> l(_spin_lock);
     auto it = _fd_map.find(fd);
     if (it == _fd_map.end()) {
@@ -400,10 +608,67 @@ void RpcContext::handle_message_event(int fd) {
         return;
     }
     auto f = it->second;
+    auto func = [this, f](RpcMessage&& msg) {
+        size_t bytes = msg.wire_size();
+        RpcNameMetrics* metrics = _metrics.rpc(msg.head()->rpc_id);
+        if (f->_metrics) {
+            f->_metrics->received(bytes);
+        }
+        if (msg.head()->dest_dealer == -1) {
+            if (metrics) {
+                metrics->server_request_bytes(bytes);
+            }
+            if (!msg.uncompress(_config.max_uncompressed_size)) {
+                SLOG(WARNING) << "uncompress rpc request failed. " << *msg.head();
+                RpcRequest req;
+                req.head() = illegal_msg_head(msg);
+                reply_error(req, RpcErrorCodeType::EILLEGALMSG);
+                return;
+            }
+            RpcRequest req(std::move(msg));
+            req.stamp_trace(RPC_TRACE_RECV_MESSAGE);
+            push_request(std::move(req));
+        } else {
+            // response从发出request的client frontend上回来
+            uint32_t ts = msg.head()->timestamp_us;
+            double latency = -1;
+            if (ts != 0) {
+                uint32_t latency_us = rpc_timestamp_us() - ts;
+                latency = latency_us;
+                if (metrics) {
+                    metrics->client_response(bytes, latency_us);
+                }
+                if (f->_metrics) {
+                    f->_metrics->latency(latency_us);
+                }
+            }
+            f->load().on_response(latency);
+            if (msg.head()->credit != 0) {
+                f->release_credit(msg.head()->credit);
+            }
+            if (!msg.uncompress(_config.max_uncompressed_size)) {
+                SLOG(WARNING) << "uncompress rpc response failed. " << *msg.head();
+                RpcResponse resp;
+                resp.head() = illegal_msg_head(msg);
+                resp.set_error_code(RpcErrorCodeType::EILLEGALMSG);
+                push_response(std::move(resp));
+                return;
+            }
+            push_response(RpcResponse(std::move(msg)));
+        }
+    };
+    if (events & EPOLLOUT) {
+        f->resume_writing();
+    }
+    if ((events & ~EPOLLOUT) == 0) {
+        return;
+    }
     bool ret = f->handle_event(fd, func);
     if (!ret) {
         remove_frontend_event(f);
         f->set_state(FRONTEND_EPIPE);
+        // 有挂起的发送时由epipe负责重发
+        f->abort_writing();
         if (_to_del_client_sockets.count(f->info().global_rank)) {
             remove_frontend(f);
         }
@@ -467,7 +732,12 @@ void RpcContext::update_comm_info(const std::vector<CommInfo>& list, MasterClien
     for (const auto& comm_info : to_add) {
         auto f = std::make_shared<FrontEnd>();
         f->_ctx = this;
+        f->_max_credit = _config.flow_control.max_credit_bytes;
+        f->set_queue_config(_config.send_queue);
+        f->_compact_head = !_is_use_rdma && _config.compact_head;
+        f->_checksum = !_is_use_rdma && _config.checksum;
         f->_info = comm_info;
+        f->_metrics = _metrics.peer(comm_info.global_rank);
         f->is_client_socket() = true;
         f->_is_use_rdma = _is_use_rdma;
         _client_sockets.emplace(comm_info.global_rank, f);
@@ -494,6 +764,7 @@ void RpcContext::update_service_info(const std::vector<RpcServiceInfo>& list) {
         }
         for (const auto& info : service_list) {
             _rpc_info.emplace(info.rpc_service_name, info);
+            _metrics.add_rpc(info.rpc_id, info.rpc_service_name);
         }
         for (const auto& pr : _rpc_info) {
             const auto& rpc_info = pr.second;
@@ -529,6 +800,10 @@ void RpcContext::accept() {
     std::string info;
     auto f = std::make_shared<FrontEnd>();
     f->_ctx = this;
+    f->_max_credit = _config.flow_control.max_credit_bytes;
+    f->set_queue_config(_config.send_queue);
+    f->_compact_head = !_is_use_rdma && _config.compact_head;
+    f->_checksum = !_is_use_rdma && _config.checksum;
     f->_socket = _acceptor->accept();
     if (!f->_socket || !f->_socket->accept(info)) {
         return;
@@ -537,7 +812,12 @@ void RpcContext::accept() {
     CommInfo comm_info;
     uint16_t magic = -1;
     ar >> magic >> f->_info;
-    SCHECK(magic == 0);
+    if (magic != 0) {
+        SLOG(WARNING) << "rpc service magic not correct. " << magic;
+        ar.release();
+        return;
+    }
+    f->_metrics = _metrics.peer(f->_info.global_rank);
     ar.release();
     SLOG(INFO) << "accept from " << f->info();
     // 不async可能会导致同时互相connect时死锁
@@ -589,40 +869,97 @@ bool RpcContext::get_avaliable_servers(const std::string& rpc_name,
  * 假设外部已经抢到读锁
  */
 void RpcContext::push_request(RpcRequest&& req) {
+    if (req.head().expired(rpc_wall_clock_us())) {
+        count_expired_request(RPC_EXPIRED_ARRIVE);
+        // 调用者已经放弃，回复ETIMEOUT只是让一直等待的调用者尽快返回
+        reply_error(req, RpcErrorCodeType::ETIMEOUT);
+        return;
+    }
     int rpc_id = req.head().rpc_id;
     auto it = _server_backend.find(rpc_id);
-    /// TODO: 如果没有找到server，那么先扔掉，后面想办法回复一个默认的resp
     if (it == _server_backend.end()) {
         SLOG(WARNING)
-              << "recv request, but no such service. Drop it. "
+              << "recv request, but no such service. "
               << " rpc_id is " << req.head().rpc_id
               << " sid is " << req.head().sid;
+        reply_error(req, RpcErrorCodeType::ENOSUCHSERVICE);
         return;
     }
+    if (rpc_trace_t* trace = req.trace()) {
+        trace->stamp(RPC_TRACE_PUSH_REQUEST);
+        trace->server_rank = _self.global_rank;
+    }
+    RpcNameMetrics* metrics = _metrics.rpc(rpc_id);
+    if (metrics) {
+        metrics->server_request();
+    }
     auto fq = it->second;
     auto dealer = fq->next(req.head().sid);
     if (!dealer) {
         if (!fq->push_request(req.head().sid, std::move(req))) {
             SLOG(WARNING)
-                << "recv request, but no such server. Drop it. "
+                << "recv request, but no such server. "
                 << " rpc_id is " << req.head().rpc_id
                 << " sid is " << req.head().sid;
+            reply_error(req, RpcErrorCodeType::ENOSUCHSERVER);
         }
     } else {
         dealer->push_request(std::move(req));
+        if (metrics) {
+            metrics->server_channel_depth(dealer->pending_requests());
+        }
     }
     
 }
 
+void RpcContext::reply_error(RpcRequest& req, RpcErrorCodeType code) {
+    if (req.head().src_dealer == -1) {
+        return;
+    }
+    RpcResponse resp(req);
+    resp.set_error_code(code);
+    if (resp.head().dest_rank == _self.global_rank) {
+        push_response(std::move(resp));
+    } else {
+        // io线程不能等待credit
+        send_response(std::move(resp), true, false);
+    }
+}
+
+std::string RpcContext::rpc_name(int rpc_id) {
+    for (const auto& it : _rpc_info) {
+        if (it.second.rpc_id == rpc_id) {
+            return it.first;
+        }
+    }
+    return std::to_string(rpc_id);
+}
+
+void RpcContext::count_expired_request(RpcExpiredStage stage) {
+    _expired_request_num.fetch_add(1, std::memory_order_relaxed);
+    _metrics.expired_request(stage);
+}
+
 /*
  * 假设外部已经抢到读锁
  */
 void RpcContext::push_response(RpcResponse&& resp) {
+    if (resp.trace()) {
+        resp.stamp_trace(RPC_TRACE_RECV_RESPONSE);
+        _tracer.record(rpc_name(resp.head().rpc_id), *resp.trace());
+    }
+    RpcNameMetrics* metrics = _metrics.rpc(resp.head().rpc_id);
+    if (metrics && resp.error_code() != RpcErrorCodeType::SUCC) {
+        metrics->client_error(resp.error_code());
+    }
     auto it = _client_backend.find(resp.head().dest_dealer);
     if (it != _client_backend.end()) {
         auto dealer = it->second;
         if (dealer) {
             dealer->push_response(std::move(resp));
+            if (metrics) {
+                metrics->client_channel_depth(dealer->pending_responses());
+            }
             return;
         }
     }
@@ -641,6 +978,10 @@ void RpcContext::add_frontend_event(FrontEnd* f) {
             add_event(fd, f->_epfd, true);
             _fd_map[fd] = f;
         }
+        // 发送阻塞时才注册EPOLLOUT
+        for (int fd : f->_socket->send_fds()) {
+            _fd_map[fd] = f;
+        }
     }
 }
 
@@ -653,6 +994,51 @@ void RpcContext::remove_frontend_event(FrontEnd* f) {
     }
 }
 
+/*
+ * 由持有f发送状态的线程调用
+ * 在fds()中的fd已经注册了EPOLLIN，只修改事件，其余的fd单独注册EPOLLOUT
+ */
+bool RpcContext::set_writable_event(FrontEnd* f, bool writable) {
+    bool ok = true;
+    std::vector<int> recv_fds = f->_socket->fds();
+    if (writable) {
+        f->_writable_fds = f->blocked_fds();
+    }
+    for (int fd : f->_writable_fds) {
+        bool is_recv_fd = std::find(recv_fds.begin(), recv_fds.end(), fd) != recv_fds.end();
+        epoll_event event;
+        event.data.fd = fd;
+        event.events = 0;
+        if (writable) {
+            event.events |= EPOLLOUT;
+        }
+        int ret;
+        if (is_recv_fd) {
+            event.events |= EPOLLIN;
+            ret = epoll_ctl(f->_epfd, EPOLL_CTL_MOD, fd, &event);
+        } else if (writable) {
+            ++_n_events;
+            ret = epoll_ctl(f->_epfd, EPOLL_CTL_ADD, fd, &event);
+            if (ret != 0) {
+                --_n_events;
+            }
+        } else {
+            ret = epoll_ctl(f->_epfd, EPOLL_CTL_DEL, fd, nullptr);
+            if (ret == 0) {
+                --_n_events;
+            }
+        }
+        if (ret != 0) {
+            PSLOG(WARNING) << "epoll ctl error " << fd;
+            ok = false;
+        }
+    }
+    if (!writable) {
+        f->_writable_fds.clear();
+    }
+    return ok;
+}
+
 
 // 必须在_spin_lock写锁中
 void RpcContext::remove_frontend(FrontEnd* f) {
@@ -661,6 +1047,9 @@ void RpcContext::remove_frontend(FrontEnd* f) {
         for (auto& fd : f->_socket->fds()) {
             _fd_map.erase(fd);
         }
+        for (auto& fd : f->_socket->send_fds()) {
+            _fd_map.erase(fd);
+        }
     }
     comm_rank_t rank = f->_info.global_rank;
     if (f->_is_client_socket) {
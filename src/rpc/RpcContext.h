@@ -12,15 +12,23 @@
 
 #include "Master.h"
 #include "RpcChannel.h"
+#include "ShmSocket.h"
 #include "SpinLock.h"
 #include "TcpSocket.h"
 #include "common.h"
 #include "FrontEnd.h"
+#include "LoadBalancer.h"
+#include "AsyncExecutor.h"
 #ifdef USE_RDMA
 #include "RdmaSocket.h"
 #endif
+#ifdef USE_IO_URING
+#include "IoUringSocket.h"
+#endif
 #include "MasterClient.h"
+#include "RpcMetrics.h"
 #include "RpcServer.h"
+#include "RpcTrace.h"
 #include "pico_log.h"
 
 namespace paradigm4 {
@@ -37,17 +45,56 @@ struct RpcConfig {
         protocol = o.protocol;
 #ifdef USE_RDMA
         rdma = o.rdma;
+#endif
+#ifdef USE_IO_URING
+        PICO_CONFIG_COPY_FIELD(o, io_uring);
 #endif
         tcp = o.tcp;
+        // 后加的字段，o中没有时保留默认值
+        PICO_CONFIG_COPY_FIELD(o, shm);
+        PICO_CONFIG_COPY_FIELD(o, async_thread_num);
+        PICO_CONFIG_COPY_FIELD(o, busy_poll_us);
+        PICO_CONFIG_COPY_FIELD(o, flow_control);
+        PICO_CONFIG_COPY_FIELD(o, send_queue);
+        PICO_CONFIG_COPY_FIELD(o, compact_head);
+        PICO_CONFIG_COPY_FIELD(o, checksum);
+        PICO_CONFIG_COPY_FIELD(o, max_uncompressed_size);
+        PICO_CONFIG_COPY_FIELD(o, trace);
     }
 
     std::string bind_ip = "127.0.0.1";
     size_t io_thread_num = 1;
+    // tcp, shm, rdma(USE_RDMA), io_uring(USE_IO_URING)
+    // shm: 本机的rank之间走共享内存，其他与tcp相同
     std::string protocol = "tcp";
 #ifdef USE_RDMA
     RdmaConfig rdma;
+#endif
+#ifdef USE_IO_URING
+    IoUringConfig io_uring;
 #endif
     TcpConfig tcp;
+    ShmConfig shm;
+    // RpcContext::async线程池的最大线程数
+    size_t async_thread_num = 64;
+    // io线程没有事件时不睡眠，非阻塞epoll_wait空转这么久(us)后才阻塞，0表示不空转
+    // 用CPU换延迟，通常和tcp.busy_poll/tcp.prefer_busy_poll一起设置
+    int busy_poll_us = 0;
+    // 每个连接的发送窗口，见FlowControlConfig
+    FlowControlConfig flow_control;
+    // 每个连接的发送队列优先级和大block分段，见SendQueueConfig
+    SendQueueConfig send_queue;
+    // 用varint编码的紧凑head发送，没有启用的功能的字段不占字节；false时发送完整的rpc_head_t
+    // 收到时总能识别两种head，rdma不使用
+    bool compact_head = true;
+    // 发送时在head中带上整个消息的CRC32C，接收方校验失败时断开连接，消息重发
+    // 收到时总会校验带checksum的消息，rdma不使用
+    bool checksum = false;
+    // 收到的压缩body或者block解压后的上限，超过或者解压失败时request回复EILLEGALMSG，
+    // response以EILLEGALMSG交给dealer
+    size_t max_uncompressed_size = RPC_MAX_BODY_SIZE;
+    // 按比例追踪request经过的各阶段，见RpcTracer
+    RpcTraceConfig trace;
 };
 
 class Dealer;
@@ -61,15 +108,25 @@ class FairQueue : public NoncopyableObject {
 public:
     FairQueue() {}
     void add_server(int sid);
-    void remove_server(int sid);
+    // 还在缓存中没有交给dealer的request放入dropped
+    void remove_server(int sid, std::vector<RpcRequest>& dropped);
     void add_server_dealer(int sid, Dealer* dealer);
     void remove_server_dealer(int sid, Dealer* dealer);
     bool empty();
     Dealer* next();
+    // sid为-1时有balancer则按各dealer积压的request数选择，否则轮流
     Dealer* next(int sid);
 
     bool push_request(int sid, RpcRequest&& req);
+
+    // 与client使用同一个rpc的负载均衡策略，必须在_spin_lock写锁中
+    void set_balancer(std::shared_ptr<LoadBalancer> balancer) {
+        _balancer = std::move(balancer);
+    }
 private:
+    Dealer* balanced_next();
+
+    std::shared_ptr<LoadBalancer> _balancer;
 
     // 与server和stub共享dealer的所有权
     std::unordered_map<int, std::vector<Dealer*>> _sid2dealers;
@@ -92,15 +149,20 @@ public:
     typedef RpcChannel<RpcResponse> resp_ch_t;
     RpcContext() {}
 
-    void initialize(bool is_use_rdma, comm_rank_t rank, int io_thread_num = 1);
+    void initialize(const RpcConfig& config, comm_rank_t rank);
 
     void finalize();
 
     void async(std::function<void()>);
 
+    // 按protocol创建用于connect的socket
+    std::unique_ptr<RpcSocket> create_socket();
+
     void bind(const std::string& ip, int backlog = 20);
 
     ~RpcContext() {
+        // 任务会用到epfd和frontend，先回收
+        _executor.finalize();
         for (auto epfd : _epfds) {
             ::close(epfd);
         }
@@ -113,7 +175,8 @@ public:
 
     void begin_add_server();
 
-    void end_add_server(int rpc_id, int sid);
+    // 同时为rpc_name创建指标，不必等update_service_info
+    void end_add_server(int rpc_id, int sid, const std::string& rpc_name);
 
     void remove_server(int rpc_id, int sid);
 
@@ -131,19 +194,40 @@ public:
      */
     void remove_client_dealer(Dealer* dealers);
 
-    void poll_wait(std::vector<epoll_event>& events, int tid, int timeout);
+    // 返回事件数，events只在注册的fd变多时扩容
+    int poll_wait(std::vector<epoll_event>& events, int tid, int timeout);
+
+    int busy_poll_us() const {
+        return _config.busy_poll_us;
+    }
 
     std::shared_ptr<FrontEnd>* get_client_frontend_by_rank(comm_rank_t rank);
     /*
-     * 瞎写的，每次返回第一个，LB需要好好写
+     * 按set_load_balance设置的策略选择，没有设置时随机
      */
     std::shared_ptr<FrontEnd>* get_client_frontend_by_rpc_id(int rpc_id);
 
+    /*
+     * thread safe
+     * 设置不指定sid和rank的request选择server的策略，见LoadBalancer
+     */
+    void set_load_balance(int rpc_id, const std::string& policy);
+
+    /*
+     * thread safe
+     * 发往其他rank的消息的压缩选项，见RpcCompressOption
+     */
+    void set_compress(int rpc_id, const RpcCompressOption& opt);
+
+    // multicast共用payload之前调用，按msg或rpc_id的选项压缩一次，之后每个目标不再压缩
+    void compress_request(RpcMessage& msg);
+
     std::shared_ptr<FrontEnd>* get_client_frontend_by_sid(int rpc_id, int server_id);
 
     std::shared_ptr<FrontEnd>* get_server_frontend_by_rank(comm_rank_t rank);
 
-    void handle_message_event(int fd);
+    // events是epoll返回的事件，EPOLLOUT时继续挂起的发送
+    void handle_message_event(int fd, uint32_t events);
 
     std::vector<CommInfo> get_comm_info();
     
@@ -173,9 +257,19 @@ public:
           std::vector<int>& servers);
 
     // 返回选用了哪一个frontend
-    comm_rank_t send_request(RpcMessage&& req);
+    /*
+     * 不能持有_spin_lock调用，credit不足时会释放锁等待
+     * flow_control为false时不等待credit，用于io线程和重发
+     */
+    comm_rank_t send_request(RpcMessage&& req, bool flow_control = true);
 
-    void send_response(RpcMessage&& resp, bool nonblock);
+    void send_response(RpcMessage&& resp, bool nonblock, bool flow_control = true);
+
+    // 当前线程在io线程中持有读锁调用inline handler，这时send_request和send_response不做流控
+    static bool& in_io_handler() {
+        static thread_local bool ret = false;
+        return ret;
+    }
 
     /*
      * only for proxy
@@ -183,6 +277,30 @@ public:
      */
     void push_request(RpcRequest&& req);
 
+    /*
+     * 不处理的request回复code，response带回request占用的credit
+     * 没有dealer的request不回复；假设外部已经抢到读锁
+     */
+    void reply_error(RpcRequest& req, RpcErrorCodeType code);
+
+    // thread safe
+    void count_expired_request(RpcExpiredStage stage);
+
+    // 因为deadline已过没有处理的request数
+    size_t expired_request_num() {
+        return _expired_request_num.load(std::memory_order_relaxed);
+    }
+
+    // 内置指标，其中的指针在initialize后不再改变
+    RpcMetrics& metrics() {
+        return _metrics;
+    }
+
+    // 本rank作为client收到的被追踪的response的汇总
+    RpcTracer& tracer() {
+        return _tracer;
+    }
+
      /* 
       * 假设外部已经抢到读锁
       */
@@ -192,7 +310,19 @@ public:
        
     void remove_frontend_event(FrontEnd* f);
 
+    // 发送阻塞时在阻塞的fd上注册EPOLLOUT，恢复发送时取消
+    bool set_writable_event(FrontEnd* f, bool writable);
+
 private:
+    /*
+     * 按msg自己的选项或者rpc_id查压缩选项，还需要压缩时放入opt并返回true
+     * 假设外部已经抢到读锁；压缩本身在锁外调用RpcMessage::compress
+     */
+    bool compress_option(RpcMessage& msg, RpcCompressOption& opt);
+
+    // 按_rpc_info查rpc_id对应的名字，假设外部已经抢到读锁
+    std::string rpc_name(int rpc_id);
+
     void remove_frontend(FrontEnd* f);
        
     void add_event(int fd, int epfd, bool edge_trigger);
@@ -208,6 +338,7 @@ private:
 
 
     RWSpinLock _spin_lock;
+    RpcConfig _config;
     bool _is_use_rdma = true;
 
     // backend 相关
@@ -231,6 +362,8 @@ private:
     std::unordered_map<int, std::unordered_map<int, ServerInfo*>> _rpc_server_info;
     std::unordered_map<int, std::vector<std::shared_ptr<FrontEnd>>>
           _rpc_server_frontend;
+    std::unordered_map<int, std::shared_ptr<LoadBalancer>> _rpc_balancer;
+    std::unordered_map<int, RpcCompressOption> _rpc_compress;
     
     /*
      * 加速 get_client_frontend_by_sid
@@ -249,7 +382,13 @@ private:
     CommInfo _self;
     int _io_thread_num;
 
-    std::atomic<size_t> _async_thread_num = {0};
+    AsyncExecutor _executor;
+
+    std::atomic<size_t> _expired_request_num = {0};
+
+    RpcTracer _tracer;
+
+    RpcMetrics _metrics;
 };
 
 } // namespace core
@@ -1,41 +1,433 @@
 #include "RpcMessage.h"
+#include "Crc32c.h"
 
 namespace paradigm4 {
 namespace pico {
 namespace core {
 
-void RpcMessage::initialize(rpc_head_t&& head, BinaryArchive&& ar, LazyArchive&& lazy) {
-    lazy.apply(_data);
-    head.extra_block_count = _data.size();
-    head.extra_block_length = sizeof(data_block_t) * _data.size();
+void RpcMessage::update_extra_block_length() {
+    head()->extra_block_count = _data.size();
+    head()->extra_block_length = sizeof(data_block_t) * _data.size();
     for (const auto& data : _data) {
         // TODO 把这个判断临界值的逻辑拽出来
         if (data.length < MIN_ZERO_COPY_SIZE) {
-            head.extra_block_length += data.length;
+            head()->extra_block_length += data.length;
+        }
+    }
+}
+
+size_t RpcMessage::wire_size() {
+    size_t ret = sizeof(rpc_head_t) + head()->body_size + sizeof(data_block_t) * _data.size();
+    for (const auto& data : _data) {
+        ret += data.length;
+    }
+    return ret;
+}
+
+static char* put_varint(char* p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = char(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = char(v);
+    return p;
+}
+
+static char* put_zigzag(char* p, int64_t v) {
+    return put_varint(p, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+}
+
+// 不完整时返回false，p停在end；超过10个字节时也返回false，p停在end之前
+static bool get_varint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <class T>
+static bool get_zigzag(const char*& p, const char* end, T& v) {
+    uint64_t u;
+    if (!get_varint(p, end, u)) {
+        return false;
+    }
+    v = T(int64_t(u >> 1) ^ -int64_t(u & 1));
+    return true;
+}
+
+template <class T>
+static bool get_unsigned(const char*& p, const char* end, T& v) {
+    uint64_t u;
+    if (!get_varint(p, end, u)) {
+        return false;
+    }
+    v = T(u);
+    return true;
+}
+
+bool RpcMessage::encode_compact_head() {
+    _compact_size = 0;
+    rpc_head_t& h = *head();
+    // 每个字段最多10个字节
+    char buf[1 + 10 * 15];
+    uint8_t flags = RPC_COMPACT_HEAD;
+    char* p = put_varint(buf + 1, h.body_size);
+    for (int64_t v : {int64_t(h.src_rank), int64_t(h.dest_rank), int64_t(h.src_dealer),
+              int64_t(h.dest_dealer), int64_t(h.rpc_id), int64_t(h.sid)}) {
+        p = put_zigzag(p, v);
+    }
+    p = put_varint(p, h.extra_block_count);
+    if (h.extra_block_count) {
+        p = put_varint(p, h.extra_block_length);
+    }
+    if (h.error_code != SUCC) {
+        flags |= RPC_COMPACT_ERROR_CODE;
+        p = put_zigzag(p, h.error_code);
+    }
+    if (h.codec != RPC_CODEC_NONE || h.priority != RPC_PRIORITY_NORMAL) {
+        flags |= RPC_COMPACT_CODEC;
+        *p++ = char(h.codec | h.priority << 4);
+    }
+    if (h.timestamp_us) {
+        flags |= RPC_COMPACT_TIMESTAMP;
+        p = put_varint(p, h.timestamp_us);
+    }
+    if (h.deadline_us) {
+        flags |= RPC_COMPACT_DEADLINE;
+        p = put_zigzag(p, h.deadline_us);
+    }
+    if (h.credit) {
+        flags |= RPC_COMPACT_CREDIT;
+        p = put_varint(p, h.credit);
+    }
+    if (h.async_id) {
+        flags |= RPC_COMPACT_ASYNC_ID;
+        p = put_varint(p, h.async_id);
+    }
+    if (h.checksum) {
+        flags |= RPC_COMPACT_CHECKSUM;
+        for (int i = 0; i < 4; ++i) {
+            *p++ = char(h.checksum >> (8 * i));
+        }
+    }
+    size_t n = p - buf;
+    if (n > RPC_COMPACT_HEAD_MAX) {
+        return false;
+    }
+    buf[0] = char(flags);
+    std::memcpy(_compact_head, buf, n);
+    _compact_size = n;
+    return true;
+}
+
+size_t RpcMessage::decode_compact_head(const char* p, size_t n, rpc_head_t& head) {
+    const char* begin = p;
+    const char* end = p + n;
+    if (p == end) {
+        return 0;
+    }
+    // varint没有读完时区分是没收完还是已经损坏
+    auto fail = [&p, end]() {
+        return p < end ? RPC_COMPACT_HEAD_BAD : 0;
+    };
+    uint8_t flags = *p++;
+    head = rpc_head_t();
+    if (!get_unsigned(p, end, head.body_size)
+          || !get_zigzag(p, end, head.src_rank)
+          || !get_zigzag(p, end, head.dest_rank)
+          || !get_zigzag(p, end, head.src_dealer)
+          || !get_zigzag(p, end, head.dest_dealer)
+          || !get_zigzag(p, end, head.rpc_id)
+          || !get_zigzag(p, end, head.sid)
+          || !get_unsigned(p, end, head.extra_block_count)) {
+        return fail();
+    }
+    if (head.extra_block_count && !get_unsigned(p, end, head.extra_block_length)) {
+        return fail();
+    }
+    if ((flags & RPC_COMPACT_ERROR_CODE) && !get_zigzag(p, end, head.error_code)) {
+        return fail();
+    }
+    if (flags & RPC_COMPACT_CODEC) {
+        if (p == end) {
+            return 0;
+        }
+        uint8_t b = *p++;
+        head.codec = b & 0x0f;
+        head.priority = b >> 4;
+        if (head.codec >= RPC_CODEC_NUM || head.priority >= RPC_PRIORITY_NUM) {
+            return RPC_COMPACT_HEAD_BAD;
+        }
+    }
+    if ((flags & RPC_COMPACT_TIMESTAMP) && !get_unsigned(p, end, head.timestamp_us)) {
+        return fail();
+    }
+    if ((flags & RPC_COMPACT_DEADLINE) && !get_zigzag(p, end, head.deadline_us)) {
+        return fail();
+    }
+    if ((flags & RPC_COMPACT_CREDIT) && !get_unsigned(p, end, head.credit)) {
+        return fail();
+    }
+    if ((flags & RPC_COMPACT_ASYNC_ID) && !get_unsigned(p, end, head.async_id)) {
+        return fail();
+    }
+    if (flags & RPC_COMPACT_CHECKSUM) {
+        if (end - p < 4) {
+            return 0;
         }
+        for (int i = 0; i < 4; ++i) {
+            head.checksum |= uint32_t(uint8_t(*p++)) << (8 * i);
+        }
+    }
+    if (!check_head(head)) {
+        return RPC_COMPACT_HEAD_BAD;
     }
+    return p - begin;
+}
+
+bool RpcMessage::check_head(const rpc_head_t& head) {
+    // 小于MIN_ZERO_COPY_SIZE的block跟在meta后面，更大的单独发送
+    uint64_t max_extra = uint64_t(head.extra_block_count)
+          * (sizeof(data_block_t) + MIN_ZERO_COPY_SIZE);
+    return head.codec < RPC_CODEC_NUM
+          && head.priority < RPC_PRIORITY_NUM
+          && head.body_size <= RPC_MAX_BODY_SIZE
+          && head.extra_block_length >= uint64_t(head.extra_block_count) * sizeof(data_block_t)
+          && head.extra_block_length <= max_extra;
+}
+
+bool RpcMessage::check_blocks(const rpc_head_t& head, const char* meta) {
+    const data_block_t* blocks = reinterpret_cast<const data_block_t*>(meta);
+    uint64_t length = uint64_t(head.extra_block_count) * sizeof(data_block_t);
+    for (size_t i = 0; i < head.extra_block_count; ++i) {
+        if (blocks[i].length < MIN_ZERO_COPY_SIZE) {
+            length += blocks[i].length;
+        }
+    }
+    return length == head.extra_block_length;
+}
+
+void RpcMessage::receive_blocks(char* meta) {
+    _data.reserve(head()->extra_block_count);
+    data_block_t* cur_lazy_meta = reinterpret_cast<data_block_t*>(meta);
+    char* cur = meta + head()->extra_block_count * sizeof(data_block_t);
+    for (size_t i = 0; i < head()->extra_block_count; ++i) {
+        auto len = cur_lazy_meta[i].length;
+        if (len < MIN_ZERO_COPY_SIZE) {
+            _data.emplace_back(len);
+            std::memcpy(_data.back().data, cur, len);
+            cur += len;
+        } else {
+            ++_pending_block_cnt;
+            _data.emplace_back(len);
+        }
+        _data.back().codec = cur_lazy_meta[i].codec;
+    }
+}
+
+uint32_t RpcMessage::compute_checksum() {
+    uint32_t crc = crc32c(0, head(), sizeof(rpc_head_t));
+    crc = crc32c(crc, body(), head()->body_size);
+    for (const auto& block : _data) {
+        crc = crc32c(crc, &block.length, sizeof(block.length));
+        crc = crc32c(crc, &block.codec, sizeof(block.codec));
+        crc = crc32c(crc, block.data, block.length);
+    }
+    return crc;
+}
+
+void RpcMessage::initialize(rpc_head_t&& head, BinaryArchive&& ar, LazyArchive&& lazy) {
+    lazy.apply(_data);
     head.body_size = ar.length() - sizeof(rpc_head_t);
     _start = ar.buffer();
     *this->head() = head;
     _buffer = ar.release_shared();
     _hold = core::make_unique<LazyArchive>(std::move(lazy));
+    update_extra_block_length();
 }
 
-void RpcMessage::finalize(rpc_head_t& head, BinaryArchive& ar, LazyArchive& lazy) {
+/*
+ * 压缩过的body放进新的buffer，原buffer释放
+ * 压缩过的block换成pico_malloc分配的block(USE_RDMA时是RdmaContext注册过的allocator_type内存)，
+ * 原block仍由_hold持有
+ */
+void RpcMessage::compress(const RpcCompressOption& opt) {
+    if (_compressed) {
+        return;
+    }
+    _compressed = true;
+    const RpcCompressOption& o = has_compress_option() ? _compress : opt;
+    if (o.codec == RPC_CODEC_NONE) {
+        return;
+    }
+    char* out;
+    size_t out_size;
+    size_t body_size = head()->body_size;
+    if (head()->codec == RPC_CODEC_NONE && body_size > 0 && body_size >= o.min_body_size
+          && RpcCompressor::compress(o.codec, body(), body_size, &out, &out_size)) {
+        BinaryArchive ar;
+        ar.write_raw(_start, sizeof(rpc_head_t));
+        ar.write_raw(out, out_size);
+        pico_free(out);
+        _start = ar.buffer();
+        _buffer = ar.release_shared();
+        _shared_body = nullptr;
+        _body_buffer.reset();
+        head()->body_size = out_size;
+        head()->codec = o.codec;
+    }
+    bool changed = false;
+    for (auto& block : _data) {
+        if (block.codec != RPC_CODEC_NONE || block.length == 0 || block.length < o.min_block_size) {
+            continue;
+        }
+        if (RpcCompressor::compress(o.codec, block.data, block.length, &out, &out_size)) {
+#ifdef USE_RDMA
+            // RdmaSocket直接发送block，需要拷贝到注册过的内存中
+            data_block_t compressed(uint32_t(out_size));
+            memcpy(compressed.data, out, out_size);
+            pico_free(out);
+#else
+            data_block_t compressed(out, out_size);
+            compressed.deleter.owner = 3;
+#endif
+            compressed.codec = o.codec;
+            std::swap(block, compressed);
+            changed = true;
+        }
+    }
+    if (changed) {
+        update_extra_block_length();
+    }
+}
+
+void RpcMessage::finalize(rpc_head_t& head, BinaryArchive& ar, LazyArchive& lazy,
+      core::unique_ptr<rpc_trace_t>& trace) {
     //SCHECK(_hold == nullptr);
     lazy._hold = std::move(_hold);
+    // 其他rank的消息已经在io线程中解压并检查过，这里只剩本进程内自己压缩的数据
+    SCHECK(uncompress(RPC_MAX_BODY_SIZE)) << *this->head();
     head = *this->head();
-    ar.set_read_buffer(_start, head.body_size + sizeof(rpc_head_t));
-    ar.advance_cursor(sizeof(head));
+    if (rpc_trace_t* t = this->trace()) {
+        SCHECK(_data.back().length == sizeof(rpc_trace_t)) << _data.back().length;
+        trace = core::make_unique<rpc_trace_t>(*t);
+        _data.pop_back();
+        // 调用者看到的head不包括trace
+        head.extra_block_count -= 1;
+        head.extra_block_length -= sizeof(data_block_t) + sizeof(rpc_trace_t);
+    }
+    if (_shared_body) {
+        ar.set_read_buffer(_shared_body, head.body_size);
+    } else {
+        ar.set_read_buffer(_start, head.body_size + sizeof(rpc_head_t));
+        ar.advance_cursor(sizeof(head));
+    }
     lazy.attach(std::move(_data));
 }
 
+bool RpcMessage::uncompress(size_t max_size) {
+    if (head()->codec != RPC_CODEC_NONE) {
+        char* out;
+        size_t out_size;
+        if (!RpcCompressor::uncompress(head()->codec, body(), head()->body_size, max_size,
+              &out, &out_size)) {
+            return false;
+        }
+        // head可能还在接收buffer中，调用者之后按原来的长度跳过这个消息
+        BinaryArchive ar;
+        ar.write_raw(_start, sizeof(rpc_head_t));
+        ar.write_raw(out, out_size);
+        pico_free(out);
+        _start = ar.buffer();
+        _buffer = ar.release_shared();
+        _shared_body = nullptr;
+        _body_buffer.reset();
+        head()->body_size = out_size;
+        head()->codec = RPC_CODEC_NONE;
+    }
+    size_t max_block = std::min(max_size, size_t(UINT32_MAX));
+    for (auto& block : _data) {
+        if (block.codec == RPC_CODEC_NONE || block.codec == RPC_TRACE_BLOCK_CODEC) {
+            continue;
+        }
+        char* out;
+        size_t out_size;
+        if (block.codec >= RPC_CODEC_NUM || !RpcCompressor::uncompress(uint8_t(block.codec),
+              block.data, block.length, max_block, &out, &out_size)) {
+            return false;
+        }
+        // 换出来的压缩block在这里释放
+        data_block_t raw(out, out_size);
+        raw.deleter.owner = 3;
+        std::swap(block, raw);
+    }
+    return true;
+}
+
+/*
+ * msg的buffer和block移进payload，body之后不能再修改
+ * 带codec的head不共用，每个目标各自按compress选项压缩
+ */
+std::shared_ptr<RpcMessage::shared_payload_t> RpcMessage::share_payload(RpcMessage&& msg) {
+    if (msg._shared) {
+        // 已经是共用的消息，沿用原来的payload
+        return msg._shared;
+    }
+    auto payload = std::make_shared<shared_payload_t>();
+    if (rpc_trace_t* t = msg.trace()) {
+        payload->trace = core::make_unique<rpc_trace_t>(*t);
+        msg._data.pop_back();
+    }
+    payload->codec = msg.head()->codec;
+    payload->compressed = msg._compressed;
+    payload->body = msg.body();
+    payload->body_size = msg.head()->body_size;
+    // 收到的紧凑消息body在接收buffer中
+    payload->buffer = msg._body_buffer ? std::move(msg._body_buffer) : std::move(msg._buffer);
+    payload->data = std::move(msg._data);
+    payload->hold = std::move(msg._hold);
+    payload->compress = msg._compress;
+    return payload;
+}
+
+RpcMessage::RpcMessage(const rpc_head_t& h, const std::shared_ptr<shared_payload_t>& payload)
+    : RpcMessage(h) {
+    head()->body_size = payload->body_size;
+    head()->codec = payload->codec;
+    _shared = payload;
+    _shared_body = payload->body;
+    _compress = payload->compress;
+    _compressed = payload->compressed;
+    _data.reserve(payload->data.size());
+    for (const auto& block : payload->data) {
+        // 没有所有权，由payload持有
+        _data.emplace_back(block.data, block.length);
+        _data.back().codec = block.codec;
+#ifdef USE_RDMA
+        _data.back().lkey = block.lkey;
+#endif
+    }
+    if (payload->trace) {
+        _data.emplace_back(uint32_t(sizeof(rpc_trace_t)));
+        std::memcpy(_data.back().data, payload->trace.get(), sizeof(rpc_trace_t));
+        _data.back().codec = RPC_TRACE_BLOCK_CODEC;
+    }
+    update_extra_block_length();
+}
+
 RpcMessage::RpcMessage(RpcRequest&& req) {
     if (req._msg) {
         *this = std::move(*req._msg);
     } else {
         initialize(std::move(req._head), std::move(req._ar), std::move(req._lazy));
     }
+    _compress = req._compress;
+    attach_trace(std::move(req._trace));
 }
 
 RpcMessage::RpcMessage(RpcResponse&& resp) {
@@ -44,6 +436,19 @@ RpcMessage::RpcMessage(RpcResponse&& resp) {
     } else {
         initialize(std::move(resp._head), std::move(resp._ar), std::move(resp._lazy));
     }
+    _compress = resp._compress;
+    attach_trace(std::move(resp._trace));
+}
+
+void RpcMessage::attach_trace(core::unique_ptr<rpc_trace_t>&& trace) {
+    if (!trace) {
+        return;
+    }
+    _data.emplace_back(uint32_t(sizeof(rpc_trace_t)));
+    std::memcpy(_data.back().data, trace.get(), sizeof(rpc_trace_t));
+    _data.back().codec = RPC_TRACE_BLOCK_CODEC;
+    update_extra_block_length();
+    trace.reset();
 }
 } // namespace core
 } // namespace pico
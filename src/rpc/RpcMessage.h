@@ -1,8 +1,15 @@
 #ifndef PARADIGM4_PICO_CORE_RPC_MESSAGE_H
 #define PARADIGM4_PICO_CORE_RPC_MESSAGE_H
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <sys/uio.h>
+
 #include "Archive.h"
 #include "LazyArchive.h"
+#include "RpcCompress.h"
+#include "RpcTrace.h"
 #include "common.h"
 #include "RdmaContext.h"
 
@@ -21,24 +28,59 @@ enum RpcErrorCodeType:int16_t {
     EILLEGALMSG,
     ETIMEOUT,
     ENOTFOUND,
-    ECONNECTION
+    ECONNECTION,
+    EOVERLOAD
+};
+
+// 不同机器之间比较deadline，所以用system_clock，依赖时钟同步
+static inline int64_t rpc_wall_clock_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// 消息在发送队列中的优先级，数值小的先发，见SendQueueConfig
+enum RpcPriority : uint8_t {
+    RPC_PRIORITY_HIGH = 0,
+    RPC_PRIORITY_NORMAL = 1,
+    RPC_PRIORITY_BULK = 2,
 };
 
+constexpr int RPC_PRIORITY_NUM = 3;
+
 /*!
  * \brief rpc message info head,
  * must be trival type
  */
 struct rpc_head_t {
-    uint64_t body_size = 0;
+    // body的压缩方式，见RpcCompress.h
+    // 必须是第一个字节，取值都小于0x80，最高位为1的是紧凑格式的head，见RPC_COMPACT_HEAD
+    uint8_t codec = RPC_CODEC_NONE;
+    // 见RpcPriority，response默认与request相同
+    uint8_t priority = RPC_PRIORITY_NORMAL;
+    RpcErrorCodeType error_code = SUCC;
     comm_rank_t src_rank = -1;
     comm_rank_t dest_rank = -1;
+    uint64_t body_size = 0;
     int32_t src_dealer = -1;
     int32_t dest_dealer = -1;
     int32_t rpc_id = -1;
     int32_t sid = -1;
     uint32_t extra_block_count = 0;
     uint32_t extra_block_length = 0;
-    RpcErrorCodeType error_code = SUCC;
+    // request发出时的steady_clock微秒(截断)，response原样带回，用于统计延迟；0表示没有
+    uint32_t timestamp_us = 0;
+    // request占用的发送方credit，response原样带回，发送方收到后归还，见FlowControlConfig
+    uint32_t credit = 0;
+    // request的截止时间，rpc_wall_clock_us；0表示没有，response不带
+    int64_t deadline_us = 0;
+    // Dealer::async_request的请求号，response原样带回；0表示同步调用
+    uint32_t async_id = 0;
+    // 整个消息的CRC32C，见RpcMessage::compute_checksum；0表示没有
+    uint32_t checksum = 0;
+
+    bool expired(int64_t now_us) const {
+        return deadline_us != 0 && now_us >= deadline_us;
+    }
 
     size_t msg_size() {
         return sizeof(rpc_head_t) + extra_block_length + body_size;
@@ -50,6 +92,7 @@ struct rpc_head_t {
                << "), rpc_id:" << head.rpc_id 
                << ", sid:" << head.sid
                << ", error:" << (int)head.error_code
+               << ", codec:" << (int)head.codec
                << ", extra_block(count:length):(" << head.extra_block_count 
                << ":" << head.extra_block_length << ")"
                << ", size:" << head.body_size << "]";
@@ -57,6 +100,40 @@ struct rpc_head_t {
     }
 };
 
+/*
+ * 建连时代替magic发送，rpc_head_t的布局或者head的编码变化时递增
+ * 版本2调整了rpc_head_t的字段顺序(codec成为第一个字节)并加入紧凑格式的head
+ * 版本3的紧凑格式带上lazy block，默认用于所有消息
+ * 版本不同的节点(之前的节点magic为0)互相拒绝连接，升级时需要整个集群一起重启
+ */
+constexpr int64_t RPC_WIRE_VERSION = 3;
+
+/*
+ * 紧凑格式的head，第一个字节最高位为1，低7位是可选字段的标志
+ * 之后依次是varint的body_size，zigzag varint的src_rank, dest_rank, src_dealer,
+ * dest_dealer, rpc_id, sid，varint的extra_block_count，不为0时再是varint的extra_block_length，
+ * 再按标志位从低到高是存在的可选字段，之后与完整的head相同，是body和lazy block
+ * 可选字段都是没有启用的功能不使用的，为0时不占字节
+ * codec和priority合用一个字节，低4位是codec；checksum是4个字节的小端序
+ */
+constexpr uint8_t RPC_COMPACT_HEAD = 0x80;
+constexpr uint8_t RPC_COMPACT_ERROR_CODE = 0x01;
+constexpr uint8_t RPC_COMPACT_CODEC = 0x02;
+constexpr uint8_t RPC_COMPACT_TIMESTAMP = 0x04;
+constexpr uint8_t RPC_COMPACT_DEADLINE = 0x08;
+constexpr uint8_t RPC_COMPACT_CREDIT = 0x10;
+constexpr uint8_t RPC_COMPACT_ASYNC_ID = 0x20;
+constexpr uint8_t RPC_COMPACT_CHECKSUM = 0x40;
+// 编码后超过这个长度时收益不大，仍然发送完整的head
+constexpr size_t RPC_COMPACT_HEAD_MAX = 64;
+// decode_compact_head遇到无法解析的head时的返回值
+constexpr size_t RPC_COMPACT_HEAD_BAD = size_t(-1);
+// 收到的head中body_size的上限，超过时认为head已经损坏，不按它分配buffer
+constexpr uint64_t RPC_MAX_BODY_SIZE = uint64_t(4) << 30;
+
+// 放在最后一个lazy block的codec中，表示这个block是rpc_trace_t，收到时取出，不交给LazyArchive
+constexpr uint16_t RPC_TRACE_BLOCK_CODEC = 0x100;
+
 class RpcRequest;
 class RpcResponse;
 
@@ -66,6 +143,21 @@ static const size_t MIN_ZERO_COPY_SIZE = 4 * 1024;
 
 class RpcMessage {
 public:
+    // multicast时多个消息共用的body和block，只序列化一次
+    struct shared_payload_t {
+        std::shared_ptr<char> buffer;
+        char* body = nullptr;
+        uint64_t body_size = 0;
+        pico::core::vector<data_block_t> data;
+        core::unique_ptr<LazyArchive> hold;
+        RpcCompressOption compress;
+        // 共用之前已经压缩过，每个目标不再压缩
+        uint8_t codec = RPC_CODEC_NONE;
+        bool compressed = false;
+        // trace不共用，每个目标复制一份，各自在发送路径上stamp
+        core::unique_ptr<rpc_trace_t> trace;
+    };
+
     RpcMessage() = default;
 
     RpcMessage(RpcMessage&& o) {
@@ -82,20 +174,7 @@ public:
     // head | archive | block_size array
     RpcMessage(char* start, const std::shared_ptr<char>& buffer)
         : _start(start), _buffer(buffer) {
-        _data.reserve(head()->extra_block_count);
-        char* cur = extra();
-        data_block_t* cur_lazy_meta = lazy_meta();
-        for (size_t i = 0; i < head()->extra_block_count; ++i) {
-            auto len = cur_lazy_meta[i].length;
-            if (len < MIN_ZERO_COPY_SIZE) {
-                _data.emplace_back(len);
-	  	        std::memcpy(_data.back().data, cur, len);
-                cur += len;
-            } else {
-                ++_pending_block_cnt;
-                _data.emplace_back(len);
-            }
-        }
+        receive_blocks(reinterpret_cast<char*>(lazy_meta()));
     }
 
     RpcMessage(RpcRequest&&);
@@ -108,17 +187,90 @@ public:
         _buffer = ar.release_shared();
     }
 
+    // 收到紧凑格式的head时，展开的head放进新的buffer，body和lazy block meta仍在接收的buffer中
+    RpcMessage(const rpc_head_t& h, char* body, const std::shared_ptr<char>& buffer)
+        : RpcMessage(h) {
+        _shared_body = body;
+        _body_buffer = buffer;
+        receive_blocks(body + h.body_size);
+    }
+
+    static bool is_compact_head(char first_byte) {
+        return uint8_t(first_byte) & RPC_COMPACT_HEAD;
+    }
+
+    /*
+     * 从p开始的n个字节解析紧凑格式的head
+     * 返回head的字节数，还没有收完时返回0，字段无法解析或者超出范围时返回RPC_COMPACT_HEAD_BAD
+     */
+    static size_t decode_compact_head(const char* p, size_t n, rpc_head_t& head);
+
+    // 收到的完整head的各字段是否在合理范围内，不合理时之后的字节都无法解析
+    static bool check_head(const rpc_head_t& head);
+
+    // head之后的整个消息已经收到，meta是lazy block meta的开始，检查block的长度与extra_block_length一致
+    static bool check_blocks(const rpc_head_t& head, const char* meta);
+
+    /*
+     * 发送前调用，编码紧凑格式的head，之后cursor发送紧凑的head
+     * 编码超过RPC_COMPACT_HEAD_MAX时清除之前的编码，返回是否使用紧凑格式
+     */
+    bool encode_compact_head();
+
+    /*
+     * head(checksum置0)，body，每个block的length，codec和数据依次计算的CRC32C，
+     * 不包括block的指针；所有block都收完后才能调用
+     */
+    uint32_t compute_checksum();
+
+    // 发送前调用，在压缩之后、encode_compact_head之前
+    void fill_checksum() {
+        head()->checksum = 0;
+        uint32_t crc = compute_checksum();
+        head()->checksum = crc ? crc : 1;
+    }
+
+    // 没有checksum的消息总是通过
+    bool verify_checksum() {
+        uint32_t expected = head()->checksum;
+        if (expected == 0) {
+            return true;
+        }
+        head()->checksum = 0;
+        uint32_t crc = compute_checksum();
+        head()->checksum = expected;
+        return (crc ? crc : 1) == expected;
+    }
+
+    // 被追踪的消息最后一个block是rpc_trace_t，否则返回nullptr
+    rpc_trace_t* trace() {
+        if (_data.empty() || _data.back().codec != RPC_TRACE_BLOCK_CODEC) {
+            return nullptr;
+        }
+        return reinterpret_cast<rpc_trace_t*>(_data.back().data);
+    }
+
+    // 取出msg的body和block给多个消息共用，msg可以已经压缩
+    static std::shared_ptr<shared_payload_t> share_payload(RpcMessage&& msg);
+
+    // 自己的head，body和block引用payload，block不复制
+    RpcMessage(const rpc_head_t& h, const std::shared_ptr<shared_payload_t>& payload);
+
     rpc_head_t* head() {
         return reinterpret_cast<rpc_head_t*>(_start);
     }
 
     data_block_t* lazy_meta() {
-        return reinterpret_cast<data_block_t*>(
-              _start + sizeof(rpc_head_t) + head()->body_size);
+        return reinterpret_cast<data_block_t*>(body() + head()->body_size);
+    }
+
+    // 共用payload时body不在head后面
+    char* body() {
+        return _shared_body ? _shared_body : _start + sizeof(rpc_head_t);
     }
 
     char* extra() {
-        return _start + sizeof(rpc_head_t) + head()->body_size
+        return body() + head()->body_size
                + head()->extra_block_count * sizeof(data_block_t);
     }
 
@@ -131,10 +283,28 @@ public:
 
         void attach(RpcMessage* msg, bool zero_copy) {
             reset();
+            append(msg, zero_copy);
+        }
+
+        // 把msg的段接在后面，多个消息可以拼在同一个cursor上一起发送
+        void append(RpcMessage* msg, bool zero_copy) {
             auto& data = msg->_data;
             if (!zero_copy) {
-                _cur.emplace_back(
-                      msg->_start, sizeof(rpc_head_t) + msg->head()->body_size);
+                if (msg->_compact_size) {
+                    // 紧凑的head在消息对象内，调用者保证发完之前消息不移动
+                    _cur.emplace_back(msg->_compact_head, msg->_compact_size);
+                    if (msg->head()->body_size) {
+                        _cur.emplace_back(msg->body(), msg->head()->body_size);
+                    }
+                } else if (msg->_shared_body) {
+                    _cur.emplace_back(msg->_start, sizeof(rpc_head_t));
+                    if (msg->head()->body_size) {
+                        _cur.emplace_back(msg->_shared_body, msg->head()->body_size);
+                    }
+                } else {
+                    _cur.emplace_back(
+                          msg->_start, sizeof(rpc_head_t) + msg->head()->body_size);
+                }
                 if (data.size()) {
                     _cur.emplace_back(reinterpret_cast<char*>(data.data()),
                           data.size() * sizeof(data[0]));
@@ -149,6 +319,7 @@ public:
                     _cur.emplace_back(data[i].data, data[i].length);
                 }
             }
+            _ends.push_back(_cur.size());
         }
 
         void cursor(RpcMessage& msg) {
@@ -161,7 +332,14 @@ public:
 
         void reset() {
             _i = 0;
+            _handover = 0;
             _cur.clear();
+            _ends.clear();
+        }
+
+        // 已经完整发出的消息个数
+        size_t finished() {
+            return std::upper_bound(_ends.begin(), _ends.end(), _i) - _ends.begin();
         }
 
         bool has_next() {
@@ -189,8 +367,53 @@ public:
             }
         }
 
+        // 与advance不同，可以跨越多个段
+        void consume(size_t nbytes) {
+            while (nbytes > 0) {
+                size_t n = std::min(nbytes, _cur[_i].second);
+                advance(n);
+                nbytes -= n;
+            }
+        }
+
+        // 剩余的字节数
+        size_t bytes() {
+            size_t n = 0;
+            for (size_t k = _i; k < _cur.size(); ++k) {
+                n += _cur[k].second;
+            }
+            return n;
+        }
+
+        // 从当前位置起最多max_bytes字节作为一个消息放进out，不移动cursor，返回字节数
+        size_t prefix(byte_cursor& out, size_t max_bytes) {
+            out.reset();
+            size_t n = 0;
+            for (size_t k = _i; k < _cur.size() && n < max_bytes; ++k) {
+                size_t len = std::min(_cur[k].second, max_bytes - n);
+                out._cur.emplace_back(_cur[k].first, len);
+                n += len;
+            }
+            out._ends.push_back(out._cur.size());
+            return n;
+        }
+
+        // 从当前位置起最多填max_iov个段，返回填充的个数，不移动cursor
+        size_t fill_iovec(iovec* iov, size_t max_iov) {
+            size_t n = std::min(max_iov, size());
+            for (size_t k = 0; k < n; ++k) {
+                iov[k].iov_base = _cur[_i + k].first;
+                iov[k].iov_len = _cur[_i + k].second;
+            }
+            return n;
+        }
+
         size_t _i = 0;
+        // ShmSocket已经处理过交出的段数，之后的大block还没有决定走哪条路
+        size_t _handover = 0;
         pico::core::vector<std::pair<char*, size_t>> _cur;
+        // 每个消息最后一段之后的位置
+        pico::core::vector<size_t> _ends;
     };
 
     friend std::ostream& operator<<(std::ostream& stream, const RpcMessage& msg) {
@@ -202,21 +425,72 @@ public:
         _send_failure_func();
     }
 
+    bool has_compress_option() {
+        return _compress.codec != RPC_CODEC_NONE;
+    }
+
+    // 是否有不跟在消息后面、由zero copy cursor单独发送的大block
+    bool has_zero_copy_block() {
+        for (auto& block : _data) {
+            if (block.length >= MIN_ZERO_COPY_SIZE) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * 发送到其他rank之前调用，重发时不会重复压缩
+     * 没有设置单独的选项时使用opt
+     */
+    void compress(const RpcCompressOption& opt);
+
+    /*
+     * 收到其他rank的消息后在io线程中调用，解压body和block，head复制到新的buffer再修改
+     * 数据损坏或者解压后超过max_size时返回false，调用者不能再使用消息的内容
+     */
+    bool uncompress(size_t max_size);
+
     friend RpcRequest;
     friend RpcResponse;
     friend class TcpSocket;
     friend class RdmaSocket;
 
     void initialize(rpc_head_t&& head, BinaryArchive&& ar, LazyArchive&& lazy);
-    void finalize(rpc_head_t& head, BinaryArchive& ar, LazyArchive& lazy);
+    void finalize(rpc_head_t& head, BinaryArchive& ar, LazyArchive& lazy,
+          core::unique_ptr<rpc_trace_t>& trace);
+
+    // trace作为最后一个block发出
+    void attach_trace(core::unique_ptr<rpc_trace_t>&& trace);
+
+    // 压缩或解压后重新计算extra_block_length
+    void update_extra_block_length();
+
+    // 发送时在线上的总字节数，包括所有block，用于流控
+    size_t wire_size();
+
+    // 接收时按meta建立_data，小block从meta之后的buffer复制，大block等待之后收到
+    void receive_blocks(char* meta);
 
     char* _start = nullptr;
     std::shared_ptr<char> _buffer;
+    RpcCompressOption _compress;
+    bool _compressed = false;
+    // 在FrontEnd上占用的credit，只在本地有意义
+    size_t _credit = 0;
     pico::core::vector<data_block_t> _data;
     int _pending_block_cnt = 0;
 
     std::function<void()> _send_failure_func = [](){};
     core::unique_ptr<LazyArchive> _hold;
+    // 共用的payload，_shared_body不为空时body在payload中
+    std::shared_ptr<shared_payload_t> _shared;
+    char* _shared_body = nullptr;
+    // 收到紧凑格式的head时body所在的接收buffer
+    std::shared_ptr<char> _body_buffer;
+    // encode_compact_head的结果，0表示发送完整的head
+    uint8_t _compact_size = 0;
+    char _compact_head[RPC_COMPACT_HEAD_MAX];
 };
 
 class RpcRequest {
@@ -243,8 +517,43 @@ public:
         head().sid = sid;
     }
 
+    // 覆盖按rpc name设置的压缩选项
+    void set_compress(const RpcCompressOption& opt) {
+        _compress = opt;
+    }
+
+    // timeout_ms之后server不再处理，直接回复ETIMEOUT
+    void set_timeout(int timeout_ms) {
+        head().deadline_us = rpc_wall_clock_us() + int64_t(timeout_ms) * 1000;
+    }
+
+    void set_priority(RpcPriority priority) {
+        head().priority = priority;
+    }
+
+    // 记录经过各阶段的时间，response带回，见RpcTracer
+    void enable_trace() {
+        if (!_trace) {
+            _trace = core::make_unique<rpc_trace_t>();
+        }
+    }
+
+    rpc_trace_t* trace() {
+        return _trace.get();
+    }
+
+    const rpc_trace_t* trace() const {
+        return _trace.get();
+    }
+
+    void stamp_trace(RpcTraceStage stage) {
+        if (_trace) {
+            _trace->stamp(stage);
+        }
+    }
+
     RpcRequest(RpcMessage&& msg) {
-        msg.finalize(_head, _ar, _lazy);
+        msg.finalize(_head, _ar, _lazy, _trace);
         _msg = core::make_unique<RpcMessage>(std::move(msg));
     }
 
@@ -261,6 +570,8 @@ public:
         _msg = std::move(req._msg);
         _ar = std::move(req._ar);
         _lazy = std::move(req._lazy);
+        _compress = req._compress;
+        _trace = std::move(req._trace);
         return *this;
     }
 
@@ -312,6 +623,8 @@ private:
     LazyArchive _lazy;
     core::unique_ptr<RpcMessage> _msg = nullptr;
     std::function<void(int)> _send_failure_func = [](int){};
+    RpcCompressOption _compress;
+    core::unique_ptr<rpc_trace_t> _trace;
 };
 
 class RpcResponse {
@@ -326,18 +639,27 @@ public:
         _head.src_rank = hd.dest_rank;
         _head.sid = hd.sid;
         _head.rpc_id = hd.rpc_id;
+        _head.timestamp_us = hd.timestamp_us;
+        _head.credit = hd.credit;
+        _head.async_id = hd.async_id;
+        _head.priority = hd.priority;
         _ar.resize(sizeof(_head));
         _ar.set_cursor(_ar.end());
     }
 
-    RpcResponse(const RpcRequest& req) : RpcResponse(req.head()) {}
+    // 被追踪的request的response带回trace
+    RpcResponse(const RpcRequest& req) : RpcResponse(req.head()) {
+        if (req.trace()) {
+            _trace = core::make_unique<rpc_trace_t>(*req.trace());
+        }
+    }
 
     RpcResponse(const RpcResponse&) = delete;
 
     RpcResponse& operator=(const RpcResponse&) = delete;
 
     RpcResponse(RpcMessage&& msg) {
-        msg.finalize(_head, _ar, _lazy);
+        msg.finalize(_head, _ar, _lazy, _trace);
         _msg = core::make_unique<RpcMessage>(std::move(msg));
     }
 
@@ -353,6 +675,8 @@ public:
         _msg = std::move(resp._msg);
         _ar = std::move(resp._ar);
         _lazy = std::move(resp._lazy);
+        _compress = resp._compress;
+        _trace = std::move(resp._trace);
         return *this;
     }
 
@@ -393,15 +717,50 @@ public:
         _head.error_code = err;
     }
 
+    void set_priority(RpcPriority priority) {
+        _head.priority = priority;
+    }
+
+    // 覆盖按rpc name设置的压缩选项
+    void set_compress(const RpcCompressOption& opt) {
+        _compress = opt;
+    }
+
     RpcErrorCodeType error_code() {
         return _head.error_code;
     }
 
+    // 被追踪的request的response各阶段的时间，否则是nullptr
+    const rpc_trace_t* trace() const {
+        return _trace.get();
+    }
+
+    void stamp_trace(RpcTraceStage stage) {
+        if (_trace) {
+            _trace->stamp(stage);
+        }
+    }
+
 private:
     rpc_head_t _head;
     BinaryArchive _ar;
     LazyArchive _lazy;
     core::unique_ptr<RpcMessage> _msg = nullptr;
+    RpcCompressOption _compress;
+    core::unique_ptr<rpc_trace_t> _trace;
+};
+
+// 在收到request的线程中直接调用的handler，填写resp；request没有dealer时resp不会发出
+typedef std::function<void(RpcRequest& req, RpcResponse& resp)> rpc_handler_t;
+
+/*
+ * RpcServer::create_dealer(handler)的保护选项
+ * 连续max_slow_calls次超过slow_us后，之后的request交给RpcContext::async执行；
+ * 转出后又有max_slow_calls次没有超过slow_us(中间慢一次就重新计数)，回到io线程执行
+ */
+struct InlineHandlerOption {
+    int64_t slow_us = 200;
+    int max_slow_calls = 8;
 };
 
 } // namespace core
@@ -0,0 +1,263 @@
+#include "RpcMetrics.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "observability/metrics/Metrics.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 10us到约5s
+static const std::vector<double>& rpc_latency_bucket() {
+    static const std::vector<double> bucket = Metrics::create_geometric_bucket(10, 1e7, 2);
+    return bucket;
+}
+
+static std::string rpc_error_name(RpcErrorCodeType code) {
+    switch (code) {
+    case ENOSUCHSERVER:
+        return "ENOSUCHSERVER";
+    case ENOSUCHRANK:
+        return "ENOSUCHRANK";
+    case ENOSUCHSERVICE:
+        return "ENOSUCHSERVICE";
+    case ELOGICERROR:
+        return "ELOGICERROR";
+    case EILLEGALMSG:
+        return "EILLEGALMSG";
+    case ETIMEOUT:
+        return "ETIMEOUT";
+    case ENOTFOUND:
+        return "ENOTFOUND";
+    case ECONNECTION:
+        return "ECONNECTION";
+    case EOVERLOAD:
+        return "EOVERLOAD";
+    default:
+        return std::to_string(int(code));
+    }
+}
+
+constexpr uint64_t RpcLatencyHistogram::FLUSH_SAMPLES;
+
+static int64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+RpcLatencyHistogram::RpcLatencyHistogram(prometheus::Histogram* histogram,
+      const std::vector<double>& bucket)
+    : _histogram(histogram), _bucket(bucket),
+      _counts(new std::atomic<uint64_t>[bucket.size() + 1]) {
+    for (size_t i = 0; i <= _bucket.size(); ++i) {
+        _counts[i].store(0, std::memory_order_relaxed);
+    }
+    _last_flush_ns.store(steady_ns(), std::memory_order_relaxed);
+}
+
+void RpcLatencyHistogram::observe(uint32_t latency_us) {
+    // 与prometheus相同，等于上界的值属于这个桶
+    size_t i = std::lower_bound(_bucket.begin(), _bucket.end(), double(latency_us))
+          - _bucket.begin();
+    _counts[i].fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(latency_us, std::memory_order_relaxed);
+    uint64_t pending = _pending.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (pending >= FLUSH_SAMPLES
+          || steady_ns() - _last_flush_ns.load(std::memory_order_relaxed) > 1000000000) {
+        flush();
+    }
+}
+
+void RpcLatencyHistogram::flush() {
+    std::unique_lock<std::mutex> lk(_flush_mu, std::try_to_lock);
+    if (!lk.owns_lock()) {
+        return;
+    }
+    _pending.store(0, std::memory_order_relaxed);
+    _last_flush_ns.store(steady_ns(), std::memory_order_relaxed);
+    std::vector<double> increments(_bucket.size() + 1);
+    for (size_t i = 0; i < increments.size(); ++i) {
+        increments[i] = _counts[i].exchange(0, std::memory_order_relaxed);
+    }
+    _histogram->ObserveMultiple(increments, _sum.exchange(0, std::memory_order_relaxed));
+}
+
+static std::map<std::string, std::string> with_label(std::map<std::string, std::string> labels,
+      const std::string& name, const std::string& value) {
+    labels[name] = value;
+    return labels;
+}
+
+RpcNameMetrics::RpcNameMetrics(const std::string& rank, const std::string& rpc_name) {
+    _labels = {{"rank", rank}, {"rpc", rpc_name}};
+    auto client = with_label(_labels, "role", "client");
+    auto server = with_label(_labels, "role", "server");
+    const char* requests_help = "requests sent by clients or pushed to servers of this rank";
+    const char* request_bytes_help = "wire bytes of requests written by clients or read by servers";
+    const char* response_bytes_help = "wire bytes of responses read by clients or written by servers";
+    const char* depth_help = "messages waiting in the dealer channel, sampled on push";
+    const char* errors_help = "responses with an error code received by clients";
+    _client_requests = &metrics_counter("pico_rpc_requests", requests_help, client);
+    _client_request_bytes = &metrics_counter("pico_rpc_request_bytes", request_bytes_help, client);
+    _client_response_bytes = &metrics_counter("pico_rpc_response_bytes", response_bytes_help, client);
+    _client_latency_us = std::make_unique<RpcLatencyHistogram>(&metrics_histogram(
+          "pico_rpc_latency_us", "round trip time of requests answered by remote servers",
+          _labels, rpc_latency_bucket()), rpc_latency_bucket());
+    _client_channel_depth = &metrics_gauge("pico_rpc_channel_depth", depth_help, client);
+    _server_requests = &metrics_counter("pico_rpc_requests", requests_help, server);
+    _server_request_bytes = &metrics_counter("pico_rpc_request_bytes", request_bytes_help, server);
+    _server_response_bytes = &metrics_counter("pico_rpc_response_bytes", response_bytes_help, server);
+    _server_channel_depth = &metrics_gauge("pico_rpc_channel_depth", depth_help, server);
+    for (int code = ENOSUCHSERVER; code <= EOVERLOAD; ++code) {
+        _client_errors[code - ENOSUCHSERVER] = &metrics_counter("pico_rpc_errors", errors_help,
+              with_label(_labels, "code", rpc_error_name(RpcErrorCodeType(code))));
+    }
+}
+
+void RpcNameMetrics::client_request() {
+    _client_requests->Increment();
+}
+
+void RpcNameMetrics::client_request_bytes(size_t bytes) {
+    _client_request_bytes->Increment(bytes);
+}
+
+void RpcNameMetrics::client_response(size_t bytes, uint32_t latency_us) {
+    _client_response_bytes->Increment(bytes);
+    _client_latency_us->observe(latency_us);
+}
+
+void RpcNameMetrics::client_error(RpcErrorCodeType code) {
+    if (code >= ENOSUCHSERVER && code <= EOVERLOAD) {
+        _client_errors[code - ENOSUCHSERVER]->Increment();
+        return;
+    }
+    metrics_counter("pico_rpc_errors", "responses with an error code received by clients",
+          with_label(_labels, "code", rpc_error_name(code))).Increment();
+}
+
+void RpcNameMetrics::client_channel_depth(int64_t depth) {
+    _client_channel_depth->Set(depth);
+}
+
+void RpcNameMetrics::server_request() {
+    _server_requests->Increment();
+}
+
+void RpcNameMetrics::server_request_bytes(size_t bytes) {
+    _server_request_bytes->Increment(bytes);
+}
+
+void RpcNameMetrics::server_response_bytes(size_t bytes) {
+    _server_response_bytes->Increment(bytes);
+}
+
+void RpcNameMetrics::server_channel_depth(int64_t depth) {
+    _server_channel_depth->Set(depth);
+}
+
+RpcPeerMetrics::RpcPeerMetrics(const std::string& rank, comm_rank_t peer) {
+    std::map<std::string, std::string> labels = {{"rank", rank}, {"peer", std::to_string(peer)}};
+    _sent_messages = &metrics_counter("pico_rpc_peer_sent_messages",
+          "messages written to connections with the peer", labels);
+    _sent_bytes = &metrics_counter("pico_rpc_peer_sent_bytes",
+          "wire bytes written to connections with the peer", labels);
+    _recv_messages = &metrics_counter("pico_rpc_peer_recv_messages",
+          "messages read from connections with the peer", labels);
+    _recv_bytes = &metrics_counter("pico_rpc_peer_recv_bytes",
+          "wire bytes read from connections with the peer", labels);
+    _latency_us = std::make_unique<RpcLatencyHistogram>(&metrics_histogram(
+          "pico_rpc_peer_latency_us", "round trip time of requests answered by the peer",
+          labels, rpc_latency_bucket()), rpc_latency_bucket());
+    _send_queue_depth = &metrics_gauge("pico_rpc_send_queue_depth",
+          "messages queued or being written to the peer", labels);
+}
+
+void RpcPeerMetrics::sent(size_t bytes) {
+    _sent_messages->Increment();
+    _sent_bytes->Increment(bytes);
+}
+
+void RpcPeerMetrics::received(size_t bytes) {
+    _recv_messages->Increment();
+    _recv_bytes->Increment(bytes);
+}
+
+void RpcPeerMetrics::latency(uint32_t latency_us) {
+    _latency_us->observe(latency_us);
+}
+
+void RpcPeerMetrics::send_queue_depth(int64_t depth) {
+    _send_queue_depth->Set(depth);
+}
+
+// Metrics没有启用时metrics_counter返回thread_local的对象，不能缓存指针
+void RpcMetrics::initialize(comm_rank_t rank) {
+    _enabled = Metrics::Singleton().enabled();
+    _rank = std::to_string(rank);
+    if (!_enabled) {
+        return;
+    }
+    const char* expired_help = "requests not handled because the deadline has passed";
+    _expired_requests[RPC_EXPIRED_ARRIVE] = &metrics_counter("pico_rpc_expired_requests",
+          expired_help, {{"rank", _rank}, {"stage", "arrive"}});
+    _expired_requests[RPC_EXPIRED_DEQUEUE] = &metrics_counter("pico_rpc_expired_requests",
+          expired_help, {{"rank", _rank}, {"stage", "dequeue"}});
+    _slow_inline_handlers = &metrics_counter("pico_rpc_slow_inline_handlers",
+          "inline rpc handler calls slower than InlineHandlerOption::slow_us",
+          {{"rank", _rank}});
+    _hedged_requests = &metrics_counter("pico_rpc_hedged_requests",
+          "duplicate requests sent to a second server after the hedge delay",
+          {{"rank", _rank}});
+    _hedge_wins = &metrics_counter("pico_rpc_hedge_wins",
+          "hedged calls answered first by the duplicate request",
+          {{"rank", _rank}});
+}
+
+void RpcMetrics::add_rpc(int rpc_id, const std::string& rpc_name) {
+    if (_enabled && _rpcs.count(rpc_id) == 0) {
+        _rpcs.emplace(rpc_id, std::make_unique<RpcNameMetrics>(_rank, rpc_name));
+    }
+}
+
+RpcPeerMetrics* RpcMetrics::peer(comm_rank_t rank) {
+    if (!_enabled) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> _(_mu);
+    auto& ret = _peers[rank];
+    if (!ret) {
+        ret = std::make_unique<RpcPeerMetrics>(_rank, rank);
+    }
+    return ret.get();
+}
+
+void RpcMetrics::expired_request(RpcExpiredStage stage) {
+    if (_enabled) {
+        _expired_requests[stage]->Increment();
+    }
+}
+
+void RpcMetrics::slow_inline_handler() {
+    if (_enabled) {
+        _slow_inline_handlers->Increment();
+    }
+}
+
+void RpcMetrics::hedged_requests(size_t n) {
+    if (_enabled) {
+        _hedged_requests->Increment(n);
+    }
+}
+
+void RpcMetrics::hedge_win() {
+    if (_enabled) {
+        _hedge_wins->Increment();
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
@@ -0,0 +1,179 @@
+#ifndef PARADIGM4_PICO_CORE_RPC_METRICS_H
+#define PARADIGM4_PICO_CORE_RPC_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "RpcMessage.h"
+#include "common.h"
+
+namespace prometheus {
+class Counter;
+class Gauge;
+class Histogram;
+}
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+/*
+ * io线程上的延迟分布，prometheus::Histogram::Observe要抢锁，
+ * 这里先累加到原子的桶中，攒够FLUSH_SAMPLES个或者距上次超过1秒时
+ * 由抢到_flush_mu的线程用ObserveMultiple一起交给Histogram，抢不到的直接返回
+ */
+class RpcLatencyHistogram {
+public:
+    RpcLatencyHistogram(prometheus::Histogram* histogram, const std::vector<double>& bucket);
+
+    void observe(uint32_t latency_us);
+
+private:
+    void flush();
+
+    static constexpr uint64_t FLUSH_SAMPLES = 64;
+
+    prometheus::Histogram* _histogram;
+    std::vector<double> _bucket;
+    // 比_bucket多一个+Inf
+    std::unique_ptr<std::atomic<uint64_t>[]> _counts;
+    std::atomic<uint64_t> _sum = {0};
+    std::atomic<uint64_t> _pending = {0};
+    std::atomic<int64_t> _last_flush_ns = {0};
+    std::mutex _flush_mu;
+};
+
+// request因为deadline已过没有处理的阶段
+enum RpcExpiredStage {
+    // io线程收到时
+    RPC_EXPIRED_ARRIVE = 0,
+    // server从dealer取出时
+    RPC_EXPIRED_DEQUEUE = 1,
+    RPC_EXPIRED_STAGE_NUM
+};
+
+/*
+ * 一个rpc name的指标，client是本rank发出的request，server是本rank处理的request
+ * 创建后不再改变，更新时只有prometheus指标本身的原子操作
+ */
+class RpcNameMetrics {
+public:
+    RpcNameMetrics(const std::string& rank, const std::string& rpc_name);
+
+    void client_request();
+
+    // 写入socket的request，发给本rank的不计
+    void client_request_bytes(size_t bytes);
+
+    // 从socket收到response，latency_us是从写入发送队列开始的往返时间
+    void client_response(size_t bytes, uint32_t latency_us);
+
+    // 包括本地生成的ENOSUCHSERVER，EOVERLOAD和ETIMEOUT
+    void client_error(RpcErrorCodeType code);
+
+    // 放入response后dealer的RpcChannel中的个数
+    void client_channel_depth(int64_t depth);
+
+    void server_request();
+
+    // 从socket收到的request
+    void server_request_bytes(size_t bytes);
+
+    // 写入socket的response
+    void server_response_bytes(size_t bytes);
+
+    // 放入request后dealer的RpcChannel中的个数
+    void server_channel_depth(int64_t depth);
+
+private:
+    std::map<std::string, std::string> _labels;
+    prometheus::Counter* _client_requests;
+    prometheus::Counter* _client_request_bytes;
+    prometheus::Counter* _client_response_bytes;
+    std::unique_ptr<RpcLatencyHistogram> _client_latency_us;
+    prometheus::Gauge* _client_channel_depth;
+    prometheus::Counter* _server_requests;
+    prometheus::Counter* _server_request_bytes;
+    prometheus::Counter* _server_response_bytes;
+    prometheus::Gauge* _server_channel_depth;
+    // ENOSUCHSERVER到EOVERLOAD，其他错误码在用到时查表
+    prometheus::Counter* _client_errors[EOVERLOAD - ENOSUCHSERVER + 1];
+};
+
+// 一个对端rank的指标，client和server方向的连接共用
+class RpcPeerMetrics {
+public:
+    RpcPeerMetrics(const std::string& rank, comm_rank_t peer);
+
+    // 加入发送批次的消息
+    void sent(size_t bytes);
+
+    void received(size_t bytes);
+
+    void latency(uint32_t latency_us);
+
+    // FrontEnd::_sending_queue_size，包括正在发送的消息
+    void send_queue_depth(int64_t depth);
+
+private:
+    prometheus::Counter* _sent_messages;
+    prometheus::Counter* _sent_bytes;
+    prometheus::Counter* _recv_messages;
+    prometheus::Counter* _recv_bytes;
+    std::unique_ptr<RpcLatencyHistogram> _latency_us;
+    prometheus::Gauge* _send_queue_depth;
+};
+
+/*
+ * RpcContext的内置指标，通过Metrics导出，都带有本rank的rank标签
+ * 指标在第一次需要时创建并缓存指针，之后不再查Metrics的表
+ * Metrics需要在RpcService::initialize之前initialize，否则不创建任何指标
+ */
+class RpcMetrics {
+public:
+    void initialize(comm_rank_t rank);
+
+    // update_service_info时调用，假设外部已经抢到写锁；已有的rpc_id不变
+    void add_rpc(int rpc_id, const std::string& rpc_name);
+
+    // 假设外部已经抢到读锁，没有启用或者还不知道这个rpc时返回nullptr
+    RpcNameMetrics* rpc(int rpc_id) {
+        auto it = _rpcs.find(rpc_id);
+        return it == _rpcs.end() ? nullptr : it->second.get();
+    }
+
+    // 创建FrontEnd时调用，thread safe，没有启用时返回nullptr
+    RpcPeerMetrics* peer(comm_rank_t rank);
+
+    // 以下是本rank的指标，thread safe，没有启用时什么都不做
+    void expired_request(RpcExpiredStage stage);
+
+    void slow_inline_handler();
+
+    void hedged_requests(size_t n);
+
+    void hedge_win();
+
+private:
+    bool _enabled = false;
+    prometheus::Counter* _expired_requests[RPC_EXPIRED_STAGE_NUM] = {};
+    prometheus::Counter* _slow_inline_handlers = nullptr;
+    prometheus::Counter* _hedged_requests = nullptr;
+    prometheus::Counter* _hedge_wins = nullptr;
+    std::string _rank;
+    std::unordered_map<int, std::unique_ptr<RpcNameMetrics>> _rpcs;
+    std::mutex _mu;
+    std::unordered_map<comm_rank_t, std::unique_ptr<RpcPeerMetrics>> _peers;
+};
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_RPC_METRICS_H
@@ -9,8 +9,17 @@ class RpcContext;
 class Dealer;
 
 std::shared_ptr<Dealer> RpcServer::create_dealer() {
+    return create_dealer(nullptr);
+}
+
+std::shared_ptr<Dealer> RpcServer::create_dealer(rpc_handler_t handler,
+      const InlineHandlerOption& opt) {
     std::shared_ptr<Dealer> ret = std::make_shared<Dealer>(_rpc_id, _service);
     ret->initialize_as_server(this);
+    // 加入FairQueue时可能马上收到积压的request，之前要设置好handler
+    if (handler) {
+        ret->set_inline_handler(std::move(handler), opt);
+    }
     _service->ctx()->add_server_dealer(_rpc_id, _id, ret.get());
     lock_guard<SpinLock> _(_lk);
     _dealers.insert(ret.get());
@@ -30,6 +30,13 @@ public:
 
     std::shared_ptr<Dealer> create_dealer();
 
+    /*
+     * 收到的request在io线程中直接交给handler，返回的dealer只用于持有和terminate，
+     * 不需要也不能recv_request；handler必须线程安全
+     */
+    std::shared_ptr<Dealer> create_dealer(rpc_handler_t handler,
+          const InlineHandlerOption& opt = InlineHandlerOption());
+
     void terminate();
 
     // terminate()并join所有dealer后，可以restart()
@@ -11,12 +11,21 @@ void RpcService::initialize(MasterClient* master_client,
     size_t io_thread_num = config.io_thread_num;
     _self.global_rank
           = _master_client->generate_id(rpc_service_api + "$gen_rank");
+    TcpSocket::set_tcp_config(config.tcp);
     if (config.protocol == "tcp") {
-        _ctx.initialize(false, _self.global_rank, io_thread_num);
+        _ctx.initialize(config, _self.global_rank);
+    } else if (config.protocol == "shm") {
+        ShmSocket::set_shm_config(config.shm);
+        _ctx.initialize(config, _self.global_rank);
 #ifdef USE_RDMA
     } else if (config.protocol == "rdma") {
         RdmaContext::singleton().initialize(config.rdma);
-        _ctx.initialize(true, _self.global_rank, io_thread_num);
+        _ctx.initialize(config, _self.global_rank);
+#endif
+#ifdef USE_IO_URING
+    } else if (config.protocol == "io_uring") {
+        IoUringSocket::set_io_uring_config(config.io_uring);
+        _ctx.initialize(config, _self.global_rank);
 #endif
     } else {
         SLOG(FATAL) << "unsupported protocol " << config.protocol;
@@ -76,7 +85,7 @@ std::unique_ptr<RpcServer> RpcService::create_server(
           _rpc_service_api, rpc_name, _self.global_rank, rpc_id, server_id));
     BLOG(1) << "Registered rpc serivce: " << rpc_name
             << " with rpc id: " << rpc_id << ", server id: " << server_id;
-    _ctx.end_add_server(rpc_id, server_id);
+    _ctx.end_add_server(rpc_id, server_id, rpc_name);
     return std::make_unique<RpcServer>(rpc_id, server_id, rpc_name, this);
 }
 
@@ -118,6 +127,17 @@ void RpcService::remove_server(RpcServer* server) {
 }
 
 // MT Safe
+void RpcService::set_load_balance(const std::string& rpc_name,
+      const std::string& policy) {
+    _ctx.set_load_balance(register_rpc_service(rpc_name), policy);
+}
+
+// MT Safe
+void RpcService::set_compress(const std::string& rpc_name,
+      const RpcCompressOption& opt) {
+    _ctx.set_compress(register_rpc_service(rpc_name), opt);
+}
+
 int RpcService::register_rpc_service(const std::string& rpc_name) {
     int rpc_id;
     _master_client->register_rpc_service(
@@ -153,22 +173,42 @@ void RpcService::handle_accept_event() {
     _ctx.accept();
 }
 
-void RpcService::handle_message_event(int fd) {
-    _ctx.handle_message_event(fd);
+void RpcService::handle_message_event(int fd, uint32_t events) {
+    _ctx.handle_message_event(fd, events);
 }
 
+/*
+ * busy_poll_us > 0时，非阻塞epoll_wait空转，连续busy_poll_us没有事件后才阻塞
+ * 空转期间内核也会对设置了SO_BUSY_POLL的socket轮询网卡队列
+ */
 void RpcService::receiving(int tid) {
     std::vector<epoll_event> events;
     bool terminate = false;
+    const auto spin = std::chrono::microseconds(_ctx.busy_poll_us());
+    auto last_event = std::chrono::steady_clock::now();
     while (!terminate) {
-        _ctx.poll_wait(events, tid, -1);
-        for (auto& e : events) {
+        int n;
+        if (spin.count() > 0) {
+            n = _ctx.poll_wait(events, tid, 0);
+            if (n == 0) {
+                auto now = std::chrono::steady_clock::now();
+                if (now - last_event < spin) {
+                    continue;
+                }
+                n = _ctx.poll_wait(events, tid, -1);
+            }
+            last_event = std::chrono::steady_clock::now();
+        } else {
+            n = _ctx.poll_wait(events, tid, -1);
+        }
+        for (int i = 0; i < n; ++i) {
+            auto& e = events[i];
             if (e.data.fd == _ctx._acceptor->fd()) {
                 handle_accept_event();
             } else if (e.data.fd == _terminate_fd) {
                 terminate = true;
             } else {
-                handle_message_event(e.data.fd);
+                handle_message_event(e.data.fd, e.events);
             }
         }
     }
@@ -1,6 +1,8 @@
 #ifndef PARADIGM4_PICO_CORE_RPCSERVICE_H
 #define PARADIGM4_PICO_CORE_RPCSERVICE_H
 
+#include <chrono>
+
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
@@ -51,6 +53,12 @@ public:
 
     std::shared_ptr<Dealer> create_dealer(const std::string& rpc_name);
 
+    // 见RpcClient::set_load_balance
+    void set_load_balance(const std::string& rpc_name, const std::string& policy);
+
+    // 见RpcClient::set_compress，server一方用这个设置response的压缩
+    void set_compress(const std::string& rpc_name, const RpcCompressOption& opt);
+
     std::shared_ptr<Dealer> create_dealer();
 
     void remove_dealer(Dealer*);
@@ -79,7 +87,7 @@ private:
 
     void handle_accept_event();
 
-    void handle_message_event(int fd);
+    void handle_message_event(int fd, uint32_t events);
 
     void receiving(int tid);
 
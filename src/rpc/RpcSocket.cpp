@@ -5,6 +5,8 @@ namespace paradigm4 {
 namespace pico {
 namespace core {
 
+constexpr size_t RpcSocket::RECV_BLOCK_SIZE;
+
 bool RpcSocket::send_msg(RpcMessage&& msg) {
     int64_t sz = _sending_queue_size.fetch_add(1, std::memory_order_acq_rel);
     if (sz == 0) {
@@ -39,18 +41,8 @@ bool RpcSocket::send_msg(RpcMessage&& msg) {
 }
 
 bool RpcSocket::try_recv_msgs(std::function<void(RpcMessage&&)> func) {
-    static size_t block_size = 256 * 1024;
     while (true) {
-        if (_buffer.avaliable_size() == 0) {
-            recv_buffer_t tmp;
-            tmp.alloc(block_size);
-            std::memcpy(tmp.cursor,
-                _buffer.msg_cursor,
-                _buffer.cursor - _buffer.msg_cursor);
-            tmp.cursor += _buffer.cursor - _buffer.msg_cursor;
-            _buffer = std::move(tmp);
-        }
-
+        reserve_recv_buffer();
         ssize_t n = recv_nonblock(_buffer.cursor, _buffer.avaliable_size());
         if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             errno = 0;
@@ -66,41 +58,128 @@ bool RpcSocket::try_recv_msgs(std::function<void(RpcMessage&&)> func) {
             return false;
         }
         _buffer.cursor += n;
+        dispatch_recv_buffer(func);
+        if (_recv_corrupted) {
+            return false;
+        }
+    }
+}
+
+void RpcSocket::reserve_recv_buffer() {
+    if (_buffer.avaliable_size() == 0) {
+        recv_buffer_t tmp;
+        tmp.alloc(RECV_BLOCK_SIZE);
+        std::memcpy(tmp.cursor,
+            _buffer.msg_cursor,
+            _buffer.cursor - _buffer.msg_cursor);
+        tmp.cursor += _buffer.cursor - _buffer.msg_cursor;
+        _buffer = std::move(tmp);
+    }
+}
 
-        rpc_head_t* msg_hd;
+/*
+ * 从msg_cursor开始的未收完的消息需要msg_size字节，
+ * 放不下时把已收到的部分搬到新的buffer
+ */
+void RpcSocket::keep_partial_msg(size_t msg_size) {
+    if (_buffer.msg_cursor + msg_size > _buffer.end()) {
+        recv_buffer_t tmp;
+        tmp.alloc(std::max(msg_size, RECV_BLOCK_SIZE));
+        std::memcpy(tmp.cursor,
+              _buffer.msg_cursor,
+              _buffer.cursor - _buffer.msg_cursor);
+        tmp.cursor += _buffer.cursor - _buffer.msg_cursor;
+        _buffer = std::move(tmp);
+    }
+}
 
-        for (;;) {
-            if (_buffer.msg_cursor + sizeof(rpc_head_t) <= _buffer.cursor) {
-                msg_hd = reinterpret_cast<rpc_head_t*>(_buffer.msg_cursor);
-            } else {
-                if ((_buffer.msg_cursor + sizeof(rpc_head_t)
-                    > _buffer.end())) {
-                    recv_buffer_t tmp;
-                    tmp.alloc(block_size);
-                    std::memcpy(tmp.cursor,
-                        _buffer.msg_cursor,
-                        _buffer.cursor - _buffer.msg_cursor);
-                    tmp.cursor += _buffer.cursor - _buffer.msg_cursor;
-                    _buffer = std::move(tmp);
-                }
+bool RpcSocket::verify_recv_msg(RpcMessage& msg) {
+    if (msg.verify_checksum()) {
+        return true;
+    }
+    SLOG(WARNING) << "rpc message checksum mismatch. " << *msg.head();
+    set_recv_corrupted();
+    return false;
+}
+
+void RpcSocket::set_recv_corrupted() {
+    SLOG(WARNING) << "corrupted rpc message received, close the connection.";
+    _recv_corrupted = true;
+}
+
+/*
+ * 把_buffer中已收完整的消息交给func，
+ * 剩余不完整的消息如果放不下则搬到新的buffer
+ * 第一个字节区分完整的rpc_head_t和紧凑格式的head
+ * head或者block长度不合理时设置_recv_corrupted，不按其中的长度分配buffer
+ * 大block还没收到的消息由调用者在收完后校验checksum
+ */
+void RpcSocket::dispatch_recv_buffer(std::function<void(RpcMessage&&)>& func) {
+    rpc_head_t* msg_hd;
+    for (;;) {
+        if (recv_paused() || _recv_corrupted) {
+            break;
+        }
+        size_t received = _buffer.cursor - _buffer.msg_cursor;
+        if (received > 0 && RpcMessage::is_compact_head(*_buffer.msg_cursor)) {
+            rpc_head_t head;
+            size_t head_size = RpcMessage::decode_compact_head(
+                  _buffer.msg_cursor, received, head);
+            if (head_size == 0) {
+                keep_partial_msg(RPC_COMPACT_HEAD_MAX);
                 break;
             }
-            char* expected_msg_end = _buffer.msg_cursor + msg_hd->msg_size();
-            if (expected_msg_end <= _buffer.cursor) {
-                func({_buffer.msg_cursor, _buffer.ptr});
-                _buffer.msg_cursor = expected_msg_end;
-            } else {
-                if (expected_msg_end > _buffer.end()) {
-                    recv_buffer_t tmp;
-                    tmp.alloc(std::max(msg_hd->msg_size(), block_size));
-                    std::memcpy(tmp.cursor,
-                          _buffer.msg_cursor,
-                          _buffer.cursor - _buffer.msg_cursor);
-                    tmp.cursor += _buffer.cursor - _buffer.msg_cursor;
-                    _buffer = std::move(tmp);
+            if (head_size == RPC_COMPACT_HEAD_BAD) {
+                SLOG(WARNING) << "bad compact rpc head.";
+                set_recv_corrupted();
+                break;
+            }
+            size_t msg_size = head_size + head.body_size + head.extra_block_length;
+            if (msg_size <= received) {
+                char* body = _buffer.msg_cursor + head_size;
+                if (!RpcMessage::check_blocks(head, body + head.body_size)) {
+                    SLOG(WARNING) << "bad lazy block meta. " << head;
+                    set_recv_corrupted();
+                    break;
+                }
+                RpcMessage msg(head, body, _buffer.ptr);
+                if (msg._pending_block_cnt == 0 && !verify_recv_msg(msg)) {
+                    break;
                 }
+                func(std::move(msg));
+                _buffer.msg_cursor += msg_size;
+                continue;
+            }
+            keep_partial_msg(msg_size);
+            break;
+        }
+        if (received >= sizeof(rpc_head_t)) {
+            msg_hd = reinterpret_cast<rpc_head_t*>(_buffer.msg_cursor);
+        } else {
+            keep_partial_msg(sizeof(rpc_head_t));
+            break;
+        }
+        if (!RpcMessage::check_head(*msg_hd)) {
+            SLOG(WARNING) << "bad rpc head. " << *msg_hd;
+            set_recv_corrupted();
+            break;
+        }
+        if (msg_hd->msg_size() <= received) {
+            if (!RpcMessage::check_blocks(*msg_hd,
+                      _buffer.msg_cursor + sizeof(rpc_head_t) + msg_hd->body_size)) {
+                SLOG(WARNING) << "bad lazy block meta. " << *msg_hd;
+                set_recv_corrupted();
+                break;
+            }
+            RpcMessage msg(_buffer.msg_cursor, _buffer.ptr);
+            if (msg._pending_block_cnt == 0 && !verify_recv_msg(msg)) {
                 break;
             }
+            func(std::move(msg));
+            _buffer.msg_cursor += msg_hd->msg_size();
+        } else {
+            keep_partial_msg(msg_hd->msg_size());
+            break;
         }
     }
 }
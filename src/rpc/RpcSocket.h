@@ -71,6 +71,17 @@ public:
         return {};
     }
 
+    // 发送用到的fd，可能不在fds()中
+    virtual std::vector<int> send_fds() {
+        return {};
+    }
+
+    // nonblock发送没有发完时，需要等待可写的fd
+    virtual std::vector<int> blocked_fds(RpcMessage::byte_cursor&,
+          RpcMessage::byte_cursor&) {
+        return {};
+    }
+
     // 用于连接后再次握手，确认magic，汇报角色
     virtual bool accept(std::string&) {
         return false;
@@ -98,12 +109,62 @@ public:
           RpcMessage::byte_cursor& it2)
           = 0;
 
+    /*
+     * 一次发送一批消息，it1/it2由msgs依次append得到
+     * 默认不支持批量，msgs中只能有一个消息
+     */
+    virtual bool send_msgs(pico::core::vector<RpcMessage>& msgs,
+          bool nonblock,
+          bool more,
+          RpcMessage::byte_cursor& it1,
+          RpcMessage::byte_cursor& it2) {
+        SCHECK(msgs.size() == 1) << msgs.size();
+        return send_msg(msgs[0], nonblock, more, it1, it2);
+    }
+
+    virtual size_t max_send_batch() {
+        return 1;
+    }
+
+    /*
+     * 大block是否在单独的连接上发送，此时zero copy cursor可以分段发送，
+     * 段之间可以发送其他不带大block的消息
+     */
+    virtual bool interleave_blocks() {
+        return false;
+    }
+
 protected:
 
     virtual ssize_t recv_nonblock(char* ptr, size_t size) = 0;
 
     bool try_recv_msgs(std::function<void(RpcMessage&&)>);
 
+    // 保证_buffer有空闲空间可以recv
+    void reserve_recv_buffer();
+
+    // 处理_buffer中已经收到的字节
+    void dispatch_recv_buffer(std::function<void(RpcMessage&&)>& func);
+
+    // 未收完的消息放不下时搬到新的buffer
+    void keep_partial_msg(size_t msg_size);
+
+    // 收完的消息校验checksum，失败时设置_recv_corrupted
+    bool verify_recv_msg(RpcMessage& msg);
+
+    // 收到无法解析或者校验失败的字节，调用者之后断开连接
+    void set_recv_corrupted();
+
+    // 为true时dispatch_recv_buffer停止解析，_buffer中后续的字节另有用途
+    virtual bool recv_paused() {
+        return false;
+    }
+
+    static constexpr size_t RECV_BLOCK_SIZE = 256 * 1024;
+
+    // 收到checksum不对或者head无法解析的消息，之后的字节不可信，调用者断开连接
+    bool _recv_corrupted = false;
+
     struct recv_buffer_t {
         std::shared_ptr<char> ptr = nullptr;
         size_t size = 0;
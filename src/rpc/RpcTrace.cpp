@@ -0,0 +1,194 @@
+#include "RpcTrace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <set>
+
+#include "PicoJsonNode.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+const char* rpc_trace_span_name(RpcTraceSpan span) {
+    switch (span) {
+    case RPC_TRACE_CLIENT_QUEUE:
+        return "client_queue";
+    case RPC_TRACE_WIRE:
+        return "wire";
+    case RPC_TRACE_SERVER_DISPATCH:
+        return "server_dispatch";
+    case RPC_TRACE_SERVER_QUEUE:
+        return "server_queue";
+    case RPC_TRACE_HANDLER:
+        return "handler";
+    case RPC_TRACE_TOTAL:
+        return "total";
+    default:
+        return "unknown";
+    }
+}
+
+bool rpc_trace_t::span_ns(RpcTraceSpan span, int64_t& ns) const {
+    auto diff = [this, &ns](RpcTraceStage from, RpcTraceStage to) {
+        if (!has(from) || !has(to)) {
+            return false;
+        }
+        ns = stage_ns[to] - stage_ns[from];
+        return true;
+    };
+    switch (span) {
+    case RPC_TRACE_CLIENT_QUEUE:
+        return diff(RPC_TRACE_SEND_REQUEST, RPC_TRACE_SOCKET_SEND);
+    case RPC_TRACE_WIRE: {
+        int64_t server_ns;
+        if (!diff(RPC_TRACE_RECV_MESSAGE, RPC_TRACE_SEND_RESPONSE)) {
+            return false;
+        }
+        server_ns = ns;
+        if (!diff(RPC_TRACE_SOCKET_SEND, RPC_TRACE_RECV_RESPONSE)) {
+            return false;
+        }
+        ns -= server_ns;
+        return true;
+    }
+    case RPC_TRACE_SERVER_DISPATCH:
+        return diff(RPC_TRACE_RECV_MESSAGE, RPC_TRACE_PUSH_REQUEST);
+    case RPC_TRACE_SERVER_QUEUE:
+        return diff(RPC_TRACE_PUSH_REQUEST, RPC_TRACE_RECV_REQUEST);
+    case RPC_TRACE_HANDLER:
+        return diff(RPC_TRACE_RECV_REQUEST, RPC_TRACE_SEND_RESPONSE);
+    case RPC_TRACE_TOTAL:
+        return diff(RPC_TRACE_SEND_REQUEST, RPC_TRACE_RECV_RESPONSE);
+    default:
+        return false;
+    }
+}
+
+void rpc_trace_stat_t::add(double us) {
+    ++count;
+    sum_us += us;
+    max_us = std::max(max_us, us);
+    int i = us < 1 ? 0 : int(std::log2(us)) + 1;
+    ++buckets[std::min(i, BUCKET_NUM - 1)];
+}
+
+double rpc_trace_stat_t::percentile_us(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+    size_t rank = std::min(size_t(std::ceil(p * count)), count);
+    size_t seen = 0;
+    for (int i = 0; i < BUCKET_NUM; ++i) {
+        seen += buckets[i];
+        if (seen >= std::max<size_t>(rank, 1)) {
+            return std::min(std::ldexp(1.0, i), max_us);
+        }
+    }
+    return max_us;
+}
+
+bool RpcTracer::sample() {
+    double rate = _config.sample_rate;
+    if (rate <= 0) {
+        return false;
+    }
+    if (rate >= 1) {
+        return true;
+    }
+    thread_local std::minstd_rand rng(std::random_device{}());
+    return std::uniform_real_distribution<double>(0, 1)(rng) < rate;
+}
+
+void RpcTracer::record(const std::string& rpc_name, const rpc_trace_t& trace) {
+    std::lock_guard<std::mutex> _(_mu);
+    auto& stats = _stats[rpc_name];
+    for (int span = 0; span < RPC_TRACE_SPAN_NUM; ++span) {
+        int64_t ns;
+        if (trace.span_ns(RpcTraceSpan(span), ns)) {
+            stats[span].add(std::max<int64_t>(ns, 0) / 1e3);
+        }
+    }
+    if (_config.max_traces == 0) {
+        return;
+    }
+    _records.push_back({_next_id++, rpc_name, trace});
+    while (_records.size() > _config.max_traces) {
+        _records.pop_front();
+    }
+}
+
+bool RpcTracer::stat(const std::string& rpc_name, RpcTraceSpan span, rpc_trace_stat_t& out) {
+    std::lock_guard<std::mutex> _(_mu);
+    auto it = _stats.find(rpc_name);
+    if (it == _stats.end()) {
+        return false;
+    }
+    out = it->second[span];
+    return true;
+}
+
+std::string RpcTracer::chrome_trace_json() {
+    std::lock_guard<std::mutex> _(_mu);
+    PicoJsonNode events = PicoJsonNode::array();
+    std::set<int32_t> ranks;
+    for (const auto& rec : _records) {
+        const rpc_trace_t& t = rec.trace;
+        // server时钟减去client时钟，假设两个方向的网络时间相同；没有经过socket时是同一个时钟
+        double offset_ns = 0;
+        if (t.has(RPC_TRACE_SOCKET_SEND) && t.has(RPC_TRACE_RECV_MESSAGE)
+              && t.has(RPC_TRACE_SEND_RESPONSE) && t.has(RPC_TRACE_RECV_RESPONSE)) {
+            offset_ns = ((t.stage_ns[RPC_TRACE_RECV_MESSAGE] - t.stage_ns[RPC_TRACE_SOCKET_SEND])
+                  + (t.stage_ns[RPC_TRACE_SEND_RESPONSE] - t.stage_ns[RPC_TRACE_RECV_RESPONSE]))
+                  / 2.0;
+        }
+        auto add = [&](const std::string& name, RpcTraceStage from, RpcTraceStage to,
+              bool server) {
+            if (!t.has(from) || !t.has(to)) {
+                return;
+            }
+            double shift = server ? offset_ns : 0;
+            int32_t pid = server ? t.server_rank : t.client_rank;
+            PicoJsonNode args = {{"rpc", rec.rpc_name}, {"trace_id", rec.id}};
+            PicoJsonNode event = {{"name", name}, {"cat", rec.rpc_name}, {"ph", "X"},
+                  {"ts", (t.stage_ns[from] - shift) / 1e3},
+                  {"dur", std::max<int64_t>(t.stage_ns[to] - t.stage_ns[from], 0) / 1e3},
+                  {"pid", pid}, {"tid", rec.id}};
+            event.add("args", args);
+            events.push_back(event);
+            ranks.insert(pid);
+        };
+        add(rec.rpc_name, RPC_TRACE_SEND_REQUEST, RPC_TRACE_RECV_RESPONSE, false);
+        add(rpc_trace_span_name(RPC_TRACE_CLIENT_QUEUE),
+              RPC_TRACE_SEND_REQUEST, RPC_TRACE_SOCKET_SEND, false);
+        add(rpc_trace_span_name(RPC_TRACE_SERVER_DISPATCH),
+              RPC_TRACE_RECV_MESSAGE, RPC_TRACE_PUSH_REQUEST, true);
+        add(rpc_trace_span_name(RPC_TRACE_SERVER_QUEUE),
+              RPC_TRACE_PUSH_REQUEST, RPC_TRACE_RECV_REQUEST, true);
+        add(rpc_trace_span_name(RPC_TRACE_HANDLER),
+              RPC_TRACE_RECV_REQUEST, RPC_TRACE_SEND_RESPONSE, true);
+    }
+    for (int32_t rank : ranks) {
+        PicoJsonNode args = {{"name", "rank " + std::to_string(rank)}};
+        PicoJsonNode meta = {{"name", "process_name"}, {"ph", "M"}, {"pid", rank}};
+        meta.add("args", args);
+        events.push_back(meta);
+    }
+    PicoJsonNode root;
+    root.add("traceEvents", events);
+    root.add("displayTimeUnit", "ns");
+    std::string ret;
+    root.save(ret, false);
+    return ret;
+}
+
+void RpcTracer::clear() {
+    std::lock_guard<std::mutex> _(_mu);
+    _records.clear();
+    _stats.clear();
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
@@ -0,0 +1,140 @@
+#ifndef PARADIGM4_PICO_CORE_RPC_TRACE_H
+#define PARADIGM4_PICO_CORE_RPC_TRACE_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 被采样的request经过的阶段，按时间顺序
+enum RpcTraceStage : int {
+    RPC_TRACE_SEND_REQUEST = 0,  // Dealer::send_request
+    RPC_TRACE_SOCKET_SEND,       // FrontEnd取出request写socket
+    RPC_TRACE_RECV_MESSAGE,      // server的io线程在try_recv_msgs中收到
+    RPC_TRACE_PUSH_REQUEST,      // 放进server dealer的RpcChannel
+    RPC_TRACE_RECV_REQUEST,      // Dealer::recv_request取出或者inline handler开始
+    RPC_TRACE_SEND_RESPONSE,     // Dealer::send_response
+    RPC_TRACE_RECV_RESPONSE,     // client收到response
+    RPC_TRACE_STAGE_NUM
+};
+
+// 由相邻阶段得到的耗时
+enum RpcTraceSpan : int {
+    RPC_TRACE_CLIENT_QUEUE = 0,  // client在FrontEnd发送队列中
+    RPC_TRACE_WIRE,              // 往返的网络时间，包括server发送response的排队
+    RPC_TRACE_SERVER_DISPATCH,   // server收到后找到dealer
+    RPC_TRACE_SERVER_QUEUE,      // 在server的RpcChannel中等待
+    RPC_TRACE_HANDLER,           // server处理
+    RPC_TRACE_TOTAL,             // send_request到收到response
+    RPC_TRACE_SPAN_NUM
+};
+
+const char* rpc_trace_span_name(RpcTraceSpan span);
+
+/*
+ * 各阶段的steady_clock纳秒，0表示没有经过(例如发给本rank的request不经过socket)
+ * SEND_REQUEST，SOCKET_SEND和RECV_RESPONSE是client的时钟，其余是server的，
+ * 不同机器的时钟只比较差值；作为request的最后一个lazy block发出，response原样带回
+ */
+struct rpc_trace_t {
+    int64_t stage_ns[RPC_TRACE_STAGE_NUM] = {};
+    int32_t client_rank = -1;
+    int32_t server_rank = -1;
+
+    void stamp(RpcTraceStage stage) {
+        stage_ns[stage] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool has(RpcTraceStage stage) const {
+        return stage_ns[stage] != 0;
+    }
+
+    // 对应的阶段不全时返回false
+    bool span_ns(RpcTraceSpan span, int64_t& ns) const;
+};
+
+struct RpcTraceConfig {
+    RpcTraceConfig() = default;
+
+    template<typename T>
+    RpcTraceConfig(const T& o) {
+        PICO_CONFIG_COPY_FIELD(o, sample_rate);
+        PICO_CONFIG_COPY_FIELD(o, max_traces);
+    }
+
+    // Dealer::send_request发出的request被追踪的比例，0表示不追踪
+    double sample_rate = 0;
+    // 保留最近的多少个trace用于导出
+    size_t max_traces = 1000;
+};
+
+// 一个rpc name一种span的分布，桶i是[2^(i-1), 2^i)微秒
+struct rpc_trace_stat_t {
+    static constexpr int BUCKET_NUM = 32;
+    size_t count = 0;
+    double sum_us = 0;
+    double max_us = 0;
+    size_t buckets[BUCKET_NUM] = {};
+
+    void add(double us);
+
+    // 所在桶的上界，没有样本时返回0
+    double percentile_us(double p) const;
+};
+
+/*
+ * client收到被追踪的response后汇总，每个RpcContext一个，线程安全
+ * 只有采样到的request才加锁，没有采样时sample()只读一个double
+ */
+class RpcTracer {
+public:
+    void set_config(const RpcTraceConfig& config) {
+        _config = config;
+    }
+
+    const RpcTraceConfig& config() const {
+        return _config;
+    }
+
+    bool sample();
+
+    void record(const std::string& rpc_name, const rpc_trace_t& trace);
+
+    // 没有这个rpc的trace时返回false
+    bool stat(const std::string& rpc_name, RpcTraceSpan span, rpc_trace_stat_t& out);
+
+    /*
+     * 最近max_traces个trace，Chrome trace event格式，可以在chrome://tracing或Perfetto中打开
+     * 时间轴是client的时钟，server的时间按往返时间对称估计时钟差后换算
+     */
+    std::string chrome_trace_json();
+
+    void clear();
+
+private:
+    struct record_t {
+        uint64_t id;
+        std::string rpc_name;
+        rpc_trace_t trace;
+    };
+
+    RpcTraceConfig _config;
+    std::mutex _mu;
+    uint64_t _next_id = 0;
+    std::deque<record_t> _records;
+    std::unordered_map<std::string, std::array<rpc_trace_stat_t, RPC_TRACE_SPAN_NUM>> _stats;
+};
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_RPC_TRACE_H
@@ -0,0 +1,887 @@
+#include "ShmSocket.h"
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <random>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// 旧版本glibc没有这些定义
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+ShmConfig ShmSocket::_shm_config;
+
+constexpr size_t ShmArena::SLOT_SIZE;
+
+// 共享内存block的开头，data从SHM_BLOCK_HEADER之后开始
+struct shm_block_header_t {
+    // 占用的slot数，由发送方填写
+    uint64_t slot_num;
+};
+
+static constexpr size_t SHM_BLOCK_HEADER = 64;
+
+static size_t page_round_up(size_t size) {
+    static const size_t page = ::sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+static int shm_memfd_create(const char* name) {
+    return ::syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+}
+
+/*
+ * 接收方映射的block区，按base登记，用户释放block时按地址找到
+ * socket关闭后映射保留到其中的block都释放为止
+ */
+struct shm_rx_arena_t {
+    ShmArena arena;
+    size_t map_size = 0;
+    size_t outstanding = 0;
+    bool closed = false;
+
+    ~shm_rx_arena_t() {
+        PSCHECK(::munmap(arena.base(), map_size) == 0);
+    }
+};
+
+static std::mutex shm_rx_arena_mu;
+static std::map<char*, std::unique_ptr<shm_rx_arena_t>> shm_rx_arenas;
+
+static void shm_rx_arena_register(const ShmArena& arena, size_t map_size) {
+    std::lock_guard<std::mutex> _(shm_rx_arena_mu);
+    auto& ret = shm_rx_arenas[arena.base()];
+    ret = std::make_unique<shm_rx_arena_t>();
+    ret->arena = arena;
+    ret->map_size = map_size;
+}
+
+static void shm_rx_arena_acquire(char* base) {
+    std::lock_guard<std::mutex> _(shm_rx_arena_mu);
+    ++shm_rx_arenas.at(base)->outstanding;
+}
+
+// data为nullptr时表示socket关闭
+static void shm_rx_arena_release(char* base, char* data) {
+    std::lock_guard<std::mutex> _(shm_rx_arena_mu);
+    auto it = shm_rx_arenas.find(base);
+    SCHECK(it != shm_rx_arenas.end());
+    shm_rx_arena_t& rx = *it->second;
+    if (data) {
+        rx.arena.free(data);
+        --rx.outstanding;
+    } else {
+        rx.closed = true;
+    }
+    if (rx.closed && rx.outstanding == 0) {
+        shm_rx_arenas.erase(it);
+    }
+}
+
+void shm_block_unmap(char* data) {
+    char* arena_base;
+    {
+        std::lock_guard<std::mutex> _(shm_rx_arena_mu);
+        auto it = shm_rx_arenas.upper_bound(data);
+        SCHECK(it != shm_rx_arenas.begin());
+        arena_base = (--it)->first;
+        SCHECK(data < arena_base + it->second->map_size);
+    }
+    shm_rx_arena_release(arena_base, data);
+}
+
+static constexpr uint64_t SHM_HANDOVER_STREAM = uint64_t(-1);
+// 一个包中最多的block数
+static constexpr size_t SHM_HANDOVER_BATCH = 64;
+
+size_t ShmArena::mapping_size(size_t arena_size) {
+    size_t slot_num = arena_size / SLOT_SIZE;
+    if (slot_num == 0) {
+        return 0;
+    }
+    return page_round_up(slot_num) + slot_num * SLOT_SIZE;
+}
+
+void ShmArena::attach(char* base, size_t arena_size) {
+    _base = base;
+    _slot_num = arena_size / SLOT_SIZE;
+    _flags = reinterpret_cast<std::atomic<uint8_t>*>(base);
+    _slots = base + page_round_up(_slot_num);
+    _cursor = 0;
+}
+
+size_t ShmArena::slot_num(size_t length) const {
+    return (SHM_BLOCK_HEADER + length + SLOT_SIZE - 1) / SLOT_SIZE;
+}
+
+// 从上次分配的位置开始找连续的空闲slot
+int64_t ShmArena::alloc(size_t length) {
+    size_t k = slot_num(length);
+    if (k > _slot_num) {
+        return -1;
+    }
+    size_t start = _cursor;
+    for (size_t tried = 0; tried < _slot_num;) {
+        if (start + k > _slot_num) {
+            tried += _slot_num - start;
+            start = 0;
+            continue;
+        }
+        size_t j = 0;
+        while (j < k && _flags[start + j].load(std::memory_order_acquire) == 0) {
+            ++j;
+        }
+        if (j == k) {
+            for (j = 0; j < k; ++j) {
+                _flags[start + j].store(1, std::memory_order_relaxed);
+            }
+            _cursor = (start + k) % _slot_num;
+            char* block = _slots + start * SLOT_SIZE;
+            auto* hdr = reinterpret_cast<shm_block_header_t*>(block);
+            hdr->slot_num = k;
+            return block + SHM_BLOCK_HEADER - _base;
+        }
+        tried += j + 1;
+        start += j + 1;
+    }
+    return -1;
+}
+
+bool ShmArena::valid_block(uint64_t offset, uint64_t length) const {
+    uint64_t begin = _slots - _base;
+    if (offset < begin + SHM_BLOCK_HEADER
+          || (offset - begin - SHM_BLOCK_HEADER) % SLOT_SIZE != 0) {
+        return false;
+    }
+    size_t first = (offset - begin - SHM_BLOCK_HEADER) / SLOT_SIZE;
+    size_t k = slot_num(length);
+    auto* hdr = reinterpret_cast<const shm_block_header_t*>(_base + offset - SHM_BLOCK_HEADER);
+    return first + k <= _slot_num && hdr->slot_num == k;
+}
+
+void ShmArena::free(char* data) {
+    char* block = data - SHM_BLOCK_HEADER;
+    size_t first = (block - _slots) / SLOT_SIZE;
+    // 已经在收到时检查过
+    size_t k = reinterpret_cast<shm_block_header_t*>(block)->slot_num;
+    for (size_t j = 0; j < k; ++j) {
+        _flags[first + j].store(0, std::memory_order_release);
+    }
+}
+
+// connect一方在TCP握手之后发送
+struct shm_hello_t {
+    // 0表示不在本机或不支持，之后继续用TCP
+    int64_t local = 0;
+    int64_t handover_size = 0;
+    // abstract unix socket的名字
+    char name[64] = {};
+};
+
+static socklen_t shm_unix_addr(const char* name, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    // sun_path[0]为'\0'，不在文件系统中留下文件
+    size_t len = std::min(strlen(name), sizeof(addr.sun_path) - 1);
+    memcpy(addr.sun_path + 1, name, len);
+    return offsetof(sockaddr_un, sun_path) + 1 + len;
+}
+
+static bool poll_fd(int fd, short events, int timeout_ms) {
+    pollfd pfd = {fd, events, 0};
+    for (;;) {
+        int ret = ::poll(&pfd, 1, timeout_ms);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        return ret > 0 && (pfd.revents & events);
+    }
+}
+
+static ssize_t shm_send_fds(int sock, void* data, size_t size,
+      const int* fds, int nfds, int flags) {
+    iovec iov = {data, size};
+    char control[CMSG_SPACE(sizeof(int) * 8)] = {};
+    SCHECK(nfds <= 8);
+    msghdr hdr = {};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    return retry_eintr_call(::sendmsg, sock, &hdr, flags | MSG_NOSIGNAL);
+}
+
+// nfds传入最多接收的个数，返回实际收到的个数
+static ssize_t shm_recv_fds(int sock, void* data, size_t size,
+      int* fds, int& nfds, int flags) {
+    iovec iov = {data, size};
+    char control[CMSG_SPACE(sizeof(int) * 8)] = {};
+    SCHECK(nfds <= 8);
+    msghdr hdr = {};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    ssize_t ret = retry_eintr_call(::recvmsg, sock, &hdr, flags | MSG_CMSG_CLOEXEC);
+    int max_fds = nfds;
+    nfds = 0;
+    if (ret <= 0) {
+        return ret;
+    }
+    for (cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (nfds < max_fds) {
+                fds[nfds++] = fd;
+            } else {
+                ::close(fd);
+            }
+        }
+    }
+    return ret;
+}
+
+size_t ShmRing::mapping_size(size_t capacity) {
+    return page_round_up(sizeof(header_t) + capacity);
+}
+
+void ShmRing::attach(char* base, size_t capacity, int data_efd, int space_efd) {
+    SCHECK((capacity & (capacity - 1)) == 0) << capacity;
+    _hdr = reinterpret_cast<header_t*>(base);
+    _data = base + sizeof(header_t);
+    _capacity = capacity;
+    _data_efd = data_efd;
+    _space_efd = space_efd;
+}
+
+size_t ShmRing::write(const char* ptr, size_t size) {
+    uint64_t head = _hdr->head.load(std::memory_order_relaxed);
+    uint64_t tail = _hdr->tail.load(std::memory_order_acquire);
+    size_t n = std::min<size_t>(size, _capacity - (head - tail));
+    size_t pos = head & (_capacity - 1);
+    size_t n1 = std::min(n, _capacity - pos);
+    memcpy(_data + pos, ptr, n1);
+    memcpy(_data, ptr + n1, n - n1);
+    _hdr->head.store(head + n, std::memory_order_release);
+    return n;
+}
+
+size_t ShmRing::read(char* ptr, size_t size) {
+    uint64_t tail = _hdr->tail.load(std::memory_order_relaxed);
+    uint64_t head = _hdr->head.load(std::memory_order_acquire);
+    size_t n = std::min<size_t>(size, head - tail);
+    size_t pos = tail & (_capacity - 1);
+    size_t n1 = std::min(n, _capacity - pos);
+    memcpy(ptr, _data + pos, n1);
+    memcpy(ptr + n1, _data, n - n1);
+    _hdr->tail.store(tail + n, std::memory_order_release);
+    return n;
+}
+
+void ShmRing::notify_reader() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_hdr->reader_waiting.load(std::memory_order_relaxed)
+          && _hdr->reader_waiting.exchange(0, std::memory_order_relaxed)) {
+        uint64_t one = 1;
+        retry_eintr_call(::write, _data_efd, &one, sizeof(one));
+    }
+}
+
+void ShmRing::notify_writer() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_hdr->writer_waiting.load(std::memory_order_relaxed)
+          && _hdr->writer_waiting.exchange(0, std::memory_order_relaxed)) {
+        uint64_t cnt;
+        // 计数清零后space_efd重新可写
+        retry_eintr_call(::read, _space_efd, &cnt, sizeof(cnt));
+    }
+}
+
+bool ShmRing::recheck_readable() {
+    _hdr->reader_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_hdr->head.load(std::memory_order_acquire)
+          == _hdr->tail.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    _hdr->reader_waiting.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+bool ShmRing::recheck_writable() {
+    // eventfd计数的上限，写满后不可写；已经是满的时候返回EAGAIN
+    uint64_t full = 0xfffffffffffffffeULL;
+    retry_eintr_call(::write, _space_efd, &full, sizeof(full));
+    _hdr->writer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t head = _hdr->head.load(std::memory_order_relaxed);
+    if (head - _hdr->tail.load(std::memory_order_acquire) == _capacity) {
+        return false;
+    }
+    _hdr->writer_waiting.store(0, std::memory_order_relaxed);
+    uint64_t cnt;
+    retry_eintr_call(::read, _space_efd, &cnt, sizeof(cnt));
+    return true;
+}
+
+ShmSocket::~ShmSocket() {
+    _handover_blocks.clear();
+    if (_shm_base) {
+        PSCHECK(::munmap(_shm_base, _shm_size) == 0);
+    }
+    if (_tx_arena.base()) {
+        PSCHECK(::munmap(_tx_arena.base(), _arena_map_size) == 0);
+    }
+    if (_rx_arena.base()) {
+        shm_rx_arena_release(_rx_arena.base(), nullptr);
+    }
+    for (int efd : _efds) {
+        if (efd != -1) {
+            PSCHECK(::close(efd) == 0);
+        }
+    }
+    if (_unix_fd != -1) {
+        PSCHECK(::close(_unix_fd) == 0);
+    }
+}
+
+// 本机的连接两端地址相同，或者连的是loopback
+bool ShmSocket::is_local_peer() {
+    sockaddr_in local_addr, peer_addr;
+    socklen_t len = sizeof(local_addr);
+    if (getsockname(_fd, (sockaddr*)&local_addr, &len) != 0) {
+        return false;
+    }
+    len = sizeof(peer_addr);
+    if (getpeername(_fd, (sockaddr*)&peer_addr, &len) != 0) {
+        return false;
+    }
+    return local_addr.sin_addr.s_addr == peer_addr.sin_addr.s_addr
+           || (ntohl(peer_addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+int ShmSocket::handshake_timeout_ms() {
+    if (_tcp_config.connect_timeout >= 0) {
+        return _tcp_config.connect_timeout * 1000;
+    }
+    return 60000;
+}
+
+bool ShmSocket::connect(const std::string& endpoint,
+      const std::string& info,
+      int64_t magic) {
+    if (!TcpSocket::connect(endpoint, info, magic)) {
+        return false;
+    }
+    shm_hello_t hello;
+    int listen_fd = -1;
+    if (is_local_peer()) {
+        // 名字只通过TCP连接告诉对方，本机的其他进程猜不到
+        std::random_device rd;
+        snprintf(hello.name, sizeof(hello.name), "pico_shm_%08x%08x%08x%08x",
+              rd(), rd(), rd(), rd());
+        listen_fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        PSCHECK(listen_fd >= 0);
+        sockaddr_un addr;
+        socklen_t len = shm_unix_addr(hello.name, addr);
+        if (::bind(listen_fd, (sockaddr*)&addr, len) == 0 && ::listen(listen_fd, 1) == 0) {
+            hello.local = 1;
+            hello.handover_size = std::max<size_t>(
+                  _shm_config.handover_size, MIN_ZERO_COPY_SIZE);
+        } else {
+            PSLOG(WARNING) << "bind unix socket failed, fall back to tcp. " << endpoint;
+        }
+    }
+    if (retry_eintr_call(::send, _fd, &hello, sizeof(hello), MSG_NOSIGNAL)
+          != sizeof(hello)) {
+        PSLOG(WARNING) << "send shm hello failed. " << endpoint;
+        if (listen_fd != -1) {
+            ::close(listen_fd);
+        }
+        return false;
+    }
+    if (!hello.local) {
+        if (listen_fd != -1) {
+            ::close(listen_fd);
+        }
+        return true;
+    }
+
+    int64_t ack = 0;
+    if (!poll_fd(_fd, POLLIN, handshake_timeout_ms())
+          || retry_eintr_call(::recv, _fd, &ack, sizeof(ack), MSG_NOSIGNAL | MSG_WAITALL)
+          != sizeof(ack)) {
+        PSLOG(WARNING) << "recv shm ack failed. " << endpoint;
+        ::close(listen_fd);
+        return false;
+    }
+    if (ack != 1) {
+        SLOG(WARNING) << "peer can not connect unix socket, fall back to tcp. " << endpoint;
+        ::close(listen_fd);
+        return true;
+    }
+    // 对方已经connect，不会等待
+    if (poll_fd(listen_fd, POLLIN, handshake_timeout_ms())) {
+        _unix_fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    }
+    ::close(listen_fd);
+    if (_unix_fd == -1) {
+        PSLOG(WARNING) << "accept unix socket failed. " << endpoint;
+        return false;
+    }
+    // 共享内存只交给同一个用户的进程
+    ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (::getsockopt(_unix_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0
+          || cred.uid != ::getuid()) {
+        PSLOG(WARNING) << "unix socket peer is not the same user. " << endpoint;
+        return false;
+    }
+    _handover_size = hello.handover_size;
+    return create_shm();
+}
+
+bool ShmSocket::accept(std::string& info) {
+    if (!TcpSocket::accept(info)) {
+        return false;
+    }
+    shm_hello_t hello;
+    if (retry_eintr_call(::recv, _fd, &hello, sizeof(hello), MSG_NOSIGNAL | MSG_WAITALL)
+          != sizeof(hello)) {
+        SLOG(WARNING) << "recv shm hello error";
+        return false;
+    }
+    if (!hello.local) {
+        return true;
+    }
+    hello.name[sizeof(hello.name) - 1] = '\0';
+    int64_t ack = 0;
+    _unix_fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    PSCHECK(_unix_fd >= 0);
+    sockaddr_un addr;
+    socklen_t len = shm_unix_addr(hello.name, addr);
+    if (retry_eintr_call(::connect, _unix_fd, (sockaddr*)&addr, len) == 0) {
+        ack = 1;
+    } else {
+        // 例如在不同的network namespace中
+        PSLOG(WARNING) << "connect unix socket failed, fall back to tcp. " << hello.name;
+        ::close(_unix_fd);
+        _unix_fd = -1;
+    }
+    if (retry_eintr_call(::send, _fd, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack)) {
+        PSLOG(WARNING) << "send shm ack failed";
+        return false;
+    }
+    if (ack != 1) {
+        return true;
+    }
+    _handover_size = hello.handover_size;
+    return receive_shm();
+}
+
+/*
+ * 一个memfd中依次放ring0, ring1, arena0, arena1，ring0和arena0由connect一方写，另外两个由accept一方写
+ * efds: ring0的data, space，ring1的data, space
+ */
+bool ShmSocket::create_shm() {
+    size_t capacity = 4096;
+    while (capacity < _shm_config.ring_size) {
+        capacity <<= 1;
+    }
+    size_t arena_size = _shm_config.handover_arena_size;
+    int memfd = shm_memfd_create("pico_shm_ring");
+    if (memfd == -1) {
+        PSLOG(WARNING) << "memfd_create failed";
+        return false;
+    }
+    if (::ftruncate(memfd, 2 * ShmRing::mapping_size(capacity)
+              + 2 * ShmArena::mapping_size(arena_size)) != 0) {
+        PSLOG(WARNING) << "ftruncate memfd failed";
+        ::close(memfd);
+        return false;
+    }
+    for (int& efd : _efds) {
+        efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        PSCHECK(efd >= 0);
+    }
+    bool ok = map_shm(memfd, capacity, arena_size, _efds, true);
+    if (ok) {
+        int fds[5] = {memfd, _efds[0], _efds[1], _efds[2], _efds[3]};
+        uint64_t sizes[2] = {capacity, arena_size};
+        ok = shm_send_fds(_unix_fd, sizes, sizeof(sizes), fds, 5, 0) == sizeof(sizes);
+        if (!ok) {
+            PSLOG(WARNING) << "send shm fds failed";
+        }
+    }
+    ::close(memfd);
+    return ok;
+}
+
+bool ShmSocket::receive_shm() {
+    if (!poll_fd(_unix_fd, POLLIN, handshake_timeout_ms())) {
+        SLOG(WARNING) << "recv shm fds timeout";
+        return false;
+    }
+    uint64_t sizes[2] = {0, 0};
+    int fds[5];
+    int nfds = 5;
+    ssize_t ret = shm_recv_fds(_unix_fd, sizes, sizeof(sizes), fds, nfds, 0);
+    if (ret != sizeof(sizes) || nfds != 5) {
+        PSLOG(WARNING) << "recv shm fds failed";
+        for (int i = 0; i < nfds; ++i) {
+            ::close(fds[i]);
+        }
+        return false;
+    }
+    std::copy(fds + 1, fds + 5, _efds);
+    bool ok = map_shm(fds[0], sizes[0], sizes[1], _efds, false);
+    ::close(fds[0]);
+    return ok;
+}
+
+bool ShmSocket::map_shm(int memfd, size_t capacity, size_t arena_size,
+      const int* efds, bool connector) {
+    size_t ring_size = ShmRing::mapping_size(capacity);
+    void* ptr = ::mmap(nullptr, 2 * ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (ptr == MAP_FAILED) {
+        PSLOG(WARNING) << "mmap shm ring failed";
+        return false;
+    }
+    _shm_base = static_cast<char*>(ptr);
+    _shm_size = 2 * ring_size;
+    // block区分开映射，接收方的映射可能比socket活得久
+    _arena_map_size = ShmArena::mapping_size(arena_size);
+    if (_arena_map_size) {
+        off_t arena0 = 2 * ring_size;
+        off_t arena1 = arena0 + _arena_map_size;
+        void* tx = ::mmap(nullptr, _arena_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+              memfd, connector ? arena0 : arena1);
+        void* rx = ::mmap(nullptr, _arena_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+              memfd, connector ? arena1 : arena0);
+        if (tx == MAP_FAILED || rx == MAP_FAILED) {
+            PSLOG(WARNING) << "mmap shm arena failed";
+            for (void* p : {tx, rx}) {
+                if (p != MAP_FAILED) {
+                    PSCHECK(::munmap(p, _arena_map_size) == 0);
+                }
+            }
+            return false;
+        }
+        _tx_arena.attach(static_cast<char*>(tx), arena_size);
+        _rx_arena.attach(static_cast<char*>(rx), arena_size);
+        shm_rx_arena_register(_rx_arena, _arena_map_size);
+    } else {
+        // 没有block区时大block都跟在消息后面写进环，不用交出标记
+        _handover_size = SIZE_MAX;
+    }
+    char* ring0 = _shm_base;
+    char* ring1 = _shm_base + ring_size;
+    if (connector) {
+        for (char* base : {ring0, ring1}) {
+            auto* hdr = new (base) ShmRing::header_t();
+            // 读的一方还没有开始，第一次写入时需要唤醒
+            hdr->reader_waiting.store(1, std::memory_order_relaxed);
+        }
+    }
+    (connector ? _tx : _rx).attach(ring0, capacity, efds[0], efds[1]);
+    (connector ? _rx : _tx).attach(ring1, capacity, efds[2], efds[3]);
+
+    // 环中的字节流与单连接TCP相同，只是大block不在其中
+    _shm = true;
+    _single_connection = true;
+    _zero_copy = false;
+    // 握手已经完成，之后只用共享内存和unix socket
+    if (_fd2 != -1) {
+        PSCHECK(::close(_fd2) == 0);
+        _fd2 = -1;
+    }
+    if (_fd != -1) {
+        PSCHECK(::close(_fd) == 0);
+        _fd = -1;
+    }
+    return true;
+}
+
+bool ShmSocket::has_handover(RpcMessage::byte_cursor& it2) {
+    for (size_t k = std::max(it2._i, it2._handover); k < it2._cur.size(); ++k) {
+        if (it2._cur[k].second >= _handover_size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<int> ShmSocket::blocked_fds(RpcMessage::byte_cursor& it1,
+      RpcMessage::byte_cursor& it2) {
+    if (!_shm) {
+        return TcpSocket::blocked_fds(it1, it2);
+    }
+    if (!_unsent_handover.empty() || has_handover(it2)) {
+        return {_unix_fd};
+    }
+    return {_tx.space_efd()};
+}
+
+/*
+ * 在环中的消息之前交出，能放进block区的只拷贝一次，位置成批发出；
+ * 放不下的只发出标记，block留在it2中跟在消息后面写进环，不会等对方释放block区
+ */
+bool ShmSocket::handover(RpcMessage::byte_cursor& it2, bool nonblock, bool& blocked) {
+    for (size_t k = std::max(it2._i, it2._handover); k < it2._cur.size(); ++k) {
+        auto& seg = it2._cur[k];
+        if (seg.second < _handover_size) {
+            continue;
+        }
+        int64_t offset = _tx_arena.alloc(seg.second);
+        if (offset >= 0) {
+            memcpy(_tx_arena.base() + offset, seg.first, seg.second);
+            _unsent_handover.push_back({seg.second, uint64_t(offset)});
+            seg.second = 0;
+        } else {
+            _unsent_handover.push_back({seg.second, SHM_HANDOVER_STREAM});
+        }
+    }
+    it2._handover = it2._cur.size();
+    return send_handover(nonblock, blocked);
+}
+
+bool ShmSocket::send_handover(bool nonblock, bool& blocked) {
+    size_t sent = 0;
+    while (sent < _unsent_handover.size()) {
+        size_t n = std::min(SHM_HANDOVER_BATCH, _unsent_handover.size() - sent);
+        size_t size = n * sizeof(handover_t);
+        // SOCK_SEQPACKET，一个包要么整个发出要么不发
+        ssize_t ret = retry_eintr_call(::send, _unix_fd, &_unsent_handover[sent], size,
+              MSG_NOSIGNAL | (nonblock ? MSG_DONTWAIT : 0));
+        if (ret == -1 && nonblock && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            errno = 0;
+            blocked = true;
+            break;
+        }
+        if (ret != ssize_t(size)) {
+            PSLOG(WARNING) << "shm block handover failed";
+            return false;
+        }
+        sent += n;
+    }
+    _unsent_handover.erase(_unsent_handover.begin(), _unsent_handover.begin() + sent);
+    return true;
+}
+
+bool ShmSocket::recv_handover() {
+    for (;;) {
+        handover_t records[SHM_HANDOVER_BATCH];
+        ssize_t n = retry_eintr_call(::recv, _unix_fd, records, sizeof(records), MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            errno = 0;
+            return true;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                SLOG(INFO) << "peer close.";
+            } else {
+                PSLOG(ERROR) << "recv error." << _unix_fd;
+            }
+            return false;
+        }
+        if (n % sizeof(handover_t) != 0) {
+            SLOG(ERROR) << "bad shm block handover " << n;
+            set_recv_corrupted();
+            return false;
+        }
+        for (size_t i = 0; i < n / sizeof(handover_t); ++i) {
+            const handover_t& r = records[i];
+            if (r.length > UINT32_MAX) {
+                SLOG(ERROR) << "bad shm block length " << r.length;
+                set_recv_corrupted();
+                return false;
+            }
+            if (r.offset == SHM_HANDOVER_STREAM) {
+                _handover_blocks.emplace_back(nullptr, static_cast<uint32_t>(r.length));
+                continue;
+            }
+            if (!_arena_map_size || !_rx_arena.valid_block(r.offset, r.length)) {
+                SLOG(ERROR) << "bad shm arena block " << r.offset << " " << r.length;
+                set_recv_corrupted();
+                return false;
+            }
+            shm_rx_arena_acquire(_rx_arena.base());
+            _handover_blocks.emplace_back(_rx_arena.base() + r.offset,
+                  static_cast<uint32_t>(r.length));
+            _handover_blocks.back().deleter.owner = 2;
+        }
+    }
+}
+
+/*
+ * 发送方在写入消息之前交出block，所以解析到消息时block一定已经在unix socket中
+ */
+bool ShmSocket::attach_handover(RpcMessage& msg) {
+    for (auto& block : msg._data) {
+        if (block.length < _handover_size) {
+            continue;
+        }
+        if (_handover_blocks.empty()) {
+            recv_handover();
+        }
+        if (_handover_blocks.empty() || _handover_blocks.front().length != block.length) {
+            SLOG(ERROR) << "shm block handover lost. " << *msg.head();
+            return false;
+        }
+        // 标记表示block仍然在环中，留给next_pending_block读入
+        if (_handover_blocks.front().data) {
+            uint16_t codec = block.codec;
+            block = std::move(_handover_blocks.front());
+            block.codec = codec;
+        }
+        _handover_blocks.pop_front();
+    }
+    return true;
+}
+
+bool ShmSocket::recv_ring(std::function<void(RpcMessage&&)>& func) {
+    auto stash_func = stash_pending(func);
+    std::function<void(RpcMessage&&)> tcp_func = [this, &stash_func](RpcMessage&& msg) {
+        if (msg.head()->extra_block_count != 0 && !attach_handover(msg)) {
+            set_recv_corrupted();
+            return;
+        }
+        stash_func(std::move(msg));
+    };
+    for (;;) {
+        char* ptr;
+        size_t size;
+        std::tie(ptr, size) = single_recv_progress(func, tcp_func);
+        if (_broken || _recv_corrupted) {
+            return false;
+        }
+        size_t n = _rx.read(ptr, size);
+        if (n == 0) {
+            if (_rx.recheck_readable()) {
+                continue;
+            }
+            return true;
+        }
+        _rx.notify_writer();
+        if (ptr == _buffer.cursor) {
+            _buffer.cursor += n;
+        } else {
+            pending_received(n);
+        }
+    }
+}
+
+bool ShmSocket::handle_event(int fd, std::function<void(RpcMessage&&)> func) {
+    if (!_shm) {
+        return TcpSocket::handle_event(fd, func);
+    }
+    if (fd == _rx.data_efd()) {
+        uint64_t cnt;
+        // eventfd是非阻塞的，计数可能已经被上一轮读掉
+        retry_eintr_call(::read, fd, &cnt, sizeof(cnt));
+    } else {
+        SCHECK(fd == _unix_fd) << fd << " " << _unix_fd;
+    }
+    // 对方关闭之前写进环中的消息仍然交付
+    bool alive = recv_handover();
+    if (!recv_ring(func)) {
+        return false;
+    }
+    return alive;
+}
+
+bool ShmSocket::wait_writable() {
+    // events为0时仍然会报告POLLHUP，对方关闭时不会一直等下去
+    pollfd pfds[2] = {{_tx.space_efd(), POLLOUT, 0}, {_unix_fd, 0, 0}};
+    for (;;) {
+        int ret = ::poll(pfds, 2, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PSLOG(WARNING) << "poll shm space failed";
+            return false;
+        }
+        if (pfds[1].revents & (POLLHUP | POLLERR)) {
+            SLOG(WARNING) << "shm peer closed while sending";
+            return false;
+        }
+        if (pfds[0].revents & POLLOUT) {
+            return true;
+        }
+    }
+}
+
+/*
+ * 与单连接TcpSocket相同，it1之后紧跟it2，nonblock时发不完的部分留在it1/it2中
+ * 大block在消息之前交出，对应的段置空，之后跳过
+ */
+bool ShmSocket::send_cursors(bool nonblock,
+      bool more,
+      RpcMessage::byte_cursor& it1,
+      RpcMessage::byte_cursor& it2) {
+    if (!_shm) {
+        return TcpSocket::send_cursors(nonblock, more, it1, it2);
+    }
+    bool blocked = false;
+    if (!handover(it2, nonblock, blocked)) {
+        return false;
+    }
+    if (blocked) {
+        return true;
+    }
+    for (auto* it : {&it1, &it2}) {
+        while (it->has_next()) {
+            auto seg = it->head();
+            if (seg.second == 0) {
+                it->next();
+                continue;
+            }
+            size_t n = _tx.write(seg.first, seg.second);
+            if (n > 0) {
+                it->advance(n);
+                continue;
+            }
+            // 环满，先让对方开始读
+            _tx.notify_reader();
+            if (_tx.recheck_writable()) {
+                continue;
+            }
+            if (nonblock) {
+                return true;
+            }
+            if (!wait_writable()) {
+                return false;
+            }
+        }
+    }
+    _tx.notify_reader();
+    return true;
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
@@ -0,0 +1,244 @@
+#ifndef PARADIGM4_PICO_CORE_SHM_SOCKET_H
+#define PARADIGM4_PICO_CORE_SHM_SOCKET_H
+
+#include <atomic>
+
+#include "RpcSocket.h"
+#include "TcpSocket.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+struct ShmConfig {
+    ShmConfig() = default;
+
+    template<typename T>
+    ShmConfig(const T& o) {
+        PICO_CONFIG_COPY_FIELD(o, ring_size);
+        PICO_CONFIG_COPY_FIELD(o, handover_size);
+        PICO_CONFIG_COPY_FIELD(o, handover_arena_size);
+    }
+
+    // 每个方向的环形缓冲区大小，向上取整到2的幂，由connect一方决定
+    size_t ring_size = 2 << 20;
+    // 不小于这个大小的block不经过环形缓冲区，拷贝进共享的block区后把位置交给对方
+    size_t handover_size = 1 << 20;
+    // 每个方向的block区大小，由connect一方决定；放不下时block跟在消息后面写进环，0表示总是这样
+    size_t handover_arena_size = 32 << 20;
+};
+
+/*
+ * 放在共享内存中的单生产者单消费者字节环
+ * head/tail单调递增，取模后是位置
+ * 每个方向两个eventfd:
+ *   data: 消费者登记reader_waiting后睡眠，生产者写入后唤醒
+ *   space: 环满时生产者把计数写满使其不可写，消费者读出后变为可写(EPOLLOUT)
+ */
+class ShmRing {
+public:
+    struct header_t {
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) std::atomic<uint32_t> reader_waiting;
+        alignas(64) std::atomic<uint32_t> writer_waiting;
+    };
+
+    static size_t mapping_size(size_t capacity);
+
+    void attach(char* base, size_t capacity, int data_efd, int space_efd);
+
+    int data_efd() const {
+        return _data_efd;
+    }
+
+    int space_efd() const {
+        return _space_efd;
+    }
+
+    // 生产者，返回写入的字节数
+    size_t write(const char* ptr, size_t size);
+
+    // 消费者，返回读出的字节数
+    size_t read(char* ptr, size_t size);
+
+    // 生产者写入后调用
+    void notify_reader();
+
+    // 消费者读出后调用
+    void notify_writer();
+
+    // 消费者没有数据可读时调用，登记后仍然没有数据返回false，之后data_efd会被唤醒
+    bool recheck_readable();
+
+    // 生产者环满时调用，登记后仍然是满的返回false，之后space_efd会变为可写
+    bool recheck_writable();
+
+private:
+    header_t* _hdr = nullptr;
+    char* _data = nullptr;
+    size_t _capacity = 0;
+    int _data_efd = -1;
+    int _space_efd = -1;
+};
+
+/*
+ * 共享内存中的block区，由写环的一方分配，读的一方用完block后释放
+ * 开头是每个slot一个字节的占用标志，之后是SLOT_SIZE大小的slot，
+ * 一个block占用连续的slot，第一个slot开头的SHM_BLOCK_HEADER字节是block头
+ */
+class ShmArena {
+public:
+    static constexpr size_t SLOT_SIZE = 64 * 1024;
+
+    static size_t mapping_size(size_t arena_size);
+
+    void attach(char* base, size_t arena_size);
+
+    char* base() const {
+        return _base;
+    }
+
+    // 发送方，同一时间只有一个线程调用；返回data相对base的偏移，放不下时返回-1
+    int64_t alloc(size_t length);
+
+    // 接收方，对方交来的(offset, length)是否是一个完整的block
+    bool valid_block(uint64_t offset, uint64_t length) const;
+
+    // 接收方，释放data所在的block
+    void free(char* data);
+
+private:
+    size_t slot_num(size_t length) const;
+
+    char* _base = nullptr;
+    std::atomic<uint8_t>* _flags = nullptr;
+    char* _slots = nullptr;
+    size_t _slot_num = 0;
+    size_t _cursor = 0;
+};
+
+/*
+ * 同一台机器上的rank之间走共享内存，其他情况与TcpSocket相同
+ * 握手沿用TcpSocket，之后connect一方判断对端是否在本机:
+ *   在本机时通过abstract unix socket把memfd和eventfd交给对方，之后关闭TCP连接，
+ *   unix socket的名字是随机的，accept时检查对方的uid，
+ *   消息和小于handover_size的block与单连接TCP一样按序写进环形缓冲区，
+ *   大block拷贝进共享的block区，在消息之前通过unix socket成批交出位置，对方直接使用；
+ *   block区放不下时只交出一个标记，block与单连接TCP一样跟在消息后面写进环
+ * unix socket同时用于发现对端断开
+ */
+class ShmSocket : public TcpSocket {
+public:
+    ShmSocket() : TcpSocket() {}
+
+    ShmSocket(int fd) : TcpSocket(fd) {}
+
+    ~ShmSocket();
+
+    static void set_shm_config(const ShmConfig& config) {
+        _shm_config = config;
+    }
+
+    bool connect(const std::string& endpoint, const std::string& info, int64_t magic) override;
+
+    bool accept(std::string& info) override;
+
+    std::vector<int> fds() override {
+        if (!_shm) {
+            return TcpSocket::fds();
+        }
+        return {_rx.data_efd(), _unix_fd};
+    }
+
+    std::vector<int> send_fds() override {
+        if (!_shm) {
+            return TcpSocket::send_fds();
+        }
+        return {_unix_fd, _tx.space_efd()};
+    }
+
+    std::vector<int> blocked_fds(RpcMessage::byte_cursor& it1,
+          RpcMessage::byte_cursor& it2) override;
+
+    bool handle_event(int fd, std::function<void(RpcMessage&&)> func) override;
+
+protected:
+    bool send_cursors(bool nonblock,
+          bool more,
+          RpcMessage::byte_cursor& it1,
+          RpcMessage::byte_cursor& it2) override;
+
+    // 交出的block已经由attach_handover换成共享内存中的block
+    bool pending_in_stream(const data_block_t& block) override {
+        return TcpSocket::pending_in_stream(block) && block.deleter.owner != 2;
+    }
+
+private:
+    bool is_local_peer();
+
+    int handshake_timeout_ms();
+
+    // 握手完成后，connect一方创建共享内存并交给对方
+    bool create_shm();
+
+    bool receive_shm();
+
+    bool map_shm(int memfd, size_t capacity, size_t arena_size, const int* efds, bool connector);
+
+    // it2中还没有处理的大block
+    bool has_handover(RpcMessage::byte_cursor& it2);
+
+    // 把it2中的大block交给对方，nonblock时unix socket不可写则设置blocked，没发出的位置留到下次
+    bool handover(RpcMessage::byte_cursor& it2, bool nonblock, bool& blocked);
+
+    // 发出_unsent_handover，nonblock时unix socket不可写则设置blocked
+    bool send_handover(bool nonblock, bool& blocked);
+
+    // 收下对方交来的所有block，对方关闭时返回false
+    bool recv_handover();
+
+    // 把消息中的大block换成对方交来的block
+    bool attach_handover(RpcMessage& msg);
+
+    bool recv_ring(std::function<void(RpcMessage&&)>& func);
+
+    // 阻塞等待_tx有空间，对方关闭时返回false
+    bool wait_writable();
+
+    bool _shm = false;
+    bool _broken = false;
+    int _unix_fd = -1;
+    int _efds[4] = {-1, -1, -1, -1};
+    char* _shm_base = nullptr;
+    size_t _shm_size = 0;
+    size_t _handover_size = 0;
+    ShmRing _tx, _rx;
+    // 0表示没有block区
+    size_t _arena_map_size = 0;
+    ShmArena _tx_arena, _rx_arena;
+    // 通过unix socket交出的block，offset为SHM_HANDOVER_STREAM时block跟在消息后面写进环
+    struct handover_t {
+        uint64_t length;
+        uint64_t offset;
+    };
+    // 已经决定交出但还没有发出的记录，必须在环中的消息之前发出
+    pico::core::vector<handover_t> _unsent_handover;
+    // data为nullptr的是跟在消息后面写进环的block
+    pico::core::deque<data_block_t> _handover_blocks;
+
+    static ShmConfig _shm_config;
+};
+
+class ShmAcceptor : public TcpAcceptor {
+public:
+    std::unique_ptr<RpcSocket> accept() override {
+        return std::make_unique<ShmSocket>(accept_fd());
+    }
+};
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_SHM_SOCKET_H
@@ -29,7 +29,7 @@ AsyncReturnV<RpcResponse> TcpMasterClient::send_request(RpcRequest&& req) {
 bool TcpMasterClient::initialize() {
     SLOG(INFO) << "tcp master client initialize";
     PSCHECK(_tcp_socket = std::unique_ptr<TcpSocket>(new TcpSocket()));
-    if (!_tcp_socket->connect(_master_ep, _master_ep, 0)) {
+    if (!_tcp_socket->connect(_master_ep, _master_ep, RPC_WIRE_VERSION)) {
         SLOG(WARNING) << "connect to master failed!";
         return false;
     }
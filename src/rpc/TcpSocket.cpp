@@ -1,7 +1,10 @@
 #include "TcpSocket.h"
 #include <arpa/inet.h>
+#include <atomic>
 #include <chrono>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/errqueue.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <poll.h>
@@ -11,10 +14,28 @@
 #include <thread>
 #include <unistd.h>
 
+// 旧版本glibc没有这些定义
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
 namespace paradigm4 {
 namespace pico {
 namespace core {
 
+constexpr size_t TcpSocket::MAX_SEND_BATCH;
 TcpConfig TcpSocket::_tcp_config;
 bool TcpSocket::_use_tcp_config = false;
 
@@ -56,23 +77,57 @@ void TcpSocket::set_sockopt(int fd) {
                 fd, SOL_TCP, TCP_KEEPCNT, &optval, sizeof(optval))
             == 0);
     }
+    // 没有权限或者内核不支持时只影响延迟，不影响正确性，只警告一次
+    static std::atomic<bool> busy_poll_warned = {false};
+    if (_use_tcp_config && _tcp_config.busy_poll != -1) {
+        int optval = _tcp_config.busy_poll;
+        if (::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &optval, sizeof(optval)) != 0
+              && !busy_poll_warned.exchange(true)) {
+            PSLOG(WARNING) << "set SO_BUSY_POLL failed";
+        }
+    }
+    if (_use_tcp_config && _tcp_config.prefer_busy_poll) {
+        int one = 1;
+        if (::setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) != 0
+              && !busy_poll_warned.exchange(true)) {
+            PSLOG(WARNING) << "set SO_PREFER_BUSY_POLL failed";
+        }
+    }
 }
 
-bool TcpSocket::try_recv_pending(std::function<void(RpcMessage&&)> func) {
+std::pair<char*, size_t> TcpSocket::next_pending_block(
+      std::function<void(RpcMessage&&)>& func) {
     while (!_pending_msgs.empty()) {
         auto& msg = _pending_msgs.front();
-        size_t size = msg._data[_block_id].length - _recieved_size;
-        if (msg._data[_block_id].length < MIN_ZERO_COPY_SIZE || size == 0) {
+        if (_block_id == msg.head()->extra_block_count) {
+            if (!verify_recv_msg(msg)) {
+                return {nullptr, 0};
+            }
+            func(std::move(msg));
+            _pending_msgs.pop_front();
+            _block_id = 0;
+            _recieved_size = 0;
+            continue;
+        }
+        auto& block = msg._data[_block_id];
+        if (!pending_in_stream(block) || _recieved_size == block.length) {
             ++_block_id;
             _recieved_size = 0;
-            if (_block_id == msg.head()->extra_block_count) {
-                func(std::move(msg));
-                _pending_msgs.pop_front();
-                _block_id = 0;
-            }
             continue;
         }
-        char* ptr = msg._data[_block_id].data + _recieved_size;
+        return {block.data + _recieved_size, block.length - _recieved_size};
+    }
+    return {nullptr, 0};
+}
+
+bool TcpSocket::try_recv_pending(std::function<void(RpcMessage&&)> func) {
+    for (;;) {
+        char* ptr;
+        size_t size;
+        std::tie(ptr, size) = next_pending_block(func);
+        if (ptr == nullptr) {
+            return !_recv_corrupted;
+        }
         int ret = retry_eintr_call(
               ::recv, _fd2, ptr, size, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (ret <= 0) {
@@ -82,12 +137,76 @@ bool TcpSocket::try_recv_pending(std::function<void(RpcMessage&&)> func) {
                 return false;
             }
         } else {
-            _recieved_size += ret;
+            pending_received(ret);
         }
     }
     return true;
 }
 
+/*
+ * 单连接时大block紧跟在所属消息之后，
+ * 已经读进_buffer的部分拷贝过去，其余的直接recv进block
+ */
+std::pair<char*, size_t> TcpSocket::single_recv_progress(
+      std::function<void(RpcMessage&&)>& func,
+      std::function<void(RpcMessage&&)>& tcp_func) {
+    for (;;) {
+        char* ptr;
+        size_t size;
+        std::tie(ptr, size) = next_pending_block(func);
+        if (ptr) {
+            size_t buffered = _buffer.cursor - _buffer.msg_cursor;
+            if (buffered == 0) {
+                return {ptr, size};
+            }
+            size_t n = std::min(size, buffered);
+            std::memcpy(ptr, _buffer.msg_cursor, n);
+            _buffer.msg_cursor += n;
+            pending_received(n);
+            continue;
+        }
+        dispatch_recv_buffer(tcp_func);
+        if (_recv_corrupted) {
+            return {nullptr, 0};
+        }
+        if (_pending_msgs.empty()) {
+            reserve_recv_buffer();
+            return {_buffer.cursor, _buffer.avaliable_size()};
+        }
+    }
+}
+
+bool TcpSocket::try_recv_single(std::function<void(RpcMessage&&)> func) {
+    auto tcp_func = stash_pending(func);
+    for (;;) {
+        char* ptr;
+        size_t size;
+        std::tie(ptr, size) = single_recv_progress(func, tcp_func);
+        if (ptr == nullptr) {
+            return false;
+        }
+        ssize_t n = retry_eintr_call(
+              ::recv, _fd, ptr, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            errno = 0;
+            return true;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                SLOG(INFO) << "peer close.";
+            } else {
+                PSLOG(ERROR) << "recv error." << _fd;
+            }
+            return false;
+        }
+        if (ptr == _buffer.cursor) {
+            _buffer.cursor += n;
+        } else {
+            pending_received(n);
+        }
+    }
+}
+
 bool TcpSocket::connect(const std::string& endpoint,
       const std::string& info,
       int64_t magic) {
@@ -118,17 +237,26 @@ bool TcpSocket::connect(const std::string& endpoint,
     socklen_t len = sizeof(sockaddr_in);
     ret = getsockname(_fd, (struct sockaddr*)&local_addr, &len);
     PSCHECK(ret == 0);
-    local_addr.sin_port = htons(0);
-
-    int accept_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
-    PSCHECK(accept_fd > 0);
-    PSCHECK(::bind(accept_fd, (struct sockaddr*)&local_addr, sizeof(local_addr)) == 0) << "bind failed.";
-    retry_eintr_call(::listen, accept_fd, 1);
-    PSCHECK(getsockname(accept_fd, (struct sockaddr*)&local_addr, &len) == 0);
 
-    //SLOG(INFO) << "temporal bind local addr is  " << inet_ntoa(local_addr.sin_addr) << ":"  << ntohs(local_addr.sin_port);
-    _endpoint = inet_ntoa(local_addr.sin_addr);
-    _endpoint += ":" + std::to_string(ntohs(local_addr.sin_port));
+    // 单连接时发送port为0的地址，accept一方据此不再反向connect
+    _single_connection = _use_tcp_config && _tcp_config.single_connection;
+    int accept_fd = -1;
+    if (_single_connection) {
+        _endpoint = inet_ntoa(local_addr.sin_addr);
+        _endpoint += ":" + std::to_string(ntohs(local_addr.sin_port));
+        local_addr.sin_port = htons(0);
+    } else {
+        local_addr.sin_port = htons(0);
+        accept_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+        PSCHECK(accept_fd > 0);
+        PSCHECK(::bind(accept_fd, (struct sockaddr*)&local_addr, sizeof(local_addr)) == 0) << "bind failed.";
+        retry_eintr_call(::listen, accept_fd, 1);
+        PSCHECK(getsockname(accept_fd, (struct sockaddr*)&local_addr, &len) == 0);
+
+        //SLOG(INFO) << "temporal bind local addr is  " << inet_ntoa(local_addr.sin_addr) << ":"  << ntohs(local_addr.sin_port);
+        _endpoint = inet_ntoa(local_addr.sin_addr);
+        _endpoint += ":" + std::to_string(ntohs(local_addr.sin_port));
+    }
 
     int64_t meta[2] = {magic, (int64_t)info.length()};
     if (retry_eintr_call(
@@ -154,6 +282,11 @@ bool TcpSocket::connect(const std::string& endpoint,
         return false;
     }
 
+    if (_single_connection) {
+        enable_zero_copy();
+        return true;
+    }
+
     int temp_flags = fcntl(accept_fd, F_GETFL);
     fcntl(accept_fd, F_SETFL, temp_flags | O_NONBLOCK);
     pollfd pfds = {accept_fd, POLLIN | POLLPRI, 0};
@@ -193,6 +326,7 @@ bool TcpSocket::connect(const std::string& endpoint,
     set_sockopt(_fd2);
     ::close(accept_fd);
 
+    enable_zero_copy();
     return true;
 }
 
@@ -211,8 +345,10 @@ bool TcpSocket::accept(std::string& info) {
     int64_t magic = meta[0];
     int64_t len = meta[1];
 
-    if (magic != 0) {
-        SLOG(WARNING) << "magic not correct. magic:" << magic << " len:" << len;
+    // 之前的版本发送0，见RPC_WIRE_VERSION
+    if (magic != RPC_WIRE_VERSION) {
+        SLOG(WARNING) << "rpc wire version mismatch, peer:" << magic
+                      << " local:" << RPC_WIRE_VERSION << " len:" << len;
         return false;
     }
 
@@ -229,6 +365,12 @@ bool TcpSocket::accept(std::string& info) {
         return false;
     }
 
+    if (addr.sin_port == 0) {
+        _single_connection = true;
+        enable_zero_copy();
+        return true;
+    }
+
     _fd2 = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
     PSCHECK(_fd2 >= 0);
     set_sockopt(_fd2);
@@ -251,9 +393,59 @@ bool TcpSocket::accept(std::string& info) {
         PSLOG(WARNING) << "connect temporal failed. sleep for " << i << " seconds.";
         ::sleep(i);
     }
+    enable_zero_copy();
     return true;
 }
 
+void TcpSocket::enable_zero_copy() {
+    if (!_use_tcp_config || !_tcp_config.zero_copy_send) {
+        return;
+    }
+    int one = 1;
+    if (::setsockopt(zero_copy_fd(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+        _zero_copy = true;
+    } else {
+        PSLOG(WARNING) << "SO_ZEROCOPY not supported, fall back to copy send";
+    }
+}
+
+/*
+ * 发送线程和io线程都会调用
+ * TCP的完成通知按序号递增到达，[ee_info, ee_data]之前的消息都可以释放
+ */
+void TcpSocket::reap_zero_copy() {
+    int fd = zero_copy_fd();
+    char control[CMSG_SPACE(sizeof(sock_extended_err)) * 4];
+    int saved_errno = errno;
+    for (;;) {
+        msghdr hdr = {};
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        if (retry_eintr_call(::recvmsg, fd, &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            break;
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            auto* serr = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cm));
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            uint32_t hi = serr->ee_data;
+            pico::core::deque<std::pair<uint32_t, RpcMessage>> done;
+            _zc_lock.lock();
+            while (!_zc_inflight.empty()
+                  && int32_t(_zc_inflight.front().first - hi) <= 0) {
+                done.push_back(std::move(_zc_inflight.front()));
+                _zc_inflight.pop_front();
+            }
+            _zc_lock.unlock();
+        }
+    }
+    errno = saved_errno;
+}
+
 ssize_t TcpSocket::recv_nonblock(char* ptr, size_t size) {
     ssize_t ret = retry_eintr_call(
           ::recv, _fd, ptr, size, MSG_NOSIGNAL | MSG_DONTWAIT);
@@ -282,39 +474,44 @@ inline int64_t _send_raw(int fd, char* ptr, size_t size, bool nonblock, bool mor
 }
 
 /*
- * 根据cursor尽可能发送
+ * 根据cursor尽可能发送，每轮把剩下的段拼成一个sendmsg
+ * zc_seq非空时以MSG_ZEROCOPY发送，每次成功的sendmsg占用一个序号
  */
-inline bool _send(int fd, RpcMessage::byte_cursor& cur, int flag) {
+inline bool _send(int fd, RpcMessage::byte_cursor& cur, int flag, uint32_t* zc_seq = nullptr) {
+    static thread_local iovec iov[IOV_MAX];
     errno = 0;
     flag |= MSG_NOSIGNAL;
+    if (zc_seq) {
+        flag |= MSG_ZEROCOPY;
+    }
     while (cur.has_next()) {
-        char* ptr;
-        size_t size;
-        std::tie(ptr, size) = cur.head();
-        size_t sent = 0;
-        for (sent = 0; sent < size;) {
-            ssize_t nbytes = retry_eintr_call(::send,
-                  fd,
-                  ptr + sent,
-                  size - sent,
-                  cur.size() > 1 ? flag | MSG_MORE : flag);
-            if (nbytes != -1) {
-                sent += nbytes;
-                cur.advance(nbytes);
-            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                //PSLOG(INFO) << "may be block. " << sent;
-                return true;
-            } else {
-                PSLOG(WARNING) << "tcp send error fd is " << fd;
-                return false;
+        msghdr hdr = {};
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = cur.fill_iovec(iov, IOV_MAX);
+        ssize_t nbytes = retry_eintr_call(::sendmsg,
+              fd,
+              &hdr,
+              cur.size() > hdr.msg_iovlen ? flag | MSG_MORE : flag);
+        if (nbytes != -1) {
+            cur.consume(nbytes);
+            if (flag & MSG_ZEROCOPY) {
+                ++*zc_seq;
             }
+        } else if (errno == ENOBUFS && (flag & MSG_ZEROCOPY)) {
+            // 超过optmem限制，剩下的部分退回普通send
+            flag &= ~MSG_ZEROCOPY;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            //PSLOG(INFO) << "may be block. ";
+            return true;
+        } else {
+            PSLOG(WARNING) << "tcp send error fd is " << fd;
+            return false;
         }
     }
     return true;
 }
 
-bool TcpSocket::send_msg(RpcMessage&,
-      bool nonblock,
+bool TcpSocket::send_cursors(bool nonblock,
       bool more,
       RpcMessage::byte_cursor& it1,
       RpcMessage::byte_cursor& it2) {
@@ -322,12 +519,27 @@ bool TcpSocket::send_msg(RpcMessage&,
     if (nonblock) {
         flag |= MSG_DONTWAIT;
     }
+    uint32_t* zc_seq = nullptr;
+    if (_zero_copy && it2.has_next()) {
+        reap_zero_copy();
+        zc_seq = &_zc_seq;
+    }
+    if (_single_connection) {
+        // 大block紧跟在消息之后，it1发完才能发it2
+        if (!_send(_fd, it1, it2.has_next() || more ? flag | MSG_MORE : flag)) {
+            return false;
+        }
+        if (it1.has_next()) {
+            return true;
+        }
+        return _send(_fd, it2, more ? flag | MSG_MORE : flag, zc_seq);
+    }
     if (it2.has_next()) {
         // Should NOT use MSG_MORE for both _fd and _fd2
         if (!_send(_fd, it1, flag)) {
             return false;
         }
-        if (!_send(_fd2, it2, flag)) {
+        if (!_send(_fd2, it2, flag, zc_seq)) {
             return false;
         }
     } else {
@@ -335,7 +547,44 @@ bool TcpSocket::send_msg(RpcMessage&,
             return false;
         }
     }
+    return true;
+}
 
+/*
+ * zero copy时大block发完后整个消息转移到_zc_inflight，
+ * 调用者只会继续使用it1/it2判断是否发完
+ */
+bool TcpSocket::send_msg(RpcMessage& msg,
+      bool nonblock,
+      bool more,
+      RpcMessage::byte_cursor& it1,
+      RpcMessage::byte_cursor& it2) {
+    bool zero_copy = _zero_copy && it2.has_next();
+    if (!send_cursors(nonblock, more, it1, it2)) {
+        return false;
+    }
+    if (zero_copy && !it2.has_next()) {
+        lock_guard<SpinLock> l(_zc_lock);
+        _zc_inflight.emplace_back(_zc_seq - 1, std::move(msg));
+    }
+    return true;
+}
+
+bool TcpSocket::send_msgs(pico::core::vector<RpcMessage>& msgs,
+      bool nonblock,
+      bool more,
+      RpcMessage::byte_cursor& it1,
+      RpcMessage::byte_cursor& it2) {
+    bool zero_copy = _zero_copy && it2.has_next();
+    if (!send_cursors(nonblock, more, it1, it2)) {
+        return false;
+    }
+    if (zero_copy && !it2.has_next()) {
+        lock_guard<SpinLock> l(_zc_lock);
+        for (auto& msg : msgs) {
+            _zc_inflight.emplace_back(_zc_seq - 1, std::move(msg));
+        }
+    }
     return true;
 }
 
@@ -388,6 +637,10 @@ int TcpAcceptor::listen(int backlog) {
 }
 
 std::unique_ptr<RpcSocket> TcpAcceptor::accept() {
+    return std::make_unique<TcpSocket>(accept_fd());
+}
+
+int TcpAcceptor::accept_fd() {
     sockaddr_in remote_addr;
     socklen_t len = sizeof(remote_addr);
     int fd = ::accept4(_fd, (sockaddr*)&remote_addr, &len, SOCK_CLOEXEC);
@@ -395,7 +648,7 @@ std::unique_ptr<RpcSocket> TcpAcceptor::accept() {
     SLOG(INFO) << "received a connection from "
                << inet_ntoa(remote_addr.sin_addr) << ":"
                << ntohs(remote_addr.sin_port) << " fd is : " << fd;
-    return std::make_unique<TcpSocket>(fd);
+    return fd;
 }
 
 } // namespace core
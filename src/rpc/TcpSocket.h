@@ -9,6 +9,7 @@
 #include "RpcSocket.h"
 #include "RpcMessage.h"
 #include "SpscQueue.h"
+#include "SpinLock.h"
 
 namespace paradigm4 {
 namespace pico {
@@ -23,12 +24,26 @@ struct TcpConfig {
         keepalive_intvl = o.keepalive_intvl;
         keepalive_probes = o.keepalive_probes;
         connect_timeout = o.connect_timeout;
+        // 后加的字段，o中没有时保留默认值
+        PICO_CONFIG_COPY_FIELD(o, single_connection);
+        PICO_CONFIG_COPY_FIELD(o, zero_copy_send);
+        PICO_CONFIG_COPY_FIELD(o, busy_poll);
+        PICO_CONFIG_COPY_FIELD(o, prefer_busy_poll);
     }
 
-    int keepalive_time;
-    int keepalive_intvl;
-    int keepalive_probes;
-    int connect_timeout;
+    // -1 表示使用系统默认值
+    int keepalive_time = -1;
+    int keepalive_intvl = -1;
+    int keepalive_probes = -1;
+    int connect_timeout = -1;
+    // 大block也在主连接上发送，不再建立反向的_fd2，由connect一方决定
+    bool single_connection = false;
+    // 大block以MSG_ZEROCOPY发送，内核不支持时退回普通send
+    bool zero_copy_send = false;
+    // SO_BUSY_POLL，单位us，-1 表示使用系统默认值，超过net.core.busy_read需要CAP_NET_ADMIN
+    int busy_poll = -1;
+    // SO_PREFER_BUSY_POLL，配合RpcConfig::busy_poll_us使用
+    bool prefer_busy_poll = false;
 };
 
 class TcpSocket : public RpcSocket {
@@ -56,9 +71,34 @@ public:
     std::string endpoint();
 
     std::vector<int> fds() override {
+        if (_single_connection) {
+            return {_fd};
+        }
+        return {_fd, _fd2};
+    }
+
+    std::vector<int> send_fds() override {
+        if (_single_connection) {
+            return {_fd};
+        }
         return {_fd, _fd2};
     }
 
+    std::vector<int> blocked_fds(RpcMessage::byte_cursor& it1,
+          RpcMessage::byte_cursor& it2) override {
+        if (_single_connection) {
+            return {_fd};
+        }
+        std::vector<int> ret;
+        if (it1.has_next()) {
+            ret.push_back(_fd);
+        }
+        if (it2.has_next()) {
+            ret.push_back(_fd2);
+        }
+        return ret;
+    }
+
     int in_fd() {
         return _fd;
     }
@@ -70,18 +110,18 @@ public:
     bool try_recv_pending(std::function<void(RpcMessage&&)> func);
 
     virtual bool handle_event(int fd, std::function<void(RpcMessage&&)> func) override {
+        if (_zero_copy && fd == zero_copy_fd()) {
+            // error queue非空时epoll会一直报EPOLLERR
+            reap_zero_copy();
+        }
         if (fd == _fd2) {
             return try_recv_pending(func);
         } else {
             SCHECK(fd == _fd) << fd << " " << _fd << " " << _fd2;
-            auto tcp_func = [this, func](RpcMessage&& msg) {
-                if (msg.head()->extra_block_count == 0) {
-                    func(std::move(msg));
-                } else {
-                    _pending_msgs.push_back(std::move(msg));
-                }
-            };
-            if (!try_recv_msgs(tcp_func)) {
+            if (_single_connection) {
+                return try_recv_single(func);
+            }
+            if (!try_recv_msgs(stash_pending(func))) {
                 return false;
             }
             if (!try_recv_pending(func)) {
@@ -91,23 +131,106 @@ public:
         }
     }
 
-    virtual bool send_msg(RpcMessage& msg,
+    bool send_msg(RpcMessage& msg,
           bool nonblock,
           bool more,
           RpcMessage::byte_cursor& it1,
           RpcMessage::byte_cursor& it2) override;
 
+    bool send_msgs(pico::core::vector<RpcMessage>& msgs,
+          bool nonblock,
+          bool more,
+          RpcMessage::byte_cursor& it1,
+          RpcMessage::byte_cursor& it2) override;
+
+    size_t max_send_batch() override {
+        return MAX_SEND_BATCH;
+    }
+
+    // zero copy时整批消息在大block发完后才转移，不能分段
+    bool interleave_blocks() override {
+        return !_single_connection && !_zero_copy;
+    }
+
+    // 一次sendmsg最多拼接的消息数，受IOV_MAX限制
+    static constexpr size_t MAX_SEND_BATCH = 64;
+
     bool recv_rpc_messages(std::vector<RpcMessage>& rmsgs);
 
     static TcpConfig _tcp_config;
+protected:
+    // 带有zero copy block的消息先挂起，等_fd2上的数据收完再交给func
+    // 只有小block的消息已经收完，不排在它们后面
+    std::function<void(RpcMessage&&)> stash_pending(
+          std::function<void(RpcMessage&&)> func) {
+        return [this, func](RpcMessage&& msg) {
+            if (msg._pending_block_cnt == 0) {
+                func(std::move(msg));
+            } else {
+                _pending_msgs.push_back(std::move(msg));
+            }
+        };
+    }
+
+    bool recv_paused() override {
+        return _single_connection && !_pending_msgs.empty();
+    }
+
+    // 大block是否由recv读入，否则已经由其他途径填好
+    virtual bool pending_in_stream(const data_block_t& block) {
+        return block.length >= MIN_ZERO_COPY_SIZE;
+    }
+
+    // 跳过小block并交付收完的消息，返回下一个需要接收的大block的剩余部分
+    std::pair<char*, size_t> next_pending_block(std::function<void(RpcMessage&&)>& func);
+
+    void pending_received(size_t nbytes) {
+        _recieved_size += nbytes;
+    }
+
+    /*
+     * 单连接模式下处理已经收到的字节
+     * 返回下一次recv的位置，可能是pending block，也可能是_buffer的空闲部分，
+     * 收到checksum不对的消息时返回nullptr
+     */
+    std::pair<char*, size_t> single_recv_progress(
+          std::function<void(RpcMessage&&)>& func,
+          std::function<void(RpcMessage&&)>& tcp_func);
+
+    bool try_recv_single(std::function<void(RpcMessage&&)> func);
+
+    // 根据cursor尽可能发送，nonblock时发不完的部分留在it1/it2中
+    virtual bool send_cursors(bool nonblock,
+          bool more,
+          RpcMessage::byte_cursor& it1,
+          RpcMessage::byte_cursor& it2);
+
+    // 握手完成后调用，根据配置在发送大block的fd上开启SO_ZEROCOPY
+    void enable_zero_copy();
+
+    int zero_copy_fd() {
+        return _single_connection ? _fd : _fd2;
+    }
+
+    // 收割error queue中的完成通知，释放内核不再引用的消息
+    void reap_zero_copy();
+
+    int _fd = -1;
+    int _fd2 = -1;
+    bool _single_connection = false;
+    bool _zero_copy = false;
+
 private:
 
     // for recv   
     pico::core::deque<RpcMessage> _pending_msgs;
     size_t _block_id = 0, _recieved_size = 0;
 
-    int _fd = -1;
-    int _fd2 = -1;
+    // for zero copy send
+    // 每次成功的MSG_ZEROCOPY send占用一个序号，消息保留到最后一个序号完成
+    uint32_t _zc_seq = 0;
+    SpinLock _zc_lock;
+    pico::core::deque<std::pair<uint32_t, RpcMessage>> _zc_inflight;
 
     std::string _endpoint;
 
@@ -141,6 +264,9 @@ public:
         return _fd;
     }
 
+protected:
+    int accept_fd();
+
 private:
     int _fd;
     std::string _ep;
@@ -0,0 +1,107 @@
+#ifndef PARADIGM4_PICO_CORE_BOUNDEDQUEUE_H
+#define PARADIGM4_PICO_CORE_BOUNDEDQUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+#include "pico_log.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+/*
+ * 定长数组上的多生产者多消费者队列，不分配内存
+ * 每个格子带序号：等于位置时可写，等于位置+1时可读，读完后加上容量留给下一轮
+ * 满时try_push返回false，由调用者决定丢弃、重试还是退回到无界队列
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    // capacity向上取整到2的幂
+    explicit BoundedQueue(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity) {
+            cap <<= 1;
+        }
+        _mask = cap - 1;
+        _cells.reset(new cell_t[cap]);
+        for (size_t i = 0; i < cap; ++i) {
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool try_push(T&& v) {
+        size_t pos = _push_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell_t& c = _cells[pos & _mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0) {
+                if (_push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.v = std::move(v);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _push_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T& v) {
+        size_t pos = _pop_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell_t& c = _cells[pos & _mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+            if (diff == 0) {
+                if (_pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    v = std::move(c.v);
+                    c.seq.store(pos + _mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _pop_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t capacity() const {
+        return _mask + 1;
+    }
+
+private:
+    struct cell_t {
+        std::atomic<size_t> seq;
+        T v;
+    };
+
+    std::unique_ptr<cell_t[]> _cells;
+    size_t _mask;
+
+    char _cache_line_pad[64];
+
+    std::atomic<size_t> _push_pos = {0};
+
+    char _cache_line_pad_2[64];
+
+    std::atomic<size_t> _pop_pos = {0};
+
+    char _cache_line_pad_3[64];
+};
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_BOUNDEDQUEUE_H
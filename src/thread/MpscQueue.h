@@ -3,26 +3,38 @@
 
 #include <atomic>
 #include <utility>
+#include <vector>
+
+#include "BoundedQueue.h"
 #include "pico_memory.h"
+
 namespace paradigm4 {
 namespace pico {
 namespace core {
 
-template <typename T>
+/*
+ * 基于链表的无界多生产者单消费者队列
+ * pop释放的节点放进长度为FREE_LIST_SIZE的空闲表，push优先从中取，
+ * 稳定状态下不再分配内存；FREE_LIST_SIZE为0时每个元素一次pico_new/pico_delete
+ */
+template <typename T, size_t FREE_LIST_SIZE = 256>
 class MpscQueue {
 public:
-    MpscQueue() {
+    MpscQueue() : _free(FREE_LIST_SIZE) {
         Node* n = new_node();
         _tail = _head = n;
     }
 
     ~MpscQueue() {
-        Node* n = _head;
+        Node* n = _tail;
         do {
             Node* next = n->next;
-            delete_node(n);
+            pico_delete(n);
             n = next;
         } while (n);
+        while (_free.pop(n)) {
+            pico_delete(n);
+        }
     }
 
     void push(T&& v) {
@@ -44,6 +56,26 @@ public:
         }
     }
 
+    // 最多取max_n个追加到out，_tail只写一次
+    size_t pop_bulk(std::vector<T>& out, size_t max_n) {
+        Node* t = _tail.load(std::memory_order_relaxed);
+        size_t n = 0;
+        while (n < max_n) {
+            Node* next = t->next.load(std::memory_order_acquire);
+            if (!next) {
+                break;
+            }
+            out.push_back(std::move(next->v));
+            delete_node(t);
+            t = next;
+            ++n;
+        }
+        if (n > 0) {
+            _tail.store(t, std::memory_order_release);
+        }
+        return n;
+    }
+
     T* top() {
         Node* t = _tail.load(std::memory_order_relaxed);
         Node* next = t->next.load(std::memory_order_acquire);
@@ -63,13 +95,25 @@ private:
         std::atomic<Node*> next;
     };
 
-    template <typename ... Args>
-    inline Node* new_node(Args&&... args){
-        return pico_new<Node>(std::forward<Args>(args)...);
+    inline Node* new_node() {
+        return pico_new<Node>();
     }
 
-    inline void delete_node(Node* p){
-        pico_delete(p);
+    // 复用的节点中是被move走的旧值，直接赋值
+    inline Node* new_node(T&& v) {
+        Node* n = nullptr;
+        if (FREE_LIST_SIZE > 0 && _free.pop(n)) {
+            n->v = std::move(v);
+            n->next.store(nullptr, std::memory_order_relaxed);
+            return n;
+        }
+        return pico_new<Node>(std::move(v));
+    }
+
+    inline void delete_node(Node* p) {
+        if (FREE_LIST_SIZE == 0 || !_free.try_push(std::move(p))) {
+            pico_delete(p);
+        }
     }
 
     // consumer part
@@ -79,6 +123,11 @@ private:
 
     // producer part
     std::atomic<Node*> _head;
+
+    char _cache_line_pad_2[64];
+
+    // 消费者放入，生产者取出
+    BoundedQueue<Node*> _free;
 };
 
 } // namespace core
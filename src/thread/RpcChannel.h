@@ -1,11 +1,15 @@
 #ifndef PARADIGM4_PICO_CORE_RPCCHANNEL_H
 #define PARADIGM4_PICO_CORE_RPCCHANNEL_H
 
+#include <linux/futex.h>
 #include <poll.h>
+#include <sys/syscall.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <unistd.h>
+#include <chrono>
 #include <thread>
+#include <vector>
 
 #include "MpscQueue.h"
 #include "SpinLock.h"
@@ -19,47 +23,52 @@ class RpcChannelID {
 };
 
 /*
- * 线程间通信的管道，一个线程send，另一个recv
+ * 线程间通信的管道，多个线程send，一个线程recv
  * unbounded buffer, 所以send，一定成功
+ * _size是队列中的个数，recv等待时减1，send看到-1时唤醒recv；terminate直接唤醒
+ * 默认用futex唤醒，先按最近的等待时间自旋，只有recv已经睡下时send才需要系统调用；
+ * 需要放进epoll的用need_fd创建，改用eventfd
  */
 template <typename T>
 class RpcChannel {
 public:
-    RpcChannel() {
+    explicit RpcChannel(bool need_fd = false) {
         _id = AtomicID<RpcChannelID, int>::gen();
         if (unlikely(_id == -1)) {
             // -1 used for one-way request
             _id = AtomicID<RpcChannelID, int>::gen();
         }
-        _fd = eventfd(0, EFD_SEMAPHORE);
-        PSCHECK(_fd >= 0) << "no fd";
+        if (need_fd) {
+            _fd = eventfd(0, EFD_SEMAPHORE);
+            PSCHECK(_fd >= 0) << "no fd";
+        }
         _size    = 0;
     }
 
     void terminate() {
-        int64_t _ = 1;
-        SCHECK(::write(_fd, &_, sizeof(int64_t)) == sizeof(int64_t));
+        post();
     }
 
     ~RpcChannel() {
-        ::close(_fd);
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
     }
 
     void send(T&& item) {
         _q.push(std::move(item));
         int64_t sz = _size.fetch_add(1, std::memory_order_acq_rel);
         if (sz == -1) {
-            int64_t _ = 1;
-            PSCHECK(::write(_fd, &_, sizeof(int64_t)) == sizeof(int64_t));
+            post();
         }
     }
 
     bool recv(T& item, int timeout, int spin_count = 128) {
-        int64_t _ = 0;
         for (int i = 0; i < spin_count; ++i) {
             if (_q.pop(item)) {
                 if (_size.fetch_add(-1, std::memory_order_relaxed) == 0) {
-                    PSCHECK(::read(_fd, &_, sizeof(int64_t)) == sizeof(int64_t));
+                    // send已经push但还没有加_size，收下它马上会发的唤醒
+                    wait_post(-1);
                 }
                 return true;
             } else {
@@ -71,33 +80,48 @@ public:
         }
         auto sz = _size.fetch_add(-1, std::memory_order_release);
         SCHECK(sz >= 0);
-        if (sz == 0) {
-            if (timeout == -1) {
-                SCHECK(::read(_fd, &_, sizeof(int64_t)) == sizeof(int64_t));
-                if (_size.load(std::memory_order_acquire) >= 0) {
-                    for (; !_q.pop(item); );
-                    return true;
-                } else {
-                    return false;
-                }
-            } else {
-                pollfd pfd{_fd, POLLIN | POLLPRI, 0};
-                int nfd = poll(&pfd, 1, timeout);
-                if (nfd == 0) {
-                    _size.fetch_add(1, std::memory_order_relaxed);
-                    return false;
-                }
-                PSCHECK(::read(_fd, &_, sizeof(int64_t)) == sizeof(int64_t));
-                return _q.pop(item);
+        if (sz > 0) {
+            for (; !_q.pop(item); );
+            return true;
+        }
+        if (!wait_post(timeout)) {
+            // 超时，撤销等待；期间有send看到了-1时要收下它的唤醒
+            int64_t expected = -1;
+            if (_size.compare_exchange_strong(expected, 0, std::memory_order_relaxed)) {
+                return false;
             }
-        } else {
+            wait_post(-1);
+        }
+        // terminate时_size仍然小于0
+        if (_size.load(std::memory_order_acquire) >= 0) {
             for (; !_q.pop(item); );
             return true;
+        } else {
+            return false;
         }
     }
 
-    // use it for epoll
+    /*
+     * 最多取max_n个追加到items，返回取到的个数，没有取到时等待方式与recv相同
+     * 一次取多个时_size只调整一次，最多等一次唤醒
+     */
+    size_t recv_batch(std::vector<T>& items, size_t max_n, int timeout, int spin_count = 128) {
+        SCHECK(max_n > 0);
+        size_t n = pop_bulk(items, max_n);
+        if (n > 0) {
+            return n;
+        }
+        T item;
+        if (!recv(item, timeout, spin_count)) {
+            return 0;
+        }
+        items.push_back(std::move(item));
+        return 1 + pop_bulk(items, max_n - 1);
+    }
+
+    // use it for epoll, 只有need_fd创建的才有
     int fd() {
+        SCHECK(_fd >= 0) << "RpcChannel is created without fd";
         return _fd;
     }
 
@@ -105,14 +129,143 @@ public:
         return _id;
     }
 
+    // 队列中的个数，只是近似值，用于监控
+    int64_t size() const {
+        int64_t sz = _size.load(std::memory_order_relaxed);
+        return sz > 0 ? sz : 0;
+    }
+
+    // 超过这个时间的等待不自旋
+    static constexpr int64_t MAX_SPIN_NS = 50000;
+
 private:
+    size_t pop_bulk(std::vector<T>& items, size_t max_n) {
+        if (max_n == 0) {
+            return 0;
+        }
+        size_t n = _q.pop_bulk(items, max_n);
+        // 小于n说明有send已经push但还没有加_size，最后一个加到0的会唤醒一次
+        if (n > 0 && _size.fetch_add(-int64_t(n), std::memory_order_relaxed) < int64_t(n)) {
+            wait_post(-1);
+        }
+        return n;
+    }
+
+    void post() {
+        if (_fd >= 0) {
+            int64_t _ = 1;
+            PSCHECK(::write(_fd, &_, sizeof(int64_t)) == sizeof(int64_t));
+            return;
+        }
+        _signal.fetch_add(1);
+        if (_parked.load()) {
+            futex(FUTEX_WAKE_PRIVATE, 1, nullptr);
+        }
+    }
+
+    // 收下一次post，超时返回false，只有recv线程调用
+    bool wait_post(int timeout) {
+        if (_fd >= 0) {
+            return wait_eventfd(timeout);
+        }
+        auto start = std::chrono::steady_clock::now();
+        // 最近的等待都很短时先自旋，否则直接睡；单核上自旋只会拖慢对方
+        static const bool multi_core = std::thread::hardware_concurrency() > 1;
+        int64_t spin_ns = multi_core && _avg_wait_ns <= MAX_SPIN_NS ? 2 * _avg_wait_ns : 0;
+        bool got = false;
+        for (int i = 0; ; ++i) {
+            if (try_take()) {
+                got = true;
+                break;
+            }
+            if ((i & 15) == 15 && elapsed_ns(start) >= spin_ns) {
+                break;
+            }
+            cpu_relax();
+        }
+        if (!got) {
+            got = park(timeout, start);
+        }
+        if (got) {
+            // 截断长时间空闲的样本，忙起来后很快恢复自旋
+            int64_t ns = elapsed_ns(start);
+            ns = ns < 2 * MAX_SPIN_NS ? ns : 2 * MAX_SPIN_NS;
+            _avg_wait_ns += (ns - _avg_wait_ns) / 8;
+        }
+        return got;
+    }
+
+    bool wait_eventfd(int timeout) {
+        int64_t _ = 0;
+        if (timeout != -1) {
+            pollfd pfd{_fd, POLLIN | POLLPRI, 0};
+            if (poll(&pfd, 1, timeout) == 0) {
+                return false;
+            }
+        }
+        PSCHECK(::read(_fd, &_, sizeof(int64_t)) == sizeof(int64_t));
+        return true;
+    }
+
+    bool try_take() {
+        int32_t v = _signal.load();
+        while (v > 0) {
+            if (_signal.compare_exchange_weak(v, v - 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool park(int timeout, std::chrono::steady_clock::time_point start) {
+        // 先登记再检查，与post中的先加再检查配对，不会错过唤醒
+        _parked.store(true);
+        bool got = false;
+        for (;;) {
+            if (try_take()) {
+                got = true;
+                break;
+            }
+            timespec ts;
+            timespec* pts = nullptr;
+            if (timeout >= 0) {
+                int64_t left = int64_t(timeout) * 1000000 - elapsed_ns(start);
+                if (left <= 0) {
+                    break;
+                }
+                ts.tv_sec = left / 1000000000;
+                ts.tv_nsec = left % 1000000000;
+                pts = &ts;
+            }
+            futex(FUTEX_WAIT_PRIVATE, 0, pts);
+        }
+        _parked.store(false);
+        return got;
+    }
+
+    long futex(int op, int val, const timespec* timeout) {
+        return syscall(SYS_futex, reinterpret_cast<int32_t*>(&_signal),
+              op, val, timeout, nullptr, 0);
+    }
+
+    static int64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start).count();
+    }
+
     int _id;
-    int _fd;
+    int _fd = -1;
     char _pad_1[64];
     std::atomic<int64_t> _size;
     char _pad_2[64];
-    MpscQueue<T> _q;
+    // futex等待的post计数和recv是否睡下
+    std::atomic<int32_t> _signal = {0};
+    std::atomic<bool> _parked = {false};
+    // recv最近等待时间的EWMA，只有recv线程读写
+    int64_t _avg_wait_ns = 0;
     char _pad_3[64];
+    MpscQueue<T> _q;
+    char _pad_4[64];
 };
 
 } // namespace core
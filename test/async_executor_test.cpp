@@ -0,0 +1,110 @@
+#include <cstdlib>
+#include <cstdio>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "AsyncExecutor.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+TEST(AsyncExecutor, drain) {
+    AsyncExecutor executor;
+    executor.initialize(4, {});
+    std::atomic<int> cnt = {0};
+    for (int i = 0; i < 1000; ++i) {
+        executor.submit([&cnt]() {
+            cnt.fetch_add(1);
+        });
+    }
+    executor.drain();
+    EXPECT_EQ(cnt.load(), 1000);
+    executor.finalize();
+}
+
+TEST(AsyncExecutor, nested_submit) {
+    AsyncExecutor executor;
+    executor.initialize(2, {});
+    std::atomic<int> cnt = {0};
+    for (int i = 0; i < 100; ++i) {
+        executor.submit([&executor, &cnt]() {
+            executor.submit([&cnt]() {
+                cnt.fetch_add(1);
+            });
+        });
+    }
+    executor.drain();
+    EXPECT_EQ(cnt.load(), 100);
+    executor.finalize();
+}
+
+TEST(AsyncExecutor, blocking_tasks_bounded) {
+    AsyncExecutor executor;
+    executor.initialize(2, {});
+    std::atomic<int> running = {0};
+    std::atomic<int> max_running = {0};
+    for (int i = 0; i < 8; ++i) {
+        executor.submit([&running, &max_running]() {
+            int cur = running.fetch_add(1) + 1;
+            int old = max_running.load();
+            while (cur > old && !max_running.compare_exchange_weak(old, cur));
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            running.fetch_sub(1);
+        });
+    }
+    executor.drain();
+    EXPECT_LE(max_running.load(), 2);
+    EXPECT_EQ(running.load(), 0);
+}
+
+TEST(AsyncExecutor, finalize_runs_pending_tasks) {
+    std::atomic<int> cnt = {0};
+    {
+        AsyncExecutor executor;
+        executor.initialize(1, {});
+        for (int i = 0; i < 100; ++i) {
+            executor.submit([&cnt]() {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                cnt.fetch_add(1);
+            });
+        }
+    }
+    EXPECT_EQ(cnt.load(), 100);
+}
+
+TEST(AsyncExecutor, submit_after_finalize) {
+    AsyncExecutor executor;
+    executor.initialize(2, {});
+    std::atomic<int> cnt = {0};
+    // finalize时线程退出前后都可能有任务提交进来
+    for (int i = 0; i < 100; ++i) {
+        executor.submit([&executor, &cnt]() {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            executor.submit([&cnt]() {
+                cnt.fetch_add(1);
+            });
+        });
+    }
+    executor.finalize();
+    EXPECT_EQ(cnt.load(), 100);
+    std::thread::id caller;
+    executor.submit([&caller]() {
+        caller = std::this_thread::get_id();
+    });
+    EXPECT_EQ(caller, std::this_thread::get_id());
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    int ret = RUN_ALL_TESTS();
+    return ret;
+}
@@ -0,0 +1,94 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "BoundedQueue.h"
+#include "MpscQueue.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+TEST(BoundedQueue, full_and_wrap) {
+    BoundedQueue<std::string> q(3);
+    EXPECT_EQ(q.capacity(), 4u);
+    std::string s;
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 4; ++i) {
+            EXPECT_TRUE(q.try_push(std::to_string(i)));
+        }
+        EXPECT_FALSE(q.try_push("x"));
+        for (int i = 0; i < 4; ++i) {
+            EXPECT_TRUE(q.pop(s));
+            EXPECT_EQ(s, std::to_string(i));
+        }
+        EXPECT_FALSE(q.pop(s));
+    }
+}
+
+// 多个生产者同时push，队列很小，反复写满和回绕，不丢不重
+template <class Q, class Push>
+static void concurrent_push_pop(Q& q, Push push) {
+    const int producer_num = 4;
+    const int M = 100000;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producer_num; ++p) {
+        producers.emplace_back([&q, &push, p, M]() {
+            for (int i = 0; i < M; ++i) {
+                push(q, int64_t(p) * M + i);
+            }
+        });
+    }
+    std::vector<int> seen(producer_num * M, 0);
+    std::vector<int64_t> last(producer_num, -1);
+    int64_t x;
+    for (int i = 0; i < producer_num * M; ) {
+        if (q.pop(x)) {
+            ASSERT_GE(x, 0);
+            ASSERT_LT(x, int64_t(producer_num) * M);
+            ++seen[x];
+            // 同一个生产者的元素保持顺序
+            EXPECT_GT(x % M, last[x / M]);
+            last[x / M] = x % M;
+            ++i;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    for (auto& t : producers) {
+        t.join();
+    }
+    for (int n : seen) {
+        ASSERT_EQ(n, 1);
+    }
+    EXPECT_FALSE(q.pop(x));
+}
+
+TEST(BoundedQueue, concurrent_push) {
+    BoundedQueue<int64_t> q(64);
+    concurrent_push_pop(q, [](BoundedQueue<int64_t>& q, int64_t v) {
+        while (!q.try_push(std::move(v))) {
+            std::this_thread::yield();
+        }
+    });
+}
+
+// 生产者多于消费者时空闲表经常为空，push退回到pico_new
+TEST(MpscQueue, concurrent_push) {
+    MpscQueue<int64_t> q;
+    concurrent_push_pop(q, [](MpscQueue<int64_t>& q, int64_t v) {
+        q.push(std::move(v));
+    });
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
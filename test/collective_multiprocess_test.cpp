@@ -0,0 +1,196 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <chrono>
+#include <numeric>
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "Collective.h"
+#include "RpcService.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+class CollectiveWorker {
+public:
+    CollectiveWorker(const std::string& master_ep, int rank, int size,
+          const CollectiveConfig& config) {
+        _mc = std::make_unique<TcpMasterClient>(master_ep);
+        while (!_mc->initialize());
+        RpcConfig rpc_config;
+        rpc_config.protocol = "tcp";
+        rpc_config.bind_ip = "127.0.0.1";
+        rpc_config.io_thread_num = 1;
+        _rpc = std::make_unique<RpcService>();
+        _rpc->initialize(_mc.get(), rpc_config);
+        _coll = std::make_unique<Collective>(_rpc.get(), "bench", rank, size, config);
+    }
+
+    ~CollectiveWorker() {
+        _coll.reset();
+        _rpc->finalize();
+        _mc->finalize();
+    }
+
+    // 返回不一致的元素个数
+    size_t check() {
+        int rank = _coll->rank();
+        int size = _coll->size();
+        size_t wrong = 0;
+        const size_t n = 100003;
+        for (std::string algorithm : {"ring", "recursive_doubling"}) {
+            if (algorithm == "recursive_doubling" && (size & (size - 1)) != 0) {
+                continue;
+            }
+            CollectiveConfig config;
+            config.algorithm = algorithm;
+            config.chunk_bytes = 4096;
+            Collective coll(_rpc.get(), "check_" + algorithm, rank, size, config);
+            std::vector<int64_t> data(n);
+            for (size_t i = 0; i < n; ++i) {
+                data[i] = i * (rank + 1);
+            }
+            coll.allreduce(data.data(), n);
+            int64_t factor = int64_t(size) * (size + 1) / 2;
+            for (size_t i = 0; i < n; ++i) {
+                wrong += data[i] != int64_t(i) * factor;
+            }
+            std::vector<float> values(n, rank);
+            coll.allreduce(values.data(), n, CollectiveOp::MAX);
+            for (float v : values) {
+                wrong += v != size - 1;
+            }
+        }
+
+        std::vector<int64_t> data(n, rank + 1);
+        _coll->reduce_scatter(data.data(), n);
+        auto seg = Collective::segment(n, size, rank);
+        for (size_t i = seg.first; i < seg.first + seg.second; ++i) {
+            wrong += data[i] != int64_t(size) * (size + 1) / 2;
+        }
+
+        std::fill(data.begin(), data.end(), -1);
+        std::fill(data.begin() + seg.first, data.begin() + seg.first + seg.second, rank);
+        _coll->allgather(data.data(), n);
+        for (int r = 0; r < size; ++r) {
+            auto s = Collective::segment(n, size, r);
+            for (size_t i = s.first; i < s.first + s.second; ++i) {
+                wrong += data[i] != r;
+            }
+        }
+
+        int root = size - 1;
+        std::iota(data.begin(), data.end(), rank == root ? 7 : 0);
+        _coll->broadcast(data.data(), n, root);
+        for (size_t i = 0; i < n; ++i) {
+            wrong += data[i] != int64_t(i) + 7;
+        }
+        _coll->barrier();
+        return wrong;
+    }
+
+    // allreduce float，返回bus bandwidth，单位GB/s
+    double bus_bandwidth(size_t bytes, int iters) {
+        std::vector<float> data(bytes / sizeof(float), 1);
+        _coll->barrier();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iters; ++i) {
+            _coll->allreduce(data.data(), data.size());
+        }
+        _coll->barrier();
+        std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+        int size = _coll->size();
+        double alg_bw = double(bytes) * iters / dur.count();
+        return alg_bw * 2 * (size - 1) / size / 1e9;
+    }
+
+    std::unique_ptr<TcpMasterClient> _mc;
+    std::unique_ptr<RpcService> _rpc;
+    std::unique_ptr<Collective> _coll;
+};
+
+// bench为true时检查之后再测allreduce的带宽
+void run_collective(int size, const CollectiveConfig& config, bool bench) {
+    std::unique_ptr<Master> master = std::make_unique<Master>("127.0.0.1");
+    master->initialize();
+    auto master_ep = master->endpoint();
+    std::vector<pid_t> children;
+    for (int rank = 0; rank < size; ++rank) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            Logger::singleton().set_id(std::to_string(rank));
+            size_t wrong;
+            {
+                CollectiveWorker worker(master_ep, rank, size, config);
+                wrong = worker.check();
+                if (bench) {
+                    for (size_t bytes : {size_t(64) << 10, size_t(1) << 20, size_t(16) << 20}) {
+                        double bw = worker.bus_bandwidth(bytes, 10);
+                        if (rank == 0) {
+                            SLOG(INFO) << "ranks: " << size << " algorithm: " << config.algorithm
+                                       << " chunk: " << config.chunk_bytes
+                                       << " bytes: " << bytes << " bus bandwidth: " << bw << "GB/s";
+                        }
+                    }
+                }
+            }
+            if (wrong) {
+                SLOG(WARNING) << "rank " << rank << " got " << wrong << " wrong values";
+            }
+            exit(wrong == 0 ? 0 : 1);
+        }
+        PSCHECK(pid != -1);
+        children.push_back(pid);
+    }
+    for (pid_t pid : children) {
+        int status;
+        PSCHECK(waitpid(pid, &status, 0) == pid);
+        EXPECT_TRUE(WIFEXITED(status));
+        EXPECT_EQ(WEXITSTATUS(status), 0);
+    }
+    master->exit();
+    master->finalize();
+}
+
+TEST(Collective, ring) {
+    CollectiveConfig config;
+    config.algorithm = "ring";
+    for (int size : {2, 3, 4}) {
+        run_collective(size, config, false);
+    }
+}
+
+TEST(Collective, auto_algorithm) {
+    CollectiveConfig config;
+    config.chunk_bytes = 256 << 10;
+    run_collective(4, config, false);
+}
+
+// 带宽测试不在ctest中运行，需要时加--gtest_also_run_disabled_tests
+TEST(Collective, DISABLED_bus_bandwidth) {
+    for (std::string algorithm : {"ring", "recursive_doubling"}) {
+        CollectiveConfig config;
+        config.algorithm = algorithm;
+        for (int size : {2, 4}) {
+            run_collective(size, config, true);
+        }
+    }
+    CollectiveConfig config;
+    config.chunk_bytes = 256 << 10;
+    run_collective(4, config, true);
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
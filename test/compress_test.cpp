@@ -322,6 +322,42 @@ TEST(compress, zstd_raw_ok) {
     pico_free(c2);
 }
 
+// 损坏、截断或者声明的长度过大的输入都返回false，不会崩溃
+TEST(compress, try_raw_uncompress_bad_input) {
+    std::string raw(64 << 10, 0);
+    for (size_t i = 0; i < raw.size(); ++i) {
+        raw[i] = 'a' + i % 7 + (i % 1000 == 0 ? rand() % 10 : 0);
+    }
+    for (const char* method : {"zlib", "snappy", "lz4", "zstd"}) {
+        auto c = pico_compress(method);
+        char* packed = nullptr;
+        size_t packed_size = 0;
+        c.raw_compress(const_cast<char*>(raw.data()), raw.size(), &packed, &packed_size);
+
+        char* out = nullptr;
+        size_t out_size = 0;
+        ASSERT_TRUE(c.try_raw_uncompress(packed, packed_size, raw.size(), &out, &out_size))
+              << method;
+        EXPECT_EQ(std::string(out, out_size), raw) << method;
+        // 解压后超过上限
+        EXPECT_FALSE(c.try_raw_uncompress(packed, packed_size, raw.size() - 1,
+              &out, &out_size)) << method;
+        // 截断
+        EXPECT_FALSE(c.try_raw_uncompress(packed, packed_size / 2, raw.size(),
+              &out, &out_size)) << method;
+        EXPECT_FALSE(c.try_raw_uncompress(packed, 3, raw.size(), &out, &out_size)) << method;
+        // 压缩数据被改写
+        std::string bad(packed, packed_size);
+        for (size_t i = 0; i < bad.size() - sizeof(size_t); i += 5) {
+            bad[i] = ~bad[i];
+        }
+        EXPECT_FALSE(c.try_raw_uncompress(bad.data(), bad.size(), raw.size(),
+              &out, &out_size)) << method;
+        pico_free(packed);
+        pico_free(out);
+    }
+}
+
 
 } // namespace core
 } // namespace pico
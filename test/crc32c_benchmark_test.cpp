@@ -0,0 +1,46 @@
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "Crc32c.h"
+#include "pico_log.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 返回GB/s
+double crc32c_throughput(uint32_t (*f)(uint32_t, const void*, size_t), size_t size) {
+    std::vector<char> data(size, 'a');
+    size_t total = size_t(1) << 31;
+    int iters = std::max<size_t>(total / size, 1);
+    uint32_t crc = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; ++i) {
+        crc = f(crc, data.data(), data.size());
+    }
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+    EXPECT_NE(crc, 0u);
+    return double(size) * iters / dur.count() / 1e9;
+}
+
+TEST(Crc32c, Throughput) {
+    for (size_t size : {size_t(64), size_t(1) << 10, size_t(64) << 10, size_t(4) << 20}) {
+        double hw = crc32c_throughput(crc32c, size);
+        double sw = crc32c_throughput(crc32c_software, size);
+        SLOG(INFO) << "size: " << size << " crc32c: " << hw << "GB/s"
+                   << " software: " << sw << "GB/s";
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
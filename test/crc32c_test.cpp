@@ -0,0 +1,50 @@
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "Crc32c.h"
+#include "pico_log.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+TEST(Crc32c, CheckValue) {
+    EXPECT_EQ(crc32c(0, "123456789", 9), 0xe3069283u);
+    EXPECT_EQ(crc32c_software(0, "123456789", 9), 0xe3069283u);
+    EXPECT_EQ(crc32c(0, "", 0), 0u);
+    std::string zeros(32, '\0');
+    EXPECT_EQ(crc32c(0, zeros.data(), zeros.size()), 0x8a9136aau);
+}
+
+// 不同长度和对齐下与查表实现一致，分段计算与整体一致
+TEST(Crc32c, MatchSoftware) {
+    SLOG(INFO) << "crc32c hardware: " << crc32c_hardware();
+    std::mt19937 rng(7);
+    std::vector<unsigned char> buf(200000);
+    for (auto& c : buf) {
+        c = rng();
+    }
+    for (int i = 0; i < 2000; ++i) {
+        size_t offset = rng() % 64;
+        size_t n = rng() % (i < 1000 ? 2048 : buf.size() - 64);
+        uint32_t init = rng();
+        const unsigned char* p = buf.data() + offset;
+        uint32_t crc = crc32c(init, p, n);
+        ASSERT_EQ(crc, crc32c_software(init, p, n)) << offset << " " << n;
+        size_t cut = n ? rng() % n : 0;
+        ASSERT_EQ(crc32c(crc32c(init, p, cut), p + cut, n - cut), crc) << cut << " " << n;
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,83 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 几个线程共用一个dealer，不等response发出大量异步调用
+TEST(RpcService, AsyncRequest) {
+    const int client_thread_num = 4;
+    const int count = 2000;
+    FakeRpc rpc;
+    rpc.serve(1, "async", echo_int);
+
+    auto client = rpc.rpc(0)->create_client("async", 1);
+    auto dealer = client->create_dealer();
+    std::atomic<int> done = {0};
+    std::atomic<int> wrong = {0};
+    std::vector<std::thread> client_threads;
+    for (int t = 0; t < client_thread_num; ++t) {
+        client_threads.emplace_back([&, t]() {
+            for (int i = 0; i < count; ++i) {
+                int value = t * count + i;
+                RpcRequest request;
+                request << value;
+                dealer->async_request(std::move(request), [&, value](RpcResponse&& response) {
+                    int echo = -1;
+                    if (response.error_code() == RpcErrorCodeType::SUCC) {
+                        response >> echo;
+                    }
+                    if (echo != value) {
+                        ++wrong;
+                    }
+                    ++done;
+                }, i % 2 == 0);
+            }
+        });
+    }
+    for (auto& th : client_threads) {
+        th.join();
+    }
+    while (done.load() < client_thread_num * count) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(wrong.load(), 0);
+    EXPECT_EQ(dealer->pending_async_num(), 0u);
+
+    std::vector<std::future<RpcResponse>> futures;
+    for (int i = 0; i < count; ++i) {
+        RpcRequest request;
+        request << i;
+        futures.push_back(dealer->async_request(std::move(request)));
+    }
+    for (int i = 0; i < count; ++i) {
+        RpcResponse response = futures[i].get();
+        ASSERT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+        int echo;
+        response >> echo;
+        EXPECT_EQ(echo, i);
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
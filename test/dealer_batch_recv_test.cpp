@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+TEST(RpcService, BatchRecv) {
+    const int count = 20000;
+    const size_t batch = 64;
+    FakeRpc rpc;
+    std::shared_ptr<Dealer> server_dealer = rpc.create_server(1, "batch")->create_dealer();
+    rpc.spawn([server_dealer, batch]() {
+        std::vector<RpcRequest> requests;
+        if (server_dealer->recv_requests(requests, batch, 100)) {
+            EXPECT_LE(requests.size(), batch);
+            for (auto& request : requests) {
+                RpcResponse response(request);
+                echo_int(request, response);
+                server_dealer->send_response(std::move(response));
+            }
+        }
+    });
+
+    auto client = rpc.rpc(0)->create_client("batch", 1);
+    auto dealer = client->create_dealer();
+    for (int i = 0; i < count; ++i) {
+        RpcRequest request;
+        request << i;
+        dealer->send_request(std::move(request));
+    }
+    int64_t sum = 0;
+    int received = 0;
+    std::vector<RpcResponse> responses;
+    while (received < count) {
+        ASSERT_TRUE(dealer->recv_responses(responses, batch));
+        EXPECT_LE(responses.size(), batch);
+        for (auto& response : responses) {
+            int value;
+            response >> value;
+            sum += value;
+        }
+        received += responses.size();
+    }
+    rpc.stop();
+    EXPECT_EQ(received, count);
+    EXPECT_EQ(sum, int64_t(count) * (count - 1) / 2);
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 一个server每个request多sleep，hedge的request应该由另一个server先返回
+TEST(RpcService, HedgedRequest) {
+    const int count = 200;
+    FakeRpc rpc(FakeRpc::default_config(), 3);
+    rpc.serve(0, "hedge", echo_int);
+    rpc.serve(1, "hedge", [](RpcRequest& request, RpcResponse& response) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        echo_int(request, response);
+    });
+
+    auto client = rpc.rpc(2)->create_client("hedge", 2);
+    auto dealer = client->create_dealer();
+    HedgeOption opt;
+    opt.delay_us = 1000;
+    for (int i = 0; i < count; ++i) {
+        RpcRequest request;
+        request << i;
+        RpcResponse response = dealer->hedged_rpc_call(std::move(request), opt);
+        ASSERT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+        int value;
+        response >> value;
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_GT(dealer->hedge_sent_num(), 0u);
+    EXPECT_GT(dealer->hedge_won_num(), 0u);
+    EXPECT_LE(dealer->hedge_won_num(), dealer->hedge_sent_num());
+
+    // 按最近延迟的分位数等待，一批request一起发
+    std::vector<RpcRequest> reqs(count);
+    for (int i = 0; i < count; ++i) {
+        reqs[i] << i;
+    }
+    auto resps = dealer->hedged_rpc_calls(std::move(reqs), HedgeOption());
+    ASSERT_EQ(resps.size(), size_t(count));
+    for (int i = 0; i < count; ++i) {
+        ASSERT_EQ(resps[i].error_code(), RpcErrorCodeType::SUCC);
+        int value;
+        resps[i] >> value;
+        EXPECT_EQ(value, i);
+    }
+}
+
+// 两个server都不及时回复的调用在timeout_ms后得到ETIMEOUT，其他调用不受影响
+TEST(RpcService, HedgedTimeout) {
+    FakeRpc rpc(FakeRpc::default_config(), 3);
+    auto slow_odd = [](RpcRequest& request, RpcResponse& response) {
+        int value;
+        request >> value;
+        if (value % 2) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        }
+        response << value;
+    };
+    rpc.serve(0, "hedge_timeout", slow_odd);
+    rpc.serve(1, "hedge_timeout", slow_odd);
+
+    auto client = rpc.rpc(2)->create_client("hedge_timeout", 2);
+    auto dealer = client->create_dealer();
+    HedgeOption opt;
+    opt.delay_us = 1000;
+    opt.timeout_ms = 100;
+    std::vector<RpcRequest> reqs(4);
+    for (int i = 0; i < 4; ++i) {
+        reqs[i] << i;
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto resps = dealer->hedged_rpc_calls(std::move(reqs), opt);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(250));
+    ASSERT_EQ(resps.size(), 4u);
+    for (int i = 0; i < 4; ++i) {
+        if (i % 2) {
+            EXPECT_EQ(resps[i].error_code(), RpcErrorCodeType::ETIMEOUT);
+            continue;
+        }
+        ASSERT_EQ(resps[i].error_code(), RpcErrorCodeType::SUCC);
+        int value;
+        resps[i] >> value;
+        EXPECT_EQ(value, i);
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
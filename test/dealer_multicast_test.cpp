@@ -0,0 +1,125 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+TEST(RpcService, Multicast) {
+    const size_t n = 1 << 16;
+    FakeRpc rpc(FakeRpc::default_config(), 3);
+    std::vector<comm_rank_t> ranks;
+    for (int i = 0; i < 3; ++i) {
+        RpcService* service = rpc.rpc(i);
+        rpc.serve(i, "multicast", [service](RpcRequest& request, RpcResponse& response) {
+            std::vector<float> values;
+            std::string block;
+            request >> values;
+            request.lazy() >> block;
+            response << service->global_rank() << values.size() << block;
+        });
+        ranks.push_back(service->global_rank());
+    }
+    std::sort(ranks.begin(), ranks.end());
+
+    auto client = rpc.rpc(0)->create_client("multicast", 3);
+    auto dealer = client->create_dealer();
+    for (int round = 0; round < 10; ++round) {
+        RpcRequest request;
+        request << std::vector<float>(n, round);
+        request.lazy() << std::string(MIN_ZERO_COPY_SIZE * 4, 'a' + round);
+        dealer->multicast_request(std::move(request), ranks);
+        std::vector<comm_rank_t> replied;
+        for (size_t i = 0; i < ranks.size(); ++i) {
+            RpcResponse response;
+            ASSERT_TRUE(dealer->recv_response(response));
+            ASSERT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+            comm_rank_t rank;
+            size_t size;
+            std::string block;
+            response >> rank >> size >> block;
+            EXPECT_EQ(size, n);
+            EXPECT_EQ(block, std::string(MIN_ZERO_COPY_SIZE * 4, 'a' + round));
+            replied.push_back(rank);
+        }
+        std::sort(replied.begin(), replied.end());
+        EXPECT_EQ(replied, ranks);
+    }
+}
+
+// 压缩一次后共用，每个目标的trace各自带回自己的server_rank
+TEST(RpcService, MulticastCompressTrace) {
+    const size_t n = 1 << 16;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.trace.sample_rate = 1;
+    FakeRpc rpc(rpc_config, 3);
+    std::vector<comm_rank_t> ranks;
+    for (int i = 0; i < 3; ++i) {
+        RpcService* service = rpc.rpc(i);
+        rpc.serve(i, "multicast", [service](RpcRequest& request, RpcResponse& response) {
+            // trace不出现在lazy block中
+            EXPECT_EQ(request.head().extra_block_count, 1);
+            std::vector<float> values;
+            std::string block;
+            request >> values;
+            request.lazy() >> block;
+            response << service->global_rank() << values << block;
+        });
+        ranks.push_back(service->global_rank());
+    }
+    rpc.rpc(0)->set_compress("multicast", RpcCompressOption("lz4", 1024, 1024));
+
+    auto client = rpc.rpc(0)->create_client("multicast", 3);
+    auto dealer = client->create_dealer();
+    for (int round = 0; round < 10; ++round) {
+        std::vector<float> values = sparse_values(n, round);
+        std::string block(MIN_ZERO_COPY_SIZE * 4, 'a' + round);
+        RpcRequest request;
+        request << values;
+        request.lazy() << std::string(block);
+        dealer->multicast_request(std::move(request), ranks);
+        std::vector<comm_rank_t> replied;
+        for (size_t i = 0; i < ranks.size(); ++i) {
+            RpcResponse response;
+            ASSERT_TRUE(dealer->recv_response(response));
+            ASSERT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+            comm_rank_t rank;
+            std::vector<float> rvalues;
+            std::string rblock;
+            response >> rank >> rvalues >> rblock;
+            EXPECT_EQ(rvalues, values);
+            EXPECT_EQ(rblock, block);
+            const rpc_trace_t* trace = response.trace();
+            ASSERT_NE(trace, nullptr);
+            EXPECT_TRUE(trace->has(RPC_TRACE_SEND_REQUEST));
+            EXPECT_TRUE(trace->has(RPC_TRACE_SEND_RESPONSE));
+            EXPECT_EQ(trace->client_rank, rpc.rpc(0)->global_rank());
+            EXPECT_EQ(trace->server_rank, rank);
+            replied.push_back(rank);
+        }
+        std::sort(replied.begin(), replied.end());
+        std::vector<comm_rank_t> sorted = ranks;
+        std::sort(sorted.begin(), sorted.end());
+        EXPECT_EQ(replied, sorted);
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
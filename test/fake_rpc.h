@@ -0,0 +1,126 @@
+#ifndef PARADIGM4_PICO_CORE_TEST_FAKE_RPC_H
+#define PARADIGM4_PICO_CORE_TEST_FAKE_RPC_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RpcService.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+/*
+ * 同一个master上的n个RpcService，rpc_test之类的测试共用
+ * serve和spawn启动的后台线程在stop或者析构时退出，之后才finalize
+ */
+class FakeRpc {
+public:
+    static RpcConfig default_config() {
+        RpcConfig rpc_config;
+        rpc_config.protocol = "tcp";
+        rpc_config.bind_ip = "127.0.0.1";
+        rpc_config.io_thread_num = 1;
+        return rpc_config;
+    }
+
+    explicit FakeRpc(const RpcConfig& rpc_config = default_config(), int n = 2) {
+        _master = std::make_unique<Master>("127.0.0.1");
+        _master->initialize();
+        for (int i = 0; i < n; ++i) {
+            _mcs.push_back(std::make_unique<TcpMasterClient>(_master->endpoint()));
+            _mcs.back()->initialize();
+            _rpcs.push_back(std::make_unique<RpcService>());
+            _rpcs.back()->initialize(_mcs.back().get(), rpc_config);
+        }
+    }
+
+    ~FakeRpc() {
+        stop();
+        for (auto& rpc : _rpcs) {
+            rpc->finalize();
+        }
+        for (auto& mc : _mcs) {
+            mc->finalize();
+        }
+        _master->exit();
+        _master->finalize();
+    }
+
+    RpcService* rpc(int i) {
+        return _rpcs[i].get();
+    }
+
+    // 后台线程反复调用poll直到stop，poll应该在100ms左右返回
+    void spawn(std::function<void()> poll) {
+        _threads.emplace_back([this, poll]() {
+            while (!_stop.load()) {
+                poll();
+            }
+        });
+    }
+
+    // 在第i个RpcService上创建server，stop时删除
+    RpcServer* create_server(int i, const std::string& rpc_name) {
+        _servers.push_back(rpc(i)->create_server(rpc_name));
+        return _servers.back().get();
+    }
+
+    // handler填好response后由后台线程发送
+    RpcServer* serve(int i, const std::string& rpc_name, rpc_handler_t handler) {
+        RpcServer* server = create_server(i, rpc_name);
+        std::shared_ptr<Dealer> dealer = server->create_dealer();
+        spawn([dealer, handler]() {
+            RpcRequest request;
+            if (dealer->recv_request(request, 100)) {
+                RpcResponse response(request);
+                handler(request, response);
+                dealer->send_response(std::move(response));
+            }
+        });
+        return server;
+    }
+
+    void stop() {
+        _stop.store(true);
+        for (auto& th : _threads) {
+            th.join();
+        }
+        _threads.clear();
+        _servers.clear();
+    }
+
+private:
+    std::unique_ptr<Master> _master;
+    std::vector<std::unique_ptr<TcpMasterClient>> _mcs;
+    std::vector<std::unique_ptr<RpcService>> _rpcs;
+    std::vector<std::unique_ptr<RpcServer>> _servers;
+    std::vector<std::thread> _threads;
+    std::atomic<bool> _stop = {false};
+};
+
+// 回复request中的int
+inline void echo_int(RpcRequest& request, RpcResponse& response) {
+    int value;
+    request >> value;
+    response << value;
+}
+
+// 只有部分key有值的稀疏数据，可压缩
+inline std::vector<float> sparse_values(size_t n, unsigned seed) {
+    std::vector<float> values(n, 0);
+    for (size_t i = 0; i < n; i += 7) {
+        values[i] = (seed + i) % 100 / 10.0;
+    }
+    return values;
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+#endif // PARADIGM4_PICO_CORE_TEST_FAKE_RPC_H
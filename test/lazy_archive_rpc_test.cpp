@@ -137,6 +137,13 @@ void client_run(RpcService* rpc, const std::string& rpc_name) {
             z.push_back(s);
             z0.push_back(s);
         }
+        // 大于MIN_ZERO_COPY_SIZE，走zero copy
+        mystring big((k + 1) * 64 * 1024);
+        for (int j = 0; j < (k + 1) * 64 * 1024; j++) {
+            big.c_str()[j] = 'a' + (j * k) % 26;
+        }
+        z.push_back(big);
+        z0.push_back(big);
         std::vector<mystring> Z = z, Z0 = Z, Z1(REPEAT);
 
         RpcRequest request;
@@ -176,7 +183,7 @@ void client_run(RpcService* rpc, const std::string& rpc_name) {
     dealer.reset();
 };
 
-TEST(LazyArchive, rpc) {
+void lazy_archive_rpc_run(const RpcConfig& rpc_config) {
     Master master("127.0.0.1");
     master.initialize();
     auto master_ep = master.endpoint();
@@ -186,10 +193,6 @@ TEST(LazyArchive, rpc) {
     mc2.initialize();
 
     RpcService rpc1, rpc2;
-    RpcConfig rpc_config;
-    rpc_config.protocol = "tcp";
-    rpc_config.bind_ip = "127.0.0.1";
-    rpc_config.io_thread_num = 1;
     rpc1.initialize(&mc1, rpc_config);
     rpc2.initialize(&mc2, rpc_config);
 
@@ -220,6 +223,23 @@ TEST(LazyArchive, rpc) {
 
 }
 
+TEST(LazyArchive, rpc) {
+    RpcConfig rpc_config;
+    rpc_config.protocol = "tcp";
+    rpc_config.bind_ip = "127.0.0.1";
+    rpc_config.io_thread_num = 1;
+    lazy_archive_rpc_run(rpc_config);
+}
+
+TEST(LazyArchive, rpc_single_connection) {
+    RpcConfig rpc_config;
+    rpc_config.protocol = "tcp";
+    rpc_config.bind_ip = "127.0.0.1";
+    rpc_config.io_thread_num = 1;
+    rpc_config.tcp.single_connection = true;
+    lazy_archive_rpc_run(rpc_config);
+}
+
 
 } // namespace core
 } // namespace pico
@@ -0,0 +1,175 @@
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "LoadBalancer.h"
+#include "fake_rpc.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+static std::vector<LoadInfo> make_infos(const std::vector<int>& outstanding,
+      const std::vector<double>& latency_us) {
+    std::vector<LoadInfo> ret(outstanding.size());
+    for (size_t i = 0; i < ret.size(); ++i) {
+        ret[i].available = true;
+        ret[i].outstanding = outstanding[i];
+        ret[i].latency_us = latency_us[i];
+    }
+    return ret;
+}
+
+TEST(LoadBalancer, skip_unavailable) {
+    for (std::string policy : {"random", "round_robin", "p2c",
+              "least_outstanding", "latency_weighted"}) {
+        auto lb = LoadBalancer::create(policy);
+        auto infos = make_infos({0, 0, 0}, {0, 0, 0});
+        infos[0].available = false;
+        infos[2].available = false;
+        for (int i = 0; i < 100; ++i) {
+            EXPECT_EQ(lb->select(infos), 1) << policy;
+        }
+        infos[1].available = false;
+        EXPECT_EQ(lb->select(infos), -1) << policy;
+        EXPECT_EQ(lb->select({}), -1) << policy;
+    }
+}
+
+TEST(LoadBalancer, round_robin) {
+    auto lb = LoadBalancer::create("round_robin");
+    auto infos = make_infos({0, 0, 0}, {0, 0, 0});
+    std::vector<int> cnt(3, 0);
+    for (int i = 0; i < 300; ++i) {
+        ++cnt[lb->select(infos)];
+    }
+    EXPECT_EQ(cnt, std::vector<int>({100, 100, 100}));
+}
+
+TEST(LoadBalancer, least_outstanding) {
+    auto lb = LoadBalancer::create("least_outstanding");
+    auto infos = make_infos({5, 1, 3}, {0, 0, 0});
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->select(infos), 1);
+    }
+}
+
+TEST(LoadBalancer, p2c) {
+    auto lb = LoadBalancer::create("p2c");
+    // 两个候选时总是比较这两个
+    auto infos = make_infos({4, 2}, {0, 0});
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->select(infos), 1);
+    }
+    infos = make_infos({2, 2}, {100, 10});
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->select(infos), 1);
+    }
+    // 负载最大的永远不会被选中
+    infos = make_infos({1, 9, 2, 3}, {0, 0, 0, 0});
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_NE(lb->select(infos), 1);
+    }
+}
+
+TEST(LoadBalancer, latency_weighted) {
+    auto lb = LoadBalancer::create("latency_weighted");
+    auto infos = make_infos({0, 0}, {100, 10000});
+    std::vector<int> cnt(2, 0);
+    for (int i = 0; i < 10000; ++i) {
+        ++cnt[lb->select(infos)];
+    }
+    EXPECT_GT(cnt[0], cnt[1] * 20);
+    EXPECT_GT(cnt[1], 0);
+}
+
+TEST(LoadStat, ewma) {
+    LoadStat stat;
+    stat.on_send();
+    stat.on_send();
+    EXPECT_EQ(stat.outstanding(), 2);
+    stat.on_response(100);
+    EXPECT_EQ(stat.outstanding(), 1);
+    EXPECT_DOUBLE_EQ(stat.latency_us(), 100);
+    stat.on_response(200);
+    EXPECT_EQ(stat.outstanding(), 0);
+    EXPECT_DOUBLE_EQ(stat.latency_us(), 100 + LoadStat::EWMA_ALPHA * 100);
+    // 多余的response不会让outstanding变成负数
+    stat.on_response(100);
+    EXPECT_EQ(stat.outstanding(), 0);
+    stat.on_send();
+    EXPECT_EQ(stat.outstanding(), 1);
+    // 没有时间戳的response只减少计数
+    stat.on_response(-1);
+    EXPECT_EQ(stat.outstanding(), 0);
+    EXPECT_DOUBLE_EQ(stat.latency_us(), 100 + LoadStat::EWMA_ALPHA * 100);
+}
+
+TEST(LoadStat, terminal) {
+    LoadStat stat;
+    for (int i = 0; i < 5; ++i) {
+        stat.on_send();
+    }
+    // 2个发出后收到response, 1个发出后连接断开, 1个转到别处重发, 1个还在队列中
+    stat.on_sent(3);
+    stat.on_response(100);
+    stat.on_response(100);
+    EXPECT_EQ(stat.outstanding(), 3);
+    stat.on_drop(1);
+    EXPECT_EQ(stat.outstanding(), 2);
+    stat.on_disconnect();
+    EXPECT_EQ(stat.outstanding(), 1);
+    EXPECT_DOUBLE_EQ(stat.latency_us(), 0);
+    stat.on_disconnect();
+    EXPECT_EQ(stat.outstanding(), 1);
+
+    // response先于on_sent到达
+    stat.on_response(100);
+    stat.on_sent(1);
+    stat.on_disconnect();
+    EXPECT_EQ(stat.outstanding(), 0);
+}
+
+// 同一个rank上的两个server，一个不取request；不指定sid的request避开积压的那个
+TEST(RpcService, ServerLoadBalance) {
+    const int count = 50;
+    FakeRpc rpc;
+    rpc.rpc(1)->set_load_balance("lb", "least_outstanding");
+    RpcServer* stuck = rpc.create_server(1, "lb");
+    std::shared_ptr<Dealer> stuck_dealer = stuck->create_dealer();
+    rpc.serve(1, "lb", echo_int);
+
+    auto client = rpc.rpc(0)->create_client("lb", 2);
+    auto dealer = client->create_dealer();
+    int succ = 0;
+    for (int i = 0; i < count; ++i) {
+        RpcRequest request;
+        request << i;
+        dealer->send_request(std::move(request));
+        RpcResponse response;
+        // 第一个request可能落在不取request的server上
+        if (dealer->recv_response(response, 200)) {
+            int value;
+            response >> value;
+            EXPECT_EQ(value, i);
+            ++succ;
+        } else {
+            EXPECT_EQ(i, 0);
+        }
+    }
+    EXPECT_GE(succ, count - 1);
+    EXPECT_LE(stuck_dealer->pending_requests(), 1);
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    int ret = RUN_ALL_TESTS();
+    return ret;
+}
@@ -0,0 +1,83 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "BoundedQueue.h"
+#include "MpscQueue.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+const int N = 1 << 22;
+
+// 每个元素一次pico_new/pico_delete，即原来的MpscQueue
+typedef MpscQueue<int64_t, 0> AllocMpscQueue;
+
+// 让BoundedQueue和MpscQueue接口一致，满时自旋
+struct SpinBoundedQueue {
+    BoundedQueue<int64_t> q{4096};
+
+    void push(int64_t&& v) {
+        while (!q.try_push(std::move(v))) {
+            std::this_thread::yield();
+        }
+    }
+
+    bool pop(int64_t& v) {
+        return q.pop(v);
+    }
+};
+
+// producer_num个线程一共push N个，一个线程pop，返回每秒的个数
+template <class Q>
+double mpsc_throughput(int producer_num) {
+    Q q;
+    std::vector<std::thread> producers;
+    auto start = std::chrono::steady_clock::now();
+    for (int p = 0; p < producer_num; ++p) {
+        producers.emplace_back([&q, p, producer_num]() {
+            for (int64_t i = p; i < N; i += producer_num) {
+                int64_t x = i;
+                q.push(std::move(x));
+            }
+        });
+    }
+    int64_t sum = 0;
+    int64_t x;
+    for (int i = 0; i < N; ) {
+        if (q.pop(x)) {
+            sum += x;
+            ++i;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+    for (auto& t : producers) {
+        t.join();
+    }
+    EXPECT_EQ(sum, int64_t(N) * (N - 1) / 2);
+    return N / dur.count();
+}
+
+TEST(MpscQueueBenchmark, throughput) {
+    for (int producer_num : {1, 4, 16}) {
+        LOG(INFO) << producer_num << " producers, "
+                  << "alloc: " << mpsc_throughput<AllocMpscQueue>(producer_num) / 1e6 << "M/s, "
+                  << "free list: " << mpsc_throughput<MpscQueue<int64_t>>(producer_num) / 1e6 << "M/s, "
+                  << "bounded: " << mpsc_throughput<SpinBoundedQueue>(producer_num) / 1e6 << "M/s";
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
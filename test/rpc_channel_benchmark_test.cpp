@@ -0,0 +1,93 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcChannel.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// need_fd为true时是eventfd，否则是futex
+const bool kModes[] = {false, true};
+
+const char* mode_name(bool need_fd) {
+    return need_fd ? "eventfd" : "futex";
+}
+
+// 两个线程来回传一个数，返回单程延迟，单位us
+double ping_pong_us(bool need_fd, int n) {
+    RpcChannel<int> ping(need_fd), pong(need_fd);
+    std::thread echo([&]() {
+        int x;
+        for (int i = 0; i < n; ++i) {
+            EXPECT_TRUE(ping.recv(x, -1, 1));
+            pong.send(std::move(x));
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        int x = i;
+        ping.send(std::move(x));
+        EXPECT_TRUE(pong.recv(x, -1, 1));
+        EXPECT_EQ(x, i);
+    }
+    std::chrono::duration<double, std::micro> dur = std::chrono::steady_clock::now() - start;
+    echo.join();
+    return dur.count() / n / 2;
+}
+
+// producer_num个线程一共发n个，返回每秒收到的个数
+double throughput(bool need_fd, int producer_num, int n) {
+    RpcChannel<int> ch(need_fd);
+    std::vector<std::thread> producers;
+    auto start = std::chrono::steady_clock::now();
+    for (int p = 0; p < producer_num; ++p) {
+        producers.emplace_back([&ch, p, producer_num, n]() {
+            for (int i = p; i < n; i += producer_num) {
+                int x = i;
+                ch.send(std::move(x));
+            }
+        });
+    }
+    int64_t sum = 0;
+    int x;
+    for (int i = 0; i < n; ++i) {
+        EXPECT_TRUE(ch.recv(x, -1, 1));
+        sum += x;
+    }
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+    for (auto& t : producers) {
+        t.join();
+    }
+    EXPECT_EQ(sum, int64_t(n) * (n - 1) / 2);
+    return n / dur.count();
+}
+
+TEST(RpcChannelBenchmark, ping_pong) {
+    for (bool need_fd : kModes) {
+        LOG(INFO) << mode_name(need_fd) << " ping pong: "
+                  << ping_pong_us(need_fd, 100000) << "us";
+    }
+}
+
+TEST(RpcChannelBenchmark, throughput) {
+    for (int producer_num : {1, 4, 16}) {
+        for (bool need_fd : kModes) {
+            LOG(INFO) << mode_name(need_fd) << " " << producer_num << " producers: "
+                      << throughput(need_fd, producer_num, 1 << 21) / 1e6 << "M/s";
+        }
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
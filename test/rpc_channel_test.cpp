@@ -1,6 +1,8 @@
 #include "RpcChannel.h"
+#include <chrono>
 #include <iostream>
 #include <thread>
+#include <vector>
 #include "glog/logging.h"
 #include "gtest/gtest.h"
 
@@ -37,6 +39,95 @@ TEST(RpcChannel, read_write_ok) {
     t2.join();
 }
 
+// 多个生产者，消费者批量取，不丢不重
+TEST(RpcChannel, recv_batch) {
+    const int producer_num = 4;
+    const int M = 100000;
+    RpcChannel<int> ch;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producer_num; ++p) {
+        producers.emplace_back([&ch, p, M]() {
+            for (int i = 0; i < M; ++i) {
+                int x = p * M + i;
+                ch.send(std::move(x));
+            }
+        });
+    }
+    std::vector<int> seen(producer_num * M, 0);
+    std::vector<int> items;
+    int cnt = 0;
+    while (cnt < producer_num * M) {
+        items.clear();
+        size_t n = ch.recv_batch(items, 256, -1);
+        ASSERT_GT(n, 0u);
+        ASSERT_LE(n, 256u);
+        ASSERT_EQ(n, items.size());
+        for (int x : items) {
+            ++seen[x];
+        }
+        cnt += n;
+    }
+    for (auto& t : producers) {
+        t.join();
+    }
+    for (int x : seen) {
+        ASSERT_EQ(x, 1);
+    }
+    std::vector<int> rest;
+    EXPECT_EQ(ch.recv_batch(rest, 256, 10), 0u);
+    ch.terminate();
+    int x;
+    EXPECT_FALSE(ch.recv(x, -1));
+}
+
+// 带超时的recv与send竞争：send的间隔在超时附近抖动，
+// 覆盖睡下后被唤醒、超时撤销等待成功、撤销时send已看到-1三种情况
+static void timed_recv_race(bool need_fd) {
+    const int M = 3000;
+    RpcChannel<int> ch(need_fd);
+    std::thread producer([&ch, M]() {
+        for (int i = 0; i < M; ++i) {
+            // 0~2000us，超时是1ms
+            std::this_thread::sleep_for(std::chrono::microseconds(i * 7919 % 2001));
+            int x = i;
+            ch.send(std::move(x));
+        }
+    });
+    int next = 0, timeouts = 0;
+    while (next < M) {
+        int x = -1;
+        // 不自旋，直接走等待路径
+        if (ch.recv(x, 1, 0)) {
+            // 单个生产者，顺序不变，不丢不重
+            ASSERT_EQ(x, next);
+            ++next;
+        } else {
+            ++timeouts;
+        }
+    }
+    producer.join();
+    EXPECT_GT(timeouts, 0);
+    EXPECT_EQ(ch.size(), 0);
+    // 所有唤醒都已经收下，后续的等待不会被多余的post提前唤醒
+    int x;
+    EXPECT_FALSE(ch.recv(x, 10, 0));
+    x = M;
+    ch.send(std::move(x));
+    EXPECT_TRUE(ch.recv(x, -1, 0));
+    EXPECT_EQ(x, M);
+    EXPECT_EQ(ch.size(), 0);
+    ch.terminate();
+    EXPECT_FALSE(ch.recv(x, -1, 0));
+}
+
+TEST(RpcChannel, timed_recv_race) {
+    timed_recv_race(false);
+}
+
+TEST(RpcChannel, timed_recv_race_eventfd) {
+    timed_recv_race(true);
+}
+
 } // namespace core
 } // namespace pico
 } // namespace paradigm4
@@ -0,0 +1,77 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+TEST(RpcService, Compress) {
+    FakeRpc rpc;
+    RpcCompressOption lazy_option("lz4", 1024, 64 << 10);
+    rpc.rpc(0)->set_compress("compress", lazy_option);
+    rpc.rpc(1)->set_compress("compress", RpcCompressOption("zstd"));
+    rpc.serve(1, "compress", [](RpcRequest& request, RpcResponse& response) {
+        std::vector<float> body;
+        std::vector<char> small, random;
+        std::vector<float> large;
+        request >> body;
+        request.lazy() >> small >> large >> random;
+        response << body << small << random;
+        response.lazy() << std::move(large);
+    });
+
+    auto client = rpc.rpc(0)->create_client("compress", 1);
+    auto dealer = client->create_dealer();
+    std::vector<char> random(256 << 10);
+    for (auto& c : random) {
+        c = rand();
+    }
+    for (int k = 0; k < 100; ++k) {
+        std::vector<float> body = sparse_values(25 << 10, k);
+        std::vector<char> small(8 << 10, 'a' + k % 26);
+        std::vector<float> large = sparse_values(1 << 18, k + 1);
+        RpcRequest request;
+        // 单个request的选项覆盖按rpc name设置的
+        if (k % 2) {
+            request.set_compress(RpcCompressOption("snappy"));
+        }
+        request << body;
+        request.lazy() << std::vector<char>(small) << std::vector<float>(large)
+                       << std::vector<char>(random);
+        dealer->send_request(std::move(request));
+
+        RpcResponse response;
+        ASSERT_TRUE(dealer->recv_response(response));
+        std::vector<float> rbody, rlarge;
+        std::vector<char> rsmall, rrandom;
+        response >> rbody >> rsmall >> rrandom;
+        response.lazy() >> rlarge;
+        EXPECT_EQ(rbody, body);
+        EXPECT_EQ(rsmall, small);
+        EXPECT_EQ(rrandom, random);
+        EXPECT_EQ(rlarge, large);
+    }
+
+    for (uint8_t codec : {RPC_CODEC_LZ4, RPC_CODEC_SNAPPY, RPC_CODEC_ZSTD}) {
+        auto& st = RpcCompressor::stat(codec);
+        EXPECT_LT(st.wire_bytes.load(), st.raw_bytes.load()) << RpcCompressor::codec_name(codec);
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
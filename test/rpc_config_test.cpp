@@ -0,0 +1,69 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <string>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcContext.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 用户自己的配置类型只有最初的字段
+struct OldTcpConfig {
+    int keepalive_time = 10;
+    int keepalive_intvl = 11;
+    int keepalive_probes = 12;
+    int connect_timeout = 13;
+};
+
+struct OldRpcConfig {
+    std::string bind_ip = "127.0.0.2";
+    size_t io_thread_num = 3;
+    std::string protocol = "shm";
+#ifdef USE_RDMA
+    RdmaConfig rdma;
+#endif
+    OldTcpConfig tcp;
+};
+
+struct NewerRpcConfig : OldRpcConfig {
+    size_t async_thread_num = 7;
+    SendQueueConfig send_queue;
+};
+
+TEST(RpcConfig, ConvertOldConfig) {
+    RpcConfig config = OldRpcConfig();
+    EXPECT_EQ(config.bind_ip, "127.0.0.2");
+    EXPECT_EQ(config.io_thread_num, 3u);
+    EXPECT_EQ(config.protocol, "shm");
+    EXPECT_EQ(config.tcp.keepalive_time, 10);
+    EXPECT_EQ(config.tcp.connect_timeout, 13);
+    // 后加的字段保留默认值
+    RpcConfig def;
+    EXPECT_FALSE(config.tcp.single_connection);
+    EXPECT_EQ(config.async_thread_num, def.async_thread_num);
+    EXPECT_EQ(config.shm.handover_arena_size, def.shm.handover_arena_size);
+    EXPECT_EQ(config.send_queue.policy, def.send_queue.policy);
+    EXPECT_EQ(config.compact_head, def.compact_head);
+
+    NewerRpcConfig newer;
+    newer.send_queue.policy = "weighted";
+    config = newer;
+    EXPECT_EQ(config.async_thread_num, 7u);
+    EXPECT_EQ(config.send_queue.policy, "weighted");
+    EXPECT_EQ(config.shm.ring_size, def.shm.ring_size);
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// server处理一个request要10ms，排队超过deadline的request不再处理
+TEST(RpcService, RequestDeadline) {
+    const int count = 40;
+    FakeRpc rpc;
+    std::atomic<int> handled = {0};
+    rpc.serve(1, "deadline", [&handled](RpcRequest&, RpcResponse&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ++handled;
+    });
+
+    auto client = rpc.rpc(0)->create_client("deadline", 1);
+    auto dealer = client->create_dealer();
+    // 到达时就已经过期
+    RpcRequest expired;
+    expired.set_timeout(-1);
+    dealer->send_request(std::move(expired));
+    RpcResponse response;
+    ASSERT_TRUE(dealer->recv_response(response));
+    EXPECT_EQ(response.error_code(), RpcErrorCodeType::ETIMEOUT);
+
+    dealer->set_request_timeout(100);
+    for (int i = 0; i < count; ++i) {
+        dealer->send_request(RpcRequest());
+    }
+    int timeout_num = 0;
+    for (int i = 0; i < count; ++i) {
+        ASSERT_TRUE(dealer->recv_response(response));
+        if (response.error_code() == RpcErrorCodeType::ETIMEOUT) {
+            ++timeout_num;
+        } else {
+            EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+        }
+    }
+    EXPECT_GT(timeout_num, 0);
+    EXPECT_EQ(timeout_num + 1, int(rpc.rpc(1)->ctx()->expired_request_num()));
+    EXPECT_EQ(handled + timeout_num, count);
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// server处理慢时，client发出但没有收到response的request不超过credit
+void flow_control_run(bool block) {
+    const size_t msg_size = 64 << 10;
+    const size_t window = 16;
+    const int count = 200;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.flow_control.max_credit_bytes = window * msg_size;
+    rpc_config.flow_control.block = block;
+    FakeRpc rpc(rpc_config);
+    std::atomic<int> handled = {0};
+    rpc.serve(1, "flow_control", [&handled](RpcRequest&, RpcResponse&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        ++handled;
+    });
+
+    auto client = rpc.rpc(0)->create_client("flow_control", 1);
+    auto dealer = client->create_dealer();
+    // 不等response一直发
+    int max_outstanding = 0;
+    for (int i = 0; i < count; ++i) {
+        RpcRequest request;
+        request << std::string(msg_size - sizeof(rpc_head_t) - 8, 'a');
+        dealer->send_request(std::move(request));
+        max_outstanding = std::max(max_outstanding, i + 1 - handled.load());
+    }
+    int overload_num = 0;
+    for (int i = 0; i < count; ++i) {
+        RpcResponse response;
+        ASSERT_TRUE(dealer->recv_response(response));
+        if (response.error_code() == RpcErrorCodeType::EOVERLOAD) {
+            ++overload_num;
+        } else {
+            EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+        }
+    }
+    EXPECT_EQ(handled + overload_num, count);
+    if (block) {
+        EXPECT_EQ(overload_num, 0);
+        // 最后一个response归还credit和server取下一个request之间有一点间隔
+        EXPECT_LE(max_outstanding, int(window) + 2);
+    } else {
+        EXPECT_GT(overload_num, 0);
+    }
+}
+
+TEST(RpcService, FlowControlBlock) {
+    flow_control_run(true);
+}
+
+TEST(RpcService, FlowControlOverload) {
+    flow_control_run(false);
+}
+
+// 对端没有处理的request也要带回credit，否则之后的request一直EOVERLOAD
+TEST(RpcService, FlowControlNoSuchService) {
+    const size_t msg_size = 48 << 10;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.flow_control.max_credit_bytes = 64 << 10;
+    rpc_config.flow_control.block = false;
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "credit", [](RpcRequest&, RpcResponse&) {});
+    auto client = rpc.rpc(0)->create_client("credit", 1);
+    auto dealer = client->create_dealer();
+    auto missing_client = rpc.rpc(0)->create_client("missing", 0);
+    auto missing_dealer = missing_client->create_dealer();
+    comm_rank_t server_rank = rpc.rpc(1)->global_rank();
+
+    for (int i = 0; i < 10; ++i) {
+        RpcRequest missing(server_rank);
+        missing << std::string(msg_size, 'a');
+        missing_dealer->send_request(std::move(missing));
+        RpcResponse response;
+        ASSERT_TRUE(missing_dealer->recv_response(response, 5000));
+        EXPECT_EQ(response.error_code(), RpcErrorCodeType::ENOSUCHSERVICE);
+
+        RpcRequest request;
+        request << std::string(msg_size, 'b');
+        dealer->send_request(std::move(request));
+        ASSERT_TRUE(dealer->recv_response(response, 5000));
+        EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+    }
+}
+
+// server没有取走的request在dealer结束时回复ENOSUCHSERVER
+TEST(RpcService, FlowControlTerminatedDealer) {
+    const size_t msg_size = 48 << 10;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.flow_control.max_credit_bytes = 64 << 10;
+    rpc_config.flow_control.block = false;
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "other", [](RpcRequest&, RpcResponse&) {});
+    auto server = rpc.rpc(1)->create_server("credit");
+    auto server_dealer = server->create_dealer();
+    auto client = rpc.rpc(0)->create_client("credit", 1);
+    auto dealer = client->create_dealer();
+    auto other_client = rpc.rpc(0)->create_client("other", 1);
+    auto other_dealer = other_client->create_dealer();
+
+    RpcRequest request;
+    request << std::string(msg_size, 'a');
+    dealer->send_request(std::move(request));
+    // 等request进入server的队列
+    while (server_dealer->pending_requests() == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    server->terminate();
+    server_dealer.reset();
+    RpcResponse response;
+    ASSERT_TRUE(dealer->recv_response(response, 5000));
+    EXPECT_EQ(response.error_code(), RpcErrorCodeType::ENOSUCHSERVER);
+
+    // 同一个连接上的credit已经归还
+    RpcRequest other;
+    other << std::string(msg_size, 'b');
+    other_dealer->send_request(std::move(other));
+    ASSERT_TRUE(other_dealer->recv_response(response, 5000));
+    EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,123 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+TEST(RpcService, InlineHandler) {
+    FakeRpc rpc;
+    auto server = rpc.rpc(1)->create_server("inline");
+    auto server_dealer = server->create_dealer([](RpcRequest& req, RpcResponse& resp) {
+        int value;
+        req >> value;
+        resp << value + 1;
+    });
+
+    auto client = rpc.rpc(0)->create_client("inline", 1);
+    auto dealer = client->create_dealer();
+    for (int i = 0; i < 1000; ++i) {
+        RpcRequest request;
+        request << i;
+        RpcResponse response = dealer->sync_rpc_call(std::move(request));
+        ASSERT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+        int value;
+        response >> value;
+        EXPECT_EQ(value, i + 1);
+    }
+    EXPECT_FALSE(server_dealer->inline_offloaded());
+}
+
+TEST(RpcService, SlowInlineHandler) {
+    FakeRpc rpc;
+    auto server = rpc.rpc(1)->create_server("slow_inline");
+    InlineHandlerOption opt;
+    opt.slow_us = 500;
+    opt.max_slow_calls = 4;
+    std::atomic<bool> slow = {true};
+    auto server_dealer = server->create_dealer([&slow](RpcRequest&, RpcResponse&) {
+        if (slow.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }, opt);
+
+    auto client = rpc.rpc(0)->create_client("slow_inline", 1);
+    auto dealer = client->create_dealer();
+    for (int i = 0; i < 3; ++i) {
+        dealer->sync_rpc_call(RpcRequest());
+    }
+    EXPECT_FALSE(server_dealer->inline_offloaded());
+    for (int i = 0; i < 10; ++i) {
+        RpcResponse response = dealer->sync_rpc_call(RpcRequest());
+        EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+    }
+    EXPECT_TRUE(server_dealer->inline_offloaded());
+
+    // 变快之后回到io线程
+    slow.store(false);
+    for (int i = 0; i < 10; ++i) {
+        RpcResponse response = dealer->sync_rpc_call(RpcRequest());
+        EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+    }
+    EXPECT_FALSE(server_dealer->inline_offloaded());
+}
+
+// inline handler在io线程中转发超过credit的request，不能等待credit
+TEST(RpcService, InlineHandlerFlowControl) {
+    const int count = 20;
+    const size_t msg_size = 48 << 10;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.flow_control.max_credit_bytes = 64 << 10;
+    FakeRpc rpc(rpc_config);
+    std::atomic<int> forwarded = {0};
+    rpc.serve(0, "back", [&forwarded](RpcRequest&, RpcResponse&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        ++forwarded;
+    });
+    auto back_client = rpc.rpc(1)->create_client("back", 1);
+    auto back_dealer = back_client->create_dealer();
+    auto server = rpc.rpc(1)->create_server("front");
+    auto server_dealer = server->create_dealer([&back_dealer](RpcRequest&, RpcResponse&) {
+        RpcRequest request;
+        request << std::string(msg_size, 'a');
+        back_dealer->send_request(std::move(request));
+    });
+
+    auto client = rpc.rpc(0)->create_client("front", 1);
+    auto dealer = client->create_dealer();
+    for (int i = 0; i < count; ++i) {
+        dealer->send_request(RpcRequest());
+    }
+    for (int i = 0; i < count; ++i) {
+        RpcResponse response;
+        ASSERT_TRUE(dealer->recv_response(response, 5000));
+        EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+    }
+    for (int i = 0; i < count; ++i) {
+        RpcResponse response;
+        ASSERT_TRUE(back_dealer->recv_response(response, 5000));
+        EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+    }
+    EXPECT_EQ(forwarded.load(), count);
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,122 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+static RpcConfig io_uring_config(bool single_connection) {
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.protocol = "io_uring";
+    rpc_config.tcp.single_connection = single_connection;
+    return rpc_config;
+}
+
+static void echo_blocks(RpcRequest& request, RpcResponse& response) {
+    std::string body;
+    std::vector<char> block1, block2;
+    request >> body;
+    request.lazy() >> block1 >> block2;
+    response << body;
+    response.lazy() << std::move(block2) << std::move(block1);
+}
+
+// 小消息, 超过接收缓冲区的body, 以及zero copy的大block
+static void io_uring_lazy_blocks(bool single_connection) {
+    FakeRpc rpc(io_uring_config(single_connection));
+    rpc.serve(1, "io_uring", echo_blocks);
+
+    auto client = rpc.rpc(0)->create_client("io_uring", 1);
+    auto dealer = client->create_dealer();
+    std::vector<size_t> sizes = {0, 100, 8 << 10, 100 << 10, 3 << 20};
+    for (int k = 0; k < 10; ++k) {
+        for (size_t size : sizes) {
+            std::string body(size, 'a' + k % 26);
+            std::vector<char> block1(size, 'b' + k % 20), block2(size / 2 + 5, 'c');
+            RpcRequest request;
+            request << body;
+            request.lazy() << std::vector<char>(block1) << std::vector<char>(block2);
+            dealer->send_request(std::move(request));
+
+            RpcResponse response;
+            ASSERT_TRUE(dealer->recv_response(response));
+            std::string rbody;
+            std::vector<char> rblock1, rblock2;
+            response >> rbody;
+            response.lazy() >> rblock2 >> rblock1;
+            EXPECT_EQ(rbody, body);
+            EXPECT_EQ(rblock1, block1);
+            EXPECT_EQ(rblock2, block2);
+        }
+    }
+}
+
+TEST(IoUringSocket, LazyBlocks) {
+    io_uring_lazy_blocks(false);
+}
+
+TEST(IoUringSocket, SingleConnectionLazyBlocks) {
+    io_uring_lazy_blocks(true);
+}
+
+// 多个线程同时发送，发送端经常遇到EAGAIN挂起，接收端一次唤醒收割多个消息
+TEST(IoUringSocket, ConcurrentSend) {
+    const int client_thread_num = 4;
+    const int count = 2000;
+    FakeRpc rpc(io_uring_config(false));
+    rpc.serve(1, "io_uring", echo_blocks);
+
+    auto client = rpc.rpc(0)->create_client("io_uring", 1);
+    auto dealer = client->create_dealer();
+    std::vector<std::thread> client_threads;
+    std::vector<std::vector<std::future<RpcResponse>>> futures(client_thread_num);
+    for (int t = 0; t < client_thread_num; ++t) {
+        client_threads.emplace_back([&, t]() {
+            for (int i = 0; i < count; ++i) {
+                RpcRequest request;
+                request << std::to_string(t * count + i);
+                request.lazy() << std::vector<char>(i % 7 == 0 ? 64 << 10 : 0, 'x')
+                      << std::vector<char>();
+                futures[t].push_back(dealer->async_request(std::move(request)));
+            }
+        });
+    }
+    for (auto& th : client_threads) {
+        th.join();
+    }
+    for (int t = 0; t < client_thread_num; ++t) {
+        for (int i = 0; i < count; ++i) {
+            RpcResponse response = futures[t][i].get();
+            ASSERT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+            std::string body;
+            std::vector<char> block1, block2;
+            response >> body;
+            response.lazy() >> block2 >> block1;
+            EXPECT_EQ(body, std::to_string(t * count + i));
+            EXPECT_EQ(block1.size(), i % 7 == 0 ? size_t(64 << 10) : 0u);
+            EXPECT_EQ(block2.size(), 0u);
+        }
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    int ret = RUN_ALL_TESTS();
+    return ret;
+}
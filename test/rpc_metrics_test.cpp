@@ -0,0 +1,80 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <string>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+#include "observability/metrics/Metrics.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 每个TEST在单独的进程中运行，启用Metrics不影响其他测试
+TEST(RpcService, Metrics) {
+    const int count = 100;
+    metrics_initialize("127.0.0.1", 18480, "/metrics", "rpc_metrics_test", "0");
+    FakeRpc rpc;
+    rpc.serve(1, "metrics", [](RpcRequest& request, RpcResponse& response) {
+        int i;
+        request >> i;
+        if (i % 2) {
+            response.set_error_code(RpcErrorCodeType::ENOTFOUND);
+        }
+        response << i;
+    });
+
+    auto client = rpc.rpc(0)->create_client("metrics", 1);
+    auto dealer = client->create_dealer();
+    for (int i = 0; i < count; ++i) {
+        RpcRequest request;
+        request << i;
+        dealer->send_request(std::move(request));
+        RpcResponse response;
+        ASSERT_TRUE(dealer->recv_response(response));
+    }
+
+    std::string client_rank = std::to_string(rpc.rpc(0)->global_rank());
+    std::string server_rank = std::to_string(rpc.rpc(1)->global_rank());
+    auto value = [](const std::string& name, const std::string& rank,
+          const std::string& role) {
+        return metrics_counter(name, "", {{"rank", rank}, {"rpc", "metrics"},
+              {"role", role}}).Value();
+    };
+    EXPECT_EQ(value("pico_rpc_requests", client_rank, "client"), count);
+    EXPECT_EQ(value("pico_rpc_requests", server_rank, "server"), count);
+    double request_bytes = value("pico_rpc_request_bytes", client_rank, "client");
+    EXPECT_GE(request_bytes, count * (sizeof(rpc_head_t) + sizeof(int)));
+    EXPECT_EQ(value("pico_rpc_request_bytes", server_rank, "server"), request_bytes);
+    double response_bytes = value("pico_rpc_response_bytes", server_rank, "server");
+    EXPECT_GE(response_bytes, count * sizeof(rpc_head_t));
+    EXPECT_EQ(value("pico_rpc_response_bytes", client_rank, "client"), response_bytes);
+    EXPECT_EQ(metrics_counter("pico_rpc_errors", "", {{"rank", client_rank},
+          {"rpc", "metrics"}, {"code", "ENOTFOUND"}}).Value(), count / 2);
+
+    // client到server的连接上至少有这些request和response
+    EXPECT_GE(metrics_counter("pico_rpc_peer_sent_bytes", "",
+          {{"rank", client_rank}, {"peer", server_rank}}).Value(), request_bytes);
+    EXPECT_GE(metrics_counter("pico_rpc_peer_recv_bytes", "",
+          {{"rank", client_rank}, {"peer", server_rank}}).Value(), response_bytes);
+
+    // 延迟先累加在RpcLatencyHistogram中，每64个或者超过1秒才交给prometheus
+    auto latency = metrics_histogram("pico_rpc_latency_us", "",
+          {{"rank", client_rank}, {"rpc", "metrics"}}, {}).Collect().histogram;
+    EXPECT_GE(latency.sample_count, 64u);
+    EXPECT_LE(latency.sample_count, uint64_t(count));
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
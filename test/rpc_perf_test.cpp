@@ -1,12 +1,17 @@
 #include <cstdio>
 #include <cstdlib>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
 #include "RpcService.h"
+#include "fake_rpc.h"
 #include "macro.h"
 
 namespace paradigm4 {
@@ -15,48 +20,6 @@ namespace core {
 
 const int kMaxRetry = 100;
 
-class FakeRpc {
-public:
-    FakeRpc() {
-        _master = std::make_unique<Master>("127.0.0.1");
-        _master->initialize();
-        auto master_ep = _master->endpoint();
-        _mc1 = std::make_unique<TcpMasterClient>(master_ep);
-        _mc2 = std::make_unique<TcpMasterClient>(master_ep);
-        _mc1->initialize();
-        _mc2->initialize();
-        RpcConfig rpc_config;
-        rpc_config.protocol = "tcp";
-        rpc_config.bind_ip = "127.0.0.1";
-        rpc_config.io_thread_num = 1;
-        _rpc1 = std::make_unique<RpcService>();
-        _rpc2 = std::make_unique<RpcService>();
-        _rpc1->initialize(_mc1.get(), rpc_config);
-        _rpc2->initialize(_mc2.get(), rpc_config);
-    }
-
-    ~FakeRpc() {
-        _rpc1->finalize();
-        _rpc2->finalize();
-        _mc1->finalize();
-        _mc2->finalize();
-        _master->exit();
-        _master->finalize();
-    }
-
-    RpcService* rpc1() {
-        return _rpc1.get();
-    }
-
-    RpcService* rpc2() {
-        return _rpc2.get();
-    }
-
-    std::unique_ptr<Master> _master;
-    std::unique_ptr<RpcService> _rpc1, _rpc2;
-    std::unique_ptr<TcpMasterClient> _mc1, _mc2;
-};
-
 TEST(RpcService, SmallMessage) {
     auto server_run = [](RpcService* rpc) {
         auto server = rpc->create_server("asdf");
@@ -94,8 +57,8 @@ TEST(RpcService, SmallMessage) {
         }
     };
     FakeRpc rpc;
-    auto server_thread = std::thread(server_run, rpc.rpc1());
-    auto client_thread = std::thread(client_run, rpc.rpc1());
+    auto server_thread = std::thread(server_run, rpc.rpc(0));
+    auto client_thread = std::thread(client_run, rpc.rpc(0));
     client_thread.join();
     server_thread.join();
 }
@@ -144,15 +107,334 @@ TEST(RpcService, SmallLazyArchive) {
         }
     };
     FakeRpc rpc;
-    auto server_thread = std::thread(server_run, rpc.rpc1());
-    auto client_thread = std::thread(client_run, rpc.rpc1());
+    auto server_thread = std::thread(server_run, rpc.rpc(0));
+    auto client_thread = std::thread(client_run, rpc.rpc(0));
     client_thread.join();
     server_thread.join();
 }
 
 
+// 返回MB/s
+double lazy_block_throughput(const RpcConfig& rpc_config, size_t block_size) {
+    const size_t total_size = 1ul << 30;
+    const int window = 16;
+    int count = std::max<size_t>(total_size / block_size, window);
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "zero_copy", [](RpcRequest&, RpcResponse&) {});
+
+    auto client = rpc.rpc(0)->create_client("zero_copy", 1);
+    auto dealer = client->create_dealer();
+    std::vector<char> block(block_size, 'a');
+    auto send = [&]() {
+        RpcRequest request;
+        request.lazy() << std::vector<char>(block);
+        dealer->send_request(std::move(request));
+    };
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < window; ++i) {
+        send();
+    }
+    for (int i = 0; i < count; ++i) {
+        RpcResponse response;
+        EXPECT_TRUE(dealer->recv_response(response));
+        if (i + window < count) {
+            send();
+        }
+    }
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+    return double(block_size) * count / dur.count() / (1 << 20);
+}
+
+TEST(RpcService, ZeroCopyThroughput) {
+    for (size_t block_size : {64ul << 10, 256ul << 10, 1ul << 20, 4ul << 20, 16ul << 20}) {
+        RpcConfig rpc_config = FakeRpc::default_config();
+        double copy = lazy_block_throughput(rpc_config, block_size);
+        rpc_config.tcp.zero_copy_send = true;
+        double zero_copy = lazy_block_throughput(rpc_config, block_size);
+        SLOG(INFO) << "block size: " << (block_size >> 10) << "KB"
+                   << " copy: " << copy << "MB/s"
+                   << " zero copy: " << zero_copy << "MB/s";
+    }
+}
+
+void echo_string(RpcRequest& request, RpcResponse& response) {
+    std::string msg;
+    request >> msg;
+    response << msg;
+}
+
+// 单个client同步调用，返回平均往返时间，单位us
+double small_message_latency(const RpcConfig& rpc_config, size_t msg_size) {
+    const int count = 20000;
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "latency", echo_string);
+
+    auto client = rpc.rpc(0)->create_client("latency", 1);
+    auto dealer = client->create_dealer();
+    std::string msg(msg_size, 'a');
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i) {
+        RpcRequest request;
+        request << msg;
+        dealer->send_request(std::move(request));
+        RpcResponse response;
+        EXPECT_TRUE(dealer->recv_response(response));
+    }
+    std::chrono::duration<double, std::micro> dur = std::chrono::steady_clock::now() - start;
+    return dur.count() / count;
+}
 
+TEST(RpcService, ShmVsTcp) {
+    RpcConfig tcp_config = FakeRpc::default_config();
+    RpcConfig shm_config = FakeRpc::default_config();
+    shm_config.protocol = "shm";
+    for (size_t msg_size : {16ul, 1ul << 10, 16ul << 10}) {
+        double tcp = small_message_latency(tcp_config, msg_size);
+        double shm = small_message_latency(shm_config, msg_size);
+        SLOG(INFO) << "message size: " << msg_size << "B"
+                   << " tcp rtt: " << tcp << "us"
+                   << " shm rtt: " << shm << "us";
+    }
+    for (size_t block_size : {64ul << 10, 256ul << 10, 1ul << 20, 4ul << 20, 16ul << 20}) {
+        double tcp = lazy_block_throughput(tcp_config, block_size);
+        double shm = lazy_block_throughput(shm_config, block_size);
+        SLOG(INFO) << "block size: " << (block_size >> 10) << "KB"
+                   << " tcp: " << tcp << "MB/s"
+                   << " shm: " << shm << "MB/s";
+    }
+}
 
+// 两端的io线程都空转，对比阻塞epoll_wait的往返时间
+TEST(RpcService, BusyPollLatency) {
+    RpcConfig block_config = FakeRpc::default_config();
+    RpcConfig spin_config = FakeRpc::default_config();
+    spin_config.busy_poll_us = 200;
+    spin_config.tcp.busy_poll = 50;
+    spin_config.tcp.prefer_busy_poll = true;
+    for (std::string protocol : {"tcp", "shm"}) {
+        block_config.protocol = protocol;
+        spin_config.protocol = protocol;
+        for (size_t msg_size : {16ul, 1ul << 10}) {
+            double block = small_message_latency(block_config, msg_size);
+            double spin = small_message_latency(spin_config, msg_size);
+            SLOG(INFO) << protocol << " message size: " << msg_size << "B"
+                       << " blocking rtt: " << block << "us"
+                       << " busy poll rtt: " << spin << "us";
+        }
+    }
+}
+
+/*
+ * 两个server，其中一个每个request多sleep slow_us
+ * client在第三个进程内，多个线程各自同步调用，返回所有request延迟的(p50, p99)，单位ms
+ */
+std::pair<double, double> slow_server_latency(const std::string& policy, int slow_us) {
+    const int client_thread_num = 4;
+    const int count = 500;
+    FakeRpc rpc(FakeRpc::default_config(), 3);
+    rpc.serve(0, "lb", [](RpcRequest&, RpcResponse&) {});
+    rpc.serve(1, "lb", [slow_us](RpcRequest&, RpcResponse&) {
+        std::this_thread::sleep_for(std::chrono::microseconds(slow_us));
+    });
+
+    auto client = rpc.rpc(2)->create_client("lb", 2);
+    client->set_load_balance(policy);
+    std::vector<std::vector<double>> latency(client_thread_num);
+    std::vector<std::thread> client_threads;
+    for (int t = 0; t < client_thread_num; ++t) {
+        client_threads.emplace_back([&, t]() {
+            auto dealer = client->create_dealer();
+            for (int i = 0; i < count; ++i) {
+                auto start = std::chrono::steady_clock::now();
+                RpcRequest request;
+                dealer->send_request(std::move(request));
+                RpcResponse response;
+                EXPECT_TRUE(dealer->recv_response(response));
+                std::chrono::duration<double, std::milli> dur
+                      = std::chrono::steady_clock::now() - start;
+                latency[t].push_back(dur.count());
+            }
+        });
+    }
+    for (auto& th : client_threads) {
+        th.join();
+    }
+
+    std::vector<double> all;
+    for (auto& v : latency) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    std::sort(all.begin(), all.end());
+    return {all[all.size() / 2], all[all.size() * 99 / 100]};
+}
+
+TEST(RpcService, LoadBalanceSlowServer) {
+    for (std::string policy : {"random", "round_robin", "p2c",
+              "least_outstanding", "latency_weighted"}) {
+        auto ret = slow_server_latency(policy, 2000);
+        SLOG(INFO) << "policy: " << policy
+                   << " p50: " << ret.first << "ms"
+                   << " p99: " << ret.second << "ms";
+    }
+}
+
+// 返回同步调用的平均延迟，单位us
+double inline_handler_latency(bool inline_handler, int count) {
+    auto handler = [](RpcRequest& req, RpcResponse& resp) {
+        int value;
+        req >> value;
+        resp << value + 1;
+    };
+    FakeRpc rpc;
+    std::shared_ptr<Dealer> server_dealer;
+    if (inline_handler) {
+        server_dealer = rpc.create_server(1, "inline")->create_dealer(handler);
+    } else {
+        rpc.serve(1, "inline", handler);
+    }
+
+    auto client = rpc.rpc(0)->create_client("inline", 1);
+    auto dealer = client->create_dealer();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i) {
+        RpcRequest request;
+        request << i;
+        RpcResponse response = dealer->sync_rpc_call(std::move(request));
+        int value;
+        response >> value;
+        EXPECT_EQ(value, i + 1);
+    }
+    std::chrono::duration<double, std::micro> dur = std::chrono::steady_clock::now() - start;
+    return dur.count() / count;
+}
+
+TEST(RpcService, InlineHandlerLatency) {
+    double queued = inline_handler_latency(false, 10000);
+    double inlined = inline_handler_latency(true, 10000);
+    SLOG(INFO) << "queued: " << queued << "us inline: " << inlined << "us";
+}
+
+/*
+ * 大的BULK request在发送队列中时，同一连接上HIGH request的延迟
+ * 返回(大request全部返回的时间, HIGH request的p50)，单位ms
+ */
+std::pair<double, double> priority_latency(size_t chunk_bytes) {
+    const int bulk_num = 4;
+    const size_t bulk_size = 64 << 20;
+    const int ping_num = 20;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.send_queue.chunk_bytes = chunk_bytes;
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "bulk", [](RpcRequest&, RpcResponse&) {});
+    rpc.serve(1, "ping", [](RpcRequest&, RpcResponse&) {});
+
+    auto bulk_client = rpc.rpc(0)->create_client("bulk", 1);
+    auto ping_client = rpc.rpc(0)->create_client("ping", 1);
+    auto bulk_dealer = bulk_client->create_dealer();
+    auto ping_dealer = ping_client->create_dealer();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < bulk_num; ++i) {
+        RpcRequest request;
+        request.set_priority(RPC_PRIORITY_BULK);
+        request.lazy() << std::string(bulk_size, 'a' + i);
+        bulk_dealer->send_request(std::move(request));
+    }
+    std::vector<double> latency;
+    for (int i = 0; i < ping_num; ++i) {
+        auto ping_start = std::chrono::steady_clock::now();
+        RpcRequest request;
+        request.set_priority(RPC_PRIORITY_HIGH);
+        request << i;
+        ping_dealer->send_request(std::move(request));
+        RpcResponse response;
+        EXPECT_TRUE(ping_dealer->recv_response(response));
+        std::chrono::duration<double, std::milli> dur
+              = std::chrono::steady_clock::now() - ping_start;
+        latency.push_back(dur.count());
+    }
+    for (int i = 0; i < bulk_num; ++i) {
+        RpcResponse response;
+        EXPECT_TRUE(bulk_dealer->recv_response(response));
+    }
+    std::chrono::duration<double, std::milli> bulk_dur = std::chrono::steady_clock::now() - start;
+    std::sort(latency.begin(), latency.end());
+    return {bulk_dur.count(), latency[ping_num / 2]};
+}
+
+TEST(RpcService, PriorityLaneLatency) {
+    auto whole = priority_latency(0);
+    auto chunked = priority_latency(1 << 20);
+    SLOG(INFO) << "without chunk bulk: " << whole.first << "ms ping p50: " << whole.second << "ms";
+    SLOG(INFO) << "with chunk bulk: " << chunked.first << "ms ping p50: " << chunked.second << "ms";
+}
+
+/*
+ * client不等response连续发送tiny request，server原样回复
+ * 返回每秒往返的消息数
+ */
+double tiny_message_throughput(bool compact_head, bool checksum = false) {
+    const int count = 200000;
+    const int window = 1000;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.compact_head = compact_head;
+    rpc_config.checksum = checksum;
+    FakeRpc rpc(rpc_config);
+    std::shared_ptr<Dealer> server_dealer = rpc.create_server(1, "tiny")->create_dealer();
+    rpc.spawn([server_dealer]() {
+        std::vector<RpcRequest> reqs;
+        if (server_dealer->recv_requests(reqs, 64, 100)) {
+            for (auto& request : reqs) {
+                RpcResponse response(request);
+                response.archive().write_raw(request.archive().cursor(),
+                      request.archive().readable_length());
+                server_dealer->send_response(std::move(response));
+            }
+        }
+    });
+
+    auto client = rpc.rpc(0)->create_client("tiny", 1);
+    auto dealer = client->create_dealer();
+    const std::string payload(16, 'x');
+    auto start = std::chrono::steady_clock::now();
+    int sent = 0;
+    for (int received = 0; received < count; ++received) {
+        while (sent < count && sent - received < window) {
+            RpcRequest request;
+            request.archive().write_raw(payload.data(), payload.size());
+            dealer->send_request(std::move(request));
+            ++sent;
+        }
+        RpcResponse response;
+        EXPECT_TRUE(dealer->recv_response(response));
+        EXPECT_EQ(response.archive().readable_length(), payload.size());
+    }
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+    return count / dur.count();
+}
+
+TEST(RpcService, CompactHeadThroughput) {
+    double full = tiny_message_throughput(false);
+    double compact = tiny_message_throughput(true);
+    SLOG(INFO) << "16 bytes payload, full head: " << full / 1e3 << "K msg/s"
+               << ", compact head: " << compact / 1e3 << "K msg/s";
+}
+
+TEST(RpcService, ChecksumThroughput) {
+    for (size_t block_size : {64ul << 10, 1ul << 20, 16ul << 20}) {
+        RpcConfig rpc_config = FakeRpc::default_config();
+        double plain = lazy_block_throughput(rpc_config, block_size);
+        rpc_config.checksum = true;
+        double checked = lazy_block_throughput(rpc_config, block_size);
+        SLOG(INFO) << "block size: " << (block_size >> 10) << "KB"
+                   << " no checksum: " << plain << "MB/s"
+                   << " checksum: " << checked << "MB/s";
+    }
+    double plain = tiny_message_throughput(true);
+    double checked = tiny_message_throughput(true, true);
+    SLOG(INFO) << "16 bytes payload, no checksum: " << plain / 1e3 << "K msg/s"
+               << ", checksum: " << checked / 1e3 << "K msg/s";
+}
 
 } // namespace core
 } // namespace pico
@@ -0,0 +1,135 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 大的BULK request在发送队列中时，同一连接上HIGH request不用等它们发完
+TEST(RpcService, PriorityLane) {
+    const int bulk_num = 4;
+    const size_t bulk_size = 64 << 20;
+    const int ping_num = 20;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.send_queue.chunk_bytes = 1 << 20;
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "bulk", [](RpcRequest&, RpcResponse&) {});
+    rpc.serve(1, "ping", [](RpcRequest&, RpcResponse&) {});
+
+    auto bulk_client = rpc.rpc(0)->create_client("bulk", 1);
+    auto ping_client = rpc.rpc(0)->create_client("ping", 1);
+    auto bulk_dealer = bulk_client->create_dealer();
+    auto ping_dealer = ping_client->create_dealer();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < bulk_num; ++i) {
+        RpcRequest request;
+        request.set_priority(RPC_PRIORITY_BULK);
+        request.lazy() << std::string(bulk_size, 'a' + i);
+        bulk_dealer->send_request(std::move(request));
+    }
+    std::vector<double> latency;
+    for (int i = 0; i < ping_num; ++i) {
+        auto ping_start = std::chrono::steady_clock::now();
+        RpcRequest request;
+        request.set_priority(RPC_PRIORITY_HIGH);
+        request << i;
+        ping_dealer->send_request(std::move(request));
+        RpcResponse response;
+        ASSERT_TRUE(ping_dealer->recv_response(response));
+        EXPECT_EQ(response.head().priority, RPC_PRIORITY_HIGH);
+        std::chrono::duration<double, std::milli> dur
+              = std::chrono::steady_clock::now() - ping_start;
+        latency.push_back(dur.count());
+    }
+    // ping没有排在所有BULK request之后
+    EXPECT_LT(bulk_dealer->pending_responses(), bulk_num);
+    for (int i = 0; i < bulk_num; ++i) {
+        RpcResponse response;
+        ASSERT_TRUE(bulk_dealer->recv_response(response));
+        EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+    }
+    std::chrono::duration<double, std::milli> bulk_dur = std::chrono::steady_clock::now() - start;
+    std::sort(latency.begin(), latency.end());
+    // 一般只等一段，比发完一个BULK request快得多
+    EXPECT_LT(latency[ping_num / 2], bulk_dur.count() / bulk_num);
+}
+
+// 源源不断的HIGH request只能插在分段之间，大block照样能发完
+TEST(RpcService, PriorityLaneWeighted) {
+    const size_t bulk_size = 32 << 20;
+    const int window = 256;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.send_queue.policy = "weighted";
+    rpc_config.send_queue.weights = {1, 1, 1};
+    rpc_config.send_queue.chunk_bytes = 256 << 10;
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "bulk", [](RpcRequest&, RpcResponse&) {});
+    rpc.serve(1, "ping", echo_int);
+
+    auto bulk_client = rpc.rpc(0)->create_client("bulk", 1);
+    auto ping_client = rpc.rpc(0)->create_client("ping", 1);
+    auto bulk_dealer = bulk_client->create_dealer();
+    auto ping_dealer = ping_client->create_dealer();
+
+    std::atomic<bool> stop = {false};
+    std::atomic<int> inflight = {0};
+    std::atomic<int> done = {0};
+    std::thread flood([&]() {
+        for (int i = 0; !stop.load(); ++i) {
+            if (inflight.load() >= window) {
+                std::this_thread::yield();
+                continue;
+            }
+            ++inflight;
+            RpcRequest request;
+            request.set_priority(RPC_PRIORITY_HIGH);
+            request << i;
+            ping_dealer->async_request(std::move(request), [&](RpcResponse&&) {
+                --inflight;
+                ++done;
+            }, true);
+        }
+    });
+    while (done.load() < window) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    RpcRequest request;
+    request.set_priority(RPC_PRIORITY_BULK);
+    request.lazy() << std::string(bulk_size, 'b');
+    bulk_dealer->send_request(std::move(request));
+    RpcResponse response;
+    int before = done.load();
+    EXPECT_TRUE(bulk_dealer->recv_response(response, 30000));
+    EXPECT_EQ(response.error_code(), RpcErrorCodeType::SUCC);
+    // 大block发送期间ping也在继续
+    EXPECT_GT(done.load(), before);
+    stop.store(true);
+    flood.join();
+    while (inflight.load() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,106 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+TEST(RpcService, Trace) {
+    const int count = 20;
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.trace.sample_rate = 1;
+    rpc_config.trace.max_traces = 10;
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "trace", [](RpcRequest& request, RpcResponse& response) {
+        // trace不出现在lazy block中
+        EXPECT_EQ(request.head().extra_block_count, 1);
+        std::string str;
+        request.lazy() >> str;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        response << str;
+    });
+
+    auto client = rpc.rpc(0)->create_client("trace", 1);
+    auto dealer = client->create_dealer();
+    for (int i = 0; i < count; ++i) {
+        RpcRequest request;
+        request.lazy() << std::string(MIN_ZERO_COPY_SIZE * 2, 'a');
+        dealer->send_request(std::move(request));
+        RpcResponse response;
+        ASSERT_TRUE(dealer->recv_response(response));
+        std::string str;
+        response >> str;
+        EXPECT_EQ(str.size(), MIN_ZERO_COPY_SIZE * 2);
+        const rpc_trace_t* trace = response.trace();
+        ASSERT_NE(trace, nullptr);
+        for (int stage = 0; stage < RPC_TRACE_STAGE_NUM; ++stage) {
+            EXPECT_TRUE(trace->has(RpcTraceStage(stage))) << stage;
+        }
+        EXPECT_EQ(trace->client_rank, rpc.rpc(0)->global_rank());
+        EXPECT_EQ(trace->server_rank, rpc.rpc(1)->global_rank());
+    }
+
+    RpcTracer& tracer = rpc.rpc(0)->ctx()->tracer();
+    rpc_trace_stat_t stat;
+    ASSERT_TRUE(tracer.stat("trace", RPC_TRACE_TOTAL, stat));
+    EXPECT_EQ(stat.count, size_t(count));
+    ASSERT_TRUE(tracer.stat("trace", RPC_TRACE_HANDLER, stat));
+    EXPECT_GE(stat.sum_us / stat.count, 1000);
+    for (int span = 0; span < RPC_TRACE_SPAN_NUM; ++span) {
+        EXPECT_TRUE(tracer.stat("trace", RpcTraceSpan(span), stat)) << span;
+    }
+    std::string json = tracer.chrome_trace_json();
+    EXPECT_NE(json.find("traceEvents"), std::string::npos);
+    EXPECT_NE(json.find("handler"), std::string::npos);
+    EXPECT_FALSE(rpc.rpc(1)->ctx()->tracer().stat("trace", RPC_TRACE_TOTAL, stat));
+}
+
+TEST(RpcTrace, Span) {
+    rpc_trace_t trace;
+    int64_t ns;
+    EXPECT_FALSE(trace.span_ns(RPC_TRACE_TOTAL, ns));
+    int64_t stages[] = {100, 300, 1000, 1100, 1400, 2400, 2800};
+    std::copy(stages, stages + RPC_TRACE_STAGE_NUM, trace.stage_ns);
+    ASSERT_TRUE(trace.span_ns(RPC_TRACE_CLIENT_QUEUE, ns));
+    EXPECT_EQ(ns, 200);
+    // 往返2500，server端1400
+    ASSERT_TRUE(trace.span_ns(RPC_TRACE_WIRE, ns));
+    EXPECT_EQ(ns, 1100);
+    ASSERT_TRUE(trace.span_ns(RPC_TRACE_SERVER_QUEUE, ns));
+    EXPECT_EQ(ns, 300);
+    ASSERT_TRUE(trace.span_ns(RPC_TRACE_HANDLER, ns));
+    EXPECT_EQ(ns, 1000);
+    ASSERT_TRUE(trace.span_ns(RPC_TRACE_TOTAL, ns));
+    EXPECT_EQ(ns, 2700);
+
+    rpc_trace_stat_t stat;
+    EXPECT_EQ(stat.percentile_us(0.5), 0);
+    for (int i = 1; i <= 100; ++i) {
+        stat.add(i);
+    }
+    EXPECT_EQ(stat.count, 100u);
+    EXPECT_EQ(stat.max_us, 100);
+    EXPECT_EQ(stat.percentile_us(0.5), 64);
+    EXPECT_EQ(stat.percentile_us(0.99), 100);
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
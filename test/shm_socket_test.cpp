@@ -0,0 +1,122 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "RpcService.h"
+#include "fake_rpc.h"
+#include "macro.h"
+
+namespace paradigm4 {
+namespace pico {
+namespace core {
+
+// 同一进程中的两个RpcService之间也是本机连接，走共享内存
+static void shm_lazy_blocks(size_t arena_size) {
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.protocol = "shm";
+    rpc_config.shm.ring_size = 64 << 10;
+    rpc_config.shm.handover_size = 256 << 10;
+    rpc_config.shm.handover_arena_size = arena_size;
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "shm", [](RpcRequest& request, RpcResponse& response) {
+        std::string body;
+        std::vector<char> block1, block2;
+        request >> body;
+        request.lazy() >> block1 >> block2;
+        response << body;
+        response.lazy() << std::move(block2) << std::move(block1);
+    });
+
+    auto client = rpc.rpc(0)->create_client("shm", 1);
+    auto dealer = client->create_dealer();
+    // 小block, 环中的大block, 交出去的大block, 以及超过环大小的body
+    std::vector<size_t> sizes = {0, 100, 8 << 10, 100 << 10, 256 << 10, 3 << 20};
+    for (int k = 0; k < 20; ++k) {
+        for (size_t size : sizes) {
+            std::string body(size, 'a' + k % 26);
+            std::vector<char> block1(size, 'b' + k % 20), block2(size / 2 + 5, 'c');
+            RpcRequest request;
+            request << body;
+            request.lazy() << std::vector<char>(block1) << std::vector<char>(block2);
+            dealer->send_request(std::move(request));
+
+            RpcResponse response;
+            ASSERT_TRUE(dealer->recv_response(response));
+            std::string rbody;
+            std::vector<char> rblock1, rblock2;
+            response >> rbody;
+            response.lazy() >> rblock2 >> rblock1;
+            EXPECT_EQ(rbody, body);
+            EXPECT_EQ(rblock1, block1);
+            EXPECT_EQ(rblock2, block2);
+        }
+    }
+}
+
+TEST(RpcService, ShmLazyBlocks) {
+    shm_lazy_blocks(ShmConfig().handover_arena_size);
+}
+
+// 3MB的block放不进block区，跟在消息后面写进环；0表示总是这样
+TEST(RpcService, ShmHandoverFallback) {
+    shm_lazy_blocks(1 << 20);
+    shm_lazy_blocks(0);
+}
+
+// 不等response连续发出，收到的block占着block区，之后的block改走环，顺序不变
+TEST(RpcService, ShmHandoverWindow) {
+    RpcConfig rpc_config = FakeRpc::default_config();
+    rpc_config.protocol = "shm";
+    rpc_config.shm.ring_size = 64 << 10;
+    rpc_config.shm.handover_size = 256 << 10;
+    rpc_config.shm.handover_arena_size = 2 << 20;
+    FakeRpc rpc(rpc_config);
+    rpc.serve(1, "shm_window", [](RpcRequest& request, RpcResponse& response) {
+        std::string body;
+        std::vector<char> block;
+        request >> body;
+        request.lazy() >> block;
+        response << body;
+        response.lazy() << std::move(block);
+    });
+
+    auto client = rpc.rpc(0)->create_client("shm_window", 1);
+    auto dealer = client->create_dealer();
+    const int window = 16;
+    for (int k = 0; k < window; ++k) {
+        RpcRequest request;
+        request << std::to_string(k);
+        request.lazy() << std::vector<char>((600 << 10) + k, 'a' + k);
+        dealer->send_request(std::move(request));
+    }
+    std::vector<RpcResponse> responses(window);
+    for (int k = 0; k < window; ++k) {
+        ASSERT_TRUE(dealer->recv_response(responses[k]));
+    }
+    std::vector<bool> seen(window, false);
+    for (auto& response : responses) {
+        std::string body;
+        std::vector<char> block;
+        response >> body;
+        response.lazy() >> block;
+        int i = std::stoi(body);
+        ASSERT_TRUE(i >= 0 && i < window);
+        EXPECT_FALSE(seen[i]);
+        seen[i] = true;
+        EXPECT_EQ(block, std::vector<char>((600 << 10) + i, 'a' + i));
+    }
+}
+
+} // namespace core
+} // namespace pico
+} // namespace paradigm4
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}